@@ -0,0 +1,291 @@
+// Traces the same rays through one BVH stored in each BVHNodeOrder and reports speed and
+// how many cache lines the node reads touched. Then compares shadow rays against closest
+// hits, primary rays traced one at a time against ray packets, and the SIMD triangle leaf
+// kernels against testing leaves one triangle at a time.
+//
+// usage: BVHTraversalBenchmark [path/to/model.obj] [ray count]
+// Without a model a procedural scene of clustered triangles is used.
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "asset_utils/model_loader.h"
+#include "common/types.h"
+#include "intersection_utils/bvh.h"
+#include "intersection_utils/packet_traversal.h"
+#include "intersection_utils/traversal.h"
+#include "intersection_utils/triangle_blocks.h"
+
+namespace {
+using IntersectionUtils::BVH;
+using IntersectionUtils::BVHNodeOrder;
+
+std::vector<Common::Triangle> LoadTriangles(const std::string& path) {
+  std::vector<std::string> mtl_files;
+  const auto geo = AssetUtils::Detail::ParseOBJ(path, &mtl_files);
+  if (!geo)
+    throw std::runtime_error("Couldn't load " + path);
+
+  std::vector<Common::Triangle> triangles;
+  for (const auto& sub_geo : geo->geometries) {
+    for (const auto& face : sub_geo.faces) {
+      triangles.emplace_back(
+          geo->vertices[face.vertex_idxs[0]],
+          geo->vertices[face.vertex_idxs[1]],
+          geo->vertices[face.vertex_idxs[2]]);
+    }
+  }
+
+  return triangles;
+}
+
+std::vector<Common::Triangle> MakeScene(const std::size_t count) {
+  std::mt19937 gen(1234);
+  std::uniform_real_distribution<float> cluster_pos(-10.0f, 10.0f);
+  std::normal_distribution<float> offset(0.0f, 0.5f);
+  std::uniform_real_distribution<float> size(0.01f, 0.2f);
+
+  std::vector<glm::vec3> clusters(64);
+  for (auto& c : clusters)
+    c = glm::vec3(cluster_pos(gen), cluster_pos(gen), cluster_pos(gen));
+
+  std::vector<Common::Triangle> triangles;
+  triangles.reserve(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    const glm::vec3 v0 = clusters[i % clusters.size()] + glm::vec3(offset(gen), offset(gen), offset(gen));
+    triangles.emplace_back(
+        v0,
+        v0 + glm::vec3(size(gen), size(gen), size(gen)),
+        v0 + glm::vec3(-size(gen), size(gen), size(gen)));
+  }
+
+  return triangles;
+}
+
+// Rays from points around the scene towards random points inside it
+std::vector<Common::Ray> MakeRays(const BVH<Common::Triangle>& bvh, const std::size_t count) {
+  const auto& root = bvh.GetBVH()[0];
+  const glm::vec3 center = (root.min_bounds + root.max_bounds) * 0.5f;
+  const glm::vec3 extent = root.max_bounds - root.min_bounds;
+  const float radius = glm::length(extent);
+
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  std::vector<Common::Ray> rays;
+  rays.reserve(count);
+  while (rays.size() < count) {
+    const glm::vec3 dir(unit(gen), unit(gen), unit(gen));
+    if (glm::dot(dir, dir) < 1e-4f)
+      continue;
+
+    const glm::vec3 origin = center + glm::normalize(dir) * radius;
+    const glm::vec3 target = center + glm::vec3(unit(gen), unit(gen), unit(gen)) * extent * 0.5f;
+    rays.emplace_back(origin, glm::normalize(target - origin));
+  }
+
+  return rays;
+}
+
+// Pinhole camera rays looking at the scene from outside it, ordered so every run of
+// tile_width * tile_height rays is one screen tile, the order packets are traced in
+std::vector<Common::Ray> MakeCameraRays(
+    const BVH<Common::Triangle>& bvh,
+    const std::size_t count,
+    const int tile_width,
+    const int tile_height) {
+  const auto& root = bvh.GetBVH()[0];
+  const glm::vec3 center = (root.min_bounds + root.max_bounds) * 0.5f;
+  const float radius = glm::length(root.max_bounds - root.min_bounds) * 0.5f;
+  const glm::vec3 origin = center + glm::vec3(0.3f, 0.4f, 1.0f) * radius * 1.5f;
+  const glm::vec3 forward = glm::normalize(center - origin);
+  const glm::vec3 right = glm::normalize(glm::cross(forward, glm::vec3(0, 1, 0)));
+  const glm::vec3 up = glm::cross(right, forward);
+
+  // image size rounded to whole tiles
+  int side = static_cast<int>(std::sqrt(static_cast<double>(count)));
+  side -= side % (tile_width * tile_height);
+  side = std::max(side, tile_width * tile_height);
+  const float pixel = 1.2f / side;
+
+  std::vector<Common::Ray> rays;
+  rays.reserve(static_cast<std::size_t>(side) * side);
+  for (int tile_y = 0; tile_y < side; tile_y += tile_height) {
+    for (int tile_x = 0; tile_x < side; tile_x += tile_width) {
+      for (int y = tile_y; y < tile_y + tile_height; ++y) {
+        for (int x = tile_x; x < tile_x + tile_width; ++x) {
+          const glm::vec3 dir = forward + right * ((x + 0.5f) * pixel - 0.6f) + up * (0.6f - (y + 0.5f) * pixel);
+          rays.emplace_back(origin, glm::normalize(dir));
+        }
+      }
+    }
+  }
+
+  return rays;
+}
+
+template <int N, class IntersectFn>
+double TracePackets(
+    const BVH<Common::Triangle>& bvh,
+    std::vector<Common::Ray> rays,
+    const IntersectFn& intersect,
+    IntersectionUtils::TraversalStats* const stats,
+    std::size_t* const hit_count) {
+  std::uint32_t hits[N];
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i + N <= rays.size(); i += N) {
+    IntersectionUtils::ClosestHitPacket<N>(bvh, &rays[i], hits, intersect, stats);
+    for (int lane = 0; lane < N; ++lane)
+      *hit_count += hits[lane] != IntersectionUtils::kNoHit;
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+const char* OrderName(const BVHNodeOrder order) {
+  switch (order) {
+    case BVHNodeOrder::kDepthFirst: return "depth first";
+    case BVHNodeOrder::kDepthFirstLargerChild: return "depth first, larger child";
+    case BVHNodeOrder::kVanEmdeBoas: return "van Emde Boas";
+    case BVHNodeOrder::kTreelets: return "treelets";
+  }
+  return "";
+}
+}
+
+int main(int argc, char** argv) {
+  const std::vector<Common::Triangle> triangles = argc > 1 ? LoadTriangles(argv[1]) : MakeScene(500000);
+  const std::size_t ray_count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+
+  const BVH<Common::Triangle> base_bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+  const std::vector<Common::Ray> rays = MakeRays(base_bvh, ray_count);
+  std::cout << triangles.size() << " triangles, " << base_bvh.GetBVH().size() << " nodes, "
+            << rays.size() << " rays" << std::endl;
+
+  const auto intersect = [](const Common::Triangle& tri, Common::Ray* const ray_ptr) {
+    return IntersectionUtils::IntersectsTriangle(ray_ptr, tri.v0, tri.v1, tri.v2);
+  };
+
+  for (const BVHNodeOrder order : {
+           BVHNodeOrder::kDepthFirst,
+           BVHNodeOrder::kDepthFirstLargerChild,
+           BVHNodeOrder::kVanEmdeBoas,
+           BVHNodeOrder::kTreelets}) {
+    BVH<Common::Triangle> bvh = base_bvh;
+    bvh.Reorder(order);
+
+    IntersectionUtils::TraversalStats stats;
+    std::size_t hits = 0;
+    for (Common::Ray ray : rays)
+      hits += IntersectionUtils::ClosestHit(bvh, &ray, intersect, &stats) != IntersectionUtils::kNoHit;
+
+    // timed pass without stats so the counters don't skew it
+    const auto start = std::chrono::steady_clock::now();
+    for (Common::Ray ray : rays)
+      IntersectionUtils::ClosestHit(bvh, &ray, intersect);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const double per_ray = 1.0 / rays.size();
+    std::cout << std::left << std::setw(28) << OrderName(order) << std::fixed << std::setprecision(2)
+              << rays.size() / seconds / 1e6 << " Mrays/s, "
+              << stats.nodes_visited * per_ray << " nodes/ray, "
+              << stats.cache_lines_touched * per_ray << " lines/ray, "
+              << stats.prims_tested * per_ray << " prims/ray, "
+              << hits << " hits" << std::endl;
+  }
+
+  // shadow ray queries, any hit against answering them with a closest hit
+  const Common::Interval shadow_interval(0.001f, std::numeric_limits<float>::max());
+  for (const bool any_hit : {false, true}) {
+    IntersectionUtils::TraversalStats stats;
+    std::size_t occluded = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (Common::Ray ray : rays) {
+      if (any_hit)
+        occluded += IntersectionUtils::Occluded(base_bvh, ray, shadow_interval, intersect, &stats);
+      else
+        occluded += IntersectionUtils::ClosestHit(base_bvh, &ray, intersect, &stats) != IntersectionUtils::kNoHit;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const double per_ray = 1.0 / rays.size();
+    std::cout << std::left << std::setw(28) << (any_hit ? "shadow, Occluded" : "shadow, ClosestHit")
+              << std::fixed << std::setprecision(2)
+              << rays.size() / seconds / 1e6 << " Mrays/s, "
+              << stats.nodes_visited * per_ray << " nodes/ray, "
+              << stats.prims_tested * per_ray << " prims/ray, "
+              << occluded << " occluded" << std::endl;
+  }
+
+  // leaf kernels, over 8 triangle leaves so blocks fill an AVX register
+  {
+    IntersectionUtils::BVHBuildOptions options;
+    options.max_leaf_size = 8;
+    const BVH<Common::Triangle> leaf_bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+    const IntersectionUtils::TriangleBlocks blocks(leaf_bvh, [](const Common::Triangle& tri) { return tri; });
+
+    std::vector<std::pair<const char*, IntersectionUtils::TriangleKernel>> kernels = {
+        {"leaves, scalar blocks", IntersectionUtils::TriangleKernel::kScalar}};
+#if defined(INTERSECTION_UTILS_X86_64)
+    kernels.push_back({"leaves, SSE blocks", IntersectionUtils::TriangleKernel::kSSE});
+    if (IntersectionUtils::DetectTriangleKernel() == IntersectionUtils::TriangleKernel::kAVX2)
+      kernels.push_back({"leaves, AVX2 blocks", IntersectionUtils::TriangleKernel::kAVX2});
+#endif
+
+    const auto report = [&rays](const char* name, const double seconds, const std::size_t hits) {
+      std::cout << std::left << std::setw(28) << name << std::fixed << std::setprecision(2)
+                << rays.size() / seconds / 1e6 << " Mrays/s, " << hits << " hits" << std::endl;
+    };
+
+    std::size_t hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (Common::Ray ray : rays)
+      hits += IntersectionUtils::ClosestHit(leaf_bvh, &ray, intersect) != IntersectionUtils::kNoHit;
+    report("leaves, one triangle a time", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), hits);
+
+    for (const auto& [name, kernel] : kernels) {
+      const IntersectionUtils::TriangleBlockFn kernel_fn = IntersectionUtils::GetTriangleBlockFn(kernel);
+      hits = 0;
+      start = std::chrono::steady_clock::now();
+      for (Common::Ray ray : rays)
+        hits += IntersectionUtils::ClosestHitBlocks(leaf_bvh, blocks, &ray, 0.0f, kernel_fn) != IntersectionUtils::kNoHit;
+      report(name, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), hits);
+    }
+  }
+
+  // primary rays, one at a time against 4x2 and 4x4 packets of the same tiles
+  const std::vector<Common::Ray> camera_rays = MakeCameraRays(base_bvh, ray_count, 4, 4);
+  for (const int packet_size : {1, 8, 16}) {
+    IntersectionUtils::TraversalStats stats;
+    std::size_t hits = 0;
+    double seconds = 0.0;
+    if (packet_size == 1) {
+      const auto start = std::chrono::steady_clock::now();
+      for (Common::Ray ray : camera_rays)
+        hits += IntersectionUtils::ClosestHit(base_bvh, &ray, intersect, &stats) != IntersectionUtils::kNoHit;
+      seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } else if (packet_size == 8) {
+      // 4x4 tiles are two 4x2 ones back to back
+      seconds = TracePackets<8>(base_bvh, camera_rays, intersect, &stats, &hits);
+    } else {
+      seconds = TracePackets<16>(base_bvh, camera_rays, intersect, &stats, &hits);
+    }
+
+    const double per_ray = 1.0 / camera_rays.size();
+    std::cout << std::left << std::setw(28)
+              << ("primary, " + (packet_size == 1 ? std::string("single rays") : std::to_string(packet_size) + " ray packets"))
+              << std::fixed << std::setprecision(2)
+              << camera_rays.size() / seconds / 1e6 << " Mrays/s, "
+              << stats.nodes_visited * per_ray << " node visits/ray, "
+              << stats.prims_tested * per_ray << " prims/ray, "
+              << hits << " hits" << std::endl;
+  }
+
+  return 0;
+}
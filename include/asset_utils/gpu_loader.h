@@ -7,23 +7,115 @@
 
 #include "asset_utils/types.h"
 #include "common/types.h"
+#include "intersection_utils/dynamic_bvh.h"
 
 namespace AssetUtils {
 
+// Node format the shaders traverse, needs to match the bvh_node_layout uniform
+// in shaders/ray_intersects.glsl
+enum class BVHNodeLayout : std::uint32_t {
+  kBinary = 0,
+  // BVHs collapsed to IntersectionUtils::BVH8, bound to binding_offset + 7
+  kWide8 = 1,
+  // BVH8 with 8 bit quantized child bounds, half the size of kWide8. Bound to binding_offset + 8
+  kCompressedWide8 = 2,
+};
+
 // Due to how models are currently loaded onto the gpu in one large contiguous buffer
 // this function should be called with all models expected to be in scene.
 // There is no real streaming support other than simply recalling this function to reload
 // gpu data.
 //
+// The binary node buffer is always uploaded. With the wide layouts the wide nodes are
+// uploaded as well and each model's BVH range points at its wide root, the bvh_node_layout
+// uniform then needs to be set to match. kCompressedWide8 also prints a size/accuracy report.
+//
+// A top level BVH over the models' world space boxes is built as well and bound to
+// binding_offset + 9, with the model index of each of its leaf entries at + 10.
+// UpdateModelMatrix and UpdateModelBVHNodes rebuild it, so it's always current.
+// The tlas_instance_count uniform needs to be set to GetTLASInstanceCount().
+//
+// Geometry and placement are kept apart: each model's data is uploaded once, and the
+// bvhs buffer at binding_offset + 0 is an instance table pointing at it. Every model
+// starts with one untransformed instance whose index is the model's index, more can be
+// placed with AddModelInstance without copying any geometry.
+//
 // For now compute shader program should be bound before calling. (might change)
-void UploadModelDataToGPU(const std::vector<Model*>& models, const std::uint32_t binding_offset = 0);
+void UploadModelDataToGPU(
+    const std::vector<Model*>& models,
+    const std::uint32_t binding_offset = 0,
+    const BVHNodeLayout node_layout = BVHNodeLayout::kBinary);
 
-// Index should be the same as the index in the vector passed to UploadModelDataToGPU
+// Index is an instance index, either a model's index in the vector passed to
+// UploadModelDataToGPU for its first instance or one returned by AddModelInstance
 //
 // Might want to create either a multiupload version or a flush to prevent multiple buffer uploads
 //
 // For now compute shader program should be bound before calling. (might change)
 void UpdateModelMatrix(const std::uint32_t index, const glm::mat4& matrix);
 
+// Places the model at model_index (its index in the vector passed to UploadModelDataToGPU)
+// again, sharing the geometry already uploaded. Returns the new instance's index, for
+// UpdateModelMatrix and RemoveModelInstance. Indices of removed instances get reused.
+//
+// For now compute shader program should be bound before calling. (might change)
+std::uint32_t AddModelInstance(const std::uint32_t model_index, const glm::mat4& matrix = glm::mat4(1));
+
+// Stops tracing the instance, other instances keep their indices. The model's geometry
+// stays uploaded, a model's first instance can be removed too.
+void RemoveModelInstance(const std::uint32_t index);
+
+// Partial reupload for deforming models, so a vertex animation doesn't have to go through
+// UploadModelDataToGPU every frame. Index is the model's index in the vector passed to
+// UploadModelDataToGPU, every instance of the model sees the change.
+//
+// The model must keep the node and vertex counts it was uploaded with, i.e. the vertices
+// were moved and the BVH refit with RefitModel rather than rebuilt. Typical use:
+//   const auto dirty = RefitModel(&model);
+//   UpdateModelVertices(index, model, 0, vertex_count);
+//   UpdateModelBVHNodes(index, model, dirty);
+//   if (model.model_bvh.GetRefitDegradation() > 2.0f) // rebuild and reupload instead
+//
+// With the wide layouts the refit bounds can collapse into a different number of wide
+// nodes, UpdateModelBVHNodes then throws before changing anything and the model needs
+// a full reupload.
+//
+// For now compute shader program should be bound before calling. (might change)
+void UpdateModelBVHNodes(
+    const std::uint32_t index,
+    const Model& model,
+    const IntersectionUtils::BVHNodeRange& dirty_nodes);
+
+void UpdateModelVertices(
+    const std::uint32_t index,
+    const Model& model,
+    const std::uint32_t first_vertex,
+    const std::uint32_t vertex_count);
+
+// Partial reupload for a model whose triangles are kept in a DynamicBVH and edited while
+// it's traced. Writes just the ranges TakeDirtyNodes and TakeDirtyPrims returned, so
+// call it with those after each batch of edits:
+//   UpdateModelDynamicBVH(index, bvh, bvh.TakeDirtyNodes(), bvh.TakeDirtyPrims());
+// The triangles index the model's uploaded vertices and materials.
+//
+// The tree lives in the model's slot from UploadModelDataToGPU, which has room for the
+// uploaded model's node and triangle counts. Upload a model at least as large as the
+// DynamicBVH will get (GetBVH().size() nodes, GetPrims().size() triangles), then write
+// the whole tree once with ranges {0, size}. Throws std::runtime_error, before changing
+// anything, when the tree outgrew its slot or a wide layout is in use, the model then
+// needs a full reupload.
+//
+// For now compute shader program should be bound before calling. (might change)
+void UpdateModelDynamicBVH(
+    const std::uint32_t index,
+    const IntersectionUtils::DynamicBVH<GPU::Triangle>& bvh,
+    const std::vector<IntersectionUtils::BVHNodeRange>& dirty_nodes,
+    const std::vector<IntersectionUtils::BVHNodeRange>& dirty_prims);
+
+// Instances in the current TLAS, for the tlas_instance_count uniform. Zero when every
+// instance was removed or only empty models are uploaded, the TLAS buffers then only
+// hold a placeholder that mustn't be traversed
+std::uint32_t GetTLASInstanceCount();
+
 void UpdateRays(const std::uint32_t ray_count, const Common::Ray* const ray_buffer);
 }
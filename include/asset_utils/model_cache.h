@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "asset_utils/types.h"
+#include "intersection_utils/bvh.h"
+
+namespace AssetUtils {
+// Bump whenever what WriteModelCache writes changes, older files are then rebuilt
+constexpr std::uint32_t kModelCacheVersion = 1;
+
+// Hash of the BVH options that change the tree. Thread counts don't, parallel builds
+// produce the same tree as serial ones
+std::uint64_t HashBVHBuildOptions(const IntersectionUtils::BVHBuildOptions& options);
+
+// Hash of the contents of every file in order. A missing file hashes differently from an
+// empty one
+std::uint64_t HashFiles(const std::vector<std::string>& paths);
+
+// Binary cache of a loaded model: the packed vertices, triangles and BVH nodes in their
+// in-memory layouts plus the material table, so reloading skips parsing and building.
+//
+// The file is keyed by a hash of the OBJ and MTL contents plus the BVH options. mtl_files
+// are the names ParseOBJ returned, relative to folder_path. Throws std::runtime_error if
+// the file can't be written. Writes to a temporary file first, so a crash never leaves a
+// half written cache behind
+void WriteModelCache(
+    const std::string& cache_path,
+    const Model& model,
+    const std::string& obj_path,
+    const std::string& folder_path,
+    const std::vector<std::string>& mtl_files);
+
+// Maps the cache and rebuilds the model from it. Returns nullptr when there's no cache,
+// when it's from another version, or when the OBJ, its MTLs or the options changed since
+// it was written. Texture files are still loaded from disk.
+//
+// Needs a GL context for the textures unless load_textures is false, like LoadObject
+std::unique_ptr<Model> ReadModelCache(
+    const std::string& cache_path,
+    const std::string& obj_path,
+    const std::string& folder_path,
+    const IntersectionUtils::BVHBuildOptions& options,
+    const bool load_textures = true);
+}  // namespace AssetUtils
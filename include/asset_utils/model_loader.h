@@ -12,13 +12,37 @@
 #include "asset_utils/types.h"
 
 namespace AssetUtils {
-std::unique_ptr<Model> LoadObject(const std::string& obj_location);
+// Loads ./objects/<obj_location>/<obj_location>.obj. With use_cache the parsed model and
+// its BVH are saved next to the OBJ (see WriteModelCache), and later loads with the same
+// files and options read that back instead of parsing and building again.
+// Without load_textures no GL calls are made, so models can be loaded for the CPU ray
+// tracer on machines without a GPU. Materials keep their texture_path either way
+std::unique_ptr<Model> LoadObject(
+    const std::string& obj_location,
+    const IntersectionUtils::BVHBuildOptions& bvh_options = {},
+    const bool use_cache = true,
+    const bool load_textures = true);
+
+// Reorders the model's BVH nodes and triangles (see BVH::Reorder) and renumbers the vertices
+// to follow, and rebuilds the model's triangle_blocks. Needs a reupload afterwards
+void ReorderModel(Model* const model_ptr, const IntersectionUtils::BVHNodeOrder order);
+
+// Refits the model's BVH to its current vertex_data_buffer after vertices were moved and
+// rebuilds its triangle_blocks. Returns the nodes that changed, see UpdateModelBVHNodes
+IntersectionUtils::BVHNodeRange RefitModel(Model* const model_ptr);
 
 namespace Detail {
 std::unique_ptr<CpuGeometry> ParseOBJ(const std::string& file_path, std::vector<std::string>* const mtl_files);
 
-void ParseMTL(const std::string& folder_path, const std::string& file_name, std::unordered_map<std::string, Material>* libs);
+void ParseMTL(
+    const std::string& folder_path,
+    const std::string& file_name,
+    std::unordered_map<std::string, Material>* libs,
+    const bool load_textures = true);
 
-std::unique_ptr<Model> ConvertCPUGeometryToModel(std::unique_ptr<CpuGeometry> cpu_geo, std::unordered_map<std::string, Material> materials);
+std::unique_ptr<Model> ConvertCPUGeometryToModel(
+    std::unique_ptr<CpuGeometry> cpu_geo,
+    std::unordered_map<std::string, Material> materials,
+    const IntersectionUtils::BVHBuildOptions& bvh_options = {});
 } // namespace Detail
 }  // namespace AssetUtils
@@ -2,6 +2,7 @@
 
 #include <array>
 #include <optional>
+#include <string>
 #include <type_traits>
 #include <utility>
 
@@ -9,6 +10,7 @@
 #include <glm/glm.hpp>
 
 #include "intersection_utils/bvh.h"
+#include "intersection_utils/triangle_blocks.h"
 #include "common/types.h"
 #include "asset_utils/gpu_texture.h"
 
@@ -33,6 +35,8 @@ struct Material {
   glm::vec3 specular;
   float specular_ex;
   GPUTexture texture;
+  // file texture was loaded from, for rebuilding the material from a model cache
+  std::string texture_path;
   bool use_texture = false;
 };
 
@@ -40,6 +44,10 @@ struct Model {
   IntersectionUtils::BVH<GPU::Triangle> model_bvh;
   std::vector<Material> model_materials;
   std::vector<GPU::PackedVertexData> vertex_data_buffer;
+  // model_bvh's leaves as the CPU ray tracer's SIMD kernels read them. ReorderModel and
+  // RefitModel keep it up to date, call RebuildTriangleBlocks after changing the BVH or
+  // the vertices any other way
+  IntersectionUtils::TriangleBlocks triangle_blocks;
 
   Model(
     IntersectionUtils::BVH<GPU::Triangle> _model_bvh,
@@ -47,8 +55,16 @@ struct Model {
     std::vector<GPU::PackedVertexData> _vertex_data_buffer)
     : model_bvh(std::move(_model_bvh)),
       model_materials(std::move(_model_materials)),
-      vertex_data_buffer(std::move(_vertex_data_buffer))
-   {};
+      vertex_data_buffer(std::move(_vertex_data_buffer)) {
+    RebuildTriangleBlocks();
+  }
+
+  void RebuildTriangleBlocks() {
+    const auto& verts = vertex_data_buffer;
+    triangle_blocks = IntersectionUtils::TriangleBlocks(model_bvh, [&verts](const GPU::Triangle& tri) {
+      return Common::Triangle(verts[tri.vertex_idxs[0]].vertex, verts[tri.vertex_idxs[1]].vertex, verts[tri.vertex_idxs[2]].vertex);
+    });
+  }
 };
 
 // These are temporary structs for creating the above
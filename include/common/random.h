@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+namespace Common {
+
+/**
+ * PCG32 (XSH RR), a small fast generator with 2^63 independent streams.
+ *
+ * Each generator is a value, so every thread or pixel can own one and results don't
+ * depend on which thread got there first. See https://www.pcg-random.org
+ */
+class Pcg32 {
+ public:
+  Pcg32() : Pcg32(0, 0) {}
+
+  Pcg32(const std::uint64_t seed, const std::uint64_t stream) { Seed(seed, stream); }
+
+  void Seed(const std::uint64_t seed, const std::uint64_t stream) {
+    state_ = 0;
+    increment_ = (stream << 1u) | 1u;
+    NextUint();
+    state_ += seed;
+    NextUint();
+  }
+
+  std::uint32_t NextUint() {
+    const std::uint64_t old_state = state_;
+    state_ = old_state * 6364136223846793005ull + increment_;
+    const auto xorshifted = static_cast<std::uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+    const auto rotation = static_cast<std::uint32_t>(old_state >> 59u);
+    return (xorshifted >> rotation) | (xorshifted << ((32u - rotation) & 31u));
+  }
+
+  // Uniform in [0, 1), the top 24 bits so every value is exactly representable
+  float NextFloat() { return (NextUint() >> 8) * (1.0f / 16777216.0f); }
+
+ private:
+  std::uint64_t state_;
+  std::uint64_t increment_;
+};
+
+/**
+ * This thread's generator, used by the random* helpers in common/utils.h.
+ * Threads start on different streams. Reseed it (e.g. per pixel) to make results
+ * independent of how work was split between threads
+ */
+inline Pcg32& ThreadRng() {
+  static std::atomic<std::uint64_t> next_stream{0};
+  thread_local Pcg32 rng(0x853c49e6748fea9bull, next_stream.fetch_add(1, std::memory_order_relaxed));
+  return rng;
+}
+
+// Sample mappings, each turning uniform numbers in [0, 1) into a point without rejection
+// loops, so every call costs the same number of random numbers
+
+// Uniform in the unit disk on z = 0, Shirley and Chiu's concentric mapping
+inline glm::vec3 SampleUnitDisk(const float u1, const float u2) {
+  const float a = 2.0f * u1 - 1.0f;
+  const float b = 2.0f * u2 - 1.0f;
+  if (a == 0.0f && b == 0.0f)
+    return glm::vec3(0.0f);
+
+  const float quarter_pi = glm::pi<float>() * 0.25f;
+  const bool x_major = a * a > b * b;
+  const float radius = x_major ? a : b;
+  const float theta = x_major ? quarter_pi * (b / a) : 2.0f * quarter_pi - quarter_pi * (a / b);
+  return glm::vec3(radius * std::cos(theta), radius * std::sin(theta), 0.0f);
+}
+
+// Uniform on the unit sphere
+inline glm::vec3 SampleUnitSphere(const float u1, const float u2) {
+  const float z = 1.0f - 2.0f * u1;
+  const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+  const float phi = 2.0f * glm::pi<float>() * u2;
+  return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Uniform on the hemisphere around normal
+inline glm::vec3 SampleHemisphere(const glm::vec3& normal, const float u1, const float u2) {
+  const glm::vec3 on_sphere = SampleUnitSphere(u1, u2);
+  return glm::dot(on_sphere, normal) > 0.0f ? on_sphere : -on_sphere;
+}
+
+}  // namespace Common
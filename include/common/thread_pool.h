@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Common {
+
+// Resolves a requested thread count, 0 meaning one per hardware thread
+inline std::uint32_t ResolveThreadCount(const std::uint32_t requested) {
+  if (requested != 0)
+    return requested;
+
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Fixed size pool of worker threads pulling from a shared FIFO queue.
+ *
+ * Tasks are allowed to submit more tasks and wait on them. Waiting is done with Wait(),
+ * which runs queued tasks on the waiting thread instead of blocking, so nested waits
+ * can't starve the pool.
+ */
+class ThreadPool {
+ public:
+  explicit ThreadPool(const std::uint32_t thread_count = 0) {
+    const std::uint32_t count = ResolveThreadCount(thread_count);
+    workers_.reserve(count);
+    for (std::uint32_t i = 0; i < count; ++i)
+      workers_.emplace_back([this]() { WorkerLoop(); });
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_)
+      worker.join();
+  }
+
+  template <class Fn>
+  std::future<std::invoke_result_t<Fn>> Submit(Fn&& fn) {
+    using Result = std::invoke_result_t<Fn>;
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Fn>(fn));
+    std::future<Result> out = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.emplace_back([task]() { (*task)(); });
+    }
+    wake_.notify_one();
+    return out;
+  }
+
+  // Runs one queued task on the calling thread. Returns false if there was nothing to run
+  bool RunPendingTask() {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (tasks_.empty())
+        return false;
+
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+
+    task();
+    return true;
+  }
+
+  // Blocks until the future is ready, helping with queued work in the meantime
+  template <class T>
+  T Wait(std::future<T>* const future_ptr) {
+    auto& future = *future_ptr;
+    while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      if (!RunPendingTask())
+        std::this_thread::yield();
+    }
+
+    return future.get();
+  }
+
+  std::uint32_t GetThreadCount() const { return static_cast<std::uint32_t>(workers_.size()); }
+
+ private:
+  void WorkerLoop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+        if (stopping_ && tasks_.empty())
+          return;
+
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+};
+
+/**
+ * Calls fn(begin, end) over [0, count) split into chunks of at most chunk_size.
+ * Chunks are disjoint so fn can write to its own range without locking.
+ * Runs inline when pool is null.
+ */
+template <class Fn>
+void ParallelFor(ThreadPool* const pool, const std::size_t count, const std::size_t chunk_size, const Fn& fn) {
+  if (!pool || count <= chunk_size) {
+    fn(std::size_t(0), count);
+    return;
+  }
+
+  std::vector<std::future<void>> chunks;
+  chunks.reserve(count / chunk_size + 1);
+  for (std::size_t begin = chunk_size; begin < count; begin += chunk_size) {
+    const std::size_t end = std::min(count, begin + chunk_size);
+    chunks.push_back(pool->Submit([&fn, begin, end]() { fn(begin, end); }));
+  }
+
+  // first chunk on this thread
+  fn(std::size_t(0), std::min(count, chunk_size));
+  for (auto& chunk : chunks)
+    pool->Wait(&chunk);
+}
+
+}  // namespace Common
@@ -5,6 +5,8 @@
 #include "glm/gtc/constants.hpp"
 #include "glm/gtx/norm.hpp"
 
+#include "common/random.h"
+
 namespace Common {
 
 inline float pi() {
@@ -19,8 +21,9 @@ inline glm::vec3 unitVector(const glm::vec3& v) {
 	return v / glm::length(v);
 }
 
+// [0, 1) from this thread's generator, see ThreadRng in common/random.h
 inline float randomFloat() {
-	return std::rand() / (RAND_MAX + 1.0f);
+	return ThreadRng().NextFloat();
 }
 
 inline float randomFloat(float min, float max) {
@@ -32,30 +35,18 @@ inline glm::vec3 randomVec3(float min, float max) {
 }
 
 inline glm::vec3 randomInUnitDisk() {
-	while (true)
-	{
-		auto p = glm::vec3(randomFloat (-1, 1), randomFloat(-1, 1), 0);
-		if (glm::length2(p) < 1)
-			return p;
-	}
+	const float u1 = randomFloat();
+	return SampleUnitDisk(u1, randomFloat());
 }
 
 inline glm::vec3 randomUnitVector() {
-	while (true)
-	{
-		auto p = randomVec3(-1, 1);
-		auto lensq = glm::length2(p);
-		if (1e-160 < lensq && lensq <= 1)
-			return p / std::sqrt(lensq);
-	}
+	const float u1 = randomFloat();
+	return SampleUnitSphere(u1, randomFloat());
 }
 
 inline glm::vec3 randomOnHemisphere(const glm::vec3& normal) {
-	glm::vec3 onSphere = randomUnitVector();
-	if (glm::dot(onSphere, normal) > 0.0)
-		return onSphere;
-	else
-		return -onSphere;
+	const float u1 = randomFloat();
+	return SampleHemisphere(normal, u1, randomFloat());
 }
 
 inline float linearToGamma(float linearComponent) {
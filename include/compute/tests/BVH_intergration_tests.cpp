@@ -62,10 +62,14 @@ class IntigrationTestStruct : public testing::Test  {
 
 TEST_F(IntigrationTestStruct, Test) {
   const std::string OBJ_loc = "Rubik";
-  const auto out = AssetUtils::LoadObject(OBJ_loc);
+  // expected hit index below depends on the triangle order the midpoint builder produces
+  IntersectionUtils::BVHBuildOptions bvh_options;
+  bvh_options.method = IntersectionUtils::BVHBuildMethod::kMidpoint;
+  const auto out = AssetUtils::LoadObject(OBJ_loc, bvh_options);
   AssetUtils::UploadModelDataToGPU({out.get()});
   const GLint loc = glGetUniformLocation(compute_prog, "bvh_count");
   glUniform1ui(loc, 1);
+  glUniform1ui(glGetUniformLocation(compute_prog, "tlas_instance_count"), AssetUtils::GetTLASInstanceCount());
   std::vector<Common::Ray> rays;
   rays.reserve(64);
   // Odd rays hit, even miss
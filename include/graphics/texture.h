@@ -18,6 +18,10 @@ public:
     Texture();
     virtual ~Texture();
     virtual void Init(const std::vector<Color8>& textureData, uint width, uint height);
+    // Replaces the pixels, re-uploading them if the texture is on the GPU. Same as Init
+    // the first time or when the size changes, a GPU texture then keeps its handle and is
+    // reallocated at the new size
+    void Update(const std::vector<Color8>& textureData, uint width, uint height);
     virtual GLuint getTextureHandle(GLenum binding, GLuint bindIndex, bool isImage = false);
     const byte* getImageData();
     virtual void updateImageDataFromGPU();
@@ -5,15 +5,259 @@
 #include <memory>
 #include <cmath>
 #include <stdexcept>
+#include <string>
 #include <utility>
 #include <algorithm>
+#include <array>
 #include <functional>
+#include <type_traits>
 
 #include <glm/glm.hpp>
 
 #include "common/types.h"
+#include "common/thread_pool.h"
 
 namespace IntersectionUtils {
+enum class BVHBuildMethod {
+  // Splits at the spatial midpoint of the longest axis. Fast to build, poor trees
+  kMidpoint,
+  // Binned surface area heuristic. Slower to build, much cheaper to traverse
+  kBinnedSAH,
+  // Linear BVH, splits on Morton code prefixes of the radix sorted centroids. Close to O(n),
+  // meant for geometry that is rebuilt every frame
+  kLBVH,
+  // Binned SAH that also considers spatial splits, clipping primatives that straddle the
+  // plane so they can be referenced from both sides. Needs a split_fn. Best for long thin
+  // triangles whose bounds overlap heavily, at the cost of duplicated references
+  kSBVH,
+};
+
+// Order nodes are stored in. Sibling pairs always stay next to each other, only the order
+// of the pairs changes. Parents always come before their children
+enum class BVHNodeOrder {
+  // Order Subdivide allocates pairs in: a pair, then the left child's subtree, then the right's
+  kDepthFirst,
+  // Depth first, descending into the child with the larger surface area first. That child is
+  // the more likely one to be hit so its subtree ends up closest to the parent
+  kDepthFirstLargerChild,
+  // Recursive van Emde Boas layout, the top half of the levels first then each bottom
+  // subtree, so nearby levels share cache lines whatever the line size
+  kVanEmdeBoas,
+  // Greedy treelets of layout_treelet_pairs pairs, each grown by the pair most likely to be
+  // hit (largest surface area relative to the root)
+  kTreelets,
+};
+
+/**
+ * Options controlling how a BVH is built
+ *
+ * @var bin_count Number of centroid bins evaluated per axis by the SAH builder
+ * @var traversal_cost Cost of visiting an internal node, relative to leaf_cost
+ * @var leaf_cost Cost of intersecting a single primative in a leaf
+ * @var max_leaf_size The SAH builder will always split nodes with more primatives
+ *                    than this, even when keeping the leaf looks cheaper
+ * @var thread_count Threads used to build, 0 for one per hardware thread, 1 for a serial build.
+ *                   The node array is identical whatever the count
+ * @var parallel_subtree_threshold Subtrees with at least this many primatives are built as
+ *                                 their own task. Smaller builds never start threads
+ * @var thread_pool Optional pool to build on instead of spinning one up per build
+ * @var morton_63_bit LBVH only, quantize centroids to 21 bits per axis instead of 10.
+ *                    Needed when a model has lots of detail packed into a small part of its bounds
+ * @var treelet_size Leaves per treelet for the post build treelet restructuring pass (3 - 7).
+ *                   0 disables it. Mostly useful to recover quality after an LBVH build
+ * @var sbvh_max_duplication SBVH only, extra primative references spatial splits may create,
+ *                           as a fraction of the primative count
+ * @var sbvh_overlap_threshold SBVH only, spatial splits are only tried when the children of
+ *                             the best object split overlap by more than this fraction of
+ *                             the root's surface area
+ * @var node_order Memory order of the finished nodes, see BVHNodeOrder. Primatives are
+ *                 reordered to follow the leaves
+ * @var layout_treelet_pairs Sibling pairs per treelet for BVHNodeOrder::kTreelets
+ */
+struct BVHBuildOptions {
+  BVHBuildMethod method = BVHBuildMethod::kBinnedSAH;
+  std::uint32_t bin_count = 16;
+  float traversal_cost = 1.0f;
+  float leaf_cost = 1.0f;
+  std::uint32_t max_leaf_size = 4;
+  std::uint32_t thread_count = 0;
+  std::uint32_t parallel_subtree_threshold = 4096;
+  Common::ThreadPool* thread_pool = nullptr;
+  bool morton_63_bit = false;
+  std::uint32_t treelet_size = 0;
+  float sbvh_max_duplication = 0.25f;
+  float sbvh_overlap_threshold = 1e-5f;
+  BVHNodeOrder node_order = BVHNodeOrder::kDepthFirst;
+  std::uint32_t layout_treelet_pairs = 4;
+};
+
+inline float SurfaceArea(const glm::vec3& min_bounds, const glm::vec3& max_bounds) {
+  const glm::vec3 extent = max_bounds - min_bounds;
+  if (extent.x < 0 || extent.y < 0 || extent.z < 0)
+    return 0.0f; // empty box
+
+  return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+/**
+ * Splits a triangle at an axis aligned plane and returns the bounds of each side, clipped to
+ * ref_bounds. Meant to be wrapped in a split_fn for BVHBuildMethod::kSBVH.
+ * A side the triangle doesn't reach comes back as an empty (inverted) box
+ */
+inline std::pair<std::pair<glm::vec3, glm::vec3>, std::pair<glm::vec3, glm::vec3>> SplitTriangleBounds(
+    const glm::vec3& v0,
+    const glm::vec3& v1,
+    const glm::vec3& v2,
+    const int axis,
+    const float position,
+    const std::pair<glm::vec3, glm::vec3>& ref_bounds) {
+  std::pair<glm::vec3, glm::vec3> left(glm::vec3(std::numeric_limits<float>::max()), glm::vec3(std::numeric_limits<float>::lowest()));
+  std::pair<glm::vec3, glm::vec3> right = left;
+  const auto grow = [](std::pair<glm::vec3, glm::vec3>* const bounds_ptr, const glm::vec3& p) {
+    bounds_ptr->first = glm::min(bounds_ptr->first, p);
+    bounds_ptr->second = glm::max(bounds_ptr->second, p);
+  };
+
+  const glm::vec3 verts[3] = {v0, v1, v2};
+  for (int i = 0; i < 3; ++i) {
+    const glm::vec3& a = verts[i];
+    const glm::vec3& b = verts[(i + 1) % 3];
+    if (a[axis] <= position)
+      grow(&left, a);
+    if (a[axis] >= position)
+      grow(&right, a);
+
+    // edge crosses the plane, the crossing point belongs to both sides
+    if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position)) {
+      const float t = (position - a[axis]) / (b[axis] - a[axis]);
+      glm::vec3 crossing = a + (b - a) * glm::clamp(t, 0.0f, 1.0f);
+      crossing[axis] = position;
+      grow(&left, crossing);
+      grow(&right, crossing);
+    }
+  }
+
+  left.first = glm::max(left.first, ref_bounds.first);
+  left.second = glm::min(left.second, ref_bounds.second);
+  left.second[axis] = std::min(left.second[axis], position);
+  right.first = glm::max(right.first, ref_bounds.first);
+  right.second = glm::min(right.second, ref_bounds.second);
+  right.first[axis] = std::max(right.first[axis], position);
+  return {left, right};
+}
+
+namespace Detail {
+// spreads the low 10 bits of v so there are 2 zero bits between each
+inline std::uint64_t ExpandBits10(std::uint64_t v) {
+  v &= 0x3ff;
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// spreads the low 21 bits of v so there are 2 zero bits between each
+inline std::uint64_t ExpandBits21(std::uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+
+/**
+ * Morton code of a point already normalized to [0, 1] in each axis
+ *
+ * @param use_63_bit 21 bits per axis if true, otherwise 10
+ */
+inline std::uint64_t MortonCode(const glm::vec3& unit_pos, const bool use_63_bit) {
+  const float scale = use_63_bit ? float(1 << 21) : float(1 << 10);
+  const float max_cell = scale - 1.0f;
+  const auto quantize = [scale, max_cell](const float f) {
+    return static_cast<std::uint64_t>(std::min(std::max(f * scale, 0.0f), max_cell));
+  };
+
+  const auto expand = use_63_bit ? ExpandBits21 : ExpandBits10;
+  return (expand(quantize(unit_pos.x)) << 2) | (expand(quantize(unit_pos.y)) << 1) | expand(quantize(unit_pos.z));
+}
+
+// False for a null split_fn or an empty std::function, true for anything else callable
+template <class Fn>
+bool HasCallable(const Fn& fn) {
+  if constexpr (std::is_same_v<Fn, std::nullptr_t>)
+    return false;
+  else if constexpr (std::is_pointer_v<Fn>)
+    return fn != nullptr;
+  else if constexpr (std::is_class_v<Fn> && std::is_constructible_v<bool, const Fn&>)
+    return static_cast<bool>(fn);
+  else
+    return true;
+}
+
+inline std::uint32_t LowestBitIndex(std::uint32_t v) {
+  std::uint32_t idx = 0;
+  while (v && !(v & 1)) {
+    v >>= 1;
+    idx++;
+  }
+  return idx;
+}
+
+/**
+ * Stable LSD radix sort of keys, applying the same permutation to values.
+ * Only sorts the low key_bits bits, 8 bits per pass. keys_tmp and values_tmp are
+ * scratch, resized to fit and swapped with the inputs between passes
+ */
+inline void RadixSortByKey(
+    std::vector<std::uint64_t>* const keys_ptr,
+    std::vector<std::uint32_t>* const values_ptr,
+    const std::uint32_t key_bits,
+    std::vector<std::uint64_t>* const keys_tmp_ptr,
+    std::vector<std::uint32_t>* const values_tmp_ptr) {
+  auto& keys = *keys_ptr;
+  auto& values = *values_ptr;
+  auto& keys_tmp = *keys_tmp_ptr;
+  auto& values_tmp = *values_tmp_ptr;
+  keys_tmp.resize(keys.size());
+  values_tmp.resize(values.size());
+
+  for (std::uint32_t shift = 0; shift < key_bits; shift += 8) {
+    std::size_t offsets[256] = {};
+    for (const std::uint64_t key : keys)
+      offsets[(key >> shift) & 0xff]++;
+
+    std::size_t sum = 0;
+    for (std::size_t& offset : offsets) {
+      const std::size_t count = offset;
+      offset = sum;
+      sum += count;
+    }
+
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+      const std::size_t dst = offsets[(keys[i] >> shift) & 0xff]++;
+      keys_tmp[dst] = keys[i];
+      values_tmp[dst] = values[i];
+    }
+
+    keys.swap(keys_tmp);
+    values.swap(values_tmp);
+  }
+}
+
+// Same, allocating its own scratch
+inline void RadixSortByKey(
+    std::vector<std::uint64_t>* const keys_ptr,
+    std::vector<std::uint32_t>* const values_ptr,
+    const std::uint32_t key_bits) {
+  std::vector<std::uint64_t> keys_tmp;
+  std::vector<std::uint32_t> values_tmp;
+  RadixSortByKey(keys_ptr, values_ptr, key_bits, &keys_tmp, &values_tmp);
+}
+}  // namespace Detail
+
 /**
 * Will have to conform to std430 alignment
 * 
@@ -29,85 +273,483 @@ struct BVHNode {
   bool IsLeaf() const { return prim_count > 0; }
 };
 
+// Contiguous run of nodes [first, first + count), used to upload only what changed
+struct BVHNodeRange {
+  std::uint32_t first = 0;
+  std::uint32_t count = 0;
+  bool Empty() const { return count == 0; }
+};
+
+template <class Prim>
+class BVHBuilder;
+
 template <class Prim>
 class BVH {
  public:
+  using Bounds = std::pair<glm::vec3, glm::vec3>;
+  using SplitFn = std::function<std::pair<Bounds, Bounds>(const Prim&, int, float, const Bounds&)>;
+
   /** Constructs a BVH for the given primatives
    * Will also rearrange primatives
    * 
    * probably needs different input type. Will depend on how scene is defined
+   *
+   * center_fn(prim) returns a glm::vec3 and bounds_fn(prim) a (min, max) pair. They are
+   * called once per primative, and may be called from several threads at once for
+   * multithreaded builds. Any callable works, lambdas are inlined into the build
    */
+  template <class CenterFn, class BoundsFn>
   BVH(
       std::vector<Prim> primatives,
-      const std::function<glm::vec3(const Prim&)>& center_fn,
-      const std::function<std::pair<glm::vec3, glm::vec3>(const Prim&)>& bounds_fn)
-    : primatives_(std::move(primatives))
-  {
-    std::vector<std::uint32_t> primatives_idxs;
-    primatives_idxs.reserve(primatives_.size());
-    for (std::size_t i = 0; i < primatives_.size(); ++i)
-      primatives_idxs.push_back(i);
-
-    bvh_.resize((2 * primatives_.size()) - 1); // might need to change if switching to BVH4 or BVH8
+      const CenterFn& center_fn,
+      const BoundsFn& bounds_fn,
+      const BVHBuildOptions& options = {})
+    : BVH(std::move(primatives), center_fn, bounds_fn, nullptr, options) {}
 
-    std::vector<glm::vec3> centers;
-    centers.reserve(primatives_.size());
-    for (const auto& primative : primatives_)
-      centers.emplace_back(center_fn(primative));
+  /**
+   * Same as above, with a split_fn for spatial splits. split_fn(prim, axis, position, ref_bounds)
+   * returns the bounds of the part of prim inside ref_bounds on each side of the plane,
+   * see SplitTriangleBounds. Only used by BVHBuildMethod::kSBVH, which requires it, so
+   * other builds can pass nullptr.
+   *
+   * SBVH builds can reference a primative from several leaves, so GetPrims() may hold
+   * copies of the same primative. GetPrimIndices() maps them back to the input order.
+   * They are also always built on the calling thread
+   */
+  template <class CenterFn, class BoundsFn, class SplitFnT>
+  BVH(
+      std::vector<Prim> primatives,
+      const CenterFn& center_fn,
+      const BoundsFn& bounds_fn,
+      const SplitFnT& split_fn,
+      const BVHBuildOptions& options = {}) {
+    BuildScratch scratch;
+    Build(primatives, center_fn, bounds_fn, split_fn, options, &scratch);
+  }
 
-    BVHNode& root = bvh_[0];
-    next_free_node_idx_++;
-    root.first_child = 0;
-    root.first_prim_index = 0;
-    root.prim_count = primatives_.size();
-    UpdateNodeBounds(primatives_idxs, bounds_fn, &root);
-    Subdivide(&primatives_idxs, centers, bounds_fn, &root);
+  // Empty BVH, for BVHBuilder to build into
+  BVH() = default;
 
-    std::vector<Prim> new_primatives;
-    new_primatives.reserve(primatives_.size());
-    
-    for (std::uint32_t idx : primatives_idxs)
-      new_primatives.push_back(std::move(primatives_[idx]));
+  /**
+   * Wraps a tree built earlier, e.g. one read back from a cache file. The arguments are
+   * what GetBVH(), GetPrims(), GetPrimIndices() and GetBuildOptions() returned for it.
+   * Throws std::invalid_argument if a node points outside the arrays
+   */
+  static BVH FromBuiltTree(
+      std::vector<BVHNode> nodes,
+      std::vector<Prim> primatives,
+      std::vector<std::uint32_t> prim_indices,
+      const BVHBuildOptions& options) {
+    if (prim_indices.size() != primatives.size())
+      throw std::invalid_argument("BVH needs one primative index per primative");
+    if (nodes.empty() != primatives.empty())
+      throw std::invalid_argument("BVH nodes and primatives have to be empty together");
 
-    primatives_ = std::move(new_primatives);
+    for (std::size_t idx = 0; idx < nodes.size(); ++idx) {
+      const BVHNode& node = nodes[idx];
+      const bool in_range = node.IsLeaf() ?
+          static_cast<std::size_t>(node.first_prim_index) + node.prim_count <= primatives.size() :
+          node.first_child > idx && static_cast<std::size_t>(node.first_child) + 1 < nodes.size();
+      if (!in_range)
+        throw std::invalid_argument("BVH node " + std::to_string(idx) + " points outside the tree");
+    }
 
-    bvh_.resize(next_free_node_idx_);
+    BVH bvh;
+    bvh.bvh_ = std::move(nodes);
+    bvh.primatives_ = std::move(primatives);
+    bvh.prim_indices_ = std::move(prim_indices);
+    bvh.options_ = options;
+    bvh.sah_cost_ = bvh.ComputeSAHCost();
+    bvh.build_sah_cost_ = bvh.sah_cost_;
+    return bvh;
   }
 
   const std::vector<BVHNode>& GetBVH() const { return bvh_; }
   const std::vector<Prim>& GetPrims() const { return primatives_; } 
+  // For rewriting data inside primatives, e.g. remapping vertex indices. Moving a primative
+  // needs a Refit, swapping primatives around breaks the tree
+  std::vector<Prim>& GetMutablePrims() { return primatives_; }
+  // Index in the constructor's primative vector of each element of GetPrims()
+  const std::vector<std::uint32_t>& GetPrimIndices() const { return prim_indices_; }
+  const BVHBuildOptions& GetBuildOptions() const { return options_; }
+
+  /**
+   * SAH cost of the finished tree, using the costs from the build options.
+   * Expected cost of tracing a ray that hits the root, lower is better
+   */
+  float GetSAHCost() const { return sah_cost_; }
+
+  /**
+   * Recomputes every node's bounds bottom up after the primatives moved, keeping the
+   * topology and primative order. Much cheaper than a rebuild, but the tree gets worse
+   * the further primatives drift from where they were when it was built.
+   *
+   * Returns the smallest range of nodes containing every node whose bounds changed.
+   * SBVH leaves get the whole primative's bounds back, not the clipped ones, which is
+   * correct but looser
+   */
+  template <class BoundsFn>
+  BVHNodeRange Refit(const BoundsFn& bounds_fn) {
+    std::uint32_t first_dirty = std::numeric_limits<std::uint32_t>::max();
+    std::uint32_t last_dirty = 0;
+
+    // children are always after their parent, see FitBoundsBottomUp
+    for (std::size_t idx = bvh_.size(); idx-- > 0;) {
+      BVHNode& node = bvh_[idx];
+      glm::vec3 min_bounds(std::numeric_limits<float>::max());
+      glm::vec3 max_bounds(std::numeric_limits<float>::lowest());
+      if (node.IsLeaf()) {
+        for (std::uint32_t i = 0; i < node.prim_count; i++) {
+          const auto [prim_min, prim_max] = bounds_fn(primatives_[node.first_prim_index + i]);
+          min_bounds = glm::min(min_bounds, prim_min);
+          max_bounds = glm::max(max_bounds, prim_max);
+        }
+      } else {
+        const BVHNode& left = bvh_[node.first_child];
+        const BVHNode& right = bvh_[node.first_child + 1];
+        min_bounds = glm::min(left.min_bounds, right.min_bounds);
+        max_bounds = glm::max(left.max_bounds, right.max_bounds);
+      }
+
+      if (min_bounds == node.min_bounds && max_bounds == node.max_bounds)
+        continue;
+
+      node.min_bounds = min_bounds;
+      node.max_bounds = max_bounds;
+      first_dirty = static_cast<std::uint32_t>(idx);
+      last_dirty = std::max(last_dirty, static_cast<std::uint32_t>(idx));
+    }
+
+    sah_cost_ = ComputeSAHCost();
+
+    BVHNodeRange dirty;
+    if (first_dirty <= last_dirty) {
+      dirty.first = first_dirty;
+      dirty.count = last_dirty - first_dirty + 1;
+    }
+    return dirty;
+  }
+
+  /**
+   * Rewrites the node array in the given order and reorders primatives so leaves that are
+   * next to each other in memory reference neighbouring primatives. Topology, bounds and
+   * SAH cost don't change, only indices do
+   */
+  void Reorder(const BVHNodeOrder order) {
+    options_.node_order = order;
+    if (bvh_.size() <= 1)
+      return;
+
+    std::vector<std::uint32_t> pair_order;
+    pair_order.reserve(bvh_.size() / 2);
+    switch (order) {
+      case BVHNodeOrder::kDepthFirst:
+      case BVHNodeOrder::kDepthFirstLargerChild:
+        OrderPairsDepthFirst(order == BVHNodeOrder::kDepthFirstLargerChild, &pair_order);
+        break;
+      case BVHNodeOrder::kVanEmdeBoas:
+        OrderPairsVanEmdeBoas(bvh_[0].first_child, PairHeight(bvh_[0].first_child), &pair_order);
+        break;
+      case BVHNodeOrder::kTreelets:
+        OrderPairsTreelets(&pair_order);
+        break;
+    }
+
+    ApplyPairOrder(pair_order);
+  }
+
+  /**
+   * SAH cost relative to when the tree was built, 1 right after a build and growing as
+   * refits stretch the nodes. A rebuild is usually worth it somewhere past 1.5 - 2
+   */
+  float GetRefitDegradation() const {
+    if (build_sah_cost_ <= 0.0f)
+      return 1.0f;
+
+    return sah_cost_ / build_sah_cost_;
+  }
+
  private:
-  void UpdateNodeBounds(
-      const std::vector<std::uint32_t>& primatives_idxs,
-      const std::function<std::pair<glm::vec3, glm::vec3>(const Prim&)>& bounds_fn,
-      BVHNode* const node_ptr) {
+  static constexpr std::size_t kPrecomputeChunkSize = 16384;
+  static constexpr std::uint32_t kMaxTreeletSize = 7;
+
+  friend class BVHBuilder<Prim>;
+
+  // Centers and bounds of every primative, one array per axis so the per axis loops of
+  // the splits read packed floats instead of striding over whole boxes
+  struct PrimData {
+    std::array<std::vector<float>, 3> centers;
+    std::array<std::vector<float>, 3> min_bounds;
+    std::array<std::vector<float>, 3> max_bounds;
+
+    void Resize(const std::size_t size) {
+      for (int axis = 0; axis < 3; ++axis) {
+        centers[axis].resize(size);
+        min_bounds[axis].resize(size);
+        max_bounds[axis].resize(size);
+      }
+    }
+
+    std::size_t Size() const { return centers[0].size(); }
+    glm::vec3 Center(const std::uint32_t idx) const { return {centers[0][idx], centers[1][idx], centers[2][idx]}; }
+    glm::vec3 MinBounds(const std::uint32_t idx) const { return {min_bounds[0][idx], min_bounds[1][idx], min_bounds[2][idx]}; }
+    glm::vec3 MaxBounds(const std::uint32_t idx) const { return {max_bounds[0][idx], max_bounds[1][idx], max_bounds[2][idx]}; }
+
+    void Swap(const std::uint32_t a, const std::uint32_t b) {
+      for (int axis = 0; axis < 3; ++axis) {
+        std::swap(centers[axis][a], centers[axis][b]);
+        std::swap(min_bounds[axis][a], min_bounds[axis][b]);
+        std::swap(max_bounds[axis][a], max_bounds[axis][b]);
+      }
+    }
+  };
+
+  // Per build scratch. Centers and bounds are computed once up front and partitioned in
+  // place together with primatives_idxs as nodes split, so prims[i] always belongs to
+  // primatives_idxs[i] and a node's data is one contiguous range of every array
+  struct BuildContext {
+    std::vector<std::uint32_t> primatives_idxs;
+    PrimData prims;
+    // LBVH only, code of the primative at each position of primatives_idxs
+    std::vector<std::uint64_t> morton_codes;
+    Common::ThreadPool* pool = nullptr;
+
+    void Swap(const std::uint32_t a, const std::uint32_t b) {
+      std::swap(primatives_idxs[a], primatives_idxs[b]);
+      prims.Swap(a, b);
+    }
+  };
+
+  struct SAHBin {
+    glm::vec3 min_bounds = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max_bounds = glm::vec3(std::numeric_limits<float>::lowest());
+    std::uint32_t count = 0;
+  };
+
+  // Bins for PartitionSAH. One per thread, the rest of BuildContext is shared by subtrees
+  // built in parallel since they only touch their own ranges
+  struct SplitScratch {
+    std::vector<SAHBin> bins;
+    std::vector<float> right_areas;
+    std::vector<std::uint32_t> right_counts;
+  };
+
+  // Everything a build allocates besides the finished tree. BVHBuilder keeps one alive
+  // between builds so nothing is reallocated once it has grown to fit
+  struct BuildScratch {
+    BuildContext ctx;
+    SplitScratch split;
+    // LBVH only
+    PrimData sorted_prims;
+    std::vector<std::uint64_t> radix_keys;
+    std::vector<std::uint32_t> radix_values;
+    // RelayoutDepthFirst
+    std::vector<BVHNode> nodes;
+    std::unique_ptr<Common::ThreadPool> owned_pool;
+    std::uint32_t owned_pool_threads = 0;
+
+    std::size_t CapacityBytes() const {
+      std::size_t bytes = 0;
+      for (const PrimData* const data : {&ctx.prims, &sorted_prims}) {
+        for (int axis = 0; axis < 3; ++axis) {
+          bytes += data->centers[axis].capacity() * sizeof(float);
+          bytes += data->min_bounds[axis].capacity() * sizeof(float);
+          bytes += data->max_bounds[axis].capacity() * sizeof(float);
+        }
+      }
+      bytes += ctx.primatives_idxs.capacity() * sizeof(std::uint32_t);
+      bytes += ctx.morton_codes.capacity() * sizeof(std::uint64_t);
+      bytes += split.bins.capacity() * sizeof(SAHBin);
+      bytes += split.right_areas.capacity() * sizeof(float);
+      bytes += split.right_counts.capacity() * sizeof(std::uint32_t);
+      bytes += radix_keys.capacity() * sizeof(std::uint64_t);
+      bytes += radix_values.capacity() * sizeof(std::uint32_t);
+      bytes += nodes.capacity() * sizeof(BVHNode);
+      return bytes;
+    }
+  };
+
+  /**
+   * Builds over input, replacing whatever this BVH held. Bad options throw before anything
+   * is touched. Vectors are cleared rather than freed, so rebuilding into the same BVH with
+   * the same scratch reuses every buffer. Input is moved from when it isn't const
+   */
+  template <class Input, class CenterFn, class BoundsFn, class SplitFnT>
+  void Build(
+      Input& input,
+      const CenterFn& center_fn,
+      const BoundsFn& bounds_fn,
+      const SplitFnT& split_fn,
+      const BVHBuildOptions& options,
+      BuildScratch* const scratch_ptr) {
+    auto& scratch = *scratch_ptr;
+    if (options.bin_count < 2)
+      throw std::invalid_argument("BVH needs at least 2 SAH bins");
+    if (options.max_leaf_size == 0)
+      throw std::invalid_argument("BVH max leaf size must be at least 1");
+    if (options.treelet_size != 0 && (options.treelet_size < 3 || options.treelet_size > kMaxTreeletSize))
+      throw std::invalid_argument("BVH treelet size must be 0 or between 3 and 7");
+    if (options.node_order == BVHNodeOrder::kTreelets && options.layout_treelet_pairs == 0)
+      throw std::invalid_argument("BVH layout treelets need at least 1 pair");
+    if (options.method == BVHBuildMethod::kSBVH && !Detail::HasCallable(split_fn))
+      throw std::invalid_argument("SBVH builds need a split_fn");
+    if (options.sbvh_max_duplication < 0.0f)
+      throw std::invalid_argument("SBVH duplication budget can't be negative");
+
+    options_ = options;
+    primatives_.clear();
+    prim_indices_.clear();
+    bvh_.clear();
+    sah_cost_ = 0.0f;
+    build_sah_cost_ = 0.0f;
+    if (input.empty())
+      return;
+
+    BuildContext& ctx = scratch.ctx;
+    ctx.pool = nullptr;
+    const bool parallel =
+        options_.method != BVHBuildMethod::kSBVH &&
+        input.size() >= options_.parallel_subtree_threshold &&
+        (options_.thread_pool || Common::ResolveThreadCount(options_.thread_count) > 1);
+    if (parallel) {
+      ctx.pool = options_.thread_pool;
+      if (!ctx.pool) {
+        const std::uint32_t thread_count = Common::ResolveThreadCount(options_.thread_count);
+        if (!scratch.owned_pool || scratch.owned_pool_threads != thread_count) {
+          scratch.owned_pool = std::make_unique<Common::ThreadPool>(thread_count);
+          scratch.owned_pool_threads = thread_count;
+        }
+        ctx.pool = scratch.owned_pool.get();
+      }
+    }
+
+    const std::size_t prim_count = input.size();
+    ctx.primatives_idxs.resize(prim_count);
+    ctx.prims.Resize(prim_count);
+    Common::ParallelFor(ctx.pool, prim_count, kPrecomputeChunkSize, [&](const std::size_t begin, const std::size_t end) {
+      for (std::size_t i = begin; i < end; ++i) {
+        ctx.primatives_idxs[i] = static_cast<std::uint32_t>(i);
+        const glm::vec3 center = center_fn(input[i]);
+        const auto [prim_min, prim_max] = bounds_fn(input[i]);
+        for (int axis = 0; axis < 3; ++axis) {
+          ctx.prims.centers[axis][i] = center[axis];
+          ctx.prims.min_bounds[axis][i] = prim_min[axis];
+          ctx.prims.max_bounds[axis][i] = prim_max[axis];
+        }
+      }
+    });
+
+    if (options_.method == BVHBuildMethod::kSBVH) {
+      // checked above, this only keeps a null split_fn from instantiating the SBVH build
+      if constexpr (!std::is_same_v<SplitFnT, std::nullptr_t>)
+        BuildSpatial(ctx, input, split_fn);
+    } else {
+      bvh_.resize((2 * prim_count) - 1);
+
+      BVHNode& root = bvh_[0];
+      std::uint32_t next_free_node_idx = 1;
+      root.first_child = 0;
+      root.first_prim_index = 0;
+      root.prim_count = prim_count;
+      if (options_.method == BVHBuildMethod::kLBVH) {
+        SortByMortonCode(&scratch);
+        Subdivide(&ctx, &scratch.split, &bvh_, 0, &next_free_node_idx);
+        bvh_.resize(next_free_node_idx);
+        FitBoundsBottomUp(ctx);
+      } else {
+        UpdateNodeBounds(ctx, &root);
+        Subdivide(&ctx, &scratch.split, &bvh_, 0, &next_free_node_idx);
+        bvh_.resize(next_free_node_idx);
+      }
+
+      // copied rather than moved so the scratch keeps its buffer for the next build
+      prim_indices_.assign(ctx.primatives_idxs.begin(), ctx.primatives_idxs.end());
+    }
+
+    if (options_.treelet_size != 0) {
+      OptimizeTreelets(0);
+      RelayoutDepthFirst(&scratch.nodes);
+    }
+
+    primatives_.reserve(prim_indices_.size());
+    if constexpr (std::is_const_v<Input>) {
+      for (std::uint32_t idx : prim_indices_)
+        primatives_.push_back(input[idx]);
+    } else if (options_.method == BVHBuildMethod::kSBVH) {
+      // primatives can be referenced more than once
+      for (std::uint32_t idx : prim_indices_)
+        primatives_.push_back(input[idx]);
+    } else {
+      for (std::uint32_t idx : prim_indices_)
+        primatives_.push_back(std::move(input[idx]));
+    }
+
+    if (options_.node_order != BVHNodeOrder::kDepthFirst)
+      Reorder(options_.node_order);
+
+    sah_cost_ = ComputeSAHCost();
+    build_sah_cost_ = sah_cost_;
+  }
+
+  float ComputeSAHCost() const {
+    if (bvh_.empty())
+      return 0.0f;
+
+    const float root_area = SurfaceArea(bvh_[0].min_bounds, bvh_[0].max_bounds);
+    if (root_area <= 0.0f)
+      return options_.leaf_cost * primatives_.size();
+
+    float cost = 0.0f;
+    for (const BVHNode& node : bvh_) {
+      const float area = SurfaceArea(node.min_bounds, node.max_bounds);
+      if (node.IsLeaf())
+        cost += area * options_.leaf_cost * node.prim_count;
+      else
+        cost += area * options_.traversal_cost;
+    }
+
+    return cost / root_area;
+  }
+
+  // Children are always allocated after their parent, so walking backwards sees
+  // both children before the node that encloses them
+  void FitBoundsBottomUp(const BuildContext& ctx) {
+    for (std::size_t idx = bvh_.size(); idx-- > 0;) {
+      BVHNode& node = bvh_[idx];
+      if (node.IsLeaf()) {
+        UpdateNodeBounds(ctx, &node);
+      } else {
+        const BVHNode& left = bvh_[node.first_child];
+        const BVHNode& right = bvh_[node.first_child + 1];
+        node.min_bounds = glm::min(left.min_bounds, right.min_bounds);
+        node.max_bounds = glm::max(left.max_bounds, right.max_bounds);
+      }
+    }
+  }
+
+  static void UpdateNodeBounds(const BuildContext& ctx, BVHNode* const node_ptr) {
     BVHNode& node = *node_ptr;
     node.min_bounds = glm::vec3(std::numeric_limits<float>::max());
     node.max_bounds = glm::vec3(std::numeric_limits<float>::lowest());
     const std::uint32_t first = node.first_prim_index;
-    for (std::uint32_t i = 0; i < node.prim_count; i++) {
-      const auto leaf_prim_idx = primatives_idxs[first + i];
-      const auto& leaf_prim = primatives_[leaf_prim_idx];
-      const auto [prim_min, prim_max] = bounds_fn(leaf_prim);
-
-      node.min_bounds = glm::min(node.min_bounds, prim_min);
-      node.max_bounds = glm::max(node.max_bounds, prim_max);
+    for (std::uint32_t i = first; i < first + node.prim_count; i++) {
+      node.min_bounds = glm::min(node.min_bounds, ctx.prims.MinBounds(i));
+      node.max_bounds = glm::max(node.max_bounds, ctx.prims.MaxBounds(i));
     }
   }
 
-  void Subdivide(
-      std::vector<std::uint32_t>* const primatives_idxs_ptr,
-      const std::vector<glm::vec3>& centers,
-      const std::function<std::pair<glm::vec3, glm::vec3>(const Prim&)>& bounds_fn,
-      BVHNode* const node_ptr) {
-    auto& primatives_idxs = *primatives_idxs_ptr;
-    auto& node = *node_ptr;
+  // Midpoint split of the longest axis. Returns false if the node should stay a leaf,
+  // otherwise partitions the node's primatives and sets split_idx to the first right index
+  static bool PartitionMidpoint(
+      BuildContext* const ctx_ptr,
+      const BVHNode& node,
+      std::uint32_t* const split_idx) {
+    auto& ctx = *ctx_ptr;
     if (node.prim_count <= 2)
-      return;
+      return false;
 
     const glm::vec3 extent = node.max_bounds - node.min_bounds;
 
-    // stand in for axis to divide, find better partitioning algo.
     int axis = 0;
     if (extent.y > extent.x)
       axis = 1;
@@ -116,40 +758,1103 @@ class BVH {
       axis = 2;
 
     const float split_pos = node.min_bounds[axis] + extent[axis] * 0.5f;
+    const std::vector<float>& centers = ctx.prims.centers[axis];
 
     std::uint32_t i = node.first_prim_index;
     std::uint32_t j = i + node.prim_count - 1;
     while (i <= j && j != std::uint32_t(-1)) {
-      if (centers[primatives_idxs[i]][axis] < split_pos)
+      if (centers[i] < split_pos)
         i++;
       else
-        std::swap(primatives_idxs[i], primatives_idxs[j--]);
+        ctx.Swap(i, j--);
+    }
+
+    *split_idx = i;
+    return true;
+  }
+
+  // Binned SAH split. Same contract as PartitionMidpoint
+  bool PartitionSAH(
+      BuildContext* const ctx_ptr,
+      SplitScratch* const scratch_ptr,
+      const BVHNode& node,
+      std::uint32_t* const split_idx) const {
+    auto& ctx = *ctx_ptr;
+    const PrimData& prims = ctx.prims;
+    if (node.prim_count <= 1)
+      return false;
+
+    const std::uint32_t first = node.first_prim_index;
+    const std::uint32_t last = first + node.prim_count;
+
+    // bin on centroid bounds, not node bounds, so no bins are wasted on empty space
+    glm::vec3 centroid_min(std::numeric_limits<float>::max());
+    glm::vec3 centroid_max(std::numeric_limits<float>::lowest());
+    for (std::uint32_t i = first; i < last; ++i) {
+      const glm::vec3 center = prims.Center(i);
+      centroid_min = glm::min(centroid_min, center);
+      centroid_max = glm::max(centroid_max, center);
+    }
+
+    const std::uint32_t bin_count = options_.bin_count;
+    auto& bins = scratch_ptr->bins;
+    auto& right_areas = scratch_ptr->right_areas;
+    auto& right_counts = scratch_ptr->right_counts;
+    bins.resize(bin_count);
+    right_areas.resize(bin_count);
+    right_counts.resize(bin_count);
+
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    std::uint32_t best_bin = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float axis_min = centroid_min[axis];
+      const float axis_extent = centroid_max[axis] - axis_min;
+      if (axis_extent <= 0.0f)
+        continue;
+
+      std::fill(bins.begin(), bins.end(), SAHBin{});
+      const float scale = bin_count / axis_extent;
+      const std::vector<float>& centers = prims.centers[axis];
+      for (std::uint32_t i = first; i < last; ++i) {
+        const std::uint32_t bin_idx = std::min(
+            bin_count - 1,
+            static_cast<std::uint32_t>((centers[i] - axis_min) * scale));
+        bins[bin_idx].min_bounds = glm::min(bins[bin_idx].min_bounds, prims.MinBounds(i));
+        bins[bin_idx].max_bounds = glm::max(bins[bin_idx].max_bounds, prims.MaxBounds(i));
+        bins[bin_idx].count++;
+      }
+
+      // sweep right to left, then left to right evaluating each plane between bins
+      SAHBin right;
+      for (std::uint32_t b = bin_count - 1; b > 0; --b) {
+        right.min_bounds = glm::min(right.min_bounds, bins[b].min_bounds);
+        right.max_bounds = glm::max(right.max_bounds, bins[b].max_bounds);
+        right.count += bins[b].count;
+        right_areas[b] = SurfaceArea(right.min_bounds, right.max_bounds);
+        right_counts[b] = right.count;
+      }
+
+      SAHBin left;
+      for (std::uint32_t b = 0; b < bin_count - 1; ++b) {
+        left.min_bounds = glm::min(left.min_bounds, bins[b].min_bounds);
+        left.max_bounds = glm::max(left.max_bounds, bins[b].max_bounds);
+        left.count += bins[b].count;
+        if (left.count == 0 || right_counts[b + 1] == 0)
+          continue;
+
+        const float cost =
+            SurfaceArea(left.min_bounds, left.max_bounds) * left.count +
+            right_areas[b + 1] * right_counts[b + 1];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_bin = b + 1;
+        }
+      }
+    }
+
+    const float node_area = SurfaceArea(node.min_bounds, node.max_bounds);
+    const float leaf_cost = options_.leaf_cost * node.prim_count;
+    if (best_axis >= 0) {
+      const float split_cost = node_area > 0.0f ?
+          options_.traversal_cost + options_.leaf_cost * best_cost / node_area :
+          options_.traversal_cost;
+      if (split_cost >= leaf_cost && node.prim_count <= options_.max_leaf_size)
+        return false;
+    } else if (node.prim_count <= options_.max_leaf_size) {
+      return false;
+    }
+
+    if (best_axis < 0) {
+      // every centroid is in the same spot, no plane separates them. Still have to respect
+      // max_leaf_size so split the range in half
+      *split_idx = first + node.prim_count / 2;
+      return true;
+    }
+
+    const float axis_min = centroid_min[best_axis];
+    const float scale = bin_count / (centroid_max[best_axis] - axis_min);
+    const std::vector<float>& centers = prims.centers[best_axis];
+    const auto goes_left = [&](const std::uint32_t i) {
+      const std::uint32_t bin_idx = std::min(
+          bin_count - 1,
+          static_cast<std::uint32_t>((centers[i] - axis_min) * scale));
+      return bin_idx < best_bin;
+    };
+
+    std::uint32_t i = first;
+    std::uint32_t j = last;
+    while (i < j) {
+      if (goes_left(i))
+        i++;
+      else
+        ctx.Swap(i, --j);
+    }
+
+    *split_idx = i;
+    return true;
+  }
+
+  // Reorders primatives_idxs by the Morton code of each centroid within the centroid bounds
+  void SortByMortonCode(BuildScratch* const scratch_ptr) const {
+    auto& ctx = scratch_ptr->ctx;
+    glm::vec3 centroid_min(std::numeric_limits<float>::max());
+    glm::vec3 centroid_max(std::numeric_limits<float>::lowest());
+    const std::size_t prim_count = ctx.prims.Size();
+    for (int axis = 0; axis < 3; ++axis) {
+      const auto [axis_min, axis_max] = std::minmax_element(ctx.prims.centers[axis].begin(), ctx.prims.centers[axis].end());
+      centroid_min[axis] = *axis_min;
+      centroid_max[axis] = *axis_max;
+    }
+
+    glm::vec3 inv_extent(0.0f);
+    for (int axis = 0; axis < 3; ++axis) {
+      const float extent = centroid_max[axis] - centroid_min[axis];
+      if (extent > 0.0f)
+        inv_extent[axis] = 1.0f / extent;
+    }
+
+    ctx.morton_codes.resize(prim_count);
+    Common::ParallelFor(ctx.pool, prim_count, kPrecomputeChunkSize, [&](const std::size_t begin, const std::size_t end) {
+      for (std::size_t i = begin; i < end; ++i) {
+        const glm::vec3 center = ctx.prims.Center(static_cast<std::uint32_t>(i));
+        ctx.morton_codes[i] = Detail::MortonCode((center - centroid_min) * inv_extent, options_.morton_63_bit);
+      }
+    });
+
+    Detail::RadixSortByKey(
+        &ctx.morton_codes,
+        &ctx.primatives_idxs,
+        options_.morton_63_bit ? 63 : 30,
+        &scratch_ptr->radix_keys,
+        &scratch_ptr->radix_values);
+
+    // primatives_idxs started out as the identity, so it now says where each entry came from
+    PrimData& sorted_prims = scratch_ptr->sorted_prims;
+    sorted_prims.Resize(prim_count);
+    Common::ParallelFor(ctx.pool, prim_count, kPrecomputeChunkSize, [&](const std::size_t begin, const std::size_t end) {
+      for (int axis = 0; axis < 3; ++axis) {
+        for (std::size_t i = begin; i < end; ++i) {
+          const std::uint32_t idx = ctx.primatives_idxs[i];
+          sorted_prims.centers[axis][i] = ctx.prims.centers[axis][idx];
+          sorted_prims.min_bounds[axis][i] = ctx.prims.min_bounds[axis][idx];
+          sorted_prims.max_bounds[axis][i] = ctx.prims.max_bounds[axis][idx];
+        }
+      }
+    });
+    std::swap(ctx.prims, sorted_prims);
+  }
+
+  // Splits at the highest bit where the first and last Morton code of the node differ.
+  // The codes are sorted so everything before the split has that bit clear
+  bool PartitionMorton(const BuildContext& ctx, const BVHNode& node, std::uint32_t* const split_idx) const {
+    if (node.prim_count <= options_.max_leaf_size)
+      return false;
+
+    const std::uint32_t first = node.first_prim_index;
+    const std::uint32_t last = first + node.prim_count;
+    const std::uint64_t first_code = ctx.morton_codes[first];
+    const std::uint64_t last_code = ctx.morton_codes[last - 1];
+    if (first_code == last_code) {
+      // identical codes, nothing to split on
+      *split_idx = first + node.prim_count / 2;
+      return true;
+    }
+
+    std::uint64_t split_bit = std::uint64_t(1) << 62;
+    while ((first_code ^ last_code) < split_bit)
+      split_bit >>= 1;
+
+    const auto begin = ctx.morton_codes.begin();
+    const auto split = std::partition_point(begin + first, begin + last, [split_bit](const std::uint64_t code) {
+      return (code & split_bit) == 0;
+    });
+
+    *split_idx = static_cast<std::uint32_t>(split - begin);
+    return true;
+  }
+
+  /**
+   * Restructures small treelets to minimize SAH cost, bottom up (Karras and Aila 2013).
+   *
+   * A treelet is grown from node_idx by repeatedly opening the treelet leaf with the largest
+   * surface area, then the cheapest binary tree over those leaves is found exhaustively.
+   * The treelet's internal nodes are rewritten into the same child pair slots, so the
+   * node count is unchanged and leaf primative ranges are never touched.
+   */
+  void OptimizeTreelets(const std::uint32_t node_idx) {
+    if (bvh_[node_idx].IsLeaf())
+      return;
+
+    OptimizeTreelets(bvh_[node_idx].first_child);
+    OptimizeTreelets(bvh_[node_idx].first_child + 1);
+
+    std::uint32_t treelet_leaves[kMaxTreeletSize];
+    std::uint32_t pair_slots[kMaxTreeletSize];
+    std::uint32_t leaf_count = 2;
+    std::uint32_t pair_count = 1;
+    treelet_leaves[0] = bvh_[node_idx].first_child;
+    treelet_leaves[1] = bvh_[node_idx].first_child + 1;
+    pair_slots[0] = bvh_[node_idx].first_child;
+    float old_cost = SurfaceArea(bvh_[node_idx].min_bounds, bvh_[node_idx].max_bounds);
+    while (leaf_count < options_.treelet_size) {
+      int largest = -1;
+      float largest_area = -1.0f;
+      for (std::uint32_t i = 0; i < leaf_count; ++i) {
+        const BVHNode& leaf = bvh_[treelet_leaves[i]];
+        const float area = SurfaceArea(leaf.min_bounds, leaf.max_bounds);
+        if (!leaf.IsLeaf() && area > largest_area) {
+          largest = static_cast<int>(i);
+          largest_area = area;
+        }
+      }
+
+      if (largest < 0)
+        break;
+
+      const std::uint32_t opened_child = bvh_[treelet_leaves[largest]].first_child;
+      old_cost += largest_area;
+      pair_slots[pair_count++] = opened_child;
+      treelet_leaves[largest] = opened_child;
+      treelet_leaves[leaf_count++] = opened_child + 1;
+    }
+
+    if (leaf_count < 3)
+      return;
+
+    // cost only counts internal node areas, the subtrees under the treelet leaves don't change
+    const std::uint32_t subset_count = 1u << leaf_count;
+    float areas[1u << kMaxTreeletSize];
+    float costs[1u << kMaxTreeletSize];
+    std::uint32_t best_split[1u << kMaxTreeletSize];
+    glm::vec3 subset_min[1u << kMaxTreeletSize];
+    glm::vec3 subset_max[1u << kMaxTreeletSize];
+    for (std::uint32_t subset = 1; subset < subset_count; ++subset) {
+      const std::uint32_t low_bit = subset & (~subset + 1);
+      if (subset == low_bit) {
+        const BVHNode& leaf = bvh_[treelet_leaves[Detail::LowestBitIndex(subset)]];
+        subset_min[subset] = leaf.min_bounds;
+        subset_max[subset] = leaf.max_bounds;
+        costs[subset] = 0.0f;
+        continue;
+      }
+
+      subset_min[subset] = glm::min(subset_min[low_bit], subset_min[subset ^ low_bit]);
+      subset_max[subset] = glm::max(subset_max[low_bit], subset_max[subset ^ low_bit]);
+      areas[subset] = SurfaceArea(subset_min[subset], subset_max[subset]);
+
+      float best = std::numeric_limits<float>::max();
+      // only partitions holding the lowest bit on the left, the mirror images cost the same
+      for (std::uint32_t part = (subset - 1) & subset; part != 0; part = (part - 1) & subset) {
+        if (!(part & low_bit))
+          continue;
+
+        const float cost = costs[part] + costs[subset ^ part];
+        if (cost < best) {
+          best = cost;
+          best_split[subset] = part;
+        }
+      }
+
+      costs[subset] = areas[subset] + best;
+    }
+
+    // small tolerance so float noise doesn't reshuffle trees that are already optimal
+    if (costs[subset_count - 1] >= old_cost * 0.9999f)
+      return;
+
+    BVHNode leaves[kMaxTreeletSize];
+    for (std::uint32_t i = 0; i < leaf_count; ++i)
+      leaves[i] = bvh_[treelet_leaves[i]];
+
+    std::uint32_t next_pair = 0;
+    const auto emit = [&](const auto& self, const std::uint32_t subset, const std::uint32_t slot) -> std::uint32_t {
+      if ((subset & (subset - 1)) == 0) {
+        bvh_[slot] = leaves[Detail::LowestBitIndex(subset)];
+        return bvh_[slot].first_prim_index;
+      }
+
+      const std::uint32_t pair = pair_slots[next_pair++];
+      const std::uint32_t left_first = self(self, best_split[subset], pair);
+      const std::uint32_t right_first = self(self, subset ^ best_split[subset], pair + 1);
+      BVHNode& node = bvh_[slot];
+      node.min_bounds = subset_min[subset];
+      node.max_bounds = subset_max[subset];
+      node.first_child = pair;
+      node.first_prim_index = std::min(left_first, right_first);
+      node.prim_count = 0;
+      return node.first_prim_index;
+    };
+    emit(emit, subset_count - 1, node_idx);
+  }
+
+  // Pairs are identified by the index of their left node. Calls fn with each pair directly
+  // below pair_idx, the children of whichever of its two nodes aren't leaves
+  template <class Fn>
+  void ForEachChildPair(const std::uint32_t pair_idx, const Fn& fn) const {
+    for (const std::uint32_t node_idx : {pair_idx, pair_idx + 1}) {
+      if (!bvh_[node_idx].IsLeaf())
+        fn(bvh_[node_idx].first_child);
+    }
+  }
+
+  // Surface area of the box around both nodes of a pair, how likely a ray is to visit it
+  float PairArea(const std::uint32_t pair_idx) const {
+    const BVHNode& left = bvh_[pair_idx];
+    const BVHNode& right = bvh_[pair_idx + 1];
+    return SurfaceArea(glm::min(left.min_bounds, right.min_bounds), glm::max(left.max_bounds, right.max_bounds));
+  }
+
+  // Levels of pairs from pair_idx down to its deepest descendant, counting itself
+  std::uint32_t PairHeight(const std::uint32_t pair_idx) const {
+    std::uint32_t height = 1;
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> stack = {{pair_idx, 1}};
+    while (!stack.empty()) {
+      const auto [idx, depth] = stack.back();
+      stack.pop_back();
+      height = std::max(height, depth);
+      ForEachChildPair(idx, [&, depth = depth](const std::uint32_t child) { stack.emplace_back(child, depth + 1); });
+    }
+    return height;
+  }
+
+  // Pairs in the order a depth first traversal visits them, left child first or, with
+  // larger_first, the child with the larger surface area first
+  void OrderPairsDepthFirst(const bool larger_first, std::vector<std::uint32_t>* const pair_order_ptr) const {
+    auto& pair_order = *pair_order_ptr;
+    std::vector<std::uint32_t> stack = {bvh_[0].first_child};
+    while (!stack.empty()) {
+      const std::uint32_t pair_idx = stack.back();
+      stack.pop_back();
+      pair_order.push_back(pair_idx);
+
+      const BVHNode& left = bvh_[pair_idx];
+      const BVHNode& right = bvh_[pair_idx + 1];
+      bool left_first = true;
+      if (larger_first)
+        left_first = SurfaceArea(left.min_bounds, left.max_bounds) >= SurfaceArea(right.min_bounds, right.max_bounds);
+
+      // last pushed is visited first
+      const BVHNode& first = left_first ? left : right;
+      const BVHNode& second = left_first ? right : left;
+      if (!second.IsLeaf())
+        stack.push_back(second.first_child);
+      if (!first.IsLeaf())
+        stack.push_back(first.first_child);
+    }
+  }
+
+  // Lays out the top levels / 2 levels under pair_idx, then each subtree hanging below them
+  void OrderPairsVanEmdeBoas(
+      const std::uint32_t pair_idx,
+      const std::uint32_t levels,
+      std::vector<std::uint32_t>* const pair_order_ptr) const {
+    if (levels <= 1) {
+      pair_order_ptr->push_back(pair_idx);
+      return;
+    }
+
+    const std::uint32_t top_levels = levels / 2;
+    OrderPairsVanEmdeBoas(pair_idx, top_levels, pair_order_ptr);
+
+    std::vector<std::uint32_t> frontier = {pair_idx};
+    for (std::uint32_t level = 0; level < top_levels; ++level) {
+      std::vector<std::uint32_t> next;
+      for (const std::uint32_t idx : frontier)
+        ForEachChildPair(idx, [&next](const std::uint32_t child) { next.push_back(child); });
+      frontier = std::move(next);
+    }
+
+    for (const std::uint32_t idx : frontier)
+      OrderPairsVanEmdeBoas(idx, levels - top_levels, pair_order_ptr);
+  }
+
+  // Groups pairs into treelets of layout_treelet_pairs, each grown from its root by always
+  // taking the largest area pair on its frontier. What's left on the frontier roots the
+  // next treelets, largest first
+  void OrderPairsTreelets(std::vector<std::uint32_t>* const pair_order_ptr) const {
+    auto& pair_order = *pair_order_ptr;
+    const auto by_area = [this](const std::uint32_t a, const std::uint32_t b) { return PairArea(a) < PairArea(b); };
+
+    std::vector<std::uint32_t> treelet_roots = {bvh_[0].first_child};
+    for (std::size_t root = 0; root < treelet_roots.size(); ++root) {
+      // max heap on surface area, the most likely pair to be visited next
+      std::vector<std::uint32_t> frontier = {treelet_roots[root]};
+      for (std::uint32_t i = 0; i < options_.layout_treelet_pairs && !frontier.empty(); ++i) {
+        std::pop_heap(frontier.begin(), frontier.end(), by_area);
+        const std::uint32_t pair_idx = frontier.back();
+        frontier.pop_back();
+        pair_order.push_back(pair_idx);
+        ForEachChildPair(pair_idx, [&](const std::uint32_t child) {
+          frontier.push_back(child);
+          std::push_heap(frontier.begin(), frontier.end(), by_area);
+        });
+      }
+
+      std::sort_heap(frontier.begin(), frontier.end(), by_area);
+      treelet_roots.insert(treelet_roots.end(), frontier.rbegin(), frontier.rend());
+    }
+  }
+
+  // Moves pairs to 1, 3, 5... in the given order, then renumbers primatives in leaf order
+  void ApplyPairOrder(const std::vector<std::uint32_t>& pair_order) {
+    std::vector<std::uint32_t> new_pair_idx(bvh_.size(), 0);
+    for (std::size_t i = 0; i < pair_order.size(); ++i)
+      new_pair_idx[pair_order[i]] = static_cast<std::uint32_t>(1 + 2 * i);
+
+    std::vector<BVHNode> new_bvh(bvh_.size());
+    new_bvh[0] = bvh_[0];
+    for (const std::uint32_t old_idx : pair_order) {
+      new_bvh[new_pair_idx[old_idx]] = bvh_[old_idx];
+      new_bvh[new_pair_idx[old_idx] + 1] = bvh_[old_idx + 1];
+    }
+
+    std::vector<Prim> new_primatives;
+    std::vector<std::uint32_t> new_prim_indices;
+    new_primatives.reserve(primatives_.size());
+    new_prim_indices.reserve(prim_indices_.size());
+    for (BVHNode& node : new_bvh) {
+      if (!node.IsLeaf()) {
+        node.first_child = new_pair_idx[node.first_child];
+        continue;
+      }
+
+      const std::uint32_t first = node.first_prim_index;
+      node.first_prim_index = static_cast<std::uint32_t>(new_primatives.size());
+      for (std::uint32_t i = first; i < first + node.prim_count; ++i) {
+        new_primatives.push_back(std::move(primatives_[i]));
+        new_prim_indices.push_back(prim_indices_[i]);
+      }
+    }
+
+    bvh_ = std::move(new_bvh);
+    primatives_ = std::move(new_primatives);
+    prim_indices_ = std::move(new_prim_indices);
+  }
+
+  // Rewrites nodes in the order Subdivide allocates them (children pair, left subtree, right
+  // subtree). Restores the parent before child ordering after treelets moved nodes around
+  void RelayoutDepthFirst(std::vector<BVHNode>* const new_bvh_ptr) {
+    auto& new_bvh = *new_bvh_ptr;
+    new_bvh.resize(bvh_.size());
+    new_bvh[0] = bvh_[0];
+    std::uint32_t next_free_node_idx = 1;
+    const auto emit = [&](const auto& self, const std::uint32_t old_idx, const std::uint32_t new_idx) -> void {
+      const BVHNode& old_node = bvh_[old_idx];
+      if (old_node.IsLeaf())
+        return;
+
+      const std::uint32_t pair = next_free_node_idx;
+      next_free_node_idx += 2;
+      new_bvh[new_idx].first_child = pair;
+      new_bvh[pair] = bvh_[old_node.first_child];
+      new_bvh[pair + 1] = bvh_[old_node.first_child + 1];
+      self(self, old_node.first_child, pair);
+      self(self, old_node.first_child + 1, pair + 1);
+    };
+    emit(emit, 0, 0);
+    std::copy(new_bvh.begin(), new_bvh.end(), bvh_.begin());
+  }
+
+  /**
+   * Splits nodes[node_idx] and recurses, allocating child pairs from next_free_node_idx.
+   *
+   * Large subtrees are built into their own node arrays on the pool and spliced back in
+   * the same order the serial recursion allocates them (children pair, whole left subtree,
+   * whole right subtree), so the output doesn't depend on scheduling.
+   */
+  void Subdivide(
+      BuildContext* const ctx_ptr,
+      SplitScratch* const scratch_ptr,
+      std::vector<BVHNode>* const nodes_ptr,
+      const std::uint32_t node_idx,
+      std::uint32_t* const next_free_node_idx_ptr) const {
+    auto& ctx = *ctx_ptr;
+    auto& nodes = *nodes_ptr;
+    auto& next_free_node_idx = *next_free_node_idx_ptr;
+    BVHNode& node = nodes[node_idx];
+
+    std::uint32_t i = 0;
+    bool split = false;
+    switch (options_.method) {
+      case BVHBuildMethod::kMidpoint:
+        split = PartitionMidpoint(&ctx, node, &i);
+        break;
+      case BVHBuildMethod::kBinnedSAH:
+        split = PartitionSAH(&ctx, scratch_ptr, node, &i);
+        break;
+      case BVHBuildMethod::kLBVH:
+        split = PartitionMorton(ctx, node, &i);
+        break;
+      case BVHBuildMethod::kSBVH:
+        // built by SubdivideSpatial instead
+        break;
     }
-    
+
+    if (!split)
+      return;
+
     const std::uint32_t left_count = i - node.first_prim_index;
     if (left_count == 0 || left_count == node.prim_count)
       return;
 
-    const std::uint32_t left_child_idx = next_free_node_idx_;
-    const std::uint32_t right_child_idx = next_free_node_idx_ + 1;
-    node.first_child = left_child_idx;
-    bvh_[left_child_idx].first_prim_index = node.first_prim_index;
-    bvh_[left_child_idx].prim_count = left_count;
-    bvh_[right_child_idx].first_prim_index = i;
-    bvh_[right_child_idx].prim_count = node.prim_count - left_count;
+    BVHNode left;
+    left.first_child = 0;
+    left.first_prim_index = node.first_prim_index;
+    left.prim_count = left_count;
+    BVHNode right;
+    right.first_child = 0;
+    right.first_prim_index = i;
+    right.prim_count = node.prim_count - left_count;
+    // LBVH fits every node's bounds in one pass once the topology is done
+    if (options_.method != BVHBuildMethod::kLBVH) {
+      UpdateNodeBounds(ctx, &left);
+      UpdateNodeBounds(ctx, &right);
+    }
 
+    const std::uint32_t left_child_idx = next_free_node_idx;
+    const std::uint32_t right_child_idx = next_free_node_idx + 1;
+    node.first_child = left_child_idx;
     node.prim_count = 0;
-    next_free_node_idx_ += 2;
+    next_free_node_idx += 2;
+
+    if (!ctx.pool || std::min(left.prim_count, right.prim_count) < options_.parallel_subtree_threshold) {
+      nodes[left_child_idx] = left;
+      nodes[right_child_idx] = right;
+      Subdivide(&ctx, scratch_ptr, &nodes, left_child_idx, &next_free_node_idx);
+      Subdivide(&ctx, scratch_ptr, &nodes, right_child_idx, &next_free_node_idx);
+      return;
+    }
+
+    // subtree roots sit at index 0 of their own arrays, descendants follow from 1
+    const auto build_subtree = [this, &ctx](const BVHNode& subtree_root) {
+      std::vector<BVHNode> subtree((2 * subtree_root.prim_count) - 1);
+      subtree[0] = subtree_root;
+      std::uint32_t subtree_next_free = 1;
+      SplitScratch split_scratch;
+      Subdivide(&ctx, &split_scratch, &subtree, 0, &subtree_next_free);
+      subtree.resize(subtree_next_free);
+      return subtree;
+    };
+
+    auto right_future = ctx.pool->Submit([&build_subtree, &right]() { return build_subtree(right); });
+    std::vector<BVHNode> left_subtree = build_subtree(left);
+    std::vector<BVHNode> right_subtree = ctx.pool->Wait(&right_future);
 
-    UpdateNodeBounds(primatives_idxs, bounds_fn, &bvh_[left_child_idx]);
-    UpdateNodeBounds(primatives_idxs, bounds_fn, &bvh_[right_child_idx]);
-    Subdivide(&primatives_idxs, centers, bounds_fn, &bvh_[left_child_idx]);
-    Subdivide(&primatives_idxs, centers, bounds_fn, &bvh_[right_child_idx]);
+    nodes[left_child_idx] = left_subtree[0];
+    nodes[right_child_idx] = right_subtree[0];
+    SpliceSubtree(left_subtree, left_child_idx, &nodes, &next_free_node_idx);
+    SpliceSubtree(right_subtree, right_child_idx, &nodes, &next_free_node_idx);
+  }
+
+  // Copies a subtree's descendants to next_free_node_idx onward, rebasing child indices
+  static void SpliceSubtree(
+      const std::vector<BVHNode>& subtree,
+      const std::uint32_t subtree_root_idx,
+      std::vector<BVHNode>* const nodes_ptr,
+      std::uint32_t* const next_free_node_idx_ptr) {
+    auto& nodes = *nodes_ptr;
+    auto& next_free_node_idx = *next_free_node_idx_ptr;
+    // local index 1 lands on next_free_node_idx
+    const std::uint32_t rebase = next_free_node_idx - 1;
+    if (!subtree[0].IsLeaf())
+      nodes[subtree_root_idx].first_child = subtree[0].first_child + rebase;
+
+    for (std::size_t local_idx = 1; local_idx < subtree.size(); ++local_idx) {
+      BVHNode node = subtree[local_idx];
+      if (!node.IsLeaf())
+        node.first_child += rebase;
+      nodes[next_free_node_idx++] = node;
+    }
+  }
+
+  // SBVH reference, a primative or the part of one left after spatial splits
+  struct SpatialRef {
+    glm::vec3 min_bounds;
+    glm::vec3 max_bounds;
+    std::uint32_t prim_idx;
+  };
+
+  template <class SplitFnT>
+  struct SpatialBuildContext {
+    const SplitFnT* split_fn = nullptr;
+    // primatives in input order, refs point into it
+    const std::vector<Prim>* input = nullptr;
+    // input primative index of each leaf slot, in leaf order
+    std::vector<std::uint32_t> leaf_prim_idxs;
+    // references spatial splits may still add
+    std::size_t duplication_budget = 0;
+    float root_area = 0.0f;
+  };
+
+  // Unnormalized SAH cost (area * count summed over both sides) of a candidate split
+  struct SplitCandidate {
+    float cost = std::numeric_limits<float>::max();
+    int axis = -1;
+    float position = 0.0f;
+    glm::vec3 left_min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 left_max = glm::vec3(std::numeric_limits<float>::lowest());
+    glm::vec3 right_min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 right_max = glm::vec3(std::numeric_limits<float>::lowest());
+  };
+
+  static bool IsEmptyBox(const glm::vec3& min_bounds, const glm::vec3& max_bounds) {
+    return min_bounds.x > max_bounds.x || min_bounds.y > max_bounds.y || min_bounds.z > max_bounds.z;
+  }
+
+  static glm::vec3 RefCenter(const SpatialRef& ref) { return (ref.min_bounds + ref.max_bounds) * 0.5f; }
+
+  template <class SplitFnT>
+  void BuildSpatial(const BuildContext& ctx, const std::vector<Prim>& input, const SplitFnT& split_fn) {
+    const std::size_t prim_count = input.size();
+    std::vector<SpatialRef> refs(prim_count);
+    glm::vec3 root_min(std::numeric_limits<float>::max());
+    glm::vec3 root_max(std::numeric_limits<float>::lowest());
+    // nothing has been partitioned yet, so prims is still in input order
+    for (std::size_t i = 0; i < prim_count; ++i) {
+      refs[i].min_bounds = ctx.prims.MinBounds(static_cast<std::uint32_t>(i));
+      refs[i].max_bounds = ctx.prims.MaxBounds(static_cast<std::uint32_t>(i));
+      refs[i].prim_idx = static_cast<std::uint32_t>(i);
+      root_min = glm::min(root_min, refs[i].min_bounds);
+      root_max = glm::max(root_max, refs[i].max_bounds);
+    }
+
+    SpatialBuildContext<SplitFnT> spatial_ctx;
+    spatial_ctx.split_fn = &split_fn;
+    spatial_ctx.input = &input;
+    spatial_ctx.duplication_budget = static_cast<std::size_t>(prim_count * options_.sbvh_max_duplication);
+    spatial_ctx.root_area = SurfaceArea(root_min, root_max);
+    spatial_ctx.leaf_prim_idxs.reserve(prim_count + spatial_ctx.duplication_budget);
+
+    bvh_.reserve(2 * (prim_count + spatial_ctx.duplication_budget));
+    bvh_.emplace_back();
+    SubdivideSpatial(&spatial_ctx, std::move(refs), 0);
+
+    prim_indices_ = std::move(spatial_ctx.leaf_prim_idxs);
+  }
+
+  // Binned SAH over reference centroids, like PartitionSAH
+  SplitCandidate FindObjectSplit(
+      const std::vector<SpatialRef>& refs,
+      const glm::vec3& centroid_min,
+      const glm::vec3& centroid_max) const {
+    struct Bin {
+      glm::vec3 min_bounds = glm::vec3(std::numeric_limits<float>::max());
+      glm::vec3 max_bounds = glm::vec3(std::numeric_limits<float>::lowest());
+      std::uint32_t count = 0;
+    };
+
+    const std::uint32_t bin_count = options_.bin_count;
+    std::vector<Bin> bins(bin_count);
+    std::vector<Bin> right_sums(bin_count);
+
+    SplitCandidate best;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float axis_min = centroid_min[axis];
+      const float axis_extent = centroid_max[axis] - axis_min;
+      if (axis_extent <= 0.0f)
+        continue;
+
+      std::fill(bins.begin(), bins.end(), Bin{});
+      const float scale = bin_count / axis_extent;
+      for (const SpatialRef& ref : refs) {
+        const std::uint32_t bin_idx = std::min(
+            bin_count - 1,
+            static_cast<std::uint32_t>((RefCenter(ref)[axis] - axis_min) * scale));
+        bins[bin_idx].min_bounds = glm::min(bins[bin_idx].min_bounds, ref.min_bounds);
+        bins[bin_idx].max_bounds = glm::max(bins[bin_idx].max_bounds, ref.max_bounds);
+        bins[bin_idx].count++;
+      }
+
+      Bin right;
+      for (std::uint32_t b = bin_count - 1; b > 0; --b) {
+        right.min_bounds = glm::min(right.min_bounds, bins[b].min_bounds);
+        right.max_bounds = glm::max(right.max_bounds, bins[b].max_bounds);
+        right.count += bins[b].count;
+        right_sums[b] = right;
+      }
+
+      Bin left;
+      for (std::uint32_t b = 0; b < bin_count - 1; ++b) {
+        left.min_bounds = glm::min(left.min_bounds, bins[b].min_bounds);
+        left.max_bounds = glm::max(left.max_bounds, bins[b].max_bounds);
+        left.count += bins[b].count;
+        const Bin& right_sum = right_sums[b + 1];
+        if (left.count == 0 || right_sum.count == 0)
+          continue;
+
+        const float cost =
+            SurfaceArea(left.min_bounds, left.max_bounds) * left.count +
+            SurfaceArea(right_sum.min_bounds, right_sum.max_bounds) * right_sum.count;
+        if (cost < best.cost) {
+          best.cost = cost;
+          best.axis = axis;
+          best.position = axis_min + (b + 1) / scale;
+          best.left_min = left.min_bounds;
+          best.left_max = left.max_bounds;
+          best.right_min = right_sum.min_bounds;
+          best.right_max = right_sum.max_bounds;
+        }
+      }
+    }
+
+    return best;
+  }
+
+  // Clips a reference at the plane, returning the part on each side
+  template <class SplitFnT>
+  static std::pair<SpatialRef, SpatialRef> SplitReference(
+      const SpatialBuildContext<SplitFnT>& ctx,
+      const Prim& prim,
+      const SpatialRef& ref,
+      const int axis,
+      const float position) {
+    const auto [left_bounds, right_bounds] =
+        (*ctx.split_fn)(prim, axis, position, Bounds(ref.min_bounds, ref.max_bounds));
+    SpatialRef left{left_bounds.first, left_bounds.second, ref.prim_idx};
+    SpatialRef right{right_bounds.first, right_bounds.second, ref.prim_idx};
+    return {left, right};
+  }
+
+  // Bins the node's bounds, clipping every reference into each bin it overlaps
+  template <class SplitFnT>
+  SplitCandidate FindSpatialSplit(
+      const SpatialBuildContext<SplitFnT>& ctx,
+      const std::vector<SpatialRef>& refs,
+      const glm::vec3& node_min,
+      const glm::vec3& node_max) const {
+    struct Bin {
+      glm::vec3 min_bounds = glm::vec3(std::numeric_limits<float>::max());
+      glm::vec3 max_bounds = glm::vec3(std::numeric_limits<float>::lowest());
+      std::uint32_t entries = 0;
+      std::uint32_t exits = 0;
+    };
+
+    const std::uint32_t bin_count = options_.bin_count;
+    std::vector<Bin> bins(bin_count);
+    std::vector<Bin> right_sums(bin_count);
+
+    SplitCandidate best;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float axis_min = node_min[axis];
+      const float axis_extent = node_max[axis] - axis_min;
+      if (axis_extent <= 0.0f)
+        continue;
+
+      std::fill(bins.begin(), bins.end(), Bin{});
+      const float bin_width = axis_extent / bin_count;
+      const auto bin_of = [&](const float value) {
+        const float bin = (value - axis_min) / bin_width;
+        return std::min(bin_count - 1, static_cast<std::uint32_t>(std::max(0.0f, bin)));
+      };
+
+      for (const SpatialRef& ref : refs) {
+        const std::uint32_t first_bin = bin_of(ref.min_bounds[axis]);
+        const std::uint32_t last_bin = std::max(first_bin, bin_of(ref.max_bounds[axis]));
+
+        SpatialRef remaining = ref;
+        for (std::uint32_t b = first_bin; b < last_bin; ++b) {
+          const float plane = axis_min + bin_width * (b + 1);
+          const auto [left, right] = SplitReference(ctx, (*ctx.input)[ref.prim_idx], remaining, axis, plane);
+          if (!IsEmptyBox(left.min_bounds, left.max_bounds)) {
+            bins[b].min_bounds = glm::min(bins[b].min_bounds, left.min_bounds);
+            bins[b].max_bounds = glm::max(bins[b].max_bounds, left.max_bounds);
+          }
+          remaining = right;
+        }
+
+        if (!IsEmptyBox(remaining.min_bounds, remaining.max_bounds)) {
+          bins[last_bin].min_bounds = glm::min(bins[last_bin].min_bounds, remaining.min_bounds);
+          bins[last_bin].max_bounds = glm::max(bins[last_bin].max_bounds, remaining.max_bounds);
+        }
+        bins[first_bin].entries++;
+        bins[last_bin].exits++;
+      }
+
+      Bin right;
+      for (std::uint32_t b = bin_count - 1; b > 0; --b) {
+        right.min_bounds = glm::min(right.min_bounds, bins[b].min_bounds);
+        right.max_bounds = glm::max(right.max_bounds, bins[b].max_bounds);
+        right.exits += bins[b].exits;
+        right_sums[b] = right;
+      }
+
+      Bin left;
+      for (std::uint32_t b = 0; b < bin_count - 1; ++b) {
+        left.min_bounds = glm::min(left.min_bounds, bins[b].min_bounds);
+        left.max_bounds = glm::max(left.max_bounds, bins[b].max_bounds);
+        left.entries += bins[b].entries;
+        const Bin& right_sum = right_sums[b + 1];
+        if (left.entries == 0 || right_sum.exits == 0)
+          continue;
+
+        const float cost =
+            SurfaceArea(left.min_bounds, left.max_bounds) * left.entries +
+            SurfaceArea(right_sum.min_bounds, right_sum.max_bounds) * right_sum.exits;
+        if (cost < best.cost) {
+          best.cost = cost;
+          best.axis = axis;
+          best.position = axis_min + bin_width * (b + 1);
+          best.left_min = left.min_bounds;
+          best.left_max = left.max_bounds;
+          best.right_min = right_sum.min_bounds;
+          best.right_max = right_sum.max_bounds;
+        }
+      }
+    }
+
+    return best;
+  }
+
+  // Sorts references to each side of the plane, clipping the ones that straddle it unless
+  // keeping them whole on one side is cheaper (reference unsplitting) or the budget ran out
+  template <class SplitFnT>
+  void PartitionSpatial(
+      SpatialBuildContext<SplitFnT>* const ctx_ptr,
+      const std::vector<SpatialRef>& refs,
+      const SplitCandidate& split,
+      std::vector<SpatialRef>* const left_refs_ptr,
+      std::vector<SpatialRef>* const right_refs_ptr) const {
+    auto& ctx = *ctx_ptr;
+    auto& left_refs = *left_refs_ptr;
+    auto& right_refs = *right_refs_ptr;
+    const int axis = split.axis;
+    const float plane = split.position;
+
+    glm::vec3 left_min(std::numeric_limits<float>::max());
+    glm::vec3 left_max(std::numeric_limits<float>::lowest());
+    glm::vec3 right_min = left_min;
+    glm::vec3 right_max = left_max;
+    std::vector<SpatialRef> straddling;
+    for (const SpatialRef& ref : refs) {
+      if (ref.max_bounds[axis] <= plane) {
+        left_refs.push_back(ref);
+        left_min = glm::min(left_min, ref.min_bounds);
+        left_max = glm::max(left_max, ref.max_bounds);
+      } else if (ref.min_bounds[axis] >= plane) {
+        right_refs.push_back(ref);
+        right_min = glm::min(right_min, ref.min_bounds);
+        right_max = glm::max(right_max, ref.max_bounds);
+      } else {
+        straddling.push_back(ref);
+      }
+    }
+
+    // straddlers count on both sides until they're decided
+    float left_count = static_cast<float>(left_refs.size() + straddling.size());
+    float right_count = static_cast<float>(right_refs.size() + straddling.size());
+    for (const SpatialRef& ref : straddling) {
+      const auto [left, right] = SplitReference(ctx, (*ctx.input)[ref.prim_idx], ref, axis, plane);
+      const bool left_empty = IsEmptyBox(left.min_bounds, left.max_bounds);
+      const bool right_empty = IsEmptyBox(right.min_bounds, right.max_bounds);
+
+      const float left_area = SurfaceArea(left_min, left_max);
+      const float right_area = SurfaceArea(right_min, right_max);
+      const float whole_left_cost =
+          SurfaceArea(glm::min(left_min, ref.min_bounds), glm::max(left_max, ref.max_bounds)) * left_count +
+          right_area * (right_count - 1.0f);
+      const float whole_right_cost =
+          left_area * (left_count - 1.0f) +
+          SurfaceArea(glm::min(right_min, ref.min_bounds), glm::max(right_max, ref.max_bounds)) * right_count;
+      float clipped_cost = std::numeric_limits<float>::max();
+      if (ctx.duplication_budget > 0 && !left_empty && !right_empty) {
+        clipped_cost =
+            SurfaceArea(glm::min(left_min, left.min_bounds), glm::max(left_max, left.max_bounds)) * left_count +
+            SurfaceArea(glm::min(right_min, right.min_bounds), glm::max(right_max, right.max_bounds)) * right_count;
+      }
+
+      if (clipped_cost < whole_left_cost && clipped_cost < whole_right_cost) {
+        ctx.duplication_budget--;
+        left_refs.push_back(left);
+        right_refs.push_back(right);
+        left_min = glm::min(left_min, left.min_bounds);
+        left_max = glm::max(left_max, left.max_bounds);
+        right_min = glm::min(right_min, right.min_bounds);
+        right_max = glm::max(right_max, right.max_bounds);
+      } else if (whole_left_cost <= whole_right_cost) {
+        left_refs.push_back(ref);
+        left_min = glm::min(left_min, ref.min_bounds);
+        left_max = glm::max(left_max, ref.max_bounds);
+        right_count -= 1.0f;
+      } else {
+        right_refs.push_back(ref);
+        right_min = glm::min(right_min, ref.min_bounds);
+        right_max = glm::max(right_max, ref.max_bounds);
+        left_count -= 1.0f;
+      }
+    }
+  }
+
+  template <class SplitFnT>
+  void SubdivideSpatial(
+      SpatialBuildContext<SplitFnT>* const ctx_ptr,
+      std::vector<SpatialRef> refs,
+      const std::uint32_t node_idx) {
+    auto& ctx = *ctx_ptr;
+    glm::vec3 node_min(std::numeric_limits<float>::max());
+    glm::vec3 node_max(std::numeric_limits<float>::lowest());
+    glm::vec3 centroid_min = node_min;
+    glm::vec3 centroid_max = node_max;
+    for (const SpatialRef& ref : refs) {
+      node_min = glm::min(node_min, ref.min_bounds);
+      node_max = glm::max(node_max, ref.max_bounds);
+      centroid_min = glm::min(centroid_min, RefCenter(ref));
+      centroid_max = glm::max(centroid_max, RefCenter(ref));
+    }
+
+    bvh_[node_idx].min_bounds = node_min;
+    bvh_[node_idx].max_bounds = node_max;
+    const std::uint32_t ref_count = static_cast<std::uint32_t>(refs.size());
+
+    SplitCandidate best;
+    bool spatial = false;
+    if (ref_count > 1) {
+      best = FindObjectSplit(refs, centroid_min, centroid_max);
+
+      // only worth clipping when the object split's children overlap noticeably
+      const glm::vec3 overlap_min = glm::max(best.left_min, best.right_min);
+      const glm::vec3 overlap_max = glm::min(best.left_max, best.right_max);
+      const bool overlapping =
+          best.axis < 0 ||
+          SurfaceArea(overlap_min, overlap_max) > options_.sbvh_overlap_threshold * ctx.root_area;
+      if (ctx.duplication_budget > 0 && overlapping) {
+        const SplitCandidate spatial_split = FindSpatialSplit(ctx, refs, node_min, node_max);
+        if (spatial_split.cost < best.cost) {
+          best = spatial_split;
+          spatial = true;
+        }
+      }
+    }
+
+    const float node_area = SurfaceArea(node_min, node_max);
+    const float leaf_cost = options_.leaf_cost * ref_count;
+    bool make_leaf = ref_count <= 1;
+    if (!make_leaf && best.axis >= 0) {
+      const float split_cost = node_area > 0.0f ?
+          options_.traversal_cost + options_.leaf_cost * best.cost / node_area :
+          options_.traversal_cost;
+      make_leaf = split_cost >= leaf_cost && ref_count <= options_.max_leaf_size;
+    } else if (!make_leaf) {
+      make_leaf = ref_count <= options_.max_leaf_size;
+    }
+
+    if (make_leaf) {
+      BVHNode& node = bvh_[node_idx];
+      node.first_child = 0;
+      node.first_prim_index = static_cast<std::uint32_t>(ctx.leaf_prim_idxs.size());
+      node.prim_count = ref_count;
+      for (const SpatialRef& ref : refs)
+        ctx.leaf_prim_idxs.push_back(ref.prim_idx);
+      return;
+    }
+
+    std::vector<SpatialRef> left_refs;
+    std::vector<SpatialRef> right_refs;
+    if (spatial) {
+      PartitionSpatial(&ctx, refs, best, &left_refs, &right_refs);
+      if (left_refs.empty() || right_refs.empty()) {
+        // unsplitting moved everything to one side, fall back to the object split
+        ctx.duplication_budget += left_refs.size() + right_refs.size() - refs.size();
+        left_refs.clear();
+        right_refs.clear();
+        spatial = false;
+        best = FindObjectSplit(refs, centroid_min, centroid_max);
+      }
+    }
+
+    if (!spatial) {
+      if (best.axis >= 0) {
+        for (const SpatialRef& ref : refs)
+          (RefCenter(ref)[best.axis] < best.position ? left_refs : right_refs).push_back(ref);
+      }
+
+      // no plane separates the centroids (or float rounding put them all on one side),
+      // still have to respect max_leaf_size so split the list in half
+      if (left_refs.empty() || right_refs.empty()) {
+        left_refs.assign(refs.begin(), refs.begin() + ref_count / 2);
+        right_refs.assign(refs.begin() + ref_count / 2, refs.end());
+      }
+    }
+
+    std::vector<SpatialRef>().swap(refs);
+
+    const std::uint32_t left_idx = static_cast<std::uint32_t>(bvh_.size());
+    bvh_.emplace_back();
+    bvh_.emplace_back();
+    bvh_[node_idx].first_child = left_idx;
+    bvh_[node_idx].first_prim_index = 0;
+    bvh_[node_idx].prim_count = 0;
+
+    SubdivideSpatial(&ctx, std::move(left_refs), left_idx);
+    SubdivideSpatial(&ctx, std::move(right_refs), left_idx + 1);
   }
 
   std::vector<Prim> primatives_;
+  std::vector<std::uint32_t> prim_indices_;
   std::vector<BVHNode> bvh_;
-  std::uint32_t next_free_node_idx_ = 0;
+  BVHBuildOptions options_;
+  float sah_cost_ = 0.0f;
+  // cost right after the build, baseline for GetRefitDegradation
+  float build_sah_cost_ = 0.0f;
+};
+
+/**
+ * Builds BVHs over and over without reallocating, for geometry that is rebuilt every frame.
+ * The builder keeps the build's scratch buffers, and the tree is written into a BVH owned by
+ * the caller. Neither gives memory back between builds, so once both have grown to fit the
+ * largest input a rebuild makes no heap allocations.
+ *
+ * That holds for serial kMidpoint, kBinnedSAH and kLBVH builds, with or without treelet
+ * optimization. Parallel builds still allocate per subtree, SBVH builds per node, and node
+ * orders other than kDepthFirst while reordering.
+ *
+ * Not thread safe, use one builder per thread
+ */
+template <class Prim>
+class BVHBuilder {
+ public:
+  /**
+   * Rebuilds bvh over primatives, see the BVH constructors for the callables. The result is
+   * the same as constructing a BVH with these arguments. primatives are copied into the
+   * BVH, not moved
+   */
+  template <class CenterFn, class BoundsFn>
+  void Build(
+      const std::vector<Prim>& primatives,
+      const CenterFn& center_fn,
+      const BoundsFn& bounds_fn,
+      const BVHBuildOptions& options,
+      BVH<Prim>* const bvh_ptr) {
+    Build(primatives, center_fn, bounds_fn, nullptr, options, bvh_ptr);
+  }
+
+  template <class CenterFn, class BoundsFn, class SplitFnT>
+  void Build(
+      const std::vector<Prim>& primatives,
+      const CenterFn& center_fn,
+      const BoundsFn& bounds_fn,
+      const SplitFnT& split_fn,
+      const BVHBuildOptions& options,
+      BVH<Prim>* const bvh_ptr) {
+    bvh_ptr->Build(primatives, center_fn, bounds_fn, split_fn, options, &scratch_);
+    peak_scratch_bytes_ = std::max(peak_scratch_bytes_, scratch_.CapacityBytes());
+  }
+
+  // Bytes of scratch held right now
+  std::size_t GetScratchBytes() const { return scratch_.CapacityBytes(); }
+  // Most scratch held after any build since construction or the last Release
+  std::size_t GetPeakScratchBytes() const { return peak_scratch_bytes_; }
+
+  // Frees every scratch buffer, the next build starts from nothing
+  void Release() {
+    scratch_ = typename BVH<Prim>::BuildScratch();
+    peak_scratch_bytes_ = 0;
+  }
+
+ private:
+  typename BVH<Prim>::BuildScratch scratch_;
+  std::size_t peak_scratch_bytes_ = 0;
 };
 
 }
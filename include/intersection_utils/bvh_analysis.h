@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "intersection_utils/bvh.h"
+#include "intersection_utils/traversal.h"
+#include "intersection_utils/wide_bvh.h"
+
+namespace IntersectionUtils {
+/**
+ * Shape and quality of a BVH, see AnalyzeBVH
+ *
+ * @var max_depth Depth of the deepest leaf, the root is depth 0
+ * @var average_leaf_depth Mean depth of the leaves, not weighted by primative count
+ * @var leaf_size_histogram Number of leaves holding each primative count, indexed by count
+ * @var overlap_ratio Summed surface area of the overlap between sibling boxes over the summed
+ *                    area of their parents. 0 when siblings never overlap, the higher the
+ *                    more often a ray has to visit both children
+ * @var binary_stack_size Stack entries Intersects in ray_intersects.glsl needs for this tree
+ * @var wide_stack_size Stack entries IntersectsWide and IntersectsCompressed need after the
+ *                      tree is collapsed into a BVH8
+ */
+struct BVHAnalysis {
+  std::size_t node_count = 0;
+  std::size_t leaf_count = 0;
+  std::size_t prim_count = 0;
+  std::uint32_t max_depth = 0;
+  float average_leaf_depth = 0.0f;
+  std::vector<std::size_t> leaf_size_histogram;
+  float sah_cost = 0.0f;
+  float overlap_ratio = 0.0f;
+  std::uint32_t binary_stack_size = 0;
+  std::uint32_t wide_stack_size = 0;
+};
+
+/**
+ * Deepest the stack of a fixed order traversal gets on this tree, like Intersects in
+ * ray_intersects.glsl: pop a node, push first_child then first_child + 1.
+ *
+ * When a node's children are pushed, everything its ancestors pushed and haven't had
+ * popped yet is still below them. first_child + 1 is pushed last and so popped first,
+ * its whole subtree is traversed with first_child still on the stack underneath.
+ */
+inline std::uint32_t RequiredStackSize(const std::vector<BVHNode>& nodes) {
+  if (nodes.empty())
+    return 0;
+
+  // parents before children, walked backwards so children are seen first. A DynamicBVH
+  // can put children before their parent and have unused nodes, so it's found from the root
+  std::vector<std::uint32_t> order = {0};
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    const BVHNode& node = nodes[order[i]];
+    if (!node.IsLeaf()) {
+      order.push_back(node.first_child);
+      order.push_back(node.first_child + 1);
+    }
+  }
+
+  std::vector<std::uint32_t> needed(nodes.size(), 0);
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    const BVHNode& node = nodes[*it];
+    if (node.IsLeaf())
+      continue;
+
+    // the right child is popped first, with the left one still underneath
+    needed[*it] = std::max({2u, needed[node.first_child], 1 + needed[node.first_child + 1]});
+  }
+
+  return std::max(1u, needed[0]);
+}
+
+/**
+ * Same for IntersectsWide / IntersectsCompressed, which push only the internal children
+ * of a node in slot order
+ */
+template <std::uint32_t Width>
+std::uint32_t RequiredStackSize(const WideBVH<Width>& wide_bvh) {
+  const auto& nodes = wide_bvh.GetNodes();
+  if (nodes.empty())
+    return 0;
+
+  std::vector<std::uint32_t> needed(nodes.size(), 0);
+  for (std::size_t idx = nodes.size(); idx-- > 0;) {
+    const WideBVHNode<Width>& node = nodes[idx];
+    std::uint32_t pushed = 0;
+    for (std::uint32_t slot = 0; slot < Width && !node.IsEmpty(slot); ++slot) {
+      if (node.IsLeaf(slot))
+        continue;
+
+      // the children pushed before this one stay underneath while it's traversed
+      needed[idx] = std::max(needed[idx], pushed + needed[node.child_or_prim_index[slot]]);
+      pushed++;
+    }
+    needed[idx] = std::max(needed[idx], pushed);
+  }
+
+  return std::max(1u, needed[0]);
+}
+
+// Throws std::runtime_error if a traversal needing required_size entries would overflow
+// the stacks in ray_intersects.glsl. what names the tree in the message
+inline void CheckStackSize(const std::uint32_t required_size, const std::string& what) {
+  if (required_size > kTraversalStackSize) {
+    throw std::runtime_error(
+        what + " needs a traversal stack of " + std::to_string(required_size) +
+        " entries, shaders only have " + std::to_string(kTraversalStackSize));
+  }
+}
+
+// Walks the whole tree, so meant for tooling and load time checks rather than every frame
+template <class Prim>
+BVHAnalysis AnalyzeBVH(const BVH<Prim>& bvh) {
+  BVHAnalysis analysis;
+  const auto& nodes = bvh.GetBVH();
+  analysis.node_count = nodes.size();
+  analysis.prim_count = bvh.GetPrims().size();
+  analysis.sah_cost = bvh.GetSAHCost();
+  if (nodes.empty())
+    return analysis;
+
+  // children are always after their parent, so depths can be filled going forwards
+  std::vector<std::uint32_t> depths(nodes.size(), 0);
+  double leaf_depth_sum = 0.0;
+  double overlap_area = 0.0;
+  double parent_area = 0.0;
+  for (std::size_t idx = 0; idx < nodes.size(); ++idx) {
+    const BVHNode& node = nodes[idx];
+    if (node.IsLeaf()) {
+      analysis.leaf_count++;
+      analysis.max_depth = std::max(analysis.max_depth, depths[idx]);
+      leaf_depth_sum += depths[idx];
+      if (analysis.leaf_size_histogram.size() <= node.prim_count)
+        analysis.leaf_size_histogram.resize(node.prim_count + 1, 0);
+      analysis.leaf_size_histogram[node.prim_count]++;
+      continue;
+    }
+
+    const BVHNode& left = nodes[node.first_child];
+    const BVHNode& right = nodes[node.first_child + 1];
+    depths[node.first_child] = depths[idx] + 1;
+    depths[node.first_child + 1] = depths[idx] + 1;
+    // children that only touch don't count, a ray can still pick one of them
+    const glm::vec3 overlap_min = glm::max(left.min_bounds, right.min_bounds);
+    const glm::vec3 overlap_max = glm::min(left.max_bounds, right.max_bounds);
+    if (overlap_min.x < overlap_max.x && overlap_min.y < overlap_max.y && overlap_min.z < overlap_max.z)
+      overlap_area += SurfaceArea(overlap_min, overlap_max);
+    parent_area += SurfaceArea(node.min_bounds, node.max_bounds);
+  }
+
+  analysis.average_leaf_depth = static_cast<float>(leaf_depth_sum / analysis.leaf_count);
+  if (parent_area > 0.0)
+    analysis.overlap_ratio = static_cast<float>(overlap_area / parent_area);
+
+  analysis.binary_stack_size = RequiredStackSize(nodes);
+  analysis.wide_stack_size = RequiredStackSize(BVH8(nodes));
+  return analysis;
+}
+
+}
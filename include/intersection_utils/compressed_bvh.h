@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "intersection_utils/wide_bvh.h"
+
+namespace IntersectionUtils {
+/**
+ * 8 wide node with child bounds quantized to 8 bits per plane, 128 bytes instead of the
+ * 256 of a WideBVHNode<8>. Each axis is a grid starting at origin with a power of two cell
+ * size, and child bounds are rounded outwards onto it so they stay conservative.
+ *
+ * Needs to match CompressedBVHNode in shaders/raytrace_types.glsl
+ *
+ * @var exponents Biased (+127) exponent of each axis' cell size, so the scale is the float
+ *                with exactly those exponent bits
+ * @var q_min Quantized child min bounds, [axis][slot]
+ * @var q_max Quantized child max bounds, [axis][slot]
+ */
+struct CompressedBVHNode {
+  static constexpr std::uint32_t kWidth = 8;
+  static constexpr std::uint32_t kEmptySlot = WideBVHNode<kWidth>::kEmptySlot;
+
+  glm::vec3 origin;
+  std::array<std::uint8_t, 3> exponents;
+  std::uint8_t _pad0 = 0;
+  std::array<std::array<std::uint8_t, kWidth>, 3> q_min;
+  std::array<std::array<std::uint8_t, kWidth>, 3> q_max;
+  std::array<std::uint32_t, kWidth> child_or_prim_index;
+  std::array<std::uint32_t, kWidth> prim_count;
+
+  bool IsEmpty(const std::uint32_t slot) const { return child_or_prim_index[slot] == kEmptySlot; }
+  bool IsLeaf(const std::uint32_t slot) const { return prim_count[slot] > 0; }
+
+  glm::vec3 GetScale() const {
+    return {
+        std::ldexp(1.0f, exponents[0] - 127),
+        std::ldexp(1.0f, exponents[1] - 127),
+        std::ldexp(1.0f, exponents[2] - 127)};
+  }
+
+  glm::vec3 GetMinBounds(const std::uint32_t slot) const {
+    return origin + glm::vec3(q_min[0][slot], q_min[1][slot], q_min[2][slot]) * GetScale();
+  }
+
+  glm::vec3 GetMaxBounds(const std::uint32_t slot) const {
+    return origin + glm::vec3(q_max[0][slot], q_max[1][slot], q_max[2][slot]) * GetScale();
+  }
+};
+static_assert(sizeof(CompressedBVHNode) == 128, "CompressedBVHNode has to match the std430 layout");
+
+/**
+ * What compression cost and saved
+ *
+ * @var mean_area_inflation Average ratio of decoded to exact child surface area
+ * @var max_area_inflation Worst ratio of decoded to exact child surface area
+ */
+struct CompressedBVHReport {
+  std::size_t node_count = 0;
+  std::size_t wide_bytes = 0;
+  std::size_t compressed_bytes = 0;
+  float mean_area_inflation = 1.0f;
+  float max_area_inflation = 1.0f;
+};
+
+// Quantized copy of a BVH8, same topology and node indices
+class CompressedWideBVH {
+ public:
+  explicit CompressedWideBVH(const BVH8& wide_bvh) {
+    const auto& wide_nodes = wide_bvh.GetNodes();
+    nodes_.reserve(wide_nodes.size());
+
+    double inflation_sum = 0.0;
+    std::size_t inflation_count = 0;
+    for (const auto& wide_node : wide_nodes) {
+      nodes_.push_back(Compress(wide_node));
+
+      const CompressedBVHNode& node = nodes_.back();
+      for (std::uint32_t slot = 0; slot < kWidth && !wide_node.IsEmpty(slot); ++slot) {
+        const float exact_area = SurfaceArea(wide_node.GetMinBounds(slot), wide_node.GetMaxBounds(slot));
+        if (exact_area <= 0.0f)
+          continue;
+
+        const float inflation = SurfaceArea(node.GetMinBounds(slot), node.GetMaxBounds(slot)) / exact_area;
+        inflation_sum += inflation;
+        inflation_count++;
+        report_.max_area_inflation = std::max(report_.max_area_inflation, inflation);
+      }
+    }
+
+    report_.node_count = nodes_.size();
+    report_.wide_bytes = wide_nodes.size() * sizeof(WideBVHNode<kWidth>);
+    report_.compressed_bytes = nodes_.size() * sizeof(CompressedBVHNode);
+    if (inflation_count > 0)
+      report_.mean_area_inflation = static_cast<float>(inflation_sum / inflation_count);
+  }
+
+  const std::vector<CompressedBVHNode>& GetNodes() const { return nodes_; }
+  const CompressedBVHReport& GetReport() const { return report_; }
+
+ private:
+  static constexpr std::uint32_t kWidth = CompressedBVHNode::kWidth;
+
+  static CompressedBVHNode Compress(const WideBVHNode<kWidth>& wide_node) {
+    CompressedBVHNode node;
+    node.child_or_prim_index = wide_node.child_or_prim_index;
+    node.prim_count = wide_node.prim_count;
+    for (auto& axis : node.q_min)
+      axis.fill(0);
+    for (auto& axis : node.q_max)
+      axis.fill(0);
+
+    const std::uint32_t child_count = wide_node.GetChildCount();
+    glm::vec3 node_min(std::numeric_limits<float>::max());
+    glm::vec3 node_max(std::numeric_limits<float>::lowest());
+    for (std::uint32_t slot = 0; slot < child_count; ++slot) {
+      node_min = glm::min(node_min, wide_node.GetMinBounds(slot));
+      node_max = glm::max(node_max, wide_node.GetMaxBounds(slot));
+    }
+
+    if (child_count == 0) {
+      node.origin = glm::vec3(0.0f);
+      node.exponents = {127, 127, 127};
+      return node;
+    }
+
+    node.origin = node_min;
+    for (int axis = 0; axis < 3; ++axis) {
+      // smallest power of two cell that still fits the extent in 255 cells
+      const float extent = node_max[axis] - node_min[axis];
+      int exponent = -126;
+      if (extent > 0.0f) {
+        exponent = std::max(-126, static_cast<int>(std::ceil(std::log2(extent / 255.0f))));
+        // compare the decoded max, not the extent, so rounding can't leave it short
+        while (node_min[axis] + std::ldexp(255.0f, exponent) < node_max[axis])
+          exponent++;
+      }
+      node.exponents[axis] = static_cast<std::uint8_t>(exponent + 127);
+    }
+
+    const glm::vec3 scale = node.GetScale();
+    for (std::uint32_t slot = 0; slot < child_count; ++slot) {
+      const glm::vec3 child_min = wide_node.GetMinBounds(slot);
+      const glm::vec3 child_max = wide_node.GetMaxBounds(slot);
+      for (int axis = 0; axis < 3; ++axis) {
+        // round outwards, then step further out if float error still left the box short
+        int q_min = static_cast<int>(std::floor((child_min[axis] - node.origin[axis]) / scale[axis]));
+        int q_max = static_cast<int>(std::ceil((child_max[axis] - node.origin[axis]) / scale[axis]));
+        q_min = std::clamp(q_min, 0, 255);
+        q_max = std::clamp(q_max, 0, 255);
+        while (q_min > 0 && node.origin[axis] + q_min * scale[axis] > child_min[axis])
+          q_min--;
+        while (q_max < 255 && node.origin[axis] + q_max * scale[axis] < child_max[axis])
+          q_max++;
+
+        node.q_min[axis][slot] = static_cast<std::uint8_t>(q_min);
+        node.q_max[axis][slot] = static_cast<std::uint8_t>(q_max);
+      }
+    }
+
+    return node;
+  }
+
+  std::vector<CompressedBVHNode> nodes_;
+  CompressedBVHReport report_;
+};
+
+}
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "intersection_utils/bvh.h"
+
+namespace IntersectionUtils {
+/**
+ * BVH that primatives can be inserted into and removed from in place, for scenes that are
+ * edited while being traced. Each change touches the path from one leaf to the root, and
+ * tree rotations along that path keep the SAH cost close to a full build's.
+ *
+ * Nodes use the same layout as BVH: children come in pairs at first_child and
+ * first_child + 1, node 0 is the root, and every leaf holds one primative with
+ * first_prim_index being its handle. Unlike BVH, children aren't always after their parent
+ * and GetBVH() can hold unused nodes, so only walk it from the root.
+ *
+ * Node and primative indices never move while they're in use, so the ranges from
+ * TakeDirtyNodes and TakeDirtyPrims are all that needs uploading after a batch of edits,
+ * see AssetUtils::UpdateModelDynamicBVH
+ */
+template <class Prim>
+class DynamicBVH {
+ public:
+  using Bounds = std::pair<glm::vec3, glm::vec3>;
+
+  // Only traversal_cost and leaf_cost are used
+  explicit DynamicBVH(const BVHBuildOptions& options = {}) : options_(options) {}
+
+  /**
+   * Adds prim with the given bounds. Returns its handle, which is also its index in
+   * GetPrims(). Handles of removed primatives are reused
+   */
+  std::uint32_t Insert(Prim prim, const Bounds& bounds) {
+    std::uint32_t handle;
+    if (!free_prims_.empty()) {
+      handle = free_prims_.back();
+      free_prims_.pop_back();
+      primatives_[handle] = std::move(prim);
+    } else {
+      handle = static_cast<std::uint32_t>(primatives_.size());
+      primatives_.push_back(std::move(prim));
+      leaf_nodes_.push_back(kNoNode);
+    }
+    dirty_prims_.push_back(handle);
+
+    InsertLeaf(handle, bounds);
+    prim_count_++;
+    return handle;
+  }
+
+  // Removes the primative, its handle may be given out again by Insert
+  void Remove(const std::uint32_t handle) {
+    CheckHandle(handle);
+    RemoveLeaf(handle);
+    leaf_nodes_[handle] = kNoNode;
+    free_prims_.push_back(handle);
+    prim_count_--;
+  }
+
+  // Replaces the primative, e.g. after it was moved. Keeps the handle
+  void Update(const std::uint32_t handle, Prim prim, const Bounds& bounds) {
+    CheckHandle(handle);
+    primatives_[handle] = std::move(prim);
+    dirty_prims_.push_back(handle);
+    RemoveLeaf(handle);
+    InsertLeaf(handle, bounds);
+  }
+
+  const std::vector<BVHNode>& GetBVH() const { return bvh_; }
+  // Indexed by handle. Slots of removed primatives keep their old value until reused
+  const std::vector<Prim>& GetPrims() const { return primatives_; }
+  std::size_t Size() const { return prim_count_; }
+  bool Empty() const { return prim_count_ == 0; }
+
+  // Same as BVH::GetSAHCost, walks the tree so it's for tooling and tests
+  float GetSAHCost() const {
+    if (bvh_.empty())
+      return 0.0f;
+
+    const float root_area = SurfaceArea(bvh_[0].min_bounds, bvh_[0].max_bounds);
+    if (root_area <= 0.0f)
+      return options_.leaf_cost * prim_count_;
+
+    float cost = 0.0f;
+    std::vector<std::uint32_t> stack = {0};
+    while (!stack.empty()) {
+      const BVHNode& node = bvh_[stack.back()];
+      stack.pop_back();
+      const float area = SurfaceArea(node.min_bounds, node.max_bounds);
+      if (node.IsLeaf()) {
+        cost += area * options_.leaf_cost * node.prim_count;
+      } else {
+        cost += area * options_.traversal_cost;
+        stack.push_back(node.first_child);
+        stack.push_back(node.first_child + 1);
+      }
+    }
+
+    return cost / root_area;
+  }
+
+  // Nodes written since the last call, merged into as few ranges as possible
+  std::vector<BVHNodeRange> TakeDirtyNodes() { return TakeRanges(&dirty_nodes_); }
+  // Same for primatives that were inserted or updated
+  std::vector<BVHNodeRange> TakeDirtyPrims() { return TakeRanges(&dirty_prims_); }
+
+ private:
+  static constexpr std::uint32_t kNoNode = std::numeric_limits<std::uint32_t>::max();
+
+  void CheckHandle(const std::uint32_t handle) const {
+    if (handle >= leaf_nodes_.size() || leaf_nodes_[handle] == kNoNode)
+      throw std::out_of_range("DynamicBVH handle isn't in the tree");
+  }
+
+  // The other node of idx's pair
+  static std::uint32_t Sibling(const std::uint32_t idx) { return idx % 2 == 1 ? idx + 1 : idx - 1; }
+
+  void MarkDirty(const std::uint32_t idx) { dirty_nodes_.push_back(idx); }
+
+  // First node of a free pair, reusing removed ones before growing
+  std::uint32_t AllocatePair() {
+    if (!free_pairs_.empty()) {
+      const std::uint32_t first = free_pairs_.back();
+      free_pairs_.pop_back();
+      return first;
+    }
+
+    const std::uint32_t first = static_cast<std::uint32_t>(bvh_.size());
+    bvh_.resize(bvh_.size() + 2);
+    parents_.resize(bvh_.size(), kNoNode);
+    return first;
+  }
+
+  void FreePair(const std::uint32_t first) {
+    // never reached from the root, but an empty box keeps a stray traversal out of it
+    for (const std::uint32_t idx : {first, first + 1}) {
+      BVHNode& node = bvh_[idx];
+      node.min_bounds = glm::vec3(std::numeric_limits<float>::max());
+      node.max_bounds = glm::vec3(std::numeric_limits<float>::lowest());
+      node.first_child = 0;
+      node.first_prim_index = 0;
+      node.prim_count = 0;
+      parents_[idx] = kNoNode;
+      MarkDirty(idx);
+    }
+    free_pairs_.push_back(first);
+  }
+
+  // Points whatever node idx holds (children or primative) back at idx
+  void AdoptContents(const std::uint32_t idx) {
+    const BVHNode& node = bvh_[idx];
+    if (node.IsLeaf()) {
+      leaf_nodes_[node.first_prim_index] = idx;
+    } else {
+      parents_[node.first_child] = idx;
+      parents_[node.first_child + 1] = idx;
+    }
+    MarkDirty(idx);
+  }
+
+  void MakeLeaf(const std::uint32_t idx, const std::uint32_t handle, const Bounds& bounds) {
+    BVHNode& node = bvh_[idx];
+    node.min_bounds = bounds.first;
+    node.max_bounds = bounds.second;
+    node.first_child = 0;
+    node.first_prim_index = handle;
+    node.prim_count = 1;
+    AdoptContents(idx);
+  }
+
+  void FitToChildren(const std::uint32_t idx) {
+    BVHNode& node = bvh_[idx];
+    const BVHNode& left = bvh_[node.first_child];
+    const BVHNode& right = bvh_[node.first_child + 1];
+    node.min_bounds = glm::min(left.min_bounds, right.min_bounds);
+    node.max_bounds = glm::max(left.max_bounds, right.max_bounds);
+    MarkDirty(idx);
+  }
+
+  /**
+   * Sibling that adds the least SAH cost when paired with a new leaf, branch and bound
+   * over the tree. Pairing with a node costs the area of the new parent plus the area
+   * every ancestor grows by, which only increases going down
+   */
+  std::uint32_t FindBestSibling(const Bounds& bounds) const {
+    const float leaf_area = SurfaceArea(bounds.first, bounds.second);
+    std::uint32_t best = 0;
+    float best_cost = std::numeric_limits<float>::max();
+
+    // (growth of the ancestors, node), cheapest ancestors first
+    using Candidate = std::pair<float, std::uint32_t>;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+    candidates.push({0.0f, 0});
+    while (!candidates.empty()) {
+      const auto [inherited_cost, idx] = candidates.top();
+      candidates.pop();
+      const BVHNode& node = bvh_[idx];
+      const float merged_area = SurfaceArea(
+          glm::min(node.min_bounds, bounds.first), glm::max(node.max_bounds, bounds.second));
+      const float cost = merged_area + inherited_cost;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = idx;
+      }
+
+      if (node.IsLeaf())
+        continue;
+
+      const float child_inherited_cost = inherited_cost + merged_area - SurfaceArea(node.min_bounds, node.max_bounds);
+      // the best any descendant could do is a parent exactly the leaf's size
+      if (leaf_area + child_inherited_cost < best_cost) {
+        candidates.push({child_inherited_cost, node.first_child});
+        candidates.push({child_inherited_cost, node.first_child + 1});
+      }
+    }
+
+    return best;
+  }
+
+  void InsertLeaf(const std::uint32_t handle, const Bounds& bounds) {
+    if (bvh_.empty()) {
+      bvh_.resize(1);
+      parents_.assign(1, kNoNode);
+      MakeLeaf(0, handle, bounds);
+      return;
+    }
+
+    // the sibling's node becomes the new parent, so nothing above it needs relinking
+    const std::uint32_t sibling = FindBestSibling(bounds);
+    const std::uint32_t first = AllocatePair();
+    bvh_[first] = bvh_[sibling];
+    parents_[first] = sibling;
+    parents_[first + 1] = sibling;
+    AdoptContents(first);
+    MakeLeaf(first + 1, handle, bounds);
+
+    BVHNode& parent = bvh_[sibling];
+    parent.first_child = first;
+    parent.first_prim_index = 0;
+    parent.prim_count = 0;
+    RefitAndRotateUpwards(sibling);
+  }
+
+  void RemoveLeaf(const std::uint32_t handle) {
+    const std::uint32_t leaf = leaf_nodes_[handle];
+    if (leaf == 0) {
+      // last primative, an empty GetBVH() is what needs uploading now
+      bvh_.clear();
+      parents_.clear();
+      free_pairs_.clear();
+      dirty_nodes_.clear();
+      return;
+    }
+
+    // the sibling takes its parent's place
+    const std::uint32_t parent = parents_[leaf];
+    const std::uint32_t sibling = Sibling(leaf);
+    bvh_[parent] = bvh_[sibling];
+    AdoptContents(parent);
+    FreePair(std::min(leaf, sibling));
+
+    if (parent != 0)
+      RefitAndRotateUpwards(parents_[parent]);
+  }
+
+  void RefitAndRotateUpwards(std::uint32_t idx) {
+    while (idx != kNoNode) {
+      FitToChildren(idx);
+      Rotate(idx);
+      idx = parents_[idx];
+    }
+  }
+
+  // Swaps what two nodes hold, their positions in the tree stay
+  void SwapNodes(const std::uint32_t a, const std::uint32_t b) {
+    std::swap(bvh_[a], bvh_[b]);
+    AdoptContents(a);
+    AdoptContents(b);
+  }
+
+  /**
+   * Tree rotation from Kopta et al. "Fast, Effective BVH Updates for Animated Scenes":
+   * swapping one of idx's children with a grandchild under the other child keeps idx's
+   * box but can shrink the other child's. Takes the swap that shrinks it most, if any
+   */
+  void Rotate(const std::uint32_t idx) {
+    const BVHNode& node = bvh_[idx];
+    if (node.IsLeaf())
+      return;
+
+    float best_gain = 0.0f;
+    std::uint32_t best_child = kNoNode;
+    std::uint32_t best_grandchild = kNoNode;
+    for (const std::uint32_t child : {node.first_child, node.first_child + 1}) {
+      const std::uint32_t other = Sibling(child);
+      const BVHNode& other_node = bvh_[other];
+      if (other_node.IsLeaf())
+        continue;
+
+      const float other_area = SurfaceArea(other_node.min_bounds, other_node.max_bounds);
+      for (const std::uint32_t grandchild : {other_node.first_child, other_node.first_child + 1}) {
+        // other ends up holding child and grandchild's sibling
+        const BVHNode& kept = bvh_[Sibling(grandchild)];
+        const float rotated_area = SurfaceArea(
+            glm::min(bvh_[child].min_bounds, kept.min_bounds), glm::max(bvh_[child].max_bounds, kept.max_bounds));
+        const float gain = other_area - rotated_area;
+        if (gain > best_gain) {
+          best_gain = gain;
+          best_child = child;
+          best_grandchild = grandchild;
+        }
+      }
+    }
+
+    if (best_child == kNoNode)
+      return;
+
+    SwapNodes(best_child, best_grandchild);
+    FitToChildren(parents_[best_grandchild]);
+  }
+
+  static std::vector<BVHNodeRange> TakeRanges(std::vector<std::uint32_t>* const indices_ptr) {
+    auto& indices = *indices_ptr;
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+    std::vector<BVHNodeRange> ranges;
+    for (const std::uint32_t idx : indices) {
+      if (!ranges.empty() && ranges.back().first + ranges.back().count == idx)
+        ranges.back().count++;
+      else
+        ranges.push_back({idx, 1});
+    }
+
+    indices.clear();
+    return ranges;
+  }
+
+  std::vector<BVHNode> bvh_;
+  // parent of each node, kNoNode for the root and unused nodes
+  std::vector<std::uint32_t> parents_;
+  std::vector<Prim> primatives_;
+  // node holding each primative, kNoNode for removed ones
+  std::vector<std::uint32_t> leaf_nodes_;
+  // first node of each unused pair
+  std::vector<std::uint32_t> free_pairs_;
+  std::vector<std::uint32_t> free_prims_;
+  std::vector<std::uint32_t> dirty_nodes_;
+  std::vector<std::uint32_t> dirty_prims_;
+  std::size_t prim_count_ = 0;
+  BVHBuildOptions options_;
+};
+
+}
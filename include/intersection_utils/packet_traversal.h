@@ -0,0 +1,247 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include <glm/glm.hpp>
+
+#include "common/types.h"
+#include "intersection_utils/traversal.h"
+
+namespace IntersectionUtils {
+/**
+ * N rays laid out one array per component so the per ray loops below compile to SIMD
+ * (8 lanes fill an AVX register, 16 an AVX-512 one or two AVX ones)
+ *
+ * @var t Current closest hit distance of each ray, intersection_distance of the rays
+ * @var hit Index in GetPrims() of each ray's closest hit, or kNoHit
+ */
+template <int N>
+struct alignas(64) RayPacket {
+  static_assert(N > 0 && N % 4 == 0, "Packets are whole SIMD registers");
+
+  float origin[3][N];
+  float dir[3][N];
+  float inv_dir[3][N];
+  float t[N];
+  std::uint32_t hit[N];
+};
+
+/**
+ * Bounds of the whole packet, used to cull nodes for all its rays with one test.
+ * Only valid when every ray's direction has the same sign on each axis, which is what
+ * makes the near and far planes of a box the same for every ray
+ */
+struct PacketFrustum {
+  glm::vec3 origin_min;
+  glm::vec3 origin_max;
+  glm::vec3 inv_dir_min;
+  glm::vec3 inv_dir_max;
+  bool negative[3];
+};
+
+namespace Detail {
+// Range of a * b over a in [a_min, a_max] and b in [b_min, b_max]
+inline void IntervalProduct(
+    const float a_min, const float a_max, const float b_min, const float b_max, float* const lo, float* const hi) {
+  const float p0 = a_min * b_min;
+  const float p1 = a_min * b_max;
+  const float p2 = a_max * b_min;
+  const float p3 = a_max * b_max;
+  *lo = std::min(std::min(p0, p1), std::min(p2, p3));
+  *hi = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+}
+
+// Fills the packet from N rays. Returns false if the rays aren't coherent enough to share
+// a frustum (direction signs differ or a component is zero), in which case the packet
+// traversal can't be used and they should be traced one at a time
+template <int N>
+bool LoadPacket(const Common::Ray* const rays, RayPacket<N>* const packet_ptr, PacketFrustum* const frustum_ptr) {
+  auto& packet = *packet_ptr;
+  auto& frustum = *frustum_ptr;
+  frustum.origin_min = frustum.inv_dir_min = glm::vec3(std::numeric_limits<float>::max());
+  frustum.origin_max = frustum.inv_dir_max = glm::vec3(std::numeric_limits<float>::lowest());
+  for (int axis = 0; axis < 3; ++axis)
+    frustum.negative[axis] = rays[0].direction[axis] < 0.0f;
+
+  bool coherent = true;
+  for (int i = 0; i < N; ++i) {
+    const Common::Ray& ray = rays[i];
+    for (int axis = 0; axis < 3; ++axis) {
+      const float dir = ray.direction[axis];
+      coherent &= dir != 0.0f && (dir < 0.0f) == frustum.negative[axis];
+      packet.origin[axis][i] = ray.origin[axis];
+      packet.dir[axis][i] = dir;
+      packet.inv_dir[axis][i] = 1.0f / dir;
+    }
+    packet.t[i] = ray.intersection_distance;
+    packet.hit[i] = kNoHit;
+    frustum.origin_min = glm::min(frustum.origin_min, ray.origin);
+    frustum.origin_max = glm::max(frustum.origin_max, ray.origin);
+    frustum.inv_dir_min = glm::min(frustum.inv_dir_min, 1.0f / ray.direction);
+    frustum.inv_dir_max = glm::max(frustum.inv_dir_max, 1.0f / ray.direction);
+  }
+
+  return coherent;
+}
+
+/**
+ * Interval arithmetic test of the whole packet against a box. False only if no ray in
+ * the packet can hit it closer than max_t, the largest t of the packet.
+ * Conservative, a true still needs the per ray test
+ */
+inline bool FrustumIntersectsBox(
+    const PacketFrustum& frustum,
+    const glm::vec3& min_bounds,
+    const glm::vec3& max_bounds,
+    const float max_t) {
+  float near_lo = 0.0f;
+  float far_hi = max_t;
+  for (int axis = 0; axis < 3; ++axis) {
+    const float near_plane = frustum.negative[axis] ? max_bounds[axis] : min_bounds[axis];
+    const float far_plane = frustum.negative[axis] ? min_bounds[axis] : max_bounds[axis];
+    float lo, hi;
+    Detail::IntervalProduct(
+        near_plane - frustum.origin_max[axis], near_plane - frustum.origin_min[axis],
+        frustum.inv_dir_min[axis], frustum.inv_dir_max[axis], &lo, &hi);
+    near_lo = std::max(near_lo, lo);
+    Detail::IntervalProduct(
+        far_plane - frustum.origin_max[axis], far_plane - frustum.origin_min[axis],
+        frustum.inv_dir_min[axis], frustum.inv_dir_max[axis], &lo, &hi);
+    far_hi = std::min(far_hi, hi);
+  }
+
+  return near_lo <= far_hi;
+}
+
+/**
+ * Slab test of every ray in the packet against a box, written without branches so it
+ * vectorizes. Returns a bitmask of the rays that enter the box closer than their t
+ */
+template <int N>
+std::uint32_t PacketIntersectsBox(
+    const RayPacket<N>& packet,
+    const glm::vec3& min_bounds,
+    const glm::vec3& max_bounds) {
+  alignas(64) float t_near[N];
+  alignas(64) float t_far[N];
+  for (int i = 0; i < N; ++i) {
+    t_near[i] = 0.0f;
+    t_far[i] = packet.t[i];
+  }
+
+  for (int axis = 0; axis < 3; ++axis) {
+    const float lo = min_bounds[axis];
+    const float hi = max_bounds[axis];
+    for (int i = 0; i < N; ++i) {
+      const float t0 = (lo - packet.origin[axis][i]) * packet.inv_dir[axis][i];
+      const float t1 = (hi - packet.origin[axis][i]) * packet.inv_dir[axis][i];
+      const float entry = t0 < t1 ? t0 : t1;
+      const float exit = t0 < t1 ? t1 : t0;
+      t_near[i] = t_near[i] > entry ? t_near[i] : entry;
+      t_far[i] = t_far[i] < exit ? t_far[i] : exit;
+    }
+  }
+
+  std::uint32_t mask = 0;
+  for (int i = 0; i < N; ++i)
+    mask |= static_cast<std::uint32_t>(t_near[i] <= t_far[i]) << i;
+
+  return mask;
+}
+
+/**
+ * Closest hit of N coherent rays through a binary BVH at once, for primary rays from
+ * neighbouring pixels. Each node is culled for the whole packet by its frustum, then
+ * slab tested for every ray together. intersect_fn is the same as for ClosestHit and is
+ * called per ray that reaches a leaf.
+ *
+ * Rays whose directions don't share signs, e.g. secondary rays after a bounce, are traced
+ * one at a time with ClosestHit instead. Either way rays[i].intersection_distance is
+ * shortened to the closest hit and hits[i] is its index in GetPrims(), or kNoHit.
+ *
+ * stats->nodes_visited counts a node once per packet that visits it
+ */
+template <int N, class Tree, class IntersectFn>
+void ClosestHitPacket(
+    const Tree& bvh,
+    Common::Ray* const rays,
+    std::uint32_t* const hits,
+    const IntersectFn& intersect_fn,
+    TraversalStats* const stats = nullptr) {
+  static_assert(N <= 32, "Lane masks are 32 bits");
+  const auto& nodes = bvh.GetBVH();
+  const auto& prims = bvh.GetPrims();
+
+  RayPacket<N> packet;
+  PacketFrustum frustum;
+  if (nodes.empty() || !LoadPacket(rays, &packet, &frustum)) {
+    for (int i = 0; i < N; ++i)
+      hits[i] = ClosestHit(bvh, &rays[i], intersect_fn, stats);
+    return;
+  }
+
+  std::uint32_t stack[kTraversalStackSize];
+  int stack_idx = 0;
+  stack[stack_idx++] = 0;
+
+  while (stack_idx > 0) {
+    const BVHNode& node = nodes[stack[--stack_idx]];
+    if (stats)
+      stats->nodes_visited++;
+
+    float max_t = 0.0f;
+    for (int i = 0; i < N; ++i)
+      max_t = std::max(max_t, packet.t[i]);
+    if (!FrustumIntersectsBox(frustum, node.min_bounds, node.max_bounds, max_t))
+      continue;
+
+    const std::uint32_t active = PacketIntersectsBox(packet, node.min_bounds, node.max_bounds);
+    if (active == 0)
+      continue;
+
+    if (node.IsLeaf()) {
+      for (int i = 0; i < N; ++i) {
+        if (!(active & (1u << i)))
+          continue;
+
+        // the ray is rebuilt from the packet so intersect_fn sees its shortened distance
+        Common::Ray& ray = rays[i];
+        ray.intersection_distance = packet.t[i];
+        for (std::uint32_t p = node.first_prim_index; p < node.first_prim_index + node.prim_count; ++p) {
+          if (intersect_fn(prims[p], &ray))
+            packet.hit[i] = p;
+        }
+        packet.t[i] = ray.intersection_distance;
+        if (stats)
+          stats->prims_tested += node.prim_count;
+      }
+      continue;
+    }
+
+    if (stack_idx + 2 > static_cast<int>(kTraversalStackSize))
+      throw std::runtime_error("BVH is too deep for the traversal stack");
+
+    // every ray goes the same way along each axis, so the child whose center is first
+    // along the axis the children are furthest apart on is nearer for the whole packet
+    const BVHNode& left = nodes[node.first_child];
+    const BVHNode& right = nodes[node.first_child + 1];
+    const glm::vec3 separation = (right.min_bounds + right.max_bounds) - (left.min_bounds + left.max_bounds);
+    const glm::vec3 abs_separation = glm::abs(separation);
+    int axis = abs_separation.x > abs_separation.y ? 0 : 1;
+    axis = abs_separation[axis] > abs_separation.z ? axis : 2;
+    const bool left_nearer = (separation[axis] > 0.0f) != frustum.negative[axis];
+    stack[stack_idx++] = node.first_child + (left_nearer ? 1 : 0);
+    stack[stack_idx++] = node.first_child + (left_nearer ? 0 : 1);
+  }
+
+  for (int i = 0; i < N; ++i) {
+    rays[i].intersection_distance = packet.t[i];
+    hits[i] = packet.hit[i];
+  }
+}
+
+}
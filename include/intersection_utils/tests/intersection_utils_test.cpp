@@ -1,8 +1,44 @@
 #include <gtest/gtest.h>
 #include "intersection_utils/bvh.h"
+#include "intersection_utils/bvh_analysis.h"
+#include "intersection_utils/wide_bvh.h"
+#include "intersection_utils/compressed_bvh.h"
+#include "intersection_utils/dynamic_bvh.h"
+#include "intersection_utils/packet_traversal.h"
+#include "intersection_utils/tlas.h"
+#include "intersection_utils/triangle_blocks.h"
+#include "intersection_utils/traversal.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <random>
 
 #include "common/types.h"
 
+// Counts heap allocations, for checking BVHBuilder rebuilds don't allocate
+static std::atomic<std::size_t> g_allocation_count{0};
+
+void* operator new(std::size_t size) {
+  g_allocation_count++;
+  if (void* ptr = std::malloc(size == 0 ? 1 : size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+// GCC pairs the free with the new it got inlined into and warns, though both are replaced
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
 namespace IntersectionUtils {
 namespace testing {
 namespace {
@@ -36,6 +72,61 @@ void RayIntersectsTri(Common::Ray& ray, const Common::Triangle& tri )
   if (t > 0.0001f)
     ray.intersection_distance = std::min(ray.intersection_distance, t);
 }
+
+// Small triangles scattered around a few dense clusters, the kind of input midpoint splits handle badly
+std::vector<Common::Triangle> MakeClusteredTriangles(const std::size_t count, const unsigned seed = 1234) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+  std::uniform_real_distribution<float> size(0.01f, 0.1f);
+  const glm::vec3 clusters[] = {{0, 0, 0}, {0.5f, 0.2f, 0}, {40, 0, 3}, {40, 10, -2}};
+
+  std::vector<Common::Triangle> triangles;
+  triangles.reserve(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    const glm::vec3& cluster = clusters[i % 4];
+    const glm::vec3 p0 = cluster + glm::vec3(offset(gen), offset(gen), offset(gen));
+    triangles.emplace_back(
+        glm::vec3(p0),
+        p0 + glm::vec3(size(gen), 0, 0),
+        p0 + glm::vec3(0, size(gen), size(gen)));
+  }
+
+  return triangles;
+}
+
+// Checks every primative is in exactly one leaf and every node encloses its contents
+template <class Prim>
+void ExpectValidBVH(const BVH<Prim>& bvh, const std::size_t prim_count) {
+  const auto& nodes = bvh.GetBVH();
+  const auto& prims = bvh.GetPrims();
+  ASSERT_EQ(prims.size(), prim_count);
+  ASSERT_FALSE(nodes.empty());
+
+  std::vector<int> seen(prim_count, 0);
+  for (const BVHNode& node : nodes) {
+    if (node.IsLeaf()) {
+      for (std::uint32_t i = 0; i < node.prim_count; ++i) {
+        seen[node.first_prim_index + i]++;
+        const auto [prim_min, prim_max] = Common::Triangle::Bounds(prims[node.first_prim_index + i]);
+        for (int axis = 0; axis < 3; ++axis) {
+          EXPECT_LE(node.min_bounds[axis], prim_min[axis]);
+          EXPECT_GE(node.max_bounds[axis], prim_max[axis]);
+        }
+      }
+    } else {
+      ASSERT_LT(node.first_child + 1, nodes.size());
+      for (const std::uint32_t child_idx : {node.first_child, node.first_child + 1}) {
+        for (int axis = 0; axis < 3; ++axis) {
+          EXPECT_LE(node.min_bounds[axis], nodes[child_idx].min_bounds[axis]);
+          EXPECT_GE(node.max_bounds[axis], nodes[child_idx].max_bounds[axis]);
+        }
+      }
+    }
+  }
+
+  for (std::size_t i = 0; i < prim_count; ++i)
+    EXPECT_EQ(seen[i], 1) << "primative slot " << i;
+}
 }
 
 TEST(BVHTest, Construction) {
@@ -44,6 +135,1123 @@ TEST(BVHTest, Construction) {
   BVH<Common::Triangle> obj{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
 }
 
+TEST(BVHTest, BinnedSAHRespectsMaxLeafSize) {
+  const auto triangles = MakeClusteredTriangles(1000);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::kBinnedSAH;
+  options.max_leaf_size = 3;
+  BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+
+  ExpectValidBVH(bvh, triangles.size());
+  for (const BVHNode& node : bvh.GetBVH()) {
+    if (node.IsLeaf()) {
+      EXPECT_LE(node.prim_count, options.max_leaf_size);
+    }
+  }
+}
+
+TEST(BVHTest, BinnedSAHSplitsCoincidentCentroids) {
+  std::vector<Common::Triangle> triangles;
+  for (int i = 0; i < 9; ++i)
+    triangles.emplace_back(glm::vec3{0, 0, 0}, glm::vec3{0, 1, 0}, glm::vec3{1, 0, 0});
+
+  BVHBuildOptions options;
+  options.max_leaf_size = 2;
+  BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+
+  ExpectValidBVH(bvh, triangles.size());
+  for (const BVHNode& node : bvh.GetBVH()) {
+    if (node.IsLeaf()) {
+      EXPECT_LE(node.prim_count, options.max_leaf_size);
+    }
+  }
+}
+
+TEST(BVHTest, BinnedSAHCheaperThanMidpoint) {
+  const auto triangles = MakeClusteredTriangles(2000);
+  BVHBuildOptions midpoint_options;
+  midpoint_options.method = BVHBuildMethod::kMidpoint;
+  BVH<Common::Triangle> midpoint{
+      triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, midpoint_options};
+  BVH<Common::Triangle> sah{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+
+  ExpectValidBVH(midpoint, triangles.size());
+  ExpectValidBVH(sah, triangles.size());
+  EXPECT_GT(sah.GetSAHCost(), 0.0f);
+  EXPECT_LT(sah.GetSAHCost(), midpoint.GetSAHCost());
+}
+
+TEST(BVHTest, ParallelBuildMatchesSerial) {
+  const auto triangles = MakeClusteredTriangles(20000);
+  for (const BVHBuildMethod method : {BVHBuildMethod::kMidpoint, BVHBuildMethod::kBinnedSAH, BVHBuildMethod::kLBVH}) {
+    BVHBuildOptions serial_options;
+    serial_options.method = method;
+    serial_options.thread_count = 1;
+    BVH<Common::Triangle> serial{
+        triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, serial_options};
+
+    BVHBuildOptions parallel_options = serial_options;
+    parallel_options.thread_count = 4;
+    parallel_options.parallel_subtree_threshold = 64;
+    BVH<Common::Triangle> parallel{
+        triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, parallel_options};
+
+    const auto& serial_nodes = serial.GetBVH();
+    const auto& parallel_nodes = parallel.GetBVH();
+    ASSERT_EQ(serial_nodes.size(), parallel_nodes.size());
+    EXPECT_EQ(std::memcmp(serial_nodes.data(), parallel_nodes.data(), serial_nodes.size() * sizeof(BVHNode)), 0);
+    ASSERT_EQ(serial.GetPrims().size(), parallel.GetPrims().size());
+    EXPECT_EQ(std::memcmp(
+        serial.GetPrims().data(),
+        parallel.GetPrims().data(),
+        serial.GetPrims().size() * sizeof(Common::Triangle)), 0);
+  }
+}
+
+
+TEST(BVHTest, MortonCodeInterleavesAxes) {
+  EXPECT_EQ(Detail::MortonCode(glm::vec3(0.0f), false), 0u);
+  // x is the most significant of each bit triple
+  EXPECT_EQ(Detail::MortonCode(glm::vec3(1.0f, 0.0f, 0.0f), false), 0x24924924u);
+  EXPECT_EQ(Detail::MortonCode(glm::vec3(1.0f), false), (1u << 30) - 1);
+  EXPECT_EQ(Detail::MortonCode(glm::vec3(1.0f), true), (std::uint64_t(1) << 63) - 1);
+}
+
+TEST(BVHTest, LBVHBuild) {
+  const auto triangles = MakeClusteredTriangles(5000);
+  for (const bool morton_63_bit : {false, true}) {
+    BVHBuildOptions options;
+    options.method = BVHBuildMethod::kLBVH;
+    options.morton_63_bit = morton_63_bit;
+    options.max_leaf_size = 2;
+    BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+
+    ExpectValidBVH(bvh, triangles.size());
+    for (const BVHNode& node : bvh.GetBVH()) {
+      if (node.IsLeaf()) {
+        EXPECT_LE(node.prim_count, options.max_leaf_size);
+      }
+    }
+  }
+}
+
+TEST(BVHTest, TreeletOptimizationLowersCost) {
+  const auto triangles = MakeClusteredTriangles(5000);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::kLBVH;
+  BVH<Common::Triangle> plain{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+
+  options.treelet_size = 7;
+  BVH<Common::Triangle> optimized{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+
+  ExpectValidBVH(optimized, triangles.size());
+  ASSERT_EQ(plain.GetBVH().size(), optimized.GetBVH().size());
+  EXPECT_LT(optimized.GetSAHCost(), plain.GetSAHCost());
+
+  const auto& nodes = optimized.GetBVH();
+  for (std::size_t i = 0; i < nodes.size(); ++i) {
+    if (!nodes[i].IsLeaf()) {
+      EXPECT_GT(nodes[i].first_child, i);
+    }
+  }
+}
+
+
+TEST(BVHTest, RefitTracksMovedPrimatives) {
+  const auto triangles = MakeClusteredTriangles(2000);
+  BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+  const std::vector<BVHNode> built_nodes = bvh.GetBVH();
+
+  const glm::vec3 offset(1.0f, 2.0f, 3.0f);
+  const auto moved_bounds = [&offset](const Common::Triangle& tri) {
+    auto bounds = Common::Triangle::Bounds(tri);
+    return std::make_pair(bounds.first + offset, bounds.second + offset);
+  };
+
+  const BVHNodeRange dirty = bvh.Refit(moved_bounds);
+  EXPECT_EQ(dirty.first, 0u);
+  EXPECT_EQ(dirty.count, built_nodes.size());
+
+  const auto& nodes = bvh.GetBVH();
+  ASSERT_EQ(nodes.size(), built_nodes.size());
+  for (std::size_t i = 0; i < nodes.size(); ++i) {
+    EXPECT_EQ(nodes[i].first_child, built_nodes[i].first_child);
+    EXPECT_EQ(nodes[i].prim_count, built_nodes[i].prim_count);
+    for (int axis = 0; axis < 3; ++axis) {
+      EXPECT_NEAR(nodes[i].min_bounds[axis], built_nodes[i].min_bounds[axis] + offset[axis], 1e-5f);
+      EXPECT_NEAR(nodes[i].max_bounds[axis], built_nodes[i].max_bounds[axis] + offset[axis], 1e-5f);
+    }
+  }
+  EXPECT_NEAR(bvh.GetRefitDegradation(), 1.0f, 1e-3f);
+
+  // nothing moved since the last refit
+  EXPECT_TRUE(bvh.Refit(moved_bounds).Empty());
+}
+
+TEST(BVHTest, RefitDegradationGrowsWhenScrambled) {
+  const auto triangles = MakeClusteredTriangles(2000);
+  BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+  EXPECT_FLOAT_EQ(bvh.GetRefitDegradation(), 1.0f);
+
+  // move every primative somewhere unrelated to where the tree put it
+  std::mt19937 gen(99);
+  std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+  std::vector<glm::vec3> new_positions(bvh.GetPrims().size());
+  for (auto& p : new_positions)
+    p = glm::vec3(position(gen), position(gen), position(gen));
+
+  const Common::Triangle* const first_prim = bvh.GetPrims().data();
+  bvh.Refit([&](const Common::Triangle& tri) {
+    const glm::vec3& p = new_positions[&tri - first_prim];
+    return std::make_pair(p - glm::vec3(0.01f), p + glm::vec3(0.01f));
+  });
+
+  EXPECT_GT(bvh.GetRefitDegradation(), 2.0f);
+}
+
+
+template <std::uint32_t Width>
+void ExpectValidWideBVH(const BVH<Common::Triangle>& bvh) {
+  const WideBVH<Width> wide_bvh(bvh.GetBVH());
+  const auto& nodes = wide_bvh.GetNodes();
+  const auto& prims = bvh.GetPrims();
+  ASSERT_FALSE(nodes.empty());
+  EXPECT_LT(nodes.size(), bvh.GetBVH().size());
+
+  std::vector<int> seen(prims.size(), 0);
+  std::vector<int> referenced(nodes.size(), 0);
+  referenced[0] = 1;
+  for (std::size_t node_idx = 0; node_idx < nodes.size(); ++node_idx) {
+    const WideBVHNode<Width>& node = nodes[node_idx];
+    const std::uint32_t child_count = node.GetChildCount();
+    EXPECT_GE(child_count, 1u);
+    for (std::uint32_t slot = child_count; slot < Width; ++slot)
+      EXPECT_TRUE(node.IsEmpty(slot));
+
+    for (std::uint32_t slot = 0; slot < child_count; ++slot) {
+      const glm::vec3 min_bounds = node.GetMinBounds(slot);
+      const glm::vec3 max_bounds = node.GetMaxBounds(slot);
+      if (node.IsLeaf(slot)) {
+        for (std::uint32_t i = 0; i < node.prim_count[slot]; ++i) {
+          const std::uint32_t prim_idx = node.child_or_prim_index[slot] + i;
+          seen[prim_idx]++;
+          const auto [prim_min, prim_max] = Common::Triangle::Bounds(prims[prim_idx]);
+          for (int axis = 0; axis < 3; ++axis) {
+            EXPECT_LE(min_bounds[axis], prim_min[axis]);
+            EXPECT_GE(max_bounds[axis], prim_max[axis]);
+          }
+        }
+      } else {
+        const std::uint32_t child_idx = node.child_or_prim_index[slot];
+        ASSERT_LT(child_idx, nodes.size());
+        EXPECT_GT(child_idx, node_idx);
+        referenced[child_idx]++;
+        const WideBVHNode<Width>& child = nodes[child_idx];
+        for (std::uint32_t child_slot = 0; child_slot < child.GetChildCount(); ++child_slot) {
+          for (int axis = 0; axis < 3; ++axis) {
+            EXPECT_LE(min_bounds[axis], child.GetMinBounds(child_slot)[axis]);
+            EXPECT_GE(max_bounds[axis], child.GetMaxBounds(child_slot)[axis]);
+          }
+        }
+      }
+    }
+  }
+
+  for (std::size_t i = 0; i < prims.size(); ++i)
+    EXPECT_EQ(seen[i], 1) << "primative slot " << i;
+  for (std::size_t i = 0; i < nodes.size(); ++i)
+    EXPECT_EQ(referenced[i], 1) << "wide node " << i;
+}
+
+TEST(BVHTest, WideBVHCollapse) {
+  const auto triangles = MakeClusteredTriangles(3000);
+  BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+
+  ExpectValidWideBVH<4>(bvh);
+  ExpectValidWideBVH<8>(bvh);
+
+  // wider nodes, fewer of them
+  EXPECT_LT(BVH8(bvh.GetBVH()).GetNodes().size(), BVH4(bvh.GetBVH()).GetNodes().size());
+}
+
+TEST(BVHTest, WideBVHCollapseSingleLeaf) {
+  const auto triangles = MakeClusteredTriangles(1);
+  BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+  ASSERT_EQ(bvh.GetBVH().size(), 1u);
+
+  const BVH8 wide_bvh(bvh.GetBVH());
+  ASSERT_EQ(wide_bvh.GetNodes().size(), 1u);
+  const auto& root = wide_bvh.GetNodes()[0];
+  EXPECT_EQ(root.GetChildCount(), 1u);
+  EXPECT_EQ(root.child_or_prim_index[0], 0u);
+  EXPECT_EQ(root.prim_count[0], 1u);
+}
+
+
+// Long thin triangles crossing each other, like wings and fuselage panels
+std::vector<Common::Triangle> MakeSliverTriangles(const std::size_t count, const unsigned seed = 77) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+  std::uniform_real_distribution<float> width(0.001f, 0.01f);
+
+  std::vector<Common::Triangle> triangles;
+  triangles.reserve(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    const glm::vec3 start(position(gen), position(gen), position(gen));
+    const glm::vec3 end(position(gen), position(gen), position(gen));
+    const glm::vec3 side(width(gen), width(gen), 0.0f);
+    triangles.emplace_back(start, end, start + side);
+  }
+
+  return triangles;
+}
+
+const BVH<Common::Triangle>::SplitFn kTriangleSplitFn =
+    [](const Common::Triangle& tri, const int axis, const float position, const BVH<Common::Triangle>::Bounds& ref_bounds) {
+      return SplitTriangleBounds(tri.v0, tri.v1, tri.v2, axis, position, ref_bounds);
+    };
+
+TEST(BVHTest, SplitTriangleBounds) {
+  const Common::Triangle tri(glm::vec3(0.0f), glm::vec3(2.0f, 0.0f, 0.0f), glm::vec3(0.0f, 2.0f, 0.0f));
+  const auto [left, right] = SplitTriangleBounds(
+      tri.v0, tri.v1, tri.v2, 0, 1.0f, Common::Triangle::Bounds(tri));
+
+  EXPECT_EQ(left.first, glm::vec3(0.0f));
+  EXPECT_EQ(left.second, glm::vec3(1.0f, 2.0f, 0.0f));
+  EXPECT_EQ(right.first, glm::vec3(1.0f, 0.0f, 0.0f));
+  EXPECT_EQ(right.second, glm::vec3(2.0f, 1.0f, 0.0f));
+}
+
+TEST(BVHTest, SBVHBuild) {
+  const auto triangles = MakeSliverTriangles(2000);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::kSBVH;
+  options.sbvh_max_duplication = 0.5f;
+  BVH<Common::Triangle> sbvh{
+      triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, kTriangleSplitFn, options};
+
+  options.method = BVHBuildMethod::kBinnedSAH;
+  BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+
+  // every input triangle is referenced, within budget, and GetPrimIndices maps back to it
+  const auto& prims = sbvh.GetPrims();
+  const auto& prim_indices = sbvh.GetPrimIndices();
+  ASSERT_EQ(prims.size(), prim_indices.size());
+  EXPECT_GT(prims.size(), triangles.size());
+  EXPECT_LE(prims.size(), triangles.size() * 3 / 2);
+  std::vector<int> referenced(triangles.size(), 0);
+  for (std::size_t i = 0; i < prims.size(); ++i) {
+    ASSERT_LT(prim_indices[i], triangles.size());
+    referenced[prim_indices[i]]++;
+    EXPECT_EQ(prims[i].v0, triangles[prim_indices[i]].v0);
+  }
+  for (std::size_t i = 0; i < triangles.size(); ++i)
+    EXPECT_GE(referenced[i], 1) << "triangle " << i;
+
+  // leaves cover each slot once and nodes enclose their children
+  const auto& nodes = sbvh.GetBVH();
+  std::vector<int> seen(prims.size(), 0);
+  for (std::size_t i = 0; i < nodes.size(); ++i) {
+    const BVHNode& node = nodes[i];
+    if (node.IsLeaf()) {
+      for (std::uint32_t j = 0; j < node.prim_count; ++j)
+        seen[node.first_prim_index + j]++;
+    } else {
+      EXPECT_GT(node.first_child, i);
+      for (const std::uint32_t child_idx : {node.first_child, node.first_child + 1}) {
+        for (int axis = 0; axis < 3; ++axis) {
+          EXPECT_LE(node.min_bounds[axis], nodes[child_idx].min_bounds[axis]);
+          EXPECT_GE(node.max_bounds[axis], nodes[child_idx].max_bounds[axis]);
+        }
+      }
+    }
+  }
+  for (std::size_t i = 0; i < prims.size(); ++i)
+    EXPECT_EQ(seen[i], 1) << "primative slot " << i;
+
+  EXPECT_LT(sbvh.GetSAHCost(), bvh.GetSAHCost());
+}
+
+// Plain stack traversal, closest hit ends up in ray.intersection_distance
+void TraceBVH(Common::Ray* const ray_ptr, const BVH<Common::Triangle>& bvh) {
+  auto& ray = *ray_ptr;
+  const auto& nodes = bvh.GetBVH();
+  std::vector<std::uint32_t> stack = {0};
+  while (!stack.empty()) {
+    const BVHNode& node = nodes[stack.back()];
+    stack.pop_back();
+
+    const glm::vec3 t0 = (node.min_bounds - ray.origin) / ray.direction;
+    const glm::vec3 t1 = (node.max_bounds - ray.origin) / ray.direction;
+    const glm::vec3 t_min = glm::min(t0, t1);
+    const glm::vec3 t_max = glm::max(t0, t1);
+    const float t_near = std::max(std::max(t_min.x, t_min.y), t_min.z);
+    const float t_far = std::min(std::min(t_max.x, t_max.y), t_max.z);
+    if (t_near > t_far || t_far < 0.0f || t_near > ray.intersection_distance)
+      continue;
+
+    if (node.IsLeaf()) {
+      for (std::uint32_t i = 0; i < node.prim_count; ++i)
+        RayIntersectsTri(ray, bvh.GetPrims()[node.first_prim_index + i]);
+    } else {
+      stack.push_back(node.first_child);
+      stack.push_back(node.first_child + 1);
+    }
+  }
+}
+
+TEST(BVHTest, SBVHFindsSameHits) {
+  const auto triangles = MakeSliverTriangles(500);
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::kSBVH;
+  BVH<Common::Triangle> sbvh{
+      triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, kTriangleSplitFn, options};
+
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+  int hits = 0;
+  for (int r = 0; r < 2000; ++r) {
+    const glm::vec3 origin(position(gen), position(gen), -3.0f);
+    Common::Ray expected(origin, glm::vec3(0.0f, 0.0f, 1.0f));
+    for (const auto& tri : triangles)
+      RayIntersectsTri(expected, tri);
+
+    Common::Ray ray(origin, glm::vec3(0.0f, 0.0f, 1.0f));
+    TraceBVH(&ray, sbvh);
+    EXPECT_FLOAT_EQ(ray.intersection_distance, expected.intersection_distance) << "ray " << r;
+    hits += expected.intersection_distance < 1e30f;
+  }
+  EXPECT_GT(hits, 0);
+}
+
+
+TEST(BVHTest, CompressedBVHIsConservative) {
+  const auto triangles = MakeClusteredTriangles(5000);
+  BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+  const BVH8 wide_bvh(bvh.GetBVH());
+  const CompressedWideBVH compressed(wide_bvh);
+
+  const auto& wide_nodes = wide_bvh.GetNodes();
+  const auto& nodes = compressed.GetNodes();
+  ASSERT_EQ(nodes.size(), wide_nodes.size());
+  for (std::size_t i = 0; i < nodes.size(); ++i) {
+    for (std::uint32_t slot = 0; slot < 8; ++slot) {
+      ASSERT_EQ(nodes[i].child_or_prim_index[slot], wide_nodes[i].child_or_prim_index[slot]);
+      ASSERT_EQ(nodes[i].prim_count[slot], wide_nodes[i].prim_count[slot]);
+      if (wide_nodes[i].IsEmpty(slot))
+        continue;
+
+      const glm::vec3 min_bounds = nodes[i].GetMinBounds(slot);
+      const glm::vec3 max_bounds = nodes[i].GetMaxBounds(slot);
+      for (int axis = 0; axis < 3; ++axis) {
+        EXPECT_LE(min_bounds[axis], wide_nodes[i].GetMinBounds(slot)[axis]);
+        EXPECT_GE(max_bounds[axis], wide_nodes[i].GetMaxBounds(slot)[axis]);
+      }
+    }
+  }
+
+  const CompressedBVHReport& report = compressed.GetReport();
+  EXPECT_EQ(report.node_count, nodes.size());
+  EXPECT_EQ(report.compressed_bytes * 2, report.wide_bytes);
+  EXPECT_GE(report.mean_area_inflation, 1.0f);
+  EXPECT_LT(report.mean_area_inflation, 1.2f);
+  EXPECT_GE(report.max_area_inflation, report.mean_area_inflation);
+}
+
+
+TEST(BVHTest, ReorderKeepsTreeValid) {
+  const auto triangles = MakeClusteredTriangles(3000);
+  const BVH<Common::Triangle> base{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+
+  std::mt19937 gen(11);
+  std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+  std::vector<Common::Ray> rays;
+  for (int r = 0; r < 500; ++r) {
+    const glm::vec3 origin(position(gen), position(gen), -3.0f);
+    const glm::vec3 target(position(gen), position(gen), 0.0f);
+    rays.emplace_back(origin, glm::normalize(target - origin));
+  }
+
+  const auto intersect_fn = [](const Common::Triangle& tri, Common::Ray* const ray_ptr) {
+    return IntersectsTriangle(ray_ptr, tri.v0, tri.v1, tri.v2);
+  };
+
+  for (const BVHNodeOrder order : {
+           BVHNodeOrder::kDepthFirstLargerChild, BVHNodeOrder::kVanEmdeBoas, BVHNodeOrder::kTreelets}) {
+    BVH<Common::Triangle> bvh = base;
+    bvh.Reorder(order);
+    ExpectValidBVH(bvh, triangles.size());
+    EXPECT_EQ(bvh.GetBVH().size(), base.GetBVH().size());
+    EXPECT_NEAR(bvh.GetSAHCost(), base.GetSAHCost(), base.GetSAHCost() * 1e-4f);
+
+    const auto& nodes = bvh.GetBVH();
+    for (std::uint32_t i = 0; i < nodes.size(); ++i) {
+      if (!nodes[i].IsLeaf()) {
+        EXPECT_GT(nodes[i].first_child, i);
+      }
+    }
+
+    // prims still map back to the input
+    for (std::size_t i = 0; i < bvh.GetPrims().size(); ++i)
+      EXPECT_EQ(bvh.GetPrims()[i].v0, triangles[bvh.GetPrimIndices()[i]].v0);
+
+    for (const auto& base_ray : rays) {
+      Common::Ray expected = base_ray;
+      const std::uint32_t expected_hit = ClosestHit(base, &expected, intersect_fn);
+      Common::Ray ray = base_ray;
+      const std::uint32_t hit = ClosestHit(bvh, &ray, intersect_fn);
+      EXPECT_FLOAT_EQ(ray.intersection_distance, expected.intersection_distance);
+      if (expected_hit != kNoHit) {
+        ASSERT_NE(hit, kNoHit);
+        EXPECT_EQ(bvh.GetPrimIndices()[hit], base.GetPrimIndices()[expected_hit]);
+      }
+    }
+  }
+}
+
+TEST(BVHTest, ClosestHitMatchesBruteForce) {
+  const auto triangles = MakeClusteredTriangles(2000);
+  const BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+  TraversalStats stats;
+  for (int r = 0; r < 500; ++r) {
+    const glm::vec3 origin(position(gen), position(gen), -3.0f);
+    Common::Ray expected(origin, glm::vec3(0.0f, 0.0f, 1.0f));
+    for (const auto& tri : triangles)
+      RayIntersectsTri(expected, tri);
+
+    Common::Ray ray(origin, glm::vec3(0.0f, 0.0f, 1.0f));
+    ClosestHit(
+        bvh,
+        &ray,
+        [](const Common::Triangle& tri, Common::Ray* const ray_ptr) {
+          return IntersectsTriangle(ray_ptr, tri.v0, tri.v1, tri.v2);
+        },
+        &stats);
+    EXPECT_NEAR(ray.intersection_distance, expected.intersection_distance, 1e-4f) << "ray " << r;
+  }
+  EXPECT_GT(stats.nodes_visited, 0u);
+  EXPECT_LT(stats.prims_tested, 500u * triangles.size());
+}
+
+
+TEST(BVHTest, BuildsFromAnyCallable) {
+  const auto triangles = MakeClusteredTriangles(2000);
+  const BVH<Common::Triangle> from_functions{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+
+  const std::function<glm::vec3(const Common::Triangle&)> center_fn = Common::Triangle::Centroid;
+  const BVH<Common::Triangle> from_std_function{
+      triangles,
+      center_fn,
+      [](const Common::Triangle& tri) { return Common::Triangle::Bounds(tri); }};
+
+  ASSERT_EQ(from_std_function.GetBVH().size(), from_functions.GetBVH().size());
+  EXPECT_EQ(from_std_function.GetPrimIndices(), from_functions.GetPrimIndices());
+  EXPECT_FLOAT_EQ(from_std_function.GetSAHCost(), from_functions.GetSAHCost());
+
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::kSBVH;
+  EXPECT_THROW(
+      (BVH<Common::Triangle>{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, nullptr, options}),
+      std::invalid_argument);
+  EXPECT_THROW(
+      (BVH<Common::Triangle>{
+          triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, BVH<Common::Triangle>::SplitFn(), options}),
+      std::invalid_argument);
+}
+
+
+TEST(BVHTest, BuilderMatchesConstructor) {
+  const auto triangles = MakeClusteredTriangles(3000);
+  BVHBuilder<Common::Triangle> builder;
+  BVH<Common::Triangle> bvh;
+  for (const BVHBuildMethod method : {BVHBuildMethod::kMidpoint, BVHBuildMethod::kBinnedSAH, BVHBuildMethod::kLBVH}) {
+    BVHBuildOptions options;
+    options.method = method;
+    options.thread_count = 1;
+    const BVH<Common::Triangle> expected{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+    builder.Build(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options, &bvh);
+
+    ExpectValidBVH(bvh, triangles.size());
+    ASSERT_EQ(bvh.GetBVH().size(), expected.GetBVH().size());
+    EXPECT_EQ(bvh.GetPrimIndices(), expected.GetPrimIndices());
+    EXPECT_FLOAT_EQ(bvh.GetSAHCost(), expected.GetSAHCost());
+    EXPECT_EQ(bvh.GetBuildOptions().method, method);
+  }
+
+  EXPECT_GT(builder.GetPeakScratchBytes(), 0u);
+  EXPECT_EQ(builder.GetPeakScratchBytes(), builder.GetScratchBytes());
+  builder.Release();
+  EXPECT_EQ(builder.GetScratchBytes(), 0u);
+
+  // bad options leave the last tree alone
+  BVHBuildOptions bad_options;
+  bad_options.bin_count = 1;
+  const std::size_t node_count = bvh.GetBVH().size();
+  EXPECT_THROW(
+      builder.Build(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, bad_options, &bvh),
+      std::invalid_argument);
+  EXPECT_EQ(bvh.GetBVH().size(), node_count);
+}
+
+TEST(BVHTest, BuilderRebuildsWithoutAllocating) {
+  auto triangles = MakeClusteredTriangles(5000);
+  const auto bounds_fn = [](const Common::Triangle& tri) { return Common::Triangle::Bounds(tri); };
+  const auto center_fn = [](const Common::Triangle& tri) { return Common::Triangle::Centroid(tri); };
+
+  for (const BVHBuildMethod method : {BVHBuildMethod::kBinnedSAH, BVHBuildMethod::kLBVH}) {
+    BVHBuildOptions options;
+    options.method = method;
+    options.thread_count = 1;
+    options.treelet_size = method == BVHBuildMethod::kLBVH ? 5 : 0;
+
+    BVHBuilder<Common::Triangle> builder;
+    BVH<Common::Triangle> bvh;
+    builder.Build(triangles, center_fn, bounds_fn, options, &bvh);
+
+    // same count, primatives moved around like an animated scene
+    for (auto& tri : triangles)
+      tri.v0.y += 0.01f;
+
+    const std::size_t allocations_before = g_allocation_count.load();
+    builder.Build(triangles, center_fn, bounds_fn, options, &bvh);
+    const std::size_t allocations = g_allocation_count.load() - allocations_before;
+    EXPECT_EQ(allocations, 0u);
+    ExpectValidBVH(bvh, triangles.size());
+  }
+}
+
+
+// Deepest a traversal that hits every box gets, pushing children in the shader's order
+std::size_t SimulateStack(const std::vector<BVHNode>& nodes) {
+  std::vector<std::uint32_t> stack = {0};
+  std::size_t peak = stack.size();
+  while (!stack.empty()) {
+    const BVHNode& node = nodes[stack.back()];
+    stack.pop_back();
+    if (!node.IsLeaf()) {
+      stack.push_back(node.first_child);
+      stack.push_back(node.first_child + 1);
+    }
+    peak = std::max(peak, stack.size());
+  }
+  return peak;
+}
+
+std::size_t SimulateStack(const BVH8& wide_bvh) {
+  const auto& nodes = wide_bvh.GetNodes();
+  std::vector<std::uint32_t> stack = {0};
+  std::size_t peak = stack.size();
+  while (!stack.empty()) {
+    const auto& node = nodes[stack.back()];
+    stack.pop_back();
+    for (std::uint32_t slot = 0; slot < 8 && !node.IsEmpty(slot); ++slot) {
+      if (!node.IsLeaf(slot))
+        stack.push_back(node.child_or_prim_index[slot]);
+    }
+    peak = std::max(peak, stack.size());
+  }
+  return peak;
+}
+
+TEST(BVHTest, AnalyzeBVH) {
+  const auto triangles = MakeClusteredTriangles(4000);
+  const BVH<Common::Triangle> bvh{triangles, Common::Triangle::Centroid, Common::Triangle::Bounds};
+  const BVHAnalysis analysis = AnalyzeBVH(bvh);
+
+  EXPECT_EQ(analysis.node_count, bvh.GetBVH().size());
+  EXPECT_EQ(analysis.leaf_count, (analysis.node_count + 1) / 2);
+  EXPECT_EQ(analysis.prim_count, triangles.size());
+  EXPECT_FLOAT_EQ(analysis.sah_cost, bvh.GetSAHCost());
+  EXPECT_GE(static_cast<float>(analysis.max_depth), analysis.average_leaf_depth);
+  EXPECT_GT(analysis.average_leaf_depth, 0.0f);
+  EXPECT_GE(analysis.overlap_ratio, 0.0f);
+
+  std::size_t leaves = 0;
+  std::size_t prims = 0;
+  for (std::size_t size = 0; size < analysis.leaf_size_histogram.size(); ++size) {
+    leaves += analysis.leaf_size_histogram[size];
+    prims += size * analysis.leaf_size_histogram[size];
+  }
+  EXPECT_EQ(leaves, analysis.leaf_count);
+  EXPECT_EQ(prims, analysis.prim_count);
+  EXPECT_EQ(analysis.leaf_size_histogram[0], 0u);
+
+  EXPECT_EQ(analysis.binary_stack_size, SimulateStack(bvh.GetBVH()));
+  EXPECT_EQ(analysis.wide_stack_size, SimulateStack(BVH8(bvh.GetBVH())));
+  EXPECT_LE(analysis.binary_stack_size, analysis.max_depth + 1);
+  EXPECT_NO_THROW(CheckStackSize(analysis.binary_stack_size, "test BVH"));
+}
+
+TEST(BVHTest, StackSizeCheckCatchesDeepTrees) {
+  // each triangle twice as far out as the last, so every midpoint split peels one off
+  const auto make_chain = [](const float direction) {
+    std::vector<Common::Triangle> triangles;
+    for (int i = 0; i < 100; ++i) {
+      const float x = direction * std::ldexp(1.0f, i);
+      triangles.emplace_back(glm::vec3(x, 0.0f, 0.0f), glm::vec3(x, 1.0f, 0.0f), glm::vec3(x, 0.0f, 1.0f));
+    }
+    return triangles;
+  };
+
+  BVHBuildOptions options;
+  options.method = BVHBuildMethod::kMidpoint;
+
+  // the deep side is always the left child, which is traversed with nothing left under it
+  const BVH<Common::Triangle> left_deep{make_chain(1.0f), Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+  const BVHAnalysis left_analysis = AnalyzeBVH(left_deep);
+  EXPECT_GT(left_analysis.max_depth, kTraversalStackSize);
+  EXPECT_EQ(left_analysis.binary_stack_size, SimulateStack(left_deep.GetBVH()));
+  EXPECT_NO_THROW(CheckStackSize(left_analysis.binary_stack_size, "test BVH"));
+
+  // the deep side is the right child, every level leaves its left sibling on the stack
+  const BVH<Common::Triangle> right_deep{make_chain(-1.0f), Common::Triangle::Centroid, Common::Triangle::Bounds, options};
+  const BVHAnalysis right_analysis = AnalyzeBVH(right_deep);
+  EXPECT_GT(right_analysis.max_depth, kTraversalStackSize);
+  EXPECT_EQ(right_analysis.binary_stack_size, SimulateStack(right_deep.GetBVH()));
+  EXPECT_THROW(CheckStackSize(right_analysis.binary_stack_size, "test BVH"), std::runtime_error);
+}
+
+
+TEST(TLASTest, TransformBoundsCoversRotatedBox) {
+  // 90 degrees about z then moved along x
+  glm::mat4 matrix(0.0f);
+  matrix[0] = glm::vec4(0, 1, 0, 0);
+  matrix[1] = glm::vec4(-1, 0, 0, 0);
+  matrix[2] = glm::vec4(0, 0, 1, 0);
+  matrix[3] = glm::vec4(10, 0, 0, 1);
+
+  const auto [min_bounds, max_bounds] = TransformBounds(glm::vec3(0, 0, 0), glm::vec3(2, 1, 1), matrix);
+  EXPECT_NEAR(min_bounds.x, 9.0f, 1e-5f);
+  EXPECT_NEAR(min_bounds.y, 0.0f, 1e-5f);
+  EXPECT_NEAR(max_bounds.x, 10.0f, 1e-5f);
+  EXPECT_NEAR(max_bounds.y, 2.0f, 1e-5f);
+  EXPECT_NEAR(max_bounds.z, 1.0f, 1e-5f);
+}
+
+TEST(TLASTest, LeavesReferenceEachInstanceOnce) {
+  std::vector<BVHInstance> instances;
+  for (std::uint32_t i = 0; i < 9; ++i) {
+    const glm::vec3 offset(static_cast<float>(i % 3) * 4.0f, static_cast<float>(i / 3) * 4.0f, 0.0f);
+    instances.push_back({offset, offset + glm::vec3(1.0f), i});
+  }
+
+  const TLAS tlas = BuildTLAS(instances);
+  ASSERT_EQ(tlas.GetPrims().size(), instances.size());
+  std::vector<int> seen(instances.size(), 0);
+  for (const BVHNode& node : tlas.GetBVH()) {
+    if (!node.IsLeaf())
+      continue;
+    EXPECT_EQ(node.prim_count, 1u);
+    seen[tlas.GetPrims()[node.first_prim_index].index]++;
+  }
+  for (const int count : seen)
+    EXPECT_EQ(count, 1);
+
+  // a ray along a row only reaches that row's instances
+  Common::Ray ray;
+  ray.origin = glm::vec3(-5.0f, 4.5f, 0.5f);
+  ray.direction = glm::vec3(1.0f, 0.0f, 0.0f);
+  ray.intersection_distance = std::numeric_limits<float>::max();
+  std::vector<std::uint32_t> reached;
+  ClosestHit(tlas, &ray, [&reached](const BVHInstance& instance, Common::Ray*) {
+    reached.push_back(instance.index);
+    return false;
+  });
+  std::sort(reached.begin(), reached.end());
+  EXPECT_EQ(reached, (std::vector<std::uint32_t>{3, 4, 5}));
+}
+
+
+TEST(BVHTest, FromBuiltTreeRestoresTree) {
+  const auto triangles = MakeClusteredTriangles(200, 14);
+  const BVH<Common::Triangle> bvh(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds);
+
+  const auto restored = BVH<Common::Triangle>::FromBuiltTree(
+      bvh.GetBVH(), bvh.GetPrims(), bvh.GetPrimIndices(), bvh.GetBuildOptions());
+  EXPECT_EQ(restored.GetBVH().size(), bvh.GetBVH().size());
+  EXPECT_EQ(restored.GetPrimIndices(), bvh.GetPrimIndices());
+  EXPECT_FLOAT_EQ(restored.GetSAHCost(), bvh.GetSAHCost());
+  EXPECT_FLOAT_EQ(restored.GetRefitDegradation(), 1.0f);
+
+  auto bad_nodes = bvh.GetBVH();
+  bad_nodes[0].first_child = static_cast<std::uint32_t>(bad_nodes.size());
+  EXPECT_THROW(
+      BVH<Common::Triangle>::FromBuiltTree(bad_nodes, bvh.GetPrims(), bvh.GetPrimIndices(), bvh.GetBuildOptions()),
+      std::invalid_argument);
+  EXPECT_THROW(
+      BVH<Common::Triangle>::FromBuiltTree(bvh.GetBVH(), bvh.GetPrims(), {}, bvh.GetBuildOptions()),
+      std::invalid_argument);
+}
+
+
+// Walks a DynamicBVH from its root, checking each live handle is in exactly one leaf and
+// every node encloses its children
+void ExpectValidDynamicBVH(const DynamicBVH<Common::Triangle>& bvh, const std::vector<bool>& live) {
+  const auto& nodes = bvh.GetBVH();
+  ASSERT_EQ(nodes.empty(), bvh.Empty());
+  if (nodes.empty())
+    return;
+
+  std::vector<int> seen(live.size(), 0);
+  std::vector<std::uint32_t> stack = {0};
+  while (!stack.empty()) {
+    const BVHNode& node = nodes[stack.back()];
+    stack.pop_back();
+    if (node.IsLeaf()) {
+      ASSERT_EQ(node.prim_count, 1u);
+      ASSERT_LT(node.first_prim_index, live.size());
+      seen[node.first_prim_index]++;
+      const auto [prim_min, prim_max] = Common::Triangle::Bounds(bvh.GetPrims()[node.first_prim_index]);
+      for (int axis = 0; axis < 3; ++axis) {
+        EXPECT_LE(node.min_bounds[axis], prim_min[axis]);
+        EXPECT_GE(node.max_bounds[axis], prim_max[axis]);
+      }
+      continue;
+    }
+
+    ASSERT_LT(node.first_child + 1, nodes.size());
+    for (const std::uint32_t child_idx : {node.first_child, node.first_child + 1}) {
+      for (int axis = 0; axis < 3; ++axis) {
+        EXPECT_LE(node.min_bounds[axis], nodes[child_idx].min_bounds[axis]);
+        EXPECT_GE(node.max_bounds[axis], nodes[child_idx].max_bounds[axis]);
+      }
+      stack.push_back(child_idx);
+    }
+  }
+
+  for (std::size_t i = 0; i < live.size(); ++i)
+    EXPECT_EQ(seen[i], live[i] ? 1 : 0) << "handle " << i;
+}
+
+TEST(DynamicBVHTest, InsertAndRemoveKeepTreeValid) {
+  const auto triangles = MakeClusteredTriangles(600, 15);
+  DynamicBVH<Common::Triangle> bvh;
+  std::vector<bool> live;
+  for (const auto& tri : triangles) {
+    const std::uint32_t handle = bvh.Insert(tri, Common::Triangle::Bounds(tri));
+    ASSERT_EQ(handle, live.size());
+    live.push_back(true);
+  }
+  ExpectValidDynamicBVH(bvh, live);
+
+  // rotations should keep it in the same league as a full build
+  const BVH<Common::Triangle> built(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds);
+  EXPECT_LT(bvh.GetSAHCost(), built.GetSAHCost() * 1.5f);
+
+  for (std::uint32_t handle = 0; handle < triangles.size(); handle += 2) {
+    bvh.Remove(handle);
+    live[handle] = false;
+  }
+  EXPECT_THROW(bvh.Remove(0), std::out_of_range);
+  ExpectValidDynamicBVH(bvh, live);
+
+  // moved primatives keep their handle, removed handles get reused
+  const Common::Triangle moved(glm::vec3(100, 0, 0), glm::vec3(101, 0, 0), glm::vec3(100, 1, 0));
+  bvh.Update(1, moved, Common::Triangle::Bounds(moved));
+  const std::uint32_t reused = bvh.Insert(triangles[598], Common::Triangle::Bounds(triangles[598]));
+  EXPECT_EQ(reused, 598u);
+  live[reused] = true;
+  ExpectValidDynamicBVH(bvh, live);
+  EXPECT_EQ(bvh.Size(), triangles.size() / 2 + 1);
+
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<float> coord(-5.0f, 45.0f);
+  for (int i = 0; i < 200; ++i) {
+    Common::Ray ray;
+    ray.origin = glm::vec3(coord(gen), coord(gen), -20.0f);
+    ray.direction = glm::normalize(glm::vec3(coord(gen), coord(gen), 20.0f) - ray.origin);
+    ray.intersection_distance = std::numeric_limits<float>::max();
+    Common::Ray expected = ray;
+    for (std::size_t handle = 0; handle < live.size(); ++handle) {
+      if (live[handle])
+        RayIntersectsTri(expected, bvh.GetPrims()[handle]);
+    }
+
+    ClosestHit(bvh, &ray, [](const Common::Triangle& tri, Common::Ray* const ray_ptr) {
+      return IntersectsTriangle(ray_ptr, tri.v0, tri.v1, tri.v2);
+    });
+    EXPECT_NEAR(ray.intersection_distance, expected.intersection_distance, 1e-3f);
+  }
+
+  for (std::uint32_t handle = 0; handle < live.size(); ++handle) {
+    if (live[handle])
+      bvh.Remove(handle);
+  }
+  EXPECT_TRUE(bvh.Empty());
+  EXPECT_TRUE(bvh.GetBVH().empty());
+}
+
+TEST(DynamicBVHTest, EditsOnlyDirtyTheirPath) {
+  const auto triangles = MakeClusteredTriangles(1000, 16);
+  DynamicBVH<Common::Triangle> bvh;
+  for (const auto& tri : triangles)
+    bvh.Insert(tri, Common::Triangle::Bounds(tri));
+  bvh.TakeDirtyNodes();
+  bvh.TakeDirtyPrims();
+
+  const Common::Triangle tri(glm::vec3(0.1f, 0.1f, 0.1f), glm::vec3(0.15f, 0.1f, 0.1f), glm::vec3(0.1f, 0.15f, 0.1f));
+  const std::uint32_t handle = bvh.Insert(tri, Common::Triangle::Bounds(tri));
+  const auto dirty_prims = bvh.TakeDirtyPrims();
+  ASSERT_EQ(dirty_prims.size(), 1u);
+  EXPECT_EQ(dirty_prims[0].first, handle);
+  EXPECT_EQ(dirty_prims[0].count, 1u);
+
+  std::uint32_t dirty_count = 0;
+  for (const BVHNodeRange& range : bvh.TakeDirtyNodes()) {
+    EXPECT_LE(range.first + range.count, bvh.GetBVH().size());
+    dirty_count += range.count;
+  }
+  // the new pair, plus the path up with a rotation at each level
+  EXPECT_GT(dirty_count, 0u);
+  EXPECT_LT(dirty_count, bvh.GetBVH().size() / 10);
+  EXPECT_TRUE(bvh.TakeDirtyNodes().empty());
+}
+
+// Deepest the stack of the shader's traversal gets, pushing first_child then first_child + 1
+std::uint32_t SimulatedStackSize(const std::vector<BVHNode>& nodes) {
+  std::vector<std::uint32_t> stack = {0};
+  std::size_t deepest = 1;
+  while (!stack.empty()) {
+    const BVHNode& node = nodes[stack.back()];
+    stack.pop_back();
+    if (node.IsLeaf())
+      continue;
+    stack.push_back(node.first_child);
+    stack.push_back(node.first_child + 1);
+    deepest = std::max(deepest, stack.size());
+  }
+  return static_cast<std::uint32_t>(deepest);
+}
+
+TEST(DynamicBVHTest, RequiredStackSizeWalksFromTheRoot) {
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<float> coord(0.0f, 40.0f);
+  const auto random_triangle = [&](const float x_scale) {
+    const glm::vec3 p(coord(gen) * x_scale, coord(gen), coord(gen));
+    return Common::Triangle(p, p + glm::vec3(0.1f, 0.0f, 0.0f), p + glm::vec3(0.0f, 0.1f, 0.0f));
+  };
+
+  DynamicBVH<Common::Triangle> bvh;
+  std::vector<Common::Triangle> triangles;
+  std::vector<std::uint32_t> handles;
+  for (int i = 0; i < 5000; ++i) {
+    triangles.push_back(random_triangle(1.0f));
+    handles.push_back(bvh.Insert(triangles.back(), Common::Triangle::Bounds(triangles.back())));
+  }
+  // removals leave unused pairs behind, and the inserts after them reuse those, ending up
+  // before their parents
+  for (std::size_t i = 0; i < handles.size(); i += 3)
+    bvh.Remove(handles[i]);
+  for (int i = 0; i < 2000; ++i) {
+    const Common::Triangle tri = random_triangle(0.1f);
+    bvh.Insert(tri, Common::Triangle::Bounds(tri));
+  }
+
+  bool child_before_parent = false;
+  for (std::size_t idx = 0; idx < bvh.GetBVH().size(); ++idx) {
+    const BVHNode& node = bvh.GetBVH()[idx];
+    child_before_parent = child_before_parent || (!node.IsLeaf() && node.first_child < idx);
+  }
+  EXPECT_TRUE(child_before_parent);
+  EXPECT_EQ(RequiredStackSize(bvh.GetBVH()), SimulatedStackSize(bvh.GetBVH()));
+
+  const BVH<Common::Triangle> built(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds);
+  EXPECT_EQ(RequiredStackSize(built.GetBVH()), SimulatedStackSize(built.GetBVH()));
+}
+
+
+TEST(TraversalTest, OccludedMatchesClosestHit) {
+  const auto triangles = MakeClusteredTriangles(2000, 17);
+  const BVH<Common::Triangle> bvh(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds);
+  const auto intersect_fn = [](const Common::Triangle& tri, Common::Ray* const ray_ptr) {
+    return IntersectsTriangle(ray_ptr, tri.v0, tri.v1, tri.v2);
+  };
+
+  // aimed at triangles, stopping either short of them or past them
+  std::mt19937 gen(3);
+  std::uniform_int_distribution<std::size_t> pick(0, triangles.size() - 1);
+  std::uniform_real_distribution<float> coord(-1.0f, 41.0f);
+  std::uniform_real_distribution<float> reach(0.5f, 1.5f);
+  int occluded_count = 0;
+  for (int i = 0; i < 500; ++i) {
+    Common::Ray ray;
+    ray.origin = glm::vec3(coord(gen), coord(gen) * 0.25f, -10.0f);
+    const glm::vec3 target = Common::Triangle::Centroid(triangles[pick(gen)]);
+    ray.direction = glm::normalize(target - ray.origin);
+    ray.intersection_distance = std::numeric_limits<float>::max();
+    const float length = glm::length(target - ray.origin) * reach(gen);
+
+    Common::Ray closest = ray;
+    const bool any_hit = ClosestHit(bvh, &closest, intersect_fn) != kNoHit;
+    const bool expected = any_hit && closest.intersection_distance < length;
+    EXPECT_EQ(Occluded(bvh, ray, Common::Interval(0.001f, length), intersect_fn), expected);
+    occluded_count += expected;
+
+    // hits before the interval starts don't count
+    if (any_hit) {
+      const float past_hit = closest.intersection_distance + 0.01f;
+      Common::Ray after = ray;
+      after.origin = ray.origin + ray.direction * past_hit;
+      after.intersection_distance = std::numeric_limits<float>::max();
+      const bool hit_after = ClosestHit(bvh, &after, intersect_fn) != kNoHit &&
+                             after.intersection_distance < length - past_hit;
+      EXPECT_EQ(Occluded(bvh, ray, Common::Interval(past_hit, length), intersect_fn), hit_after);
+    }
+  }
+  EXPECT_GT(occluded_count, 0);
+  EXPECT_LT(occluded_count, 500);
+}
+
+
+TEST(TraversalTest, PacketMatchesClosestHit) {
+  const auto triangles = MakeClusteredTriangles(2000, 21);
+  const BVH<Common::Triangle> bvh(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds);
+  const auto intersect_fn = [](const Common::Triangle& tri, Common::Ray* const ray_ptr) {
+    return IntersectsTriangle(ray_ptr, tri.v0, tri.v1, tri.v2);
+  };
+
+  // a 4x4 tile of camera rays looking at each cluster, then the same tile with every
+  // other ray turned around so the packet isn't coherent
+  const glm::vec3 targets[] = {{0.25f, 0.1f, 0}, {40, 0, 3}, {40, 10, -2}};
+  int hit_count = 0;
+  for (const bool coherent : {true, false}) {
+    for (const glm::vec3& target : targets) {
+      Common::Ray rays[16];
+      for (int i = 0; i < 16; ++i) {
+        const glm::vec3 offset((i % 4 - 1.5f) * 0.05f, (i / 4 - 1.5f) * 0.05f, 0.0f);
+        rays[i].origin = target + glm::vec3(0.3f, -0.2f, -5.0f);
+        rays[i].direction = glm::normalize(target + offset - rays[i].origin);
+        if (!coherent && i % 2)
+          rays[i].direction = -rays[i].direction;
+        rays[i].intersection_distance = std::numeric_limits<float>::max();
+      }
+
+      Common::Ray packet_rays[16];
+      std::copy(std::begin(rays), std::end(rays), packet_rays);
+      std::uint32_t hits[16];
+      ClosestHitPacket<16>(bvh, packet_rays, hits, intersect_fn);
+      std::uint32_t hits_8[16];
+      Common::Ray packet_rays_8[16];
+      std::copy(std::begin(rays), std::end(rays), packet_rays_8);
+      ClosestHitPacket<8>(bvh, packet_rays_8, hits_8, intersect_fn);
+      ClosestHitPacket<8>(bvh, packet_rays_8 + 8, hits_8 + 8, intersect_fn);
+
+      for (int i = 0; i < 16; ++i) {
+        Common::Ray single = rays[i];
+        const std::uint32_t expected = ClosestHit(bvh, &single, intersect_fn);
+        EXPECT_EQ(hits[i] != kNoHit, expected != kNoHit);
+        EXPECT_EQ(hits_8[i] != kNoHit, expected != kNoHit);
+        EXPECT_FLOAT_EQ(packet_rays[i].intersection_distance, single.intersection_distance);
+        EXPECT_FLOAT_EQ(packet_rays_8[i].intersection_distance, single.intersection_distance);
+        hit_count += expected != kNoHit;
+      }
+    }
+  }
+  EXPECT_GT(hit_count, 0);
+}
+
+
+TEST(TraversalTest, TriangleBlockKernelsMatchClosestHit) {
+  const auto triangles = MakeClusteredTriangles(3000, 23);
+  BVHBuildOptions options;
+  options.max_leaf_size = 8;
+  const BVH<Common::Triangle> bvh(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options);
+  const TriangleBlocks blocks(bvh, [](const Common::Triangle& tri) { return tri; });
+
+  std::vector<TriangleKernel> kernels = {TriangleKernel::kScalar};
+#if defined(INTERSECTION_UTILS_X86_64)
+  kernels.push_back(TriangleKernel::kSSE);
+  if (DetectTriangleKernel() == TriangleKernel::kAVX2)
+    kernels.push_back(TriangleKernel::kAVX2);
+#endif
+
+  std::mt19937 gen(9);
+  std::uniform_int_distribution<std::size_t> pick(0, triangles.size() - 1);
+  std::uniform_real_distribution<float> coord(-1.0f, 41.0f);
+  int hit_count = 0;
+  for (int i = 0; i < 500; ++i) {
+    Common::Ray ray;
+    ray.origin = glm::vec3(coord(gen), coord(gen) * 0.25f, -10.0f);
+    ray.direction = glm::normalize(Common::Triangle::Centroid(triangles[pick(gen)]) - ray.origin);
+    ray.intersection_distance = std::numeric_limits<float>::max();
+
+    // the second pass starts past the first hit, which has to be skipped
+    float t_min = 0.0f;
+    for (int pass = 0; pass < 2; ++pass) {
+      Common::Ray expected_ray = ray;
+      const std::uint32_t expected = ClosestHit(
+          bvh, &expected_ray, [t_min](const Common::Triangle& tri, Common::Ray* const ray_ptr) {
+            Common::Ray probe = *ray_ptr;
+            if (!IntersectsTriangle(&probe, tri.v0, tri.v1, tri.v2) || probe.intersection_distance <= t_min)
+              return false;
+            ray_ptr->intersection_distance = probe.intersection_distance;
+            return true;
+          });
+      hit_count += expected != kNoHit;
+
+      for (const TriangleKernel kernel : kernels) {
+        Common::Ray block_ray = ray;
+        const std::uint32_t hit = ClosestHitBlocks(bvh, blocks, &block_ray, t_min, GetTriangleBlockFn(kernel));
+        EXPECT_EQ(hit != kNoHit, expected != kNoHit) << "kernel " << static_cast<int>(kernel);
+        if (hit != kNoHit && expected != kNoHit) {
+          EXPECT_FLOAT_EQ(block_ray.intersection_distance, expected_ray.intersection_distance);
+        }
+      }
+
+      if (expected == kNoHit)
+        break;
+      t_min = expected_ray.intersection_distance + 0.001f;
+    }
+  }
+  EXPECT_GT(hit_count, 500);
+}
+
+TEST(TraversalTest, OccludedBlocksMatchesOccluded) {
+  const auto triangles = MakeClusteredTriangles(3000, 29);
+  BVHBuildOptions options;
+  options.max_leaf_size = 8;
+  const BVH<Common::Triangle> bvh(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, options);
+  const TriangleBlocks blocks(bvh, [](const Common::Triangle& tri) { return tri; });
+
+  std::vector<TriangleKernel> kernels = {TriangleKernel::kScalar};
+#if defined(INTERSECTION_UTILS_X86_64)
+  kernels.push_back(TriangleKernel::kSSE);
+  if (DetectTriangleKernel() == TriangleKernel::kAVX2)
+    kernels.push_back(TriangleKernel::kAVX2);
+#endif
+
+  std::mt19937 gen(13);
+  std::uniform_int_distribution<std::size_t> pick(0, triangles.size() - 1);
+  std::uniform_real_distribution<float> coord(-1.0f, 41.0f);
+  std::uniform_real_distribution<float> length(1.0f, 40.0f);
+  int occluded_count = 0;
+  int clear_count = 0;
+  for (int i = 0; i < 500; ++i) {
+    Common::Ray ray;
+    ray.origin = glm::vec3(coord(gen), coord(gen) * 0.25f, -10.0f);
+    ray.direction = glm::normalize(Common::Triangle::Centroid(triangles[pick(gen)]) - ray.origin);
+    const Common::Interval interval(0.001f, length(gen));
+
+    const bool expected = Occluded(bvh, ray, interval, [&interval](const Common::Triangle& tri, Common::Ray* const ray_ptr) {
+      Common::Ray probe = *ray_ptr;
+      if (!IntersectsTriangle(&probe, tri.v0, tri.v1, tri.v2) || probe.intersection_distance <= interval.min)
+        return false;
+      ray_ptr->intersection_distance = probe.intersection_distance;
+      return true;
+    });
+    occluded_count += expected;
+    clear_count += !expected;
+
+    for (const TriangleKernel kernel : kernels)
+      EXPECT_EQ(OccludedBlocks(bvh, blocks, ray, interval, GetTriangleBlockFn(kernel)), expected) << "kernel " << static_cast<int>(kernel);
+  }
+  EXPECT_GT(occluded_count, 0);
+  EXPECT_GT(clear_count, 0);
+}
+
 }
 }
 
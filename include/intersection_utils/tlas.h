@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "intersection_utils/bvh.h"
+
+namespace IntersectionUtils {
+/**
+ * One model placed in the scene, a primative of the top level BVH
+ *
+ * @var min_bounds World space box of the model
+ * @var index Which model (bottom level BVH) this is, the same index as its bvhs[] entry
+ *            in the shaders
+ */
+struct BVHInstance {
+  glm::vec3 min_bounds;
+  glm::vec3 max_bounds;
+  std::uint32_t index;
+};
+
+using TLAS = BVH<BVHInstance>;
+
+// Box around the box min_bounds/max_bounds after transforming it by matrix. Looser than
+// the transformed geometry would be, but only needs the model's root node
+inline std::pair<glm::vec3, glm::vec3> TransformBounds(
+    const glm::vec3& min_bounds,
+    const glm::vec3& max_bounds,
+    const glm::mat4& matrix) {
+  glm::vec3 out_min(std::numeric_limits<float>::max());
+  glm::vec3 out_max(std::numeric_limits<float>::lowest());
+  for (int corner = 0; corner < 8; ++corner) {
+    const glm::vec3 point(
+        (corner & 1) ? max_bounds.x : min_bounds.x,
+        (corner & 2) ? max_bounds.y : min_bounds.y,
+        (corner & 4) ? max_bounds.z : min_bounds.z);
+    const glm::vec3 transformed = glm::vec3(matrix * glm::vec4(point, 1.0f));
+    out_min = glm::min(out_min, transformed);
+    out_max = glm::max(out_max, transformed);
+  }
+
+  return {out_min, out_max};
+}
+
+/**
+ * BVH over the world space boxes of the instances. Scenes hold few enough models that
+ * this is cheap to rebuild whenever one moves, so it's always built from scratch with
+ * SAH and single instance leaves
+ */
+inline TLAS BuildTLAS(std::vector<BVHInstance> instances) {
+  BVHBuildOptions options;
+  options.max_leaf_size = 1;
+  options.thread_count = 1;
+
+  return TLAS(
+      std::move(instances),
+      [](const BVHInstance& instance) { return (instance.min_bounds + instance.max_bounds) * 0.5f; },
+      [](const BVHInstance& instance) { return std::make_pair(instance.min_bounds, instance.max_bounds); },
+      options);
+}
+
+}
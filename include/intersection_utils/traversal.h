@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include <glm/glm.hpp>
+
+#include "common/types.h"
+#include "intersection_utils/bvh.h"
+
+namespace IntersectionUtils {
+constexpr std::uint32_t kNoHit = std::numeric_limits<std::uint32_t>::max();
+// Same as the stacks in shaders/ray_intersects.glsl
+constexpr std::uint32_t kTraversalStackSize = 64;
+
+/**
+ * Counters filled in by the CPU traversals when given one
+ *
+ * @var cache_lines_touched Node reads that land on a different 64 byte line than the
+ *                          previous read. Rough measure of how well the layout suits the
+ *                          order nodes are visited in
+ */
+struct TraversalStats {
+  std::uint64_t nodes_visited = 0;
+  std::uint64_t prims_tested = 0;
+  std::uint64_t cache_lines_touched = 0;
+};
+
+// Slab test. Returns the distance to where the ray enters the box, or infinity on a miss
+inline float IntersectsBox(
+    const glm::vec3& origin,
+    const glm::vec3& inv_dir,
+    const glm::vec3& min_bounds,
+    const glm::vec3& max_bounds) {
+  const glm::vec3 t0 = (min_bounds - origin) * inv_dir;
+  const glm::vec3 t1 = (max_bounds - origin) * inv_dir;
+  const glm::vec3 t_min = glm::min(t0, t1);
+  const glm::vec3 t_max = glm::max(t0, t1);
+  const float t_near = std::max(std::max(t_min.x, t_min.y), t_min.z);
+  const float t_far = std::min(std::min(t_max.x, t_max.y), t_max.z);
+  if (t_near > t_far || t_far < 0.0f)
+    return std::numeric_limits<float>::infinity();
+
+  return std::max(t_near, 0.0f);
+}
+
+/**
+ * Möller–Trumbore, same as IntersectsTriangle in shaders/ray_intersects.glsl.
+ * Shortens ray.intersection_distance and returns true if the triangle is closer
+ */
+inline bool IntersectsTriangle(
+    Common::Ray* const ray_ptr,
+    const glm::vec3& v0,
+    const glm::vec3& v1,
+    const glm::vec3& v2) {
+  auto& ray = *ray_ptr;
+  const glm::vec3 edge_1 = v1 - v0;
+  const glm::vec3 edge_2 = v2 - v0;
+  const glm::vec3 h = glm::cross(ray.direction, edge_2);
+  const float a = glm::dot(edge_1, h);
+  if (a > -0.0001f && a < 0.0001f)
+    return false; // ray parallel to triangle
+
+  const float f = 1 / a;
+  const glm::vec3 s = ray.origin - v0;
+  const float u = f * glm::dot(s, h);
+  if (u < 0 || u > 1)
+    return false;
+
+  const glm::vec3 q = glm::cross(s, edge_1);
+  const float v = f * glm::dot(ray.direction, q);
+  if (v < 0 || u + v > 1)
+    return false;
+
+  const float t = f * glm::dot(edge_2, q);
+  if (t > 0.00001f && t < ray.intersection_distance) {
+    ray.intersection_distance = t;
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * ClosestHit with the leaves left to leaf_fn(node, node_idx, ray_ptr), for callers that
+ * keep leaf contents in their own layout (see ClosestHitBlocks). leaf_fn has to shorten
+ * ray.intersection_distance to its closest hit and return that primative's index in
+ * GetPrims(), or kNoHit
+ */
+template <class Tree, class LeafFn>
+std::uint32_t ClosestHitLeaves(
+    const Tree& bvh,
+    Common::Ray* const ray_ptr,
+    const LeafFn& leaf_fn,
+    TraversalStats* const stats = nullptr) {
+  auto& ray = *ray_ptr;
+  const auto& nodes = bvh.GetBVH();
+  if (nodes.empty())
+    return kNoHit;
+
+  const glm::vec3 inv_dir = 1.0f / ray.direction;
+  if (IntersectsBox(ray.origin, inv_dir, nodes[0].min_bounds, nodes[0].max_bounds) >= ray.intersection_distance)
+    return kNoHit;
+
+  // nodes are pushed with the distance to their box, already known to be hit
+  std::pair<std::uint32_t, float> stack[kTraversalStackSize];
+  int stack_idx = 0;
+  stack[stack_idx++] = {0, 0.0f};
+  std::uint32_t hit = kNoHit;
+  std::uintptr_t last_line = std::numeric_limits<std::uintptr_t>::max();
+
+  while (stack_idx > 0) {
+    const auto [node_idx, node_dist] = stack[--stack_idx];
+    if (node_dist >= ray.intersection_distance)
+      continue;
+
+    const BVHNode& node = nodes[node_idx];
+    if (stats)
+      stats->nodes_visited++;
+
+    if (node.IsLeaf()) {
+      const std::uint32_t leaf_hit = leaf_fn(node, node_idx, ray_ptr);
+      if (leaf_hit != kNoHit)
+        hit = leaf_hit;
+      if (stats)
+        stats->prims_tested += node.prim_count;
+      continue;
+    }
+
+    if (stack_idx + 2 > static_cast<int>(kTraversalStackSize))
+      throw std::runtime_error("BVH is too deep for the traversal stack");
+
+    const BVHNode& left = nodes[node.first_child];
+    const BVHNode& right = nodes[node.first_child + 1];
+    if (stats) {
+      // children's boxes are what gets read from memory here
+      for (const BVHNode* const child : {&left, &right}) {
+        const std::uintptr_t line = reinterpret_cast<std::uintptr_t>(child) / 64;
+        stats->cache_lines_touched += line != last_line;
+        last_line = line;
+      }
+    }
+
+    const float left_dist = IntersectsBox(ray.origin, inv_dir, left.min_bounds, left.max_bounds);
+    const float right_dist = IntersectsBox(ray.origin, inv_dir, right.min_bounds, right.max_bounds);
+    // nearer child on top so it's visited first and shortens the ray for the other
+    const bool left_nearer = left_dist <= right_dist;
+    const float near_dist = left_nearer ? left_dist : right_dist;
+    const float far_dist = left_nearer ? right_dist : left_dist;
+    if (far_dist < ray.intersection_distance)
+      stack[stack_idx++] = {node.first_child + (left_nearer ? 1 : 0), far_dist};
+    if (near_dist < ray.intersection_distance)
+      stack[stack_idx++] = {node.first_child + (left_nearer ? 0 : 1), near_dist};
+  }
+
+  return hit;
+}
+
+/**
+ * Closest hit through a binary BVH, the CPU version of Intersects in ray_intersects.glsl.
+ * intersect_fn(prim, ray_ptr) has to shorten ray.intersection_distance and return true
+ * when prim is closer. Returns the index in GetPrims() of the closest hit, or kNoHit.
+ * Tree is a BVH or a DynamicBVH
+ */
+template <class Tree, class IntersectFn>
+std::uint32_t ClosestHit(
+    const Tree& bvh,
+    Common::Ray* const ray_ptr,
+    const IntersectFn& intersect_fn,
+    TraversalStats* const stats = nullptr) {
+  const auto& prims = bvh.GetPrims();
+  return ClosestHitLeaves(
+      bvh,
+      ray_ptr,
+      [&](const BVHNode& node, std::uint32_t, Common::Ray* const leaf_ray_ptr) {
+        std::uint32_t hit = kNoHit;
+        for (std::uint32_t i = node.first_prim_index; i < node.first_prim_index + node.prim_count; ++i) {
+          if (intersect_fn(prims[i], leaf_ray_ptr))
+            hit = i;
+        }
+        return hit;
+      },
+      stats);
+}
+
+/**
+ * Occluded with the leaves left to leaf_fn(node, node_idx, ray), for callers that keep
+ * leaf contents in their own layout (see OccludedBlocks). leaf_fn returns true if any of
+ * the leaf's primatives is hit inside interval, and counts the ones it tested in stats
+ * itself since it can stop partway through the leaf
+ */
+template <class Tree, class LeafFn>
+bool OccludedLeaves(
+    const Tree& bvh,
+    const Common::Ray& ray,
+    const Common::Interval& interval,
+    const LeafFn& leaf_fn,
+    TraversalStats* const stats = nullptr) {
+  const auto& nodes = bvh.GetBVH();
+  if (nodes.empty())
+    return false;
+
+  const glm::vec3 inv_dir = 1.0f / ray.direction;
+  std::uint32_t stack[kTraversalStackSize];
+  int stack_idx = 0;
+  stack[stack_idx++] = 0;
+
+  while (stack_idx > 0) {
+    const std::uint32_t node_idx = stack[--stack_idx];
+    const BVHNode& node = nodes[node_idx];
+    if (stats)
+      stats->nodes_visited++;
+    if (IntersectsBox(ray.origin, inv_dir, node.min_bounds, node.max_bounds) >= interval.max)
+      continue;
+
+    if (node.IsLeaf()) {
+      if (leaf_fn(node, node_idx, ray))
+        return true;
+      continue;
+    }
+
+    if (stack_idx + 2 > static_cast<int>(kTraversalStackSize))
+      throw std::runtime_error("BVH is too deep for the traversal stack");
+
+    // any hit ends the search, so the order children are visited in only matters for speed
+    stack[stack_idx++] = node.first_child + 1;
+    stack[stack_idx++] = node.first_child;
+  }
+
+  return false;
+}
+
+/**
+ * Any hit through a binary BVH, for shadow rays. True as soon as a primative is hit
+ * inside interval, without looking for the closest one. intersect_fn is the same as for
+ * ClosestHit, it's given a copy of the ray with intersection_distance set to interval.max
+ */
+template <class Tree, class IntersectFn>
+bool Occluded(
+    const Tree& bvh,
+    const Common::Ray& ray,
+    const Common::Interval& interval,
+    const IntersectFn& intersect_fn,
+    TraversalStats* const stats = nullptr) {
+  const auto& prims = bvh.GetPrims();
+  return OccludedLeaves(
+      bvh,
+      ray,
+      interval,
+      [&](const BVHNode& node, std::uint32_t, const Common::Ray& leaf_ray) {
+        for (std::uint32_t i = node.first_prim_index; i < node.first_prim_index + node.prim_count; ++i) {
+          if (stats)
+            stats->prims_tested++;
+          Common::Ray probe = leaf_ray;
+          probe.intersection_distance = interval.max;
+          if (intersect_fn(prims[i], &probe) && probe.intersection_distance >= interval.min)
+            return true;
+        }
+        return false;
+      },
+      stats);
+}
+
+}
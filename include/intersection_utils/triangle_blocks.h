@@ -0,0 +1,381 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "common/types.h"
+#include "intersection_utils/bvh.h"
+#include "intersection_utils/traversal.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define INTERSECTION_UTILS_X86_64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// Lets one function use AVX2 in a build that doesn't assume it, the caller checks the CPU
+// first. MSVC allows the intrinsics anywhere
+#if defined(INTERSECTION_UTILS_X86_64) && (defined(__GNUC__) || defined(__clang__))
+#define INTERSECTION_UTILS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define INTERSECTION_UTILS_TARGET_AVX2
+#endif
+
+namespace IntersectionUtils {
+constexpr std::uint32_t kTriangleBlockWidth = 8;
+
+/**
+ * Up to 8 triangles of one BVH leaf laid out one array per component, with the edges
+ * Möller–Trumbore needs already computed. Lanes past count are zeroed, and triangles
+ * with no area are never hit
+ *
+ * @var prim_index Index in GetPrims() of each lane's triangle
+ */
+struct alignas(32) TriangleBlock {
+  float v0[3][kTriangleBlockWidth];
+  float edge_1[3][kTriangleBlockWidth];
+  float edge_2[3][kTriangleBlockWidth];
+  std::uint32_t prim_index[kTriangleBlockWidth];
+  std::uint32_t count;
+};
+
+/**
+ * Every leaf of a BVH over triangles as TriangleBlocks, for the block kernels below.
+ * A leaf's triangles fill ceil(prim_count / 8) blocks starting at FirstBlock(node), so
+ * build the BVH with max_leaf_size 8 to fill whole AVX registers.
+ *
+ * A copy of the triangles, rebuild it when the tree or its vertices change
+ */
+class TriangleBlocks {
+ public:
+  TriangleBlocks() = default;
+
+  // triangle_fn(prim) returns the Common::Triangle of a primative
+  template <class Tree, class TriangleFn>
+  TriangleBlocks(const Tree& bvh, const TriangleFn& triangle_fn) {
+    const auto& nodes = bvh.GetBVH();
+    const auto& prims = bvh.GetPrims();
+    first_block_.assign(nodes.size(), 0);
+    for (std::size_t node_idx = 0; node_idx < nodes.size(); ++node_idx) {
+      const BVHNode& node = nodes[node_idx];
+      if (!node.IsLeaf())
+        continue;
+
+      first_block_[node_idx] = static_cast<std::uint32_t>(blocks_.size());
+      for (std::uint32_t begin = 0; begin < node.prim_count; begin += kTriangleBlockWidth) {
+        TriangleBlock block;
+        std::memset(&block, 0, sizeof(block));
+        block.count = std::min(kTriangleBlockWidth, node.prim_count - begin);
+        for (std::uint32_t lane = 0; lane < block.count; ++lane) {
+          const std::uint32_t prim_idx = node.first_prim_index + begin + lane;
+          const Common::Triangle tri = triangle_fn(prims[prim_idx]);
+          const glm::vec3 edge_1 = tri.v1 - tri.v0;
+          const glm::vec3 edge_2 = tri.v2 - tri.v0;
+          for (int axis = 0; axis < 3; ++axis) {
+            block.v0[axis][lane] = tri.v0[axis];
+            block.edge_1[axis][lane] = edge_1[axis];
+            block.edge_2[axis][lane] = edge_2[axis];
+          }
+          block.prim_index[lane] = prim_idx;
+        }
+        blocks_.push_back(block);
+      }
+    }
+  }
+
+  const std::vector<TriangleBlock>& GetBlocks() const { return blocks_; }
+  std::uint32_t FirstBlock(const std::uint32_t node_idx) const { return first_block_[node_idx]; }
+
+ private:
+  std::vector<TriangleBlock> blocks_;
+  std::vector<std::uint32_t> first_block_;
+};
+
+/**
+ * Closest hit among a block's triangles with t in (t_min, ray.intersection_distance).
+ * Shortens ray.intersection_distance and returns the lane hit, or -1. Same math and
+ * epsilons as IntersectsTriangle
+ */
+using TriangleBlockFn = int (*)(const TriangleBlock& block, Common::Ray* ray_ptr, float t_min);
+
+enum class TriangleKernel {
+  kScalar,
+  kSSE,
+  kAVX2,
+};
+
+namespace Detail {
+constexpr float kParallelEpsilon = 0.0001f;
+constexpr float kMinHitDistance = 0.00001f;
+
+inline int IntersectBlockScalar(const TriangleBlock& block, Common::Ray* const ray_ptr, const float t_min) {
+  auto& ray = *ray_ptr;
+  const float lower = std::max(t_min, kMinHitDistance);
+  int hit = -1;
+  for (std::uint32_t lane = 0; lane < block.count; ++lane) {
+    const glm::vec3 v0(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+    const glm::vec3 edge_1(block.edge_1[0][lane], block.edge_1[1][lane], block.edge_1[2][lane]);
+    const glm::vec3 edge_2(block.edge_2[0][lane], block.edge_2[1][lane], block.edge_2[2][lane]);
+    const glm::vec3 h = glm::cross(ray.direction, edge_2);
+    const float a = glm::dot(edge_1, h);
+    if (a > -kParallelEpsilon && a < kParallelEpsilon)
+      continue;
+
+    const float f = 1 / a;
+    const glm::vec3 s = ray.origin - v0;
+    const float u = f * glm::dot(s, h);
+    if (u < 0 || u > 1)
+      continue;
+
+    const glm::vec3 q = glm::cross(s, edge_1);
+    const float v = f * glm::dot(ray.direction, q);
+    if (v < 0 || u + v > 1)
+      continue;
+
+    const float t = f * glm::dot(edge_2, q);
+    if (t > lower && t < ray.intersection_distance) {
+      ray.intersection_distance = t;
+      hit = static_cast<int>(lane);
+    }
+  }
+
+  return hit;
+}
+
+#if defined(INTERSECTION_UTILS_X86_64)
+// Picks the nearest of the lanes' t, misses are infinity
+inline int NearestLane(const float* const t, const int width, Common::Ray* const ray_ptr) {
+  int hit = -1;
+  for (int lane = 0; lane < width; ++lane) {
+    if (t[lane] < ray_ptr->intersection_distance) {
+      ray_ptr->intersection_distance = t[lane];
+      hit = lane;
+    }
+  }
+
+  return hit;
+}
+
+// SSE2 is part of x86-64, so this one needs no check
+inline int IntersectBlockSSE(const TriangleBlock& block, Common::Ray* const ray_ptr, const float t_min) {
+  auto& ray = *ray_ptr;
+  const __m128 dx = _mm_set1_ps(ray.direction.x);
+  const __m128 dy = _mm_set1_ps(ray.direction.y);
+  const __m128 dz = _mm_set1_ps(ray.direction.z);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 epsilon = _mm_set1_ps(kParallelEpsilon);
+  const __m128 lower = _mm_set1_ps(std::max(t_min, kMinHitDistance));
+  const __m128 infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+  alignas(16) float t_out[kTriangleBlockWidth];
+  const int width = block.count > 4 ? 8 : 4;
+  for (int base = 0; base < width; base += 4) {
+    const __m128 e1x = _mm_load_ps(&block.edge_1[0][base]);
+    const __m128 e1y = _mm_load_ps(&block.edge_1[1][base]);
+    const __m128 e1z = _mm_load_ps(&block.edge_1[2][base]);
+    const __m128 e2x = _mm_load_ps(&block.edge_2[0][base]);
+    const __m128 e2y = _mm_load_ps(&block.edge_2[1][base]);
+    const __m128 e2z = _mm_load_ps(&block.edge_2[2][base]);
+
+    const __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+    const __m128 f = _mm_div_ps(one, a);
+
+    const __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(&block.v0[0][base]));
+    const __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(&block.v0[1][base]));
+    const __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(&block.v0[2][base]));
+    const __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    const __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+    const __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+
+    __m128 valid = _mm_or_ps(_mm_cmple_ps(a, _mm_sub_ps(zero, epsilon)), _mm_cmpge_ps(a, epsilon));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, lower));
+    _mm_store_ps(&t_out[base], _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, infinity)));
+  }
+
+  return NearestLane(t_out, width, ray_ptr);
+}
+
+INTERSECTION_UTILS_TARGET_AVX2
+inline int IntersectBlockAVX2(const TriangleBlock& block, Common::Ray* const ray_ptr, const float t_min) {
+  auto& ray = *ray_ptr;
+  const __m256 dx = _mm256_set1_ps(ray.direction.x);
+  const __m256 dy = _mm256_set1_ps(ray.direction.y);
+  const __m256 dz = _mm256_set1_ps(ray.direction.z);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 epsilon = _mm256_set1_ps(kParallelEpsilon);
+  const __m256 lower = _mm256_set1_ps(std::max(t_min, kMinHitDistance));
+  const __m256 infinity = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+
+  const __m256 e1x = _mm256_load_ps(block.edge_1[0]);
+  const __m256 e1y = _mm256_load_ps(block.edge_1[1]);
+  const __m256 e1z = _mm256_load_ps(block.edge_1[2]);
+  const __m256 e2x = _mm256_load_ps(block.edge_2[0]);
+  const __m256 e2y = _mm256_load_ps(block.edge_2[1]);
+  const __m256 e2z = _mm256_load_ps(block.edge_2[2]);
+
+  const __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+  const __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+  const __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+  const __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+  const __m256 f = _mm256_div_ps(one, a);
+
+  const __m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_load_ps(block.v0[0]));
+  const __m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_load_ps(block.v0[1]));
+  const __m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_load_ps(block.v0[2]));
+  const __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+
+  const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+  const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+  const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+  const __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+  const __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+
+  __m256 valid = _mm256_or_ps(
+      _mm256_cmp_ps(a, _mm256_sub_ps(zero, epsilon), _CMP_LE_OQ), _mm256_cmp_ps(a, epsilon, _CMP_GE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+  valid = _mm256_and_ps(
+      valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, lower, _CMP_GT_OQ));
+  // most rays miss every triangle of the leaf
+  if (_mm256_movemask_ps(valid) == 0)
+    return -1;
+
+  alignas(32) float t_out[kTriangleBlockWidth];
+  _mm256_store_ps(t_out, _mm256_blendv_ps(infinity, t, valid));
+  return NearestLane(t_out, kTriangleBlockWidth, ray_ptr);
+}
+#endif
+}
+
+// Best kernel this CPU runs, checked with CPUID
+inline TriangleKernel DetectTriangleKernel() {
+#if defined(INTERSECTION_UTILS_X86_64)
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] >= 7) {
+    __cpuid(info, 1);
+    const bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+    __cpuidex(info, 7, 0);
+    if (os_saves_ymm && (info[1] & (1 << 5)))
+      return TriangleKernel::kAVX2;
+  }
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return TriangleKernel::kAVX2;
+#endif
+  return TriangleKernel::kSSE;
+#else
+  return TriangleKernel::kScalar;
+#endif
+}
+
+// Throws std::invalid_argument for a kernel this build doesn't have. Doesn't check the
+// CPU supports it, see DetectTriangleKernel
+inline TriangleBlockFn GetTriangleBlockFn(const TriangleKernel kernel) {
+  switch (kernel) {
+    case TriangleKernel::kScalar:
+      return Detail::IntersectBlockScalar;
+#if defined(INTERSECTION_UTILS_X86_64)
+    case TriangleKernel::kSSE:
+      return Detail::IntersectBlockSSE;
+    case TriangleKernel::kAVX2:
+      return Detail::IntersectBlockAVX2;
+#endif
+    default:
+      throw std::invalid_argument("Triangle kernel isn't available on this platform");
+  }
+}
+
+// Kernel for this CPU, detected once
+inline TriangleBlockFn BestTriangleBlockFn() {
+  static const TriangleBlockFn fn = GetTriangleBlockFn(DetectTriangleKernel());
+  return fn;
+}
+
+/**
+ * ClosestHit through a BVH over triangles, testing each leaf's blocks with kernel instead
+ * of calling an intersect_fn per triangle. Only hits further than t_min count.
+ * Returns the index in GetPrims() of the closest hit, or kNoHit
+ */
+template <class Tree>
+std::uint32_t ClosestHitBlocks(
+    const Tree& bvh,
+    const TriangleBlocks& blocks,
+    Common::Ray* const ray_ptr,
+    const float t_min = 0.0f,
+    const TriangleBlockFn kernel = BestTriangleBlockFn(),
+    TraversalStats* const stats = nullptr) {
+  const auto& all_blocks = blocks.GetBlocks();
+  return ClosestHitLeaves(
+      bvh,
+      ray_ptr,
+      [&](const BVHNode& node, const std::uint32_t node_idx, Common::Ray* const leaf_ray_ptr) {
+        std::uint32_t hit = kNoHit;
+        const std::uint32_t first = blocks.FirstBlock(node_idx);
+        const std::uint32_t block_count = (node.prim_count + kTriangleBlockWidth - 1) / kTriangleBlockWidth;
+        for (std::uint32_t b = first; b < first + block_count; ++b) {
+          const int lane = kernel(all_blocks[b], leaf_ray_ptr, t_min);
+          if (lane >= 0)
+            hit = all_blocks[b].prim_index[lane];
+        }
+        return hit;
+      },
+      stats);
+}
+
+
+/**
+ * Occluded through a BVH over triangles, testing each leaf's blocks with kernel. True as
+ * soon as a triangle is hit with t in (interval.min, interval.max)
+ */
+template <class Tree>
+bool OccludedBlocks(
+    const Tree& bvh,
+    const TriangleBlocks& blocks,
+    const Common::Ray& ray,
+    const Common::Interval& interval,
+    const TriangleBlockFn kernel = BestTriangleBlockFn(),
+    TraversalStats* const stats = nullptr) {
+  const auto& all_blocks = blocks.GetBlocks();
+  return OccludedLeaves(
+      bvh,
+      ray,
+      interval,
+      [&](const BVHNode& node, const std::uint32_t node_idx, const Common::Ray& leaf_ray) {
+        const std::uint32_t first = blocks.FirstBlock(node_idx);
+        const std::uint32_t block_count = (node.prim_count + kTriangleBlockWidth - 1) / kTriangleBlockWidth;
+        for (std::uint32_t b = first; b < first + block_count; ++b) {
+          if (stats)
+            stats->prims_tested += all_blocks[b].count;
+          Common::Ray probe = leaf_ray;
+          probe.intersection_distance = interval.max;
+          if (kernel(all_blocks[b], &probe, interval.min) >= 0)
+            return true;
+        }
+        return false;
+      },
+      stats);
+}
+
+}
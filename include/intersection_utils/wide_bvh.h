@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "intersection_utils/bvh.h"
+
+namespace IntersectionUtils {
+/**
+ * Node of a Width wide BVH. Child bounds are stored SoA so one ray can be tested against
+ * every child with a few SIMD ops. Children are filled from slot 0, the first empty slot
+ * ends the node.
+ *
+ * @var child_or_prim_index Node index of an internal child, first primative index of a
+ *                          leaf child, or kEmptySlot
+ * @var prim_count Primatives in a leaf child, 0 for internal children
+ */
+template <std::uint32_t Width>
+struct alignas(Width * sizeof(float)) WideBVHNode {
+  static constexpr std::uint32_t kEmptySlot = std::numeric_limits<std::uint32_t>::max();
+
+  std::array<float, Width> min_x;
+  std::array<float, Width> min_y;
+  std::array<float, Width> min_z;
+  std::array<float, Width> max_x;
+  std::array<float, Width> max_y;
+  std::array<float, Width> max_z;
+  std::array<std::uint32_t, Width> child_or_prim_index;
+  std::array<std::uint32_t, Width> prim_count;
+
+  bool IsEmpty(const std::uint32_t slot) const { return child_or_prim_index[slot] == kEmptySlot; }
+  bool IsLeaf(const std::uint32_t slot) const { return prim_count[slot] > 0; }
+  glm::vec3 GetMinBounds(const std::uint32_t slot) const { return {min_x[slot], min_y[slot], min_z[slot]}; }
+  glm::vec3 GetMaxBounds(const std::uint32_t slot) const { return {max_x[slot], max_y[slot], max_z[slot]}; }
+
+  std::uint32_t GetChildCount() const {
+    std::uint32_t count = 0;
+    while (count < Width && !IsEmpty(count))
+      ++count;
+    return count;
+  }
+};
+
+/**
+ * Wide BVH collapsed from a binary one. Leaves keep the binary tree's primative ranges, so
+ * the primatives from the source BVH::GetPrims() are used as is.
+ *
+ * Each wide node starts from a binary node's two children and keeps opening the internal
+ * child with the largest surface area until it has Width children. Internal children of a
+ * node are allocated next to each other, after their parent.
+ */
+template <std::uint32_t Width>
+class WideBVH {
+ public:
+  static_assert(Width == 4 || Width == 8, "Wide BVHs are 4 or 8 wide");
+
+  explicit WideBVH(const std::vector<BVHNode>& binary_nodes) {
+    if (binary_nodes.empty())
+      return;
+
+    nodes_.emplace_back();
+    Collapse(binary_nodes, 0, 0);
+  }
+
+  const std::vector<WideBVHNode<Width>>& GetNodes() const { return nodes_; }
+
+ private:
+  void Collapse(
+      const std::vector<BVHNode>& binary_nodes,
+      const std::uint32_t binary_idx,
+      const std::uint32_t wide_idx) {
+    // binary nodes that become the children of this wide node
+    std::array<std::uint32_t, Width> slots;
+    std::uint32_t slot_count = 0;
+
+    const BVHNode& binary_node = binary_nodes[binary_idx];
+    if (binary_node.IsLeaf()) {
+      // only happens for the root
+      slots[slot_count++] = binary_idx;
+    } else {
+      slots[slot_count++] = binary_node.first_child;
+      slots[slot_count++] = binary_node.first_child + 1;
+    }
+
+    while (slot_count < Width) {
+      std::uint32_t best_slot = Width;
+      float best_area = -1.0f;
+      for (std::uint32_t i = 0; i < slot_count; ++i) {
+        const BVHNode& node = binary_nodes[slots[i]];
+        if (node.IsLeaf())
+          continue;
+
+        const float area = SurfaceArea(node.min_bounds, node.max_bounds);
+        if (area > best_area) {
+          best_area = area;
+          best_slot = i;
+        }
+      }
+
+      if (best_slot == Width)
+        break;
+
+      const std::uint32_t opened = slots[best_slot];
+      slots[best_slot] = binary_nodes[opened].first_child;
+      slots[slot_count++] = binary_nodes[opened].first_child + 1;
+    }
+
+    WideBVHNode<Width> node;
+    node.min_x.fill(std::numeric_limits<float>::max());
+    node.min_y.fill(std::numeric_limits<float>::max());
+    node.min_z.fill(std::numeric_limits<float>::max());
+    node.max_x.fill(std::numeric_limits<float>::lowest());
+    node.max_y.fill(std::numeric_limits<float>::lowest());
+    node.max_z.fill(std::numeric_limits<float>::lowest());
+    node.child_or_prim_index.fill(WideBVHNode<Width>::kEmptySlot);
+    node.prim_count.fill(0);
+
+    std::uint32_t next_child_idx = static_cast<std::uint32_t>(nodes_.size());
+    for (std::uint32_t i = 0; i < slot_count; ++i) {
+      const BVHNode& child = binary_nodes[slots[i]];
+      node.min_x[i] = child.min_bounds.x;
+      node.min_y[i] = child.min_bounds.y;
+      node.min_z[i] = child.min_bounds.z;
+      node.max_x[i] = child.max_bounds.x;
+      node.max_y[i] = child.max_bounds.y;
+      node.max_z[i] = child.max_bounds.z;
+      if (child.IsLeaf()) {
+        node.child_or_prim_index[i] = child.first_prim_index;
+        node.prim_count[i] = child.prim_count;
+      } else {
+        node.child_or_prim_index[i] = next_child_idx++;
+      }
+    }
+
+    nodes_.resize(next_child_idx);
+    nodes_[wide_idx] = node;
+
+    for (std::uint32_t i = 0; i < slot_count; ++i) {
+      if (!node.IsLeaf(i))
+        Collapse(binary_nodes, slots[i], node.child_or_prim_index[i]);
+    }
+  }
+
+  std::vector<WideBVHNode<Width>> nodes_;
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+
+}
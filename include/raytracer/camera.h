@@ -19,6 +19,9 @@ namespace RayTracer
         uint width = 100;
         uint samplesPerPixel = 10;
         uint maxDepth = 10;
+        // Bounces every path gets before Russian roulette can end it, maxDepth still caps
+        // the rest. At maxDepth or above roulette is off
+        uint minDepth = 3;
         float vFov = 90;
         Point3 origin = Point3(0, 0, 0);
         Point3 lookAt = Point3(0, 0, -1);
@@ -27,6 +30,15 @@ namespace RayTracer
         float focusDist = 10;
     };
 
+    // Light reflected at a hit, scaling whatever comes back along the bounce. Shared by
+    // every integrator so they shade the same
+    Color ShadeHit(const Common::Ray &r, const HitRecord &rec, const PointLight &light, bool lit);
+    // Background seen by rays that leave the scene
+    Color SkyColor(const Common::Ray &r);
+    // Russian roulette on a path's throughput with u uniform in [0, 1). Dim paths are
+    // likelier to end, survivors are scaled up by the odds so the estimate stays unbiased
+    bool SurvivesRoulette(Color &throughput, float u);
+
     class Camera
     {
     public:
@@ -37,7 +49,10 @@ namespace RayTracer
 
         void Initialize(bool showModel);
         Common::Ray GetRay(uint i, uint j);
-        Color RayColor(const Common::Ray &r, uint depth, World &world, const PointLight &light) const;
+        // Path tracer following one path for up to depth bounces, with Russian roulette past
+        // the settings' minDepth. With shadowRays the light's diffuse and specular terms are
+        // only added where nothing blocks the way to it
+        Color RayColor(const Common::Ray &r, uint depth, World &world, const PointLight &light, bool shadowRays = false) const;
 
         inline uint getWidth() const { return width; }
         inline uint getHeight() const { return height; }
@@ -67,6 +82,8 @@ namespace RayTracer
 
     private:
         void UpdateCameraVectors();
+        // Where GetRay aims for each pixel, from the position, basis and settings
+        void UpdateViewport();
 
         CameraSettings cameraSettings;
         uint width;
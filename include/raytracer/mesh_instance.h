@@ -0,0 +1,52 @@
+#pragma once
+
+#include <memory>
+
+#include <glm/glm.hpp>
+
+#include "asset_utils/types.h"
+#include "common/types.h"
+#include "raytracer_types.h"
+
+namespace RayTracer {
+
+/**
+ * A loaded model placed in the world, traced on the CPU straight through the Model's BVH
+ * and vertex_data_buffer, the same flattened data the shaders read. Instances can share
+ * one Model and each have their own transform, like AddModelInstance on the GPU side.
+ * Triangles are tested with the SIMD kernels on the Model's triangle_blocks.
+ *
+ * Needs no GL context, load the model with load_textures off on machines without a GPU
+ */
+class MeshInstance : public Hittable {
+public:
+	MeshInstance(std::shared_ptr<const AssetUtils::Model> model, const glm::mat4& transform = glm::mat4(1.0f));
+
+	bool Hit(const Common::Ray& r, const Common::Interval& interval, HitRecord& rec) override;
+	bool Occludes(const Common::Ray& r, const Common::Interval& interval) override;
+
+	// Model space to world space
+	void SetTransform(const glm::mat4& transform);
+	const glm::mat4& getTransform() const { return modelToWorld; }
+	const AssetUtils::Model& getModel() const { return *model; }
+
+private:
+	// Ray in model space. The transform is affine and the direction isn't renormalized,
+	// so distances along it are the same as in world space
+	Common::Ray ToModelSpace(const Common::Ray& r) const;
+	// True if r misses the world box before tMax, false if it hits or the box is stale
+	bool MissesWorldBounds(const Common::Ray& r, float tMax) const;
+
+	std::shared_ptr<const AssetUtils::Model> model;
+	glm::mat4 modelToWorld;
+	glm::mat4 worldToModel;
+	glm::mat3 normalToWorld;
+	// World space box around the model, rays that miss it skip the transform. Made from
+	// the model's root bounds as they were at SetTransform, kept to tell when it's stale
+	glm::vec3 worldMin;
+	glm::vec3 worldMax;
+	glm::vec3 boundedMin;
+	glm::vec3 boundedMax;
+};
+
+}
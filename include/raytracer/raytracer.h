@@ -1,14 +1,21 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "common/thread_pool.h"
 #include "common/types.h"
 #include "common/utils.h"
 #include "graphics/texture.h"
 #include "raytracer_types.h"
 #include "raytracer/camera.h"
 #include "raytracer/light.h"
+#include "raytracer/render_settings.h"
+#include "raytracer/wavefront.h"
 
 namespace RayTracer {
 
@@ -16,26 +23,81 @@ namespace RayTracer {
 
 class RayTracer {
 public:
-	RayTracer(CameraSettings settings, std::string outFile, bool writeTexture)
+	RayTracer(CameraSettings settings, std::string outFile, bool writeTexture, RenderSettings renderSettings = RenderSettings())
 		: outFileName(outFile)
 		, camera(settings)
 		, world()
 		, texture()
 		, writeTexture(writeTexture)
 		, light(glm::vec3(-1, -1, -1), glm::vec3(1, 1, 1), 1.0f)
+		, renderSettings(renderSettings)
 	{}
 
 	void Init(World& w);
+	// Renders every sample of every pixel, then writes the texture or output file
 	void Render();
 
+	// Progressive rendering adds passes of renderSettings.passSamples samples per pixel into
+	// an accumulation buffer, and after each one the framebuffer (and texture, when writing
+	// one) show their average so far. Passes that write the texture have to run on the
+	// thread with the GL context
+
+	// Starts the next progressive render from no samples
+	void ResetAccumulation();
+	// Renders and publishes one pass. False, without rendering, once samplesPerPixel are
+	// done, the time budget since the first pass is spent, or Cancel was called
+	bool RenderPass();
+	// Renders passes until one of the above, then writes the output file when not
+	// writing a texture
+	void RenderProgressive();
+	// Stops the render in progress as soon as the current tile or wave is done, or the
+	// next one to start if none is, safe to call from any thread. Lasts until a render
+	// stops because of it or Render finishes anyway. A pass cut short isn't published, so
+	// the framebuffer keeps the last whole one
+	void Cancel() { cancelRequested = true; }
+
+	void SetProgressCallback(RenderProgressCallback callback) { progressCallback = std::move(callback); }
+	void SetFrameCallback(FrameCallback callback) { frameCallback = std::move(callback); }
+
 	Graphics::Texture& getTexture() { return texture; }
+	// Linear colors of the last render, row by row
+	const std::vector<Color>& getFramebuffer() const { return framebuffer; }
+	// Samples per pixel in the framebuffer so far
+	uint getSamplesDone() const { return samplesDone; }
 
 private:
+	// Adds samples [firstSample, firstSample + sampleCount) of every pixel into the
+	// accumulation buffer with the chosen integrator. False if cancelled part way
+	bool RenderSamples(uint firstSample, uint sampleCount);
+	bool RenderTiles(uint firstSample, uint sampleCount);
+	// Adds samples of pixels [x0, x1) x [y0, y1) into the accumulation buffer
+	void RenderTile(uint x0, uint y0, uint x1, uint y1, uint firstSample, uint sampleCount);
+	// Averages the accumulation buffer into the framebuffer and texture
+	void Publish();
+	void WriteOutputFile() const;
+
 	std::string outFileName;
 	Camera camera;
 	World world;
 	Graphics::Texture texture;
 	bool writeTexture;
 	PointLight light;
+
+	RenderSettings renderSettings;
+	RenderProgressCallback progressCallback;
+	// Render threads besides the calling one, null when rendering on one thread
+	std::unique_ptr<Common::ThreadPool> pool;
+	WavefrontIntegrator wavefront;
+	// Kept between renders so they don't reallocate
+	std::vector<Color> accumulation;
+	std::vector<Color> framebuffer;
+	std::vector<Graphics::Color8> texData;
+
+	FrameCallback frameCallback;
+	uint samplesDone = 0;
+	std::chrono::steady_clock::time_point progressiveStart;
+	// How long the last pass took, to tell whether another fits in the time budget
+	std::chrono::steady_clock::duration lastPassTime{};
+	std::atomic<bool> cancelRequested{false};
 };
 }
\ No newline at end of file
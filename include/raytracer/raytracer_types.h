@@ -50,6 +50,13 @@ class Hittable {
 public:
 	virtual ~Hittable() = default;
 	virtual bool Hit(const Common::Ray& r, const Common::Interval& interval, HitRecord& rec) = 0;
+
+	// Any hit test for shadow rays, only whether something is hit inside interval.
+	// Defaults to Hit, shapes with a cheaper test can override it
+	virtual bool Occludes(const Common::Ray& r, const Common::Interval& interval) {
+		HitRecord rec;
+		return Hit(r, interval, rec);
+	}
 };
 
 class Sphere : public Hittable {
@@ -93,6 +100,21 @@ public:
 
 		return true;
 	}
+
+	bool Occludes(const Common::Ray& r, const Common::Interval& interval) override {
+		glm::vec3 oc = center - r.origin;
+		auto a = glm::length2(r.direction);
+		auto h = glm::dot(r.direction, oc);
+		auto c = glm::length2(oc) - (radius * radius);
+		auto discriminant = h * h - a * c;
+
+		if (discriminant < 0) {
+			return false;
+		}
+
+		auto sqrtd = std::sqrt(discriminant);
+		return interval.surrounds((h - sqrtd) / a) || interval.surrounds((h + sqrtd) / a);
+	}
 };
 
 //TODO move Triangle here too
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "raytracer_types.h"
+
+namespace RayTracer {
+
+enum class Integrator
+{
+	// Camera::RayColor, one path at a time depth first, in tiles
+	Recursive,
+	// WavefrontIntegrator, every path of a wave one bounce at a time
+	Wavefront,
+};
+
+struct RenderSettings
+{
+	Integrator integrator = Integrator::Recursive;
+	// Width and height in pixels of the square tiles threads take work in
+	uint tileSize = 32;
+	// Paths in flight at once with the wavefront integrator, bounds its queue memory
+	uint wavefrontSize = 1 << 18;
+	// 0 for one per hardware thread
+	uint threadCount = 0;
+	// Every sample of every pixel draws from its own stream of this seed, so the same seed
+	// gives the same image whatever the thread count, tile size or integrator
+	std::uint64_t seed = 0;
+	// Test whether the light is blocked before adding its diffuse and specular terms
+	bool shadowRays = false;
+	// Samples per pixel each pass of a progressive render adds
+	uint passSamples = 1;
+	// Seconds a progressive render may take before it stops short of samplesPerPixel, 0
+	// for no limit. A pass that wouldn't finish in time isn't started
+	float timeBudget = 0.0f;
+};
+
+// Called as work finishes with how much is done out of total: tiles for the recursive
+// integrator, waves for the wavefront one. Calls are serialized, but come from the
+// render threads
+using RenderProgressCallback = std::function<void(uint done, uint total)>;
+
+// Called on the rendering thread after each pass of a progressive render, once the
+// framebuffer (and texture) show the average of samplesDone samples per pixel
+using FrameCallback = std::function<void(uint samplesDone, uint samplesPerPixel)>;
+
+// Sample streams are numbered by pixel, then sample
+inline std::uint64_t SampleStream(std::size_t pixel, uint sample, uint samplesPerPixel)
+{
+	return std::uint64_t(pixel) * samplesPerPixel + sample;
+}
+
+}
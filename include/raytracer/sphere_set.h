@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "common/types.h"
+#include "raytracer_types.h"
+
+namespace RayTracer {
+
+/**
+ * Spheres stored one array per component, tested against a ray several at a time with
+ * SIMD (8 per instruction with AVX2, 4 with SSE2, whichever the CPU has) and without a
+ * virtual call per sphere. Meant for scenes with many plain spheres, other shapes still
+ * go through Hittable
+ */
+class SphereSet {
+public:
+	// Spheres are tested in blocks of this many, the arrays are padded to a whole block
+	static constexpr std::size_t kBlockSize = 8;
+
+	void Add(const Point3& center, float radius);
+	void Clear();
+	std::size_t Size() const { return count; }
+
+	// Closest sphere hit inside interval, fills rec the same way Sphere::Hit does
+	bool Hit(const Common::Ray& r, const Common::Interval& interval, HitRecord& rec) const;
+	// True as soon as any sphere is hit inside interval
+	bool Occludes(const Common::Ray& r, const Common::Interval& interval) const;
+
+private:
+	// Padding has NaN radii, which fail every comparison and so never hit
+	std::vector<float> centerX;
+	std::vector<float> centerY;
+	std::vector<float> centerZ;
+	std::vector<float> radius;
+	std::size_t count = 0;
+};
+
+}
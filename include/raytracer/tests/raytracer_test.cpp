@@ -0,0 +1,241 @@
+#include <gtest/gtest.h>
+#include "asset_utils/model_loader.h"
+#include "raytracer/mesh_instance.h"
+#include "raytracer/raytracer.h"
+#include "raytracer/raytracer_types.h"
+#include "raytracer/sphere_set.h"
+
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/types.h"
+
+namespace RayTracer {
+namespace {
+
+// Random spheres, with a count that leaves the last block part padding
+struct SphereScene {
+  SphereSet set;
+  std::vector<Sphere> spheres;
+
+  explicit SphereScene(const int count) {
+    std::mt19937 gen(11);
+    std::uniform_real_distribution<float> position(-20.0f, 20.0f);
+    std::uniform_real_distribution<float> radius(0.1f, 2.0f);
+    for (int i = 0; i < count; ++i) {
+      const glm::vec3 center(position(gen), position(gen), position(gen));
+      const float r = radius(gen);
+      set.Add(center, r);
+      spheres.emplace_back(center, r);
+    }
+  }
+};
+
+std::vector<Common::Ray> RandomRays(const int count) {
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<float> dist(-20.0f, 20.0f);
+  std::vector<Common::Ray> rays;
+  for (int i = 0; i < count; ++i)
+    rays.emplace_back(glm::vec3(dist(gen), dist(gen), dist(gen)), glm::normalize(glm::vec3(dist(gen), dist(gen), dist(gen))));
+  return rays;
+}
+
+// Grid of size x size quads in the z = 0 plane, two triangles each
+std::shared_ptr<AssetUtils::Model> MakeGridModel(const std::uint32_t size) {
+  std::vector<AssetUtils::GPU::PackedVertexData> verts;
+  for (std::uint32_t y = 0; y <= size; ++y) {
+    for (std::uint32_t x = 0; x <= size; ++x)
+      verts.emplace_back(glm::vec3(float(x), float(y), 0.0f), glm::vec2(0.0f));
+  }
+
+  std::vector<AssetUtils::GPU::Triangle> tris;
+  for (std::uint32_t y = 0; y < size; ++y) {
+    for (std::uint32_t x = 0; x < size; ++x) {
+      const std::uint32_t corner = y * (size + 1) + x;
+      tris.push_back({{corner, corner + 1, corner + size + 2}, 0});
+      tris.push_back({{corner, corner + size + 2, corner + size + 1}, 0});
+    }
+  }
+
+  const auto triangle_bounds = [&verts](const AssetUtils::GPU::Triangle& tri) {
+    glm::vec3 lo = verts[tri.vertex_idxs[0]].vertex;
+    glm::vec3 hi = lo;
+    for (const std::uint32_t idx : tri.vertex_idxs) {
+      lo = glm::min(lo, verts[idx].vertex);
+      hi = glm::max(hi, verts[idx].vertex);
+    }
+    return std::make_pair(lo, hi);
+  };
+  const auto triangle_center = [&](const AssetUtils::GPU::Triangle& tri) {
+    const auto [lo, hi] = triangle_bounds(tri);
+    return (lo + hi) * 0.5f;
+  };
+  IntersectionUtils::BVH<AssetUtils::GPU::Triangle> bvh(std::move(tris), triangle_center, triangle_bounds);
+  return std::make_shared<AssetUtils::Model>(std::move(bvh), std::vector<AssetUtils::Material>(), std::move(verts));
+}
+
+CameraSettings SmallCamera() {
+  CameraSettings settings;
+  settings.aspect = 1.5f;
+  settings.width = 48;
+  settings.samplesPerPixel = 4;
+  settings.maxDepth = 5;
+  return settings;
+}
+
+}  // namespace
+
+TEST(RayTracerTest, CancelBeforeRenderStopsIt) {
+  World world;
+  world.AddSphere(Point3(0.0f, 0.0f, -1.0f), 0.5f);
+  const std::string out_file = ::testing::TempDir() + "raytracer_cancel_test.ppm";
+
+  for (const Integrator integrator : {Integrator::Recursive, Integrator::Wavefront}) {
+    RenderSettings render_settings;
+    render_settings.integrator = integrator;
+    render_settings.threadCount = 2;
+    render_settings.passSamples = 1;
+    RayTracer tracer(SmallCamera(), out_file, false, render_settings);
+    tracer.Init(world);
+
+    // a cancel that comes in before the render starts still stops it, and only that one
+    tracer.Cancel();
+    tracer.RenderProgressive();
+    EXPECT_EQ(tracer.getSamplesDone(), 0u);
+    tracer.RenderProgressive();
+    EXPECT_EQ(tracer.getSamplesDone(), 4u);
+
+    tracer.Cancel();
+    tracer.Render();
+    EXPECT_EQ(tracer.getSamplesDone(), 0u);
+    tracer.Render();
+    EXPECT_EQ(tracer.getSamplesDone(), 4u);
+  }
+  std::remove(out_file.c_str());
+}
+
+TEST(RayTracerTest, WavefrontMatchesRecursive) {
+  World world;
+  world.AddSphere(Point3(0.0f, 0.0f, -1.0f), 0.5f);
+  world.AddSphere(Point3(0.0f, -100.5f, -1.0f), 100.0f);
+  world.add(std::make_shared<Sphere>(Point3(0.8f, 0.1f, -1.5f), 0.3f));
+  const std::string out_file = ::testing::TempDir() + "raytracer_integrator_test.ppm";
+
+  // roulette on past the first bounce, so both also have to draw it the same
+  CameraSettings camera_settings = SmallCamera();
+  camera_settings.minDepth = 1;
+  std::vector<Color> framebuffers[2];
+  for (const Integrator integrator : {Integrator::Recursive, Integrator::Wavefront}) {
+    RenderSettings render_settings;
+    render_settings.integrator = integrator;
+    render_settings.threadCount = 2;
+    render_settings.shadowRays = true;
+    // smaller than the image, so it takes several waves
+    render_settings.wavefrontSize = 1000;
+    RayTracer tracer(camera_settings, out_file, false, render_settings);
+    tracer.Init(world);
+    tracer.Render();
+    ASSERT_EQ(tracer.getSamplesDone(), camera_settings.samplesPerPixel);
+    framebuffers[integrator == Integrator::Wavefront] = tracer.getFramebuffer();
+  }
+  std::remove(out_file.c_str());
+
+  const std::vector<Color>& recursive = framebuffers[0];
+  const std::vector<Color>& wavefront = framebuffers[1];
+  ASSERT_EQ(recursive.size(), wavefront.size());
+  ASSERT_FALSE(recursive.empty());
+  for (std::size_t i = 0; i < recursive.size(); ++i)
+    ASSERT_NEAR(glm::length(recursive[i] - wavefront[i]), 0.0f, 1e-4f) << "pixel " << i;
+
+  // not all sky, the spheres are in view
+  int differing = 0;
+  for (const Color& pixel : recursive)
+    differing += glm::length(pixel - recursive[0]) > 0.05f;
+  EXPECT_GT(differing, int(recursive.size()) / 10);
+}
+
+TEST(MeshInstanceTest, FollowsRefitModel) {
+  const std::shared_ptr<AssetUtils::Model> model = MakeGridModel(8);
+  MeshInstance mesh(model);
+  const Common::Ray ray(glm::vec3(3.3f, 4.6f, 5.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+  const Common::Interval interval(0.001f, Common::infinity);
+
+  HitRecord rec;
+  ASSERT_TRUE(mesh.Hit(ray, interval, rec));
+  EXPECT_NEAR(rec.t, 5.0f, 1e-4f);
+
+  // slide the grid off the ray and back under it lower down, past where the old bounds
+  // were. The instance has to see it through the refit
+  for (auto& vertex : model->vertex_data_buffer)
+    vertex.vertex += glm::vec3(10.0f, 0.0f, -2.0f);
+  AssetUtils::RefitModel(model.get());
+  EXPECT_FALSE(mesh.Hit(ray, interval, rec));
+  EXPECT_FALSE(mesh.Occludes(ray, interval));
+
+  const Common::Ray moved_ray(glm::vec3(13.3f, 4.6f, 5.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+  ASSERT_TRUE(mesh.Hit(moved_ray, interval, rec));
+  EXPECT_NEAR(rec.t, 7.0f, 1e-4f);
+  EXPECT_NEAR(glm::length(rec.normal - glm::vec3(0.0f, 0.0f, 1.0f)), 0.0f, 1e-4f);
+  EXPECT_FALSE(mesh.Occludes(moved_ray, Common::Interval(0.001f, 6.0f)));
+  EXPECT_TRUE(mesh.Occludes(moved_ray, Common::Interval(0.001f, 8.0f)));
+}
+
+TEST(SphereSetTest, HitMatchesSphere) {
+  SphereScene scene(1001);
+  ASSERT_EQ(scene.set.Size(), 1001u);
+  const Common::Interval interval(0.001f, Common::infinity);
+
+  int hits = 0;
+  for (const Common::Ray& ray : RandomRays(5000)) {
+    HitRecord expected;
+    bool expected_hit = false;
+    Common::Interval closest = interval;
+    for (Sphere& sphere : scene.spheres) {
+      if (sphere.Hit(ray, closest, expected)) {
+        expected_hit = true;
+        closest.max = expected.t;
+      }
+    }
+
+    HitRecord rec;
+    ASSERT_EQ(scene.set.Hit(ray, interval, rec), expected_hit);
+    if (!expected_hit)
+      continue;
+
+    ++hits;
+    EXPECT_NEAR(rec.t, expected.t, 1e-4f);
+    EXPECT_NEAR(glm::length(rec.normal - expected.normal), 0.0f, 1e-3f);
+    EXPECT_EQ(rec.frontFace, expected.frontFace);
+  }
+  EXPECT_GT(hits, 0);
+}
+
+TEST(SphereSetTest, OccludesMatchesSphere) {
+  SphereScene scene(1001);
+  const Common::Interval interval(0.001f, 10.0f);
+
+  int occluded = 0;
+  for (const Common::Ray& ray : RandomRays(5000)) {
+    bool expected = false;
+    HitRecord rec;
+    for (Sphere& sphere : scene.spheres)
+      expected = expected || sphere.Hit(ray, interval, rec);
+
+    ASSERT_EQ(scene.set.Occludes(ray, interval), expected);
+    occluded += expected;
+  }
+  EXPECT_GT(occluded, 0);
+}
+
+TEST(SphereSetTest, EmptySetMissesEverything) {
+  SphereSet set;
+  HitRecord rec;
+  const Common::Ray ray(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+  EXPECT_FALSE(set.Hit(ray, Common::Interval(0.001f, Common::infinity), rec));
+  EXPECT_FALSE(set.Occludes(ray, Common::Interval(0.001f, Common::infinity)));
+}
+
+}  // namespace RayTracer
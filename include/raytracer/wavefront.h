@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "common/random.h"
+#include "common/thread_pool.h"
+#include "common/types.h"
+#include "raytracer_types.h"
+#include "raytracer/camera.h"
+#include "raytracer/light.h"
+#include "raytracer/render_settings.h"
+#include "raytracer/world.h"
+
+namespace RayTracer {
+
+/**
+ * Path tracer that moves a whole wave of paths forward one bounce at a time instead of
+ * following each path to the end like Camera::RayColor. Each bounce runs in stages over
+ * queues laid out one array per field:
+ *
+ *   generate  camera rays for every sample of the wave's pixels
+ *   extend    closest hit of every ray
+ *   shadow    whether the light is blocked at every hit, with shadowRays
+ *   shade     light at each hit, ends paths that missed or lose Russian roulette and
+ *             picks the next bounce
+ *
+ * after which the paths still going are compacted into the next queue, grouped by the
+ * octant their direction points into so rays close in the queue go the same way.
+ *
+ * Draws the same random numbers per sample as Camera::RayColor, so renders the same
+ * image up to float rounding. Waves are split across the pool
+ */
+class WavefrontIntegrator {
+public:
+	// Adds samples [firstSample, firstSample + sampleCount) of every pixel of the camera's
+	// image into accumulation, which has to hold width * height colors. pool can be null
+	// to render on the calling thread. Returns false if cancel was set before the last
+	// wave, with only some pixels' samples added
+	bool Render(
+		Camera& camera,
+		World& world,
+		const PointLight& light,
+		const RenderSettings& settings,
+		uint firstSample,
+		uint sampleCount,
+		Common::ThreadPool* pool,
+		std::vector<Color>& accumulation,
+		const std::atomic<bool>& cancel,
+		const RenderProgressCallback& progress);
+
+private:
+	struct RayQueue
+	{
+		std::vector<float> originX, originY, originZ;
+		std::vector<float> dirX, dirY, dirZ;
+		std::vector<float> throughputR, throughputG, throughputB;
+		// Which path of the wave each ray carries
+		std::vector<std::uint32_t> path;
+		std::vector<Common::Pcg32> rng;
+
+		void Resize(std::size_t size);
+		std::size_t Size() const { return path.size(); }
+		Common::Ray GetRay(std::size_t i) const;
+	};
+
+	struct HitQueue
+	{
+		std::vector<float> pX, pY, pZ;
+		std::vector<float> normalX, normalY, normalZ;
+		std::vector<std::uint8_t> hit;
+		std::vector<std::uint8_t> occluded;
+
+		void Resize(std::size_t size);
+		HitRecord GetHitRecord(std::size_t i) const;
+	};
+
+	void Generate(Camera& camera, const RenderSettings& settings, std::size_t firstPixel, std::size_t pixels, uint firstSample, uint sampleCount, Common::ThreadPool* pool);
+	void Extend(World& world, Common::ThreadPool* pool);
+	void Shadow(const World& world, const PointLight& light, Common::ThreadPool* pool);
+	void Shade(const PointLight& light, bool shadowRays, uint bounce, uint minDepth, uint maxDepth, Common::ThreadPool* pool);
+	void Compact();
+
+	// Kept between renders so waves don't reallocate
+	RayQueue rays;
+	RayQueue nextRays;
+	HitQueue hits;
+	// Set by Shade for rays that go on to another bounce
+	std::vector<std::uint8_t> alive;
+	// What each path of the wave ended up carrying back to the camera
+	std::vector<Color> pathRadiance;
+};
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "raytracer_types.h"
+#include "sphere_set.h"
 #include "common/types.h"
 
 #include <vector>
@@ -12,12 +13,18 @@ class World {
 public:
 	World() = default;
 
+	// For shapes without a specialized store, tested one virtual call at a time
 	void add(std::shared_ptr<Hittable> hittable) { objects.push_back(hittable); }
-	void clear() { objects.clear(); }
+	// Plain spheres, tested in SIMD blocks. Prefer this over add for spheres
+	void AddSphere(const Point3& center, float radius) { spheres.Add(center, radius); }
+	void clear() { objects.clear(); spheres.Clear(); }
 
 	bool CheckHit(const Common::Ray& r, const Common::Interval& interval, HitRecord& hit);
+	// For shadow rays, true as soon as anything is hit inside interval
+	bool Occluded(const Common::Ray& r, const Common::Interval& interval) const;
 
 private:
+	SphereSet spheres;
 	std::vector<std::shared_ptr<Hittable>> objects;
 };
 
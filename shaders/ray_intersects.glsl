@@ -6,6 +6,13 @@
 // #endif
 
 uniform uint bvh_count;
+// instances in the TLAS, 0 means tlas_nodes only holds a placeholder root
+uniform uint tlas_instance_count;
+// which node buffer bvhs[i].first_index points into, see AssetUtils::BVHNodeLayout
+#define BVH_LAYOUT_BINARY 0
+#define BVH_LAYOUT_WIDE8 1
+#define BVH_LAYOUT_COMPRESSED_WIDE8 2
+uniform uint bvh_node_layout;
 layout(std430, binding = FIRST_BIND_POINT + 0) buffer BVHsBuffer {
   BVH bvhs[];
 };
@@ -34,6 +41,26 @@ layout(std430, binding = FIRST_BIND_POINT + 4) buffer VertexBuffer {
   VertexData vertices[];
 };
 
+// only bound when bvh_node_layout is BVH_LAYOUT_WIDE8
+layout(std430, binding = FIRST_BIND_POINT + 7) buffer WideBVHNodeBuffer {
+  WideBVHNode wide_nodes[];
+};
+
+// only bound when bvh_node_layout is BVH_LAYOUT_COMPRESSED_WIDE8
+layout(std430, binding = FIRST_BIND_POINT + 8) buffer CompressedBVHNodeBuffer {
+  CompressedBVHNode compressed_nodes[];
+};
+
+// top level BVH over the world space boxes of the models, leaves point into tlas_instances
+layout(std430, binding = FIRST_BIND_POINT + 9) buffer TLASNodeBuffer {
+  BVHNode tlas_nodes[];
+};
+
+// bvhs[] index of each TLAS leaf entry
+layout(std430, binding = FIRST_BIND_POINT + 10) buffer TLASInstanceBuffer {
+  uint tlas_instances[];
+};
+
 // #ifdef COMPUTE_TEST
 // layout(std430, binding = FIRST_BIND_POINT + 5) buffer RayBuffer {
 //   Ray rays[];
@@ -95,6 +122,31 @@ bool IntersectsTriangle(
   return false;
 }
 
+// Tests prim_count triangles from first_prim. Returns index of closest triangle hit,
+// or sentinal if none were closer than intersection_distance (uint(-1))
+uint IntersectsLeaf(
+    uint first_prim,
+    uint prim_count,
+    vec3 ray_origin,
+    vec3 ray_dir,
+    inout float intersection_distance,
+    inout vec3 tri_norm) {
+  uint out_tri_indx = -1;
+  for (uint i = 0; i < prim_count; ++i) {
+    Triangle tri = triangles[first_prim + i];
+
+    vec3 v0 = vertices[tri.v0_idx].vertex;
+    vec3 v1 = vertices[tri.v1_idx].vertex;
+    vec3 v2 = vertices[tri.v2_idx].vertex;
+
+    if (IntersectsTriangle(ray_origin, ray_dir, v0, v1, v2, intersection_distance, tri_norm)) {
+      out_tri_indx = first_prim + i;
+    }
+  }
+
+  return out_tri_indx;
+}
+
 // Returns index of triangle hit, or sentinal if miss (uint(-1))
 uint Intersects(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, inout float intersection_distance, inout vec3 tri_norm) {
   uint stack[64];
@@ -110,17 +162,10 @@ uint Intersects(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, inout float
     if (box_inters_dist < intersection_distance && !isinf(box_inters_dist)) {
       if (node.prim_count > 0) {
         // leaf node
-        for (uint i = 0; i < node.prim_count; ++i) {
-          Triangle tri = triangles[node.first_child_or_prim_index + i];
-
-          vec3 v0 = vertices[tri.v0_idx].vertex;
-          vec3 v1 = vertices[tri.v1_idx].vertex;
-          vec3 v2 = vertices[tri.v2_idx].vertex;
-
-          if (IntersectsTriangle(ray_origin, ray_dir, v0, v1, v2, intersection_distance, tri_norm)) {
-            out_tri_indx = node.first_child_or_prim_index + i;
-          }
-        }
+        uint hit = IntersectsLeaf(
+            node.first_child_or_prim_index, node.prim_count, ray_origin, ray_dir, intersection_distance, tri_norm);
+        if (hit != uint(-1))
+          out_tri_indx = hit;
       } else {
         // internal node
         stack[stack_idx++] = node.first_child_or_prim_index;
@@ -132,6 +177,315 @@ uint Intersects(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, inout float
   return out_tri_indx;
 }
 
+// Intersects for the wide layout. Child boxes are tested from the parent, so leaves are
+// intersected right away and only internal children go on the stack
+uint IntersectsWide(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, inout float intersection_distance, inout vec3 tri_norm) {
+  uint stack[64];
+  int stack_idx = 0;
+  stack[stack_idx++] = bvh_start_index;
+  uint out_tri_indx = -1;
+
+  while (stack_idx > 0) {
+    uint node_idx = stack[--stack_idx];
+
+    for (uint i = 0; i < WIDE_BVH_WIDTH; ++i) {
+      uint child = wide_nodes[node_idx].child_or_prim_index[i];
+      if (child == WIDE_BVH_EMPTY_SLOT)
+        break;
+
+      vec3 min_bounds = vec3(wide_nodes[node_idx].min_x[i], wide_nodes[node_idx].min_y[i], wide_nodes[node_idx].min_z[i]);
+      vec3 max_bounds = vec3(wide_nodes[node_idx].max_x[i], wide_nodes[node_idx].max_y[i], wide_nodes[node_idx].max_z[i]);
+      float box_inters_dist = IntersectsBox(ray_origin, ray_dir, min_bounds, max_bounds);
+      if (box_inters_dist >= intersection_distance || isinf(box_inters_dist))
+        continue;
+
+      uint prim_count = wide_nodes[node_idx].prim_count[i];
+      if (prim_count > 0) {
+        uint hit = IntersectsLeaf(child, prim_count, ray_origin, ray_dir, intersection_distance, tri_norm);
+        if (hit != uint(-1))
+          out_tri_indx = hit;
+      } else {
+        stack[stack_idx++] = child;
+      }
+    }
+  }
+
+  return out_tri_indx;
+}
+
+// 8 bit quantized plane of a compressed node, plane 0 - 2 is min x, y, z and 3 - 5 max x, y, z
+float DecodeCompressedPlane(uint node_idx, uint plane, uint slot) {
+  uint packed = compressed_nodes[node_idx].quantized_bounds[plane * 2 + slot / 4];
+  return float((packed >> ((slot % 4) * 8)) & 0xFFu);
+}
+
+// Child box of a compressed node, origin and scale are the node's decoded header
+void DecodeCompressedBox(uint node_idx, uint slot, vec3 origin, vec3 scale, out vec3 min_bounds, out vec3 max_bounds) {
+  vec3 q_min = vec3(
+      DecodeCompressedPlane(node_idx, 0, slot),
+      DecodeCompressedPlane(node_idx, 1, slot),
+      DecodeCompressedPlane(node_idx, 2, slot));
+  vec3 q_max = vec3(
+      DecodeCompressedPlane(node_idx, 3, slot),
+      DecodeCompressedPlane(node_idx, 4, slot),
+      DecodeCompressedPlane(node_idx, 5, slot));
+  min_bounds = origin + q_min * scale;
+  max_bounds = origin + q_max * scale;
+}
+
+vec3 DecodeCompressedScale(uint exponents) {
+  return vec3(
+      uintBitsToFloat((exponents & 0xFFu) << 23),
+      uintBitsToFloat(((exponents >> 8) & 0xFFu) << 23),
+      uintBitsToFloat(((exponents >> 16) & 0xFFu) << 23));
+}
+
+// IntersectsWide for the compressed layout, child boxes are decoded as they're tested
+uint IntersectsCompressed(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, inout float intersection_distance, inout vec3 tri_norm) {
+  uint stack[64];
+  int stack_idx = 0;
+  stack[stack_idx++] = bvh_start_index;
+  uint out_tri_indx = -1;
+
+  while (stack_idx > 0) {
+    uint node_idx = stack[--stack_idx];
+
+    vec3 origin = compressed_nodes[node_idx].origin;
+    vec3 scale = DecodeCompressedScale(compressed_nodes[node_idx].exponents);
+
+    for (uint i = 0; i < WIDE_BVH_WIDTH; ++i) {
+      uint child = compressed_nodes[node_idx].child_or_prim_index[i];
+      if (child == WIDE_BVH_EMPTY_SLOT)
+        break;
+
+      vec3 min_bounds;
+      vec3 max_bounds;
+      DecodeCompressedBox(node_idx, i, origin, scale, min_bounds, max_bounds);
+      float box_inters_dist = IntersectsBox(ray_origin, ray_dir, min_bounds, max_bounds);
+      if (box_inters_dist >= intersection_distance || isinf(box_inters_dist))
+        continue;
+
+      uint prim_count = compressed_nodes[node_idx].prim_count[i];
+      if (prim_count > 0) {
+        uint hit = IntersectsLeaf(child, prim_count, ray_origin, ray_dir, intersection_distance, tri_norm);
+        if (hit != uint(-1))
+          out_tri_indx = hit;
+      } else {
+        stack[stack_idx++] = child;
+      }
+    }
+  }
+
+  return out_tri_indx;
+}
+
+// Traverses whichever node layout was uploaded
+uint IntersectsBVH(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, inout float intersection_distance, inout vec3 tri_norm) {
+  if (bvh_node_layout == BVH_LAYOUT_WIDE8)
+    return IntersectsWide(bvh_start_index, ray_origin, ray_dir, intersection_distance, tri_norm);
+  if (bvh_node_layout == BVH_LAYOUT_COMPRESSED_WIDE8)
+    return IntersectsCompressed(bvh_start_index, ray_origin, ray_dir, intersection_distance, tri_norm);
+
+  return Intersects(bvh_start_index, ray_origin, ray_dir, intersection_distance, tri_norm);
+}
+
+// Any hit versions of the traversals above, for shadow rays. They return as soon as a
+// triangle is hit between t_min and t_max instead of looking for the closest one
+
+bool OccludedLeaf(uint first_prim, uint prim_count, vec3 ray_origin, vec3 ray_dir, float t_min, float t_max) {
+  for (uint i = 0; i < prim_count; ++i) {
+    Triangle tri = triangles[first_prim + i];
+
+    vec3 v0 = vertices[tri.v0_idx].vertex;
+    vec3 v1 = vertices[tri.v1_idx].vertex;
+    vec3 v2 = vertices[tri.v2_idx].vertex;
+
+    float t = t_max;
+    vec3 tri_norm;
+    if (IntersectsTriangle(ray_origin, ray_dir, v0, v1, v2, t, tri_norm) && t >= t_min)
+      return true;
+  }
+
+  return false;
+}
+
+bool Occluded(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, float t_min, float t_max) {
+  uint stack[64];
+  int stack_idx = 0;
+  stack[stack_idx++] = bvh_start_index;
+
+  while (stack_idx > 0) {
+    BVHNode node = nodes[stack[--stack_idx]];
+
+    float box_inters_dist = IntersectsBox(ray_origin, ray_dir, node.min_bounds, node.max_bounds);
+    if (box_inters_dist >= t_max || isinf(box_inters_dist))
+      continue;
+
+    if (node.prim_count > 0) {
+      if (OccludedLeaf(node.first_child_or_prim_index, node.prim_count, ray_origin, ray_dir, t_min, t_max))
+        return true;
+    } else {
+      stack[stack_idx++] = node.first_child_or_prim_index;
+      stack[stack_idx++] = node.first_child_or_prim_index + 1;
+    }
+  }
+
+  return false;
+}
+
+bool OccludedWide(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, float t_min, float t_max) {
+  uint stack[64];
+  int stack_idx = 0;
+  stack[stack_idx++] = bvh_start_index;
+
+  while (stack_idx > 0) {
+    uint node_idx = stack[--stack_idx];
+
+    for (uint i = 0; i < WIDE_BVH_WIDTH; ++i) {
+      uint child = wide_nodes[node_idx].child_or_prim_index[i];
+      if (child == WIDE_BVH_EMPTY_SLOT)
+        break;
+
+      vec3 min_bounds = vec3(wide_nodes[node_idx].min_x[i], wide_nodes[node_idx].min_y[i], wide_nodes[node_idx].min_z[i]);
+      vec3 max_bounds = vec3(wide_nodes[node_idx].max_x[i], wide_nodes[node_idx].max_y[i], wide_nodes[node_idx].max_z[i]);
+      float box_inters_dist = IntersectsBox(ray_origin, ray_dir, min_bounds, max_bounds);
+      if (box_inters_dist >= t_max || isinf(box_inters_dist))
+        continue;
+
+      uint prim_count = wide_nodes[node_idx].prim_count[i];
+      if (prim_count > 0) {
+        if (OccludedLeaf(child, prim_count, ray_origin, ray_dir, t_min, t_max))
+          return true;
+      } else {
+        stack[stack_idx++] = child;
+      }
+    }
+  }
+
+  return false;
+}
+
+bool OccludedCompressed(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, float t_min, float t_max) {
+  uint stack[64];
+  int stack_idx = 0;
+  stack[stack_idx++] = bvh_start_index;
+
+  while (stack_idx > 0) {
+    uint node_idx = stack[--stack_idx];
+
+    vec3 origin = compressed_nodes[node_idx].origin;
+    vec3 scale = DecodeCompressedScale(compressed_nodes[node_idx].exponents);
+
+    for (uint i = 0; i < WIDE_BVH_WIDTH; ++i) {
+      uint child = compressed_nodes[node_idx].child_or_prim_index[i];
+      if (child == WIDE_BVH_EMPTY_SLOT)
+        break;
+
+      vec3 min_bounds;
+      vec3 max_bounds;
+      DecodeCompressedBox(node_idx, i, origin, scale, min_bounds, max_bounds);
+      float box_inters_dist = IntersectsBox(ray_origin, ray_dir, min_bounds, max_bounds);
+      if (box_inters_dist >= t_max || isinf(box_inters_dist))
+        continue;
+
+      uint prim_count = compressed_nodes[node_idx].prim_count[i];
+      if (prim_count > 0) {
+        if (OccludedLeaf(child, prim_count, ray_origin, ray_dir, t_min, t_max))
+          return true;
+      } else {
+        stack[stack_idx++] = child;
+      }
+    }
+  }
+
+  return false;
+}
+
+bool OccludedBVH(uint bvh_start_index, vec3 ray_origin, vec3 ray_dir, float t_min, float t_max) {
+  if (bvh_node_layout == BVH_LAYOUT_WIDE8)
+    return OccludedWide(bvh_start_index, ray_origin, ray_dir, t_min, t_max);
+  if (bvh_node_layout == BVH_LAYOUT_COMPRESSED_WIDE8)
+    return OccludedCompressed(bvh_start_index, ray_origin, ray_dir, t_min, t_max);
+
+  return Occluded(bvh_start_index, ray_origin, ray_dir, t_min, t_max);
+}
+
+// Any hit over every model in the scene, see IntersectsScene
+bool OccludedScene(vec3 ray_origin, vec3 ray_dir, float t_min, float t_max) {
+  if (tlas_instance_count == 0)
+    return false;
+
+  uint stack[64];
+  int stack_idx = 0;
+  stack[stack_idx++] = 0;
+
+  while (stack_idx > 0) {
+    BVHNode node = tlas_nodes[stack[--stack_idx]];
+
+    float box_inters_dist = IntersectsBox(ray_origin, ray_dir, node.min_bounds, node.max_bounds);
+    if (box_inters_dist >= t_max || isinf(box_inters_dist))
+      continue;
+
+    if (node.prim_count == 0) {
+      stack[stack_idx++] = node.first_child_or_prim_index;
+      stack[stack_idx++] = node.first_child_or_prim_index + 1;
+      continue;
+    }
+
+    for (uint i = 0; i < node.prim_count; ++i) {
+      uint bvh_idx = tlas_instances[node.first_child_or_prim_index + i];
+      vec3 trans_origin = (bvhs[bvh_idx].frame * vec4(ray_origin, 1.)).xyz;
+      vec3 trans_direction = (bvhs[bvh_idx].frame * vec4(ray_dir, 0.)).xyz;
+      if (OccludedBVH(bvhs[bvh_idx].first_index, trans_origin, trans_direction, t_min, t_max))
+        return true;
+    }
+  }
+
+  return false;
+}
+
+// Closest hit over every model in the scene. Walks the TLAS in world space and only
+// transforms the ray into a model's frame where it hits that model's box.
+// hit_bvh is set to the bvhs[] index of the model hit
+uint IntersectsScene(vec3 ray_origin, vec3 ray_dir, inout float intersection_distance, inout vec3 tri_norm, out uint hit_bvh) {
+  uint stack[64];
+  int stack_idx = 0;
+  stack[stack_idx++] = 0;
+  uint out_tri_indx = -1;
+  hit_bvh = -1;
+  if (tlas_instance_count == 0)
+    return out_tri_indx;
+
+  while (stack_idx > 0) {
+    uint node_idx = stack[--stack_idx];
+    BVHNode node = tlas_nodes[node_idx];
+
+    float box_inters_dist = IntersectsBox(ray_origin, ray_dir, node.min_bounds, node.max_bounds);
+    if (box_inters_dist >= intersection_distance || isinf(box_inters_dist))
+      continue;
+
+    if (node.prim_count == 0) {
+      stack[stack_idx++] = node.first_child_or_prim_index;
+      stack[stack_idx++] = node.first_child_or_prim_index + 1;
+      continue;
+    }
+
+    for (uint i = 0; i < node.prim_count; ++i) {
+      uint bvh_idx = tlas_instances[node.first_child_or_prim_index + i];
+      // transform ray into model's space, the frame is affine so distances stay the same
+      vec3 trans_origin = (bvhs[bvh_idx].frame * vec4(ray_origin, 1.)).xyz;
+      vec3 trans_direction = (bvhs[bvh_idx].frame * vec4(ray_dir, 0.)).xyz;
+      uint hit = IntersectsBVH(bvhs[bvh_idx].first_index, trans_origin, trans_direction, intersection_distance, tri_norm);
+      if (hit != uint(-1)) {
+        out_tri_indx = hit;
+        hit_bvh = bvh_idx;
+      }
+    }
+  }
+
+  return out_tri_indx;
+}
+
 // void main() {
 //   // 2D dispatch
 //   uvec2 gid = gl_GlobalInvocationID.xy;
@@ -141,29 +141,41 @@ HitRecord CheckHit(Ray ray, Sphere[SPHERE_COUNT] spheres, float min, float max)
   }
 
   if (showModel) {
-    for (uint i = 0; i < bvh_count; i++) {
-      // transform ray into model's space
-      vec4 trans_origin = bvhs[i].frame * vec4(ray.origin, 1.);
-      vec4 trans_direction = bvhs[i].frame * vec4(ray.direction, 0.);
-      // ray.intersection_distance is inout here, think this means it will be updated as expected
-      vec3 tri_norm;
-      uint hit = Intersects(bvhs[i].first_index, trans_origin.xyz, trans_direction.xyz, ray.intersection_distance, tri_norm);
-
-      if (hit != uint(-1)) {
-        rec.hit = true;
-        // I think?
-        rec.p = (ray.intersection_distance * ray.direction) + ray.origin;
-        vec3 model_p = (ray.intersection_distance * trans_direction.xyz) + trans_origin.xyz;
-        rec.normal = tri_norm;
-        rec.t = ray.intersection_distance;
-        TriangleToSupportedMat(triangles[hit], model_p, rec.mat);
-      }
+    // ray.intersection_distance is inout here, think this means it will be updated as expected
+    vec3 tri_norm;
+    uint hit_bvh;
+    uint hit = IntersectsScene(ray.origin, ray.direction, ray.intersection_distance, tri_norm, hit_bvh);
+
+    if (hit != uint(-1)) {
+      rec.hit = true;
+      // I think?
+      rec.p = (ray.intersection_distance * ray.direction) + ray.origin;
+      vec4 trans_origin = bvhs[hit_bvh].frame * vec4(ray.origin, 1.);
+      vec4 trans_direction = bvhs[hit_bvh].frame * vec4(ray.direction, 0.);
+      vec3 model_p = (ray.intersection_distance * trans_direction.xyz) + trans_origin.xyz;
+      rec.normal = tri_norm;
+      rec.t = ray.intersection_distance;
+      TriangleToSupportedMat(triangles[hit], model_p, rec.mat);
     }
   }
 
 	return rec;
 }
 
+// Any hit version of CheckHit for shadow rays, skips the closest hit search and materials
+bool CheckOccluded(Ray ray, Sphere[SPHERE_COUNT] spheres, float min, float max) {
+  if (!showModel) {
+    HitRecord rec;
+	  for (int i = 0; i < SPHERE_COUNT; i++) {
+		  if (SphereHit(ray, spheres[i], min, max, rec))
+			  return true;
+	  }
+    return false;
+  }
+
+  return OccludedScene(ray.origin, ray.direction, min, max);
+}
+
 bool CheckLightOccluded(vec3 pos, Light light, Sphere[SPHERE_COUNT] spheres) {
 	vec3 dir = normalize(light.position - pos);
 	float max = length(light.position - pos);
@@ -171,8 +183,7 @@ bool CheckLightOccluded(vec3 pos, Light light, Sphere[SPHERE_COUNT] spheres) {
 	Ray lightRay;
 	lightRay.origin = pos;
 	lightRay.direction = dir;
-	HitRecord rec = CheckHit(lightRay, spheres, 0.001, max);
-	return rec.hit;
+	return CheckOccluded(lightRay, spheres, 0.001, max);
 }
 
 // Inspired by the "Crash Course in BRDF Implementation" by Jakub Boksansky
@@ -29,6 +29,7 @@ struct MaterialFromOBJ {
 // describes the start and len of each BVH in the BVHNodeBuffer
 // as well as the coordinate frame the bvh is in (world frame to model frame)
 // I'm pretty sure this is also inverse traditional model matrix
+// one per model instance, instances of the same model share its nodes
 struct BVH {
   uint first_index;
   uint count;
@@ -45,6 +46,35 @@ struct BVHNode {
   uint prim_count;
 };
 
+#define WIDE_BVH_WIDTH 8
+#define WIDE_BVH_EMPTY_SLOT 0xFFFFFFFFu
+
+// 8 wide node with SoA child bounds, needs to match GPUWideBVHNode in gpu_loader.cpp
+// children are filled from slot 0, the first WIDE_BVH_EMPTY_SLOT ends the node
+// prim_count > 0 means the child is a leaf and child_or_prim_index its first triangle
+struct WideBVHNode {
+  float min_x[WIDE_BVH_WIDTH];
+  float min_y[WIDE_BVH_WIDTH];
+  float min_z[WIDE_BVH_WIDTH];
+  float max_x[WIDE_BVH_WIDTH];
+  float max_y[WIDE_BVH_WIDTH];
+  float max_z[WIDE_BVH_WIDTH];
+  uint child_or_prim_index[WIDE_BVH_WIDTH];
+  uint prim_count[WIDE_BVH_WIDTH];
+};
+
+// WideBVHNode with child bounds quantized to 8 bits, needs to match GPUCompressedBVHNode
+// in gpu_loader.cpp. Child bounds decode as origin + q * scale, where scale per axis is
+// the float with the biased exponent stored in the low 3 bytes of exponents
+// quantized_bounds is min x, y, z then max x, y, z, 8 children each, 4 children per uint
+struct CompressedBVHNode {
+  vec3 origin;
+  uint exponents;
+  uint quantized_bounds[12];
+  uint child_or_prim_index[WIDE_BVH_WIDTH];
+  uint prim_count[WIDE_BVH_WIDTH];
+};
+
 // data for each triangle in buffer
 // each member points to another buffer
 struct Triangle {
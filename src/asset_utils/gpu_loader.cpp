@@ -1,10 +1,19 @@
 #include "asset_utils/gpu_loader.h"
 
 #include <glm/glm.hpp>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <utility>
 
 #include "intersection_utils/bvh.h"
+#include "intersection_utils/bvh_analysis.h"
+#include "intersection_utils/wide_bvh.h"
+#include "intersection_utils/compressed_bvh.h"
+#include "intersection_utils/tlas.h"
 
 namespace AssetUtils {
 namespace {
@@ -23,6 +32,28 @@ struct GPUBVHNode {
   std::uint32_t prim_count;
 };
 
+// needs to match WideBVHNode in shaders/raytrace_types.glsl
+struct GPUWideBVHNode {
+  float min_x[8];
+  float min_y[8];
+  float min_z[8];
+  float max_x[8];
+  float max_y[8];
+  float max_z[8];
+  std::uint32_t child_or_prim_index[8];
+  std::uint32_t prim_count[8];
+};
+
+// needs to match CompressedBVHNode in shaders/raytrace_types.glsl
+// quantized_bounds holds IntersectionUtils::CompressedBVHNode::q_min then q_max, 4 per uint
+struct GPUCompressedBVHNode {
+  glm::vec3 origin;
+  std::uint32_t exponents;
+  std::uint32_t quantized_bounds[12];
+  std::uint32_t child_or_prim_index[8];
+  std::uint32_t prim_count[8];
+};
+
 struct GPUMaterial {
   glm::vec3 diffuse;
   float specular_ex;
@@ -40,34 +71,276 @@ struct GPUTriangle {
   std::uint32_t material_idx;
 };
 
-// each element = 1 BVH per model
-static std::vector<GPUBVH> g_bvhs;       
+// Where each model's data starts in the combined buffers, for partial updates
+struct ModelOffsets {
+  std::uint32_t first_node;
+  std::uint32_t node_count;
+  std::uint32_t first_wide_node;
+  std::uint32_t wide_node_count;
+  std::uint32_t first_triangle;
+  std::uint32_t triangle_count;
+  std::uint32_t first_vertex;
+  std::uint32_t vertex_count;
+  std::uint32_t first_material;
+  // no tree to trace, left out of the TLAS. A DynamicBVH can empty a slot after upload
+  bool empty;
+};
+
+// instance table, each element = 1 placement of a model's BVH. Several can share a model
+static std::vector<GPUBVH> g_bvhs;
+// model each instance places, same indexing as g_bvhs. kFreeInstance for removed ones
+static std::vector<std::uint32_t> g_instance_models;
+// removed g_bvhs slots, reused by AddModelInstance so instance indices stay stable
+static std::vector<std::uint32_t> g_free_instances;
+constexpr std::uint32_t kFreeInstance = std::numeric_limits<std::uint32_t>::max();
 // all BVH nodes from all models
 static std::vector<GPUBVHNode> g_bvh_nodes;
+// all wide BVH nodes from all models, empty unless using BVHNodeLayout::kWide8
+static std::vector<GPUWideBVHNode> g_wide_bvh_nodes;
+// all compressed BVH nodes from all models, empty unless using BVHNodeLayout::kCompressedWide8
+static std::vector<GPUCompressedBVHNode> g_compressed_bvh_nodes;
 // all materials from all models
 static std::vector<GPUMaterial> g_materials;
 // all triangles from all models
 static std::vector<GPUTriangle> g_triangles;
 // all vertices from all models
 static std::vector<GPU::PackedVertexData> g_vertices;
+// each element = offsets of 1 model, same indexing as the vector passed to UploadModelDataToGPU
+static std::vector<ModelOffsets> g_model_offsets;
+// root box of each model in model space, same indexing as g_model_offsets
+static std::vector<std::pair<glm::vec3, glm::vec3>> g_model_bounds;
+// top level BVH over the models, leaves point into g_tlas_instances
+static std::vector<GPUBVHNode> g_tlas_nodes;
+// instance (g_bvhs) index of each TLAS primative
+static std::vector<std::uint32_t> g_tlas_instances;
+// instances in the TLAS, g_tlas_instances is padded when there are none
+static std::uint32_t g_tlas_instance_count = 0;
 
 static GLuint s_bvh_ranges_SSBO = 0;
 static GLuint s_bvh_nodes_SSBO = 0;
+static GLuint s_wide_bvh_nodes_SSBO = 0;
+static GLuint s_compressed_bvh_nodes_SSBO = 0;
 static GLuint s_materials_SSBO = 0;
 static GLuint s_triangles_SSBO = 0;
 static GLuint s_vertices_SSBO = 0;
+static GLuint s_tlas_nodes_SSBO = 0;
+static GLuint s_tlas_instances_SSBO = 0;
 
 static GLuint s_ray_buffer = 0;
+
+static BVHNodeLayout s_node_layout = BVHNodeLayout::kBinary;
+
+GPUBVHNode ToGPUNode(
+    const IntersectionUtils::BVHNode& node,
+    const std::uint32_t triangle_offset,
+    const std::uint32_t node_offset) {
+  GPUBVHNode gpu_node;
+  gpu_node.min_bounds = node.min_bounds;
+  gpu_node.max_bounds = node.max_bounds;
+  gpu_node.first_child_or_prim_index =
+      node.prim_count > 0 ?
+          node.first_prim_index + triangle_offset:
+          node.first_child + node_offset;
+  gpu_node.prim_count = node.prim_count;
+  return gpu_node;
+}
+
+GPUTriangle ToGPUTriangle(
+    const GPU::Triangle& tri,
+    const std::uint32_t vertex_offset,
+    const std::uint32_t material_offset) {
+  GPUTriangle gpu_tri;
+  gpu_tri.v0_idx = tri.vertex_idxs[0] + vertex_offset;
+  gpu_tri.v1_idx = tri.vertex_idxs[1] + vertex_offset;
+  gpu_tri.v2_idx = tri.vertex_idxs[2] + vertex_offset;
+  gpu_tri.material_idx = tri.material_idx + material_offset;
+  return gpu_tri;
+}
+
+// Instance table entry placing model_index with frame. The root it points at is in
+// whichever node buffer the current layout uses
+GPUBVH ToGPUInstance(const std::uint32_t model_index, const glm::mat4& frame) {
+  const ModelOffsets& offsets = g_model_offsets.at(model_index);
+  GPUBVH gpu_BVH;
+  if (s_node_layout == BVHNodeLayout::kBinary) {
+    gpu_BVH.first_index = offsets.first_node;
+    gpu_BVH.count = offsets.node_count;
+  } else {
+    gpu_BVH.first_index = offsets.first_wide_node;
+    gpu_BVH.count = offsets.wide_node_count;
+  }
+  gpu_BVH.frame = frame;
+  return gpu_BVH;
+}
+
+// Rebuilds the TLAS from the instances' frames and their models' bounds and reuploads
+// it. Removed instances and empty models are left out. A TLAS with no instances still
+// gets a placeholder root so the buffers aren't empty, the shaders check
+// tlas_instance_count instead of traversing it
+void UploadTLAS() {
+  std::vector<IntersectionUtils::BVHInstance> instances;
+  instances.reserve(g_bvhs.size());
+  for (std::uint32_t i = 0; i < g_bvhs.size(); ++i) {
+    const std::uint32_t model_index = g_instance_models[i];
+    if (model_index == kFreeInstance || g_model_offsets[model_index].empty)
+      continue;
+
+    // frame takes world space to model space
+    const auto& model_bounds = g_model_bounds[model_index];
+    const auto [min_bounds, max_bounds] = IntersectionUtils::TransformBounds(
+        model_bounds.first, model_bounds.second, glm::inverse(g_bvhs[i].frame));
+    instances.push_back({min_bounds, max_bounds, i});
+  }
+
+  const IntersectionUtils::TLAS tlas = IntersectionUtils::BuildTLAS(std::move(instances));
+  IntersectionUtils::CheckStackSize(IntersectionUtils::RequiredStackSize(tlas.GetBVH()), "TLAS");
+
+  g_tlas_nodes.clear();
+  g_tlas_instances.clear();
+  for (const auto& node : tlas.GetBVH())
+    g_tlas_nodes.push_back(ToGPUNode(node, 0, 0));
+  for (const auto& instance : tlas.GetPrims())
+    g_tlas_instances.push_back(instance.index);
+  g_tlas_instance_count = static_cast<std::uint32_t>(g_tlas_instances.size());
+
+  if (g_tlas_nodes.empty()) {
+    GPUBVHNode empty_root;
+    empty_root.min_bounds = glm::vec3(std::numeric_limits<float>::max());
+    empty_root.max_bounds = glm::vec3(std::numeric_limits<float>::lowest());
+    empty_root.first_child_or_prim_index = 0;
+    empty_root.prim_count = 0;
+    g_tlas_nodes.push_back(empty_root);
+  }
+  // glBufferData doesn't take empty buffers well, neither padding entry is ever read
+  if (g_tlas_instances.empty())
+    g_tlas_instances.push_back(0);
+
+  for (auto* const buff_id : {&s_tlas_nodes_SSBO, &s_tlas_instances_SSBO}) {
+    if (*buff_id == 0)
+      glGenBuffers(1, buff_id);
+  }
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_tlas_nodes_SSBO);
+  glBufferData(
+      GL_SHADER_STORAGE_BUFFER,
+      g_tlas_nodes.size() * sizeof(GPUBVHNode),
+      g_tlas_nodes.data(),
+      GL_DYNAMIC_DRAW);
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_tlas_instances_SSBO);
+  glBufferData(
+      GL_SHADER_STORAGE_BUFFER,
+      g_tlas_instances.size() * sizeof(std::uint32_t),
+      g_tlas_instances.data(),
+      GL_DYNAMIC_DRAW);
+}
+
+// Wide child index in the combined buffers
+template <class Node>
+std::uint32_t ToGlobalChildIndex(
+    const Node& node,
+    const std::uint32_t slot,
+    const std::uint32_t triangle_offset,
+    const std::uint32_t node_offset) {
+  if (node.IsEmpty(slot))
+    return node.child_or_prim_index[slot];
+
+  return node.child_or_prim_index[slot] + (node.IsLeaf(slot) ? triangle_offset : node_offset);
+}
+
+// Collapses a model's BVH and appends it to out_ptr with global indices.
+// Returns the number of nodes added
+std::uint32_t AppendWideNodes(
+    const IntersectionUtils::BVH<GPU::Triangle>& bvh,
+    const std::uint32_t triangle_offset,
+    const std::uint32_t node_offset,
+    std::vector<GPUWideBVHNode>* const out_ptr) {
+  auto& out = *out_ptr;
+  const IntersectionUtils::BVH8 wide_bvh(bvh.GetBVH());
+  IntersectionUtils::CheckStackSize(IntersectionUtils::RequiredStackSize(wide_bvh), "Wide model BVH");
+  for (const auto& node : wide_bvh.GetNodes()) {
+    GPUWideBVHNode gpu_node;
+    for (std::uint32_t i = 0; i < 8; ++i) {
+      gpu_node.min_x[i] = node.min_x[i];
+      gpu_node.min_y[i] = node.min_y[i];
+      gpu_node.min_z[i] = node.min_z[i];
+      gpu_node.max_x[i] = node.max_x[i];
+      gpu_node.max_y[i] = node.max_y[i];
+      gpu_node.max_z[i] = node.max_z[i];
+      gpu_node.prim_count[i] = node.prim_count[i];
+      gpu_node.child_or_prim_index[i] = ToGlobalChildIndex(node, i, triangle_offset, node_offset);
+    }
+    out.push_back(gpu_node);
+  }
+
+  return static_cast<std::uint32_t>(wide_bvh.GetNodes().size());
+}
+
+// Same as AppendWideNodes but quantized. report_ptr is optional
+std::uint32_t AppendCompressedNodes(
+    const IntersectionUtils::BVH<GPU::Triangle>& bvh,
+    const std::uint32_t triangle_offset,
+    const std::uint32_t node_offset,
+    std::vector<GPUCompressedBVHNode>* const out_ptr,
+    IntersectionUtils::CompressedBVHReport* const report_ptr = nullptr) {
+  auto& out = *out_ptr;
+  const IntersectionUtils::BVH8 wide_bvh(bvh.GetBVH());
+  IntersectionUtils::CheckStackSize(IntersectionUtils::RequiredStackSize(wide_bvh), "Wide model BVH");
+  const IntersectionUtils::CompressedWideBVH compressed_bvh(wide_bvh);
+  for (const auto& node : compressed_bvh.GetNodes()) {
+    GPUCompressedBVHNode gpu_node;
+    gpu_node.origin = node.origin;
+    gpu_node.exponents = node.exponents[0] | (node.exponents[1] << 8) | (node.exponents[2] << 16);
+    // little endian, byte i of q_min ends up in byte i % 4 of uint i / 4
+    static_assert(sizeof(node.q_min) + sizeof(node.q_max) == sizeof(gpu_node.quantized_bounds));
+    std::memcpy(gpu_node.quantized_bounds, node.q_min.data(), sizeof(node.q_min));
+    std::memcpy(gpu_node.quantized_bounds + 6, node.q_max.data(), sizeof(node.q_max));
+    for (std::uint32_t i = 0; i < 8; ++i) {
+      gpu_node.prim_count[i] = node.prim_count[i];
+      gpu_node.child_or_prim_index[i] = ToGlobalChildIndex(node, i, triangle_offset, node_offset);
+    }
+    out.push_back(gpu_node);
+  }
+
+  if (report_ptr) {
+    auto& report = *report_ptr;
+    const auto& model_report = compressed_bvh.GetReport();
+    const std::size_t total_nodes = report.node_count + model_report.node_count;
+    if (total_nodes > 0) {
+      report.mean_area_inflation =
+          (report.mean_area_inflation * report.node_count +
+           model_report.mean_area_inflation * model_report.node_count) / total_nodes;
+    }
+    report.max_area_inflation = std::max(report.max_area_inflation, model_report.max_area_inflation);
+    report.node_count = total_nodes;
+    report.wide_bytes += model_report.wide_bytes;
+    report.compressed_bytes += model_report.compressed_bytes;
+  }
+
+  return static_cast<std::uint32_t>(compressed_bvh.GetNodes().size());
+}
 }
 
-void UploadModelDataToGPU(const std::vector<Model*>& models, const std::uint32_t binding_offset) {
+void UploadModelDataToGPU(
+    const std::vector<Model*>& models,
+    const std::uint32_t binding_offset,
+    const BVHNodeLayout node_layout) {
+  s_node_layout = node_layout;
   g_bvhs.clear();
+  g_instance_models.clear();
+  g_free_instances.clear();
   g_bvh_nodes.clear();
+  g_wide_bvh_nodes.clear();
+  g_compressed_bvh_nodes.clear();
+  IntersectionUtils::CompressedBVHReport compression_report;
   g_materials.clear();
   g_triangles.clear();
   g_vertices.clear();
+  g_model_offsets.clear();
+  g_model_bounds.clear();
 
   std::uint32_t cur_BVH_node_off = 0;
+  std::uint32_t cur_wide_node_off = 0;
   std::uint32_t cur_triangle_off = 0;
   std::uint32_t cur_material_off = 0;
   std::uint32_t cur_vertex_off = 0;
@@ -99,44 +372,57 @@ void UploadModelDataToGPU(const std::vector<Model*>& models, const std::uint32_t
     cur_vertex_off += static_cast<std::uint32_t>(model.vertex_data_buffer.size());
 
     const auto& bvh = model.model_bvh;
-    GPUBVH gpu_BVH;
-    gpu_BVH.first_index = cur_BVH_node_off;
-    gpu_BVH.count = static_cast<std::uint32_t>(bvh.GetBVH().size());
-    g_bvhs.push_back(gpu_BVH);
+    const std::uint32_t node_count = static_cast<std::uint32_t>(bvh.GetBVH().size());
+    if (bvh.GetBVH().empty())
+      g_model_bounds.emplace_back(glm::vec3(0.0f), glm::vec3(0.0f));
+    else
+      g_model_bounds.emplace_back(bvh.GetBVH()[0].min_bounds, bvh.GetBVH()[0].max_bounds);
 
     std::uint32_t local_tri_offset = cur_triangle_off;
-    for (const auto& tri : bvh.GetPrims()) {
-      GPUTriangle gpu_tri;
-      gpu_tri.v0_idx = tri.vertex_idxs[0] + model_vert_off;
-      gpu_tri.v1_idx = tri.vertex_idxs[1] + model_vert_off;
-      gpu_tri.v2_idx = tri.vertex_idxs[2] + model_vert_off;
-      gpu_tri.material_idx = tri.material_idx + model_mat_off;
-      g_triangles.push_back(gpu_tri);
-    }
+    for (const auto& tri : bvh.GetPrims())
+      g_triangles.push_back(ToGPUTriangle(tri, model_vert_off, model_mat_off));
 
     std::uint32_t num_BVH_tri = static_cast<std::uint32_t>(bvh.GetPrims().size());
     cur_triangle_off += num_BVH_tri;
 
-    for (const auto& node : bvh.GetBVH()) {
-      GPUBVHNode gpu_node;
-      gpu_node.min_bounds = node.min_bounds;
-      gpu_node.max_bounds = node.max_bounds;
-      gpu_node.first_child_or_prim_index =
-          node.prim_count > 0 ?
-              node.first_prim_index + local_tri_offset:
-              node.first_child + cur_BVH_node_off;
-      gpu_node.prim_count = node.prim_count;
-      g_bvh_nodes.push_back(gpu_node);
+    for (const auto& node : bvh.GetBVH())
+      g_bvh_nodes.push_back(ToGPUNode(node, local_tri_offset, cur_BVH_node_off));
+
+    std::uint32_t wide_node_count = 0;
+    if (node_layout == BVHNodeLayout::kWide8) {
+      wide_node_count = AppendWideNodes(bvh, local_tri_offset, cur_wide_node_off, &g_wide_bvh_nodes);
+    } else if (node_layout == BVHNodeLayout::kCompressedWide8) {
+      wide_node_count = AppendCompressedNodes(
+          bvh, local_tri_offset, cur_wide_node_off, &g_compressed_bvh_nodes, &compression_report);
     }
 
-    cur_BVH_node_off += gpu_BVH.count;
+    g_model_offsets.push_back(ModelOffsets{
+        cur_BVH_node_off,
+        node_count,
+        cur_wide_node_off,
+        wide_node_count,
+        local_tri_offset,
+        num_BVH_tri,
+        model_vert_off,
+        static_cast<std::uint32_t>(model.vertex_data_buffer.size()),
+        model_mat_off,
+        node_count == 0});
+
+    cur_BVH_node_off += node_count;
+    cur_wide_node_off += wide_node_count;
+  }
+
+  // every model starts out placed once, untransformed
+  for (std::uint32_t i = 0; i < models.size(); ++i) {
+    g_bvhs.push_back(ToGPUInstance(i, glm::mat4(1)));
+    g_instance_models.push_back(i);
   }
 
   for (auto* const buff_id : {&s_bvh_ranges_SSBO, &s_bvh_nodes_SSBO, &s_materials_SSBO, &s_triangles_SSBO, &s_vertices_SSBO}) {
     if (*buff_id == 0)
       glGenBuffers(1, buff_id);
     else
-      std::cout << "Not recommended to re-call this function. Currently buffers are created with GL_STATIC_DRAW" << std::endl;
+      std::cout << "Not recommended to re-call this function. Currently most buffers are created with GL_STATIC_DRAW" << std::endl;
   }
 
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_bvh_ranges_SSBO);
@@ -151,7 +437,37 @@ void UploadModelDataToGPU(const std::vector<Model*>& models, const std::uint32_t
       GL_SHADER_STORAGE_BUFFER,
       g_bvh_nodes.size() * sizeof(GPUBVHNode),
       g_bvh_nodes.data(),
-      GL_STATIC_DRAW);
+      GL_DYNAMIC_DRAW);
+
+  if (node_layout == BVHNodeLayout::kWide8) {
+    if (s_wide_bvh_nodes_SSBO == 0)
+      glGenBuffers(1, &s_wide_bvh_nodes_SSBO);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_wide_bvh_nodes_SSBO);
+    glBufferData(
+        GL_SHADER_STORAGE_BUFFER,
+        g_wide_bvh_nodes.size() * sizeof(GPUWideBVHNode),
+        g_wide_bvh_nodes.data(),
+        GL_DYNAMIC_DRAW);
+  }
+
+  if (node_layout == BVHNodeLayout::kCompressedWide8) {
+    if (s_compressed_bvh_nodes_SSBO == 0)
+      glGenBuffers(1, &s_compressed_bvh_nodes_SSBO);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_compressed_bvh_nodes_SSBO);
+    glBufferData(
+        GL_SHADER_STORAGE_BUFFER,
+        g_compressed_bvh_nodes.size() * sizeof(GPUCompressedBVHNode),
+        g_compressed_bvh_nodes.data(),
+        GL_DYNAMIC_DRAW);
+
+    std::cout << "Compressed BVH nodes: " << compression_report.compressed_bytes / 1024 << " KiB"
+              << " (binary " << g_bvh_nodes.size() * sizeof(GPUBVHNode) / 1024 << " KiB"
+              << ", wide " << compression_report.wide_bytes / 1024 << " KiB)"
+              << ", box area inflation mean " << compression_report.mean_area_inflation
+              << " max " << compression_report.max_area_inflation << std::endl;
+  }
 
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_materials_SSBO);
   glBufferData(
@@ -165,14 +481,16 @@ void UploadModelDataToGPU(const std::vector<Model*>& models, const std::uint32_t
       GL_SHADER_STORAGE_BUFFER,
       g_triangles.size() * sizeof(GPUTriangle),
       g_triangles.data(),
-      GL_STATIC_DRAW);
+      GL_DYNAMIC_DRAW);
 
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_vertices_SSBO);
   glBufferData(
       GL_SHADER_STORAGE_BUFFER,
       g_vertices.size() * sizeof(GPU::PackedVertexData),
       g_vertices.data(),
-      GL_STATIC_DRAW);
+      GL_DYNAMIC_DRAW);
+
+  UploadTLAS();
 
   // bind them to the binding points that match the shader
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_offset + 0, s_bvh_ranges_SSBO);
@@ -180,10 +498,20 @@ void UploadModelDataToGPU(const std::vector<Model*>& models, const std::uint32_t
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_offset + 2, s_materials_SSBO);
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_offset + 3, s_triangles_SSBO);
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_offset + 4, s_vertices_SSBO);
+  // + 5 and + 6 are used by the ray and hit buffers of the compute tests
+  if (node_layout == BVHNodeLayout::kWide8)
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_offset + 7, s_wide_bvh_nodes_SSBO);
+  if (node_layout == BVHNodeLayout::kCompressedWide8)
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_offset + 8, s_compressed_bvh_nodes_SSBO);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_offset + 9, s_tlas_nodes_SSBO);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding_offset + 10, s_tlas_instances_SSBO);
 }
 
 void UpdateModelMatrix(const std::uint32_t index, const glm::mat4& matrix) {
-  g_bvhs.at(index).frame = matrix;
+  if (g_instance_models.at(index) == kFreeInstance)
+    throw std::out_of_range("Model instance was removed");
+
+  g_bvhs[index].frame = matrix;
 
   glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_bvh_ranges_SSBO);
   const std::size_t offset = index * sizeof(GPUBVH);
@@ -193,6 +521,230 @@ void UpdateModelMatrix(const std::uint32_t index, const glm::mat4& matrix) {
       matrix_offset,
       sizeof(glm::mat4),
       &g_bvhs.at(index).frame);
+
+  // the model's world space box moved with it
+  UploadTLAS();
+}
+
+std::uint32_t AddModelInstance(const std::uint32_t model_index, const glm::mat4& matrix) {
+  if (model_index >= g_model_offsets.size())
+    throw std::out_of_range("Model index is outside the uploaded models");
+
+  const GPUBVH gpu_BVH = ToGPUInstance(model_index, matrix);
+  std::uint32_t index;
+  if (!g_free_instances.empty()) {
+    index = g_free_instances.back();
+    g_free_instances.pop_back();
+    g_bvhs[index] = gpu_BVH;
+    g_instance_models[index] = model_index;
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_bvh_ranges_SSBO);
+    glBufferSubData(
+        GL_SHADER_STORAGE_BUFFER,
+        index * sizeof(GPUBVH),
+        sizeof(GPUBVH),
+        &g_bvhs[index]);
+  } else {
+    index = static_cast<std::uint32_t>(g_bvhs.size());
+    g_bvhs.push_back(gpu_BVH);
+    g_instance_models.push_back(model_index);
+
+    // the table grew, glBufferData keeps the buffer bound to its binding point
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_bvh_ranges_SSBO);
+    glBufferData(
+        GL_SHADER_STORAGE_BUFFER,
+        g_bvhs.size() * sizeof(GPUBVH),
+        g_bvhs.data(),
+        GL_DYNAMIC_DRAW);
+  }
+
+  UploadTLAS();
+  return index;
+}
+
+void RemoveModelInstance(const std::uint32_t index) {
+  if (g_instance_models.at(index) == kFreeInstance)
+    throw std::out_of_range("Model instance was already removed");
+
+  // the entry stays in the table, only the TLAS stops pointing at it
+  g_instance_models[index] = kFreeInstance;
+  g_free_instances.push_back(index);
+  UploadTLAS();
+}
+
+void UpdateModelBVHNodes(
+    const std::uint32_t index,
+    const Model& model,
+    const IntersectionUtils::BVHNodeRange& dirty_nodes) {
+  if (dirty_nodes.Empty())
+    return;
+
+  const ModelOffsets& offsets = g_model_offsets.at(index);
+  const auto& nodes = model.model_bvh.GetBVH();
+  if (nodes.size() != offsets.node_count)
+    throw std::runtime_error("Model BVH node count changed since upload, it needs a full reupload");
+  if (dirty_nodes.first + dirty_nodes.count > offsets.node_count)
+    throw std::out_of_range("Dirty node range is outside the model's BVH");
+
+  // the wide nodes don't map one to one onto binary ones, so the whole model is
+  // collapsed again. Which children get opened depends on their areas, so refit bounds
+  // can change the wide node count and then the model's slice no longer fits
+  std::vector<GPUWideBVHNode> wide_nodes;
+  std::vector<GPUCompressedBVHNode> compressed_nodes;
+  if (s_node_layout == BVHNodeLayout::kWide8) {
+    wide_nodes.reserve(offsets.wide_node_count);
+    AppendWideNodes(model.model_bvh, offsets.first_triangle, offsets.first_wide_node, &wide_nodes);
+    if (wide_nodes.size() != offsets.wide_node_count)
+      throw std::runtime_error("Model wide BVH node count changed since upload, it needs a full reupload");
+  } else if (s_node_layout == BVHNodeLayout::kCompressedWide8) {
+    compressed_nodes.reserve(offsets.wide_node_count);
+    AppendCompressedNodes(model.model_bvh, offsets.first_triangle, offsets.first_wide_node, &compressed_nodes);
+    if (compressed_nodes.size() != offsets.wide_node_count)
+      throw std::runtime_error("Model wide BVH node count changed since upload, it needs a full reupload");
+  }
+
+  for (std::uint32_t i = dirty_nodes.first; i < dirty_nodes.first + dirty_nodes.count; ++i)
+    g_bvh_nodes[offsets.first_node + i] = ToGPUNode(nodes[i], offsets.first_triangle, offsets.first_node);
+
+  const std::uint32_t first_node = offsets.first_node + dirty_nodes.first;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_bvh_nodes_SSBO);
+  glBufferSubData(
+      GL_SHADER_STORAGE_BUFFER,
+      first_node * sizeof(GPUBVHNode),
+      dirty_nodes.count * sizeof(GPUBVHNode),
+      &g_bvh_nodes[first_node]);
+
+  // a refit changes the root box, which the TLAS was built from
+  if (dirty_nodes.first == 0) {
+    g_model_bounds[index] = {nodes[0].min_bounds, nodes[0].max_bounds};
+    UploadTLAS();
+  }
+
+  if (s_node_layout == BVHNodeLayout::kCompressedWide8) {
+    std::copy(compressed_nodes.begin(), compressed_nodes.end(), g_compressed_bvh_nodes.begin() + offsets.first_wide_node);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_compressed_bvh_nodes_SSBO);
+    glBufferSubData(
+        GL_SHADER_STORAGE_BUFFER,
+        offsets.first_wide_node * sizeof(GPUCompressedBVHNode),
+        offsets.wide_node_count * sizeof(GPUCompressedBVHNode),
+        &g_compressed_bvh_nodes[offsets.first_wide_node]);
+    return;
+  }
+
+  if (s_node_layout != BVHNodeLayout::kWide8)
+    return;
+
+  std::copy(wide_nodes.begin(), wide_nodes.end(), g_wide_bvh_nodes.begin() + offsets.first_wide_node);
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_wide_bvh_nodes_SSBO);
+  glBufferSubData(
+      GL_SHADER_STORAGE_BUFFER,
+      offsets.first_wide_node * sizeof(GPUWideBVHNode),
+      offsets.wide_node_count * sizeof(GPUWideBVHNode),
+      &g_wide_bvh_nodes[offsets.first_wide_node]);
+}
+
+void UpdateModelVertices(
+    const std::uint32_t index,
+    const Model& model,
+    const std::uint32_t first_vertex,
+    const std::uint32_t vertex_count) {
+  if (vertex_count == 0)
+    return;
+
+  const ModelOffsets& offsets = g_model_offsets.at(index);
+  if (model.vertex_data_buffer.size() != offsets.vertex_count)
+    throw std::runtime_error("Model vertex count changed since upload, it needs a full reupload");
+  if (first_vertex + vertex_count > offsets.vertex_count)
+    throw std::out_of_range("Vertex range is outside the model's vertex buffer");
+
+  const std::uint32_t first_global = offsets.first_vertex + first_vertex;
+  std::copy_n(
+      model.vertex_data_buffer.begin() + first_vertex,
+      vertex_count,
+      g_vertices.begin() + first_global);
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_vertices_SSBO);
+  glBufferSubData(
+      GL_SHADER_STORAGE_BUFFER,
+      first_global * sizeof(GPU::PackedVertexData),
+      vertex_count * sizeof(GPU::PackedVertexData),
+      &g_vertices[first_global]);
+}
+
+void UpdateModelDynamicBVH(
+    const std::uint32_t index,
+    const IntersectionUtils::DynamicBVH<GPU::Triangle>& bvh,
+    const std::vector<IntersectionUtils::BVHNodeRange>& dirty_nodes,
+    const std::vector<IntersectionUtils::BVHNodeRange>& dirty_prims) {
+  if (s_node_layout != BVHNodeLayout::kBinary)
+    throw std::runtime_error("DynamicBVH updates need the binary node layout, the model needs a full reupload");
+
+  ModelOffsets& offsets = g_model_offsets.at(index);
+  const auto& nodes = bvh.GetBVH();
+  const auto& prims = bvh.GetPrims();
+  if (nodes.size() > offsets.node_count || prims.size() > offsets.triangle_count)
+    throw std::runtime_error("DynamicBVH outgrew the model's slot, it needs a full reupload");
+
+  // checked up front so a bad range doesn't leave the buffers half written
+  for (const auto& range : dirty_nodes) {
+    if (range.first + range.count > nodes.size())
+      throw std::out_of_range("Dirty node range is outside the DynamicBVH");
+  }
+  for (const auto& range : dirty_prims) {
+    if (range.first + range.count > prims.size())
+      throw std::out_of_range("Dirty primative range is outside the DynamicBVH");
+    for (std::uint32_t i = range.first; i < range.first + range.count; ++i) {
+      for (const std::uint32_t vertex_idx : prims[i].vertex_idxs) {
+        if (vertex_idx >= offsets.vertex_count)
+          throw std::out_of_range("DynamicBVH triangle points outside the model's vertices");
+      }
+    }
+  }
+  if (!dirty_nodes.empty())
+    IntersectionUtils::CheckStackSize(IntersectionUtils::RequiredStackSize(nodes), "DynamicBVH");
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_triangles_SSBO);
+  for (const auto& range : dirty_prims) {
+    const std::uint32_t first_global = offsets.first_triangle + range.first;
+    for (std::uint32_t i = 0; i < range.count; ++i)
+      g_triangles[first_global + i] = ToGPUTriangle(prims[range.first + i], offsets.first_vertex, offsets.first_material);
+
+    glBufferSubData(
+        GL_SHADER_STORAGE_BUFFER,
+        first_global * sizeof(GPUTriangle),
+        range.count * sizeof(GPUTriangle),
+        &g_triangles[first_global]);
+  }
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, s_bvh_nodes_SSBO);
+  bool root_dirty = false;
+  for (const auto& range : dirty_nodes) {
+    const std::uint32_t first_global = offsets.first_node + range.first;
+    for (std::uint32_t i = 0; i < range.count; ++i)
+      g_bvh_nodes[first_global + i] = ToGPUNode(nodes[range.first + i], offsets.first_triangle, offsets.first_node);
+    root_dirty = root_dirty || (range.first == 0 && range.count > 0);
+
+    glBufferSubData(
+        GL_SHADER_STORAGE_BUFFER,
+        first_global * sizeof(GPUBVHNode),
+        range.count * sizeof(GPUBVHNode),
+        &g_bvh_nodes[first_global]);
+  }
+
+  // the TLAS was built from the root box, and leaves out empty models
+  const bool was_empty = offsets.empty;
+  offsets.empty = nodes.empty();
+  if (root_dirty || was_empty != offsets.empty) {
+    if (!offsets.empty)
+      g_model_bounds[index] = {nodes[0].min_bounds, nodes[0].max_bounds};
+    UploadTLAS();
+  }
+}
+
+std::uint32_t GetTLASInstanceCount() {
+  return g_tlas_instance_count;
 }
 
 void UpdateRays(const std::uint32_t ray_count, const Common::Ray* const ray_buffer) {
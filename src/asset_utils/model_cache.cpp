@@ -0,0 +1,414 @@
+#include "asset_utils/model_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace AssetUtils {
+namespace {
+// sections are copied straight out of the mapping, so they need to be plain bytes
+static_assert(std::is_trivially_copyable_v<IntersectionUtils::BVHNode>);
+static_assert(std::is_trivially_copyable_v<GPU::Triangle>);
+static_assert(std::is_trivially_copyable_v<GPU::PackedVertexData>);
+
+constexpr char kCacheMagic[8] = {'S', 'R', 'T', 'C', 'A', 'C', 'H', 'E'};
+// every section starts on this, so it can be read in place from the mapping
+constexpr std::uint64_t kSectionAlignment = 16;
+constexpr std::uint64_t kHashMultiplier = 0x9E3779B97F4A7C15ull;
+constexpr std::uint64_t kMissingFileHash = 0x6D697373696E6721ull;
+
+struct CacheHeader {
+  char magic[8];
+  std::uint32_t version;
+  // catch layout changes that forgot the version bump
+  std::uint32_t node_size;
+  std::uint32_t triangle_size;
+  std::uint32_t vertex_size;
+  std::uint64_t content_hash;
+  std::uint64_t options_hash;
+  std::uint64_t node_count;
+  std::uint64_t prim_count;
+  std::uint64_t vertex_count;
+  std::uint64_t material_count;
+  std::uint64_t mtl_file_count;
+  std::uint64_t string_bytes;
+};
+
+// a string inside the string section
+struct CacheString {
+  std::uint64_t offset;
+  std::uint64_t length;
+};
+
+struct CacheMaterial {
+  float diffuse[3];
+  float specular[3];
+  float specular_ex;
+  std::uint32_t use_texture;
+  CacheString texture_path;
+};
+
+// Read only view of a whole file, mapped rather than read so only the pages used get loaded
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+      return;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size))
+      return;
+
+    valid_ = true;
+    size_ = static_cast<std::size_t>(size.QuadPart);
+    if (size_ == 0)
+      return;
+
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_)
+      data_ = static_cast<const std::uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+#else
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0)
+      return;
+
+    struct stat file_stat;
+    if (fstat(fd_, &file_stat) != 0)
+      return;
+
+    valid_ = true;
+    size_ = static_cast<std::size_t>(file_stat.st_size);
+    if (size_ == 0)
+      return;
+
+    void* const data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (data != MAP_FAILED)
+      data_ = static_cast<const std::uint8_t*>(data);
+#endif
+    // mapping a non empty file failed
+    if (!data_)
+      valid_ = false;
+  }
+
+  ~MappedFile() {
+#ifdef _WIN32
+    if (data_)
+      UnmapViewOfFile(data_);
+    if (mapping_)
+      CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle(file_);
+#else
+    if (data_)
+      munmap(const_cast<std::uint8_t*>(data_), size_);
+    if (fd_ >= 0)
+      close(fd_);
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // false if the file couldn't be opened or mapped
+  bool Valid() const { return valid_; }
+  const std::uint8_t* Data() const { return data_; }
+  std::size_t Size() const { return size_; }
+
+ private:
+  const std::uint8_t* data_ = nullptr;
+  std::size_t size_ = 0;
+  bool valid_ = false;
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+};
+
+std::uint64_t AlignSection(const std::uint64_t offset) {
+  return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+}
+
+// Hands out the sections of a mapped cache in the order WriteModelCache wrote them
+class SectionReader {
+ public:
+  explicit SectionReader(const MappedFile& file)
+    : data_(file.Data()), size_(file.Size()), offset_(sizeof(CacheHeader)) {}
+
+  // false if the file is too short to hold count elements here
+  template <class T>
+  bool Next(const std::uint64_t count, const T** const section_ptr) {
+    offset_ = AlignSection(offset_);
+    if (offset_ > size_ || count > (size_ - offset_) / sizeof(T))
+      return false;
+
+    *section_ptr = reinterpret_cast<const T*>(data_ + offset_);
+    offset_ += count * sizeof(T);
+    return true;
+  }
+
+ private:
+  const std::uint8_t* data_;
+  std::uint64_t size_;
+  std::uint64_t offset_;
+};
+
+std::uint64_t MixHash(std::uint64_t hash, const std::uint64_t value) {
+  hash ^= value;
+  hash *= kHashMultiplier;
+  return hash ^ (hash >> 32);
+}
+
+std::uint64_t MixHash(const std::uint64_t hash, const float value) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return MixHash(hash, static_cast<std::uint64_t>(bits));
+}
+
+// 8 bytes at a time, fast enough to run over a large OBJ on every launch
+std::uint64_t HashBytes(const std::uint8_t* const data, const std::size_t size, std::uint64_t hash) {
+  std::size_t i = 0;
+  for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t)) {
+    std::uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    hash = MixHash(hash, word);
+  }
+
+  std::uint64_t tail = 0;
+  if (i < size)
+    std::memcpy(&tail, data + i, size - i);
+  hash = MixHash(hash, tail);
+  return MixHash(hash, static_cast<std::uint64_t>(size));
+}
+
+std::vector<std::string> CacheKeyFiles(
+    const std::string& obj_path,
+    const std::string& folder_path,
+    const std::vector<std::string>& mtl_files) {
+  std::vector<std::string> paths = {obj_path};
+  for (const auto& file : mtl_files)
+    paths.push_back(folder_path + file);
+  return paths;
+}
+
+CacheString AddString(const std::string& str, std::string* const strings_ptr) {
+  auto& strings = *strings_ptr;
+  const CacheString out = {strings.size(), str.size()};
+  strings += str;
+  return out;
+}
+
+void WriteSection(std::ofstream* const out_ptr, const void* const data, const std::uint64_t bytes) {
+  auto& out = *out_ptr;
+  const std::uint64_t offset = static_cast<std::uint64_t>(out.tellp());
+  const std::uint64_t padding = AlignSection(offset) - offset;
+  static constexpr char kZeros[kSectionAlignment] = {};
+  out.write(kZeros, static_cast<std::streamsize>(padding));
+  if (bytes > 0)
+    out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+}
+}
+
+std::uint64_t HashBVHBuildOptions(const IntersectionUtils::BVHBuildOptions& options) {
+  std::uint64_t hash = MixHash(0, static_cast<std::uint64_t>(kModelCacheVersion));
+  hash = MixHash(hash, static_cast<std::uint64_t>(options.method));
+  hash = MixHash(hash, static_cast<std::uint64_t>(options.bin_count));
+  hash = MixHash(hash, options.traversal_cost);
+  hash = MixHash(hash, options.leaf_cost);
+  hash = MixHash(hash, static_cast<std::uint64_t>(options.max_leaf_size));
+  hash = MixHash(hash, static_cast<std::uint64_t>(options.morton_63_bit));
+  hash = MixHash(hash, static_cast<std::uint64_t>(options.treelet_size));
+  hash = MixHash(hash, options.sbvh_max_duplication);
+  hash = MixHash(hash, options.sbvh_overlap_threshold);
+  hash = MixHash(hash, static_cast<std::uint64_t>(options.node_order));
+  return MixHash(hash, static_cast<std::uint64_t>(options.layout_treelet_pairs));
+}
+
+std::uint64_t HashFiles(const std::vector<std::string>& paths) {
+  std::uint64_t hash = 0;
+  for (const auto& path : paths) {
+    const MappedFile file(path);
+    if (!file.Valid())
+      hash = MixHash(hash, kMissingFileHash);
+    else
+      hash = HashBytes(file.Data(), file.Size(), hash);
+  }
+
+  return hash;
+}
+
+void WriteModelCache(
+    const std::string& cache_path,
+    const Model& model,
+    const std::string& obj_path,
+    const std::string& folder_path,
+    const std::vector<std::string>& mtl_files) {
+  const auto& bvh = model.model_bvh;
+  std::string strings;
+
+  std::vector<CacheMaterial> materials;
+  materials.reserve(model.model_materials.size());
+  for (const auto& mat : model.model_materials) {
+    CacheMaterial cache_mat;
+    std::memcpy(cache_mat.diffuse, &mat.diffuse, sizeof(cache_mat.diffuse));
+    std::memcpy(cache_mat.specular, &mat.specular, sizeof(cache_mat.specular));
+    cache_mat.specular_ex = mat.specular_ex;
+    cache_mat.use_texture = mat.use_texture;
+    cache_mat.texture_path = AddString(mat.texture_path, &strings);
+    materials.push_back(cache_mat);
+  }
+
+  std::vector<CacheString> mtl_names;
+  for (const auto& file : mtl_files)
+    mtl_names.push_back(AddString(file, &strings));
+
+  CacheHeader header;
+  std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+  header.version = kModelCacheVersion;
+  header.node_size = sizeof(IntersectionUtils::BVHNode);
+  header.triangle_size = sizeof(GPU::Triangle);
+  header.vertex_size = sizeof(GPU::PackedVertexData);
+  header.content_hash = HashFiles(CacheKeyFiles(obj_path, folder_path, mtl_files));
+  header.options_hash = HashBVHBuildOptions(bvh.GetBuildOptions());
+  header.node_count = bvh.GetBVH().size();
+  header.prim_count = bvh.GetPrims().size();
+  header.vertex_count = model.vertex_data_buffer.size();
+  header.material_count = materials.size();
+  header.mtl_file_count = mtl_names.size();
+  header.string_bytes = strings.size();
+
+  const std::string tmp_path = cache_path + ".tmp";
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out)
+      throw std::runtime_error("Couldn't open " + tmp_path + " for writing");
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    WriteSection(&out, bvh.GetBVH().data(), header.node_count * sizeof(IntersectionUtils::BVHNode));
+    WriteSection(&out, bvh.GetPrims().data(), header.prim_count * sizeof(GPU::Triangle));
+    WriteSection(&out, bvh.GetPrimIndices().data(), header.prim_count * sizeof(std::uint32_t));
+    WriteSection(&out, model.vertex_data_buffer.data(), header.vertex_count * sizeof(GPU::PackedVertexData));
+    WriteSection(&out, materials.data(), materials.size() * sizeof(CacheMaterial));
+    WriteSection(&out, mtl_names.data(), mtl_names.size() * sizeof(CacheString));
+    WriteSection(&out, strings.data(), strings.size());
+    if (!out)
+      throw std::runtime_error("Failed writing " + tmp_path);
+  }
+
+  std::error_code error;
+  std::filesystem::rename(tmp_path, cache_path, error);
+  if (error) {
+    std::filesystem::remove(tmp_path, error);
+    throw std::runtime_error("Couldn't replace " + cache_path);
+  }
+}
+
+std::unique_ptr<Model> ReadModelCache(
+    const std::string& cache_path,
+    const std::string& obj_path,
+    const std::string& folder_path,
+    const IntersectionUtils::BVHBuildOptions& options,
+    const bool load_textures) {
+  const MappedFile file(cache_path);
+  if (!file.Valid() || file.Size() < sizeof(CacheHeader))
+    return nullptr;
+
+  CacheHeader header;
+  std::memcpy(&header, file.Data(), sizeof(header));
+  if (std::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+      header.version != kModelCacheVersion ||
+      header.node_size != sizeof(IntersectionUtils::BVHNode) ||
+      header.triangle_size != sizeof(GPU::Triangle) ||
+      header.vertex_size != sizeof(GPU::PackedVertexData) ||
+      header.options_hash != HashBVHBuildOptions(options))
+    return nullptr;
+
+  SectionReader reader(file);
+  const IntersectionUtils::BVHNode* nodes;
+  const GPU::Triangle* triangles;
+  const std::uint32_t* prim_indices;
+  const GPU::PackedVertexData* vertices;
+  const CacheMaterial* materials;
+  const CacheString* mtl_names;
+  const char* strings;
+  if (!reader.Next(header.node_count, &nodes) ||
+      !reader.Next(header.prim_count, &triangles) ||
+      !reader.Next(header.prim_count, &prim_indices) ||
+      !reader.Next(header.vertex_count, &vertices) ||
+      !reader.Next(header.material_count, &materials) ||
+      !reader.Next(header.mtl_file_count, &mtl_names) ||
+      !reader.Next(header.string_bytes, &strings)) {
+    std::cerr << "Model cache " << cache_path << " is truncated, rebuilding" << std::endl;
+    return nullptr;
+  }
+
+  const auto get_string = [&header, strings](const CacheString& str) -> std::string {
+    if (str.offset > header.string_bytes || str.length > header.string_bytes - str.offset)
+      throw std::invalid_argument("Model cache string is out of range");
+    return std::string(strings + str.offset, str.length);
+  };
+
+  try {
+    std::vector<std::string> mtl_files;
+    for (std::uint64_t i = 0; i < header.mtl_file_count; ++i)
+      mtl_files.push_back(get_string(mtl_names[i]));
+    if (HashFiles(CacheKeyFiles(obj_path, folder_path, mtl_files)) != header.content_hash)
+      return nullptr;
+
+    for (std::uint64_t i = 0; i < header.prim_count; ++i) {
+      for (const std::uint32_t vertex_idx : triangles[i].vertex_idxs) {
+        if (vertex_idx >= header.vertex_count)
+          throw std::invalid_argument("Model cache triangle points outside the vertices");
+      }
+      // a model without materials still has its triangles at material 0
+      if (triangles[i].material_idx >= std::max<std::uint64_t>(header.material_count, 1))
+        throw std::invalid_argument("Model cache triangle points outside the materials");
+    }
+
+    auto bvh = IntersectionUtils::BVH<GPU::Triangle>::FromBuiltTree(
+        std::vector<IntersectionUtils::BVHNode>(nodes, nodes + header.node_count),
+        std::vector<GPU::Triangle>(triangles, triangles + header.prim_count),
+        std::vector<std::uint32_t>(prim_indices, prim_indices + header.prim_count),
+        options);
+
+    std::vector<Material> model_materials(header.material_count);
+    for (std::uint64_t i = 0; i < header.material_count; ++i) {
+      const CacheMaterial& cache_mat = materials[i];
+      Material& mat = model_materials[i];
+      std::memcpy(&mat.diffuse, cache_mat.diffuse, sizeof(cache_mat.diffuse));
+      std::memcpy(&mat.specular, cache_mat.specular, sizeof(cache_mat.specular));
+      mat.specular_ex = cache_mat.specular_ex;
+      mat.use_texture = cache_mat.use_texture != 0;
+      mat.texture_path = get_string(cache_mat.texture_path);
+      if (mat.use_texture && load_textures)
+        mat.texture = GPUTexture(mat.texture_path, true);
+    }
+
+    return std::make_unique<Model>(
+        std::move(bvh),
+        std::move(model_materials),
+        std::vector<GPU::PackedVertexData>(vertices, vertices + header.vertex_count));
+  } catch (const std::invalid_argument& e) {
+    std::cerr << "Model cache " << cache_path << " is corrupt (" << e.what() << "), rebuilding" << std::endl;
+    return nullptr;
+  }
+}
+}  // namespace AssetUtils
@@ -1,5 +1,6 @@
 #include "asset_utils/model_loader.h"
 
+#include <limits>
 #include <sstream>
 #include <filesystem>
 
@@ -8,27 +9,119 @@
 #include "glad/glad.h"
 
 #include "asset_utils/gpu_texture.h"
+#include "asset_utils/model_cache.h"
+#include "intersection_utils/bvh_analysis.h"
 
 namespace AssetUtils {
 namespace {
 constexpr const char* OBJ_FOLDER = "./objects/";
+constexpr const char* MODEL_CACHE_EXTENSION = ".bvhcache";
+
+std::pair<glm::vec3, glm::vec3> TriangleBounds(
+    const std::vector<GPU::PackedVertexData>& verts,
+    const GPU::Triangle& tri) {
+  const glm::vec3& p0 = verts[tri.vertex_idxs[0]].vertex;
+  const glm::vec3& p1 = verts[tri.vertex_idxs[1]].vertex;
+  const glm::vec3& p2 = verts[tri.vertex_idxs[2]].vertex;
+
+  std::pair<glm::vec3, glm::vec3> out = std::make_pair(p0, p0);
+  out.first = glm::min(out.first, p1);
+  out.first = glm::min(out.first, p2);
+  out.second = glm::max(out.second, p1);
+  out.second = glm::max(out.second, p2);
+
+  return out;
+}
+
+// Renumbers vertices in the order the BVH's triangles first use them, so triangles that
+// are next to each other in the BVH read neighbouring vertices
+void PermuteVerticesToTriangleOrder(
+    IntersectionUtils::BVH<GPU::Triangle>* const bvh_ptr,
+    std::vector<GPU::PackedVertexData>* const verts_ptr) {
+  auto& verts = *verts_ptr;
+  constexpr std::uint32_t kUnassigned = std::numeric_limits<std::uint32_t>::max();
+  std::vector<std::uint32_t> new_idxs(verts.size(), kUnassigned);
+  std::vector<GPU::PackedVertexData> new_verts;
+  new_verts.reserve(verts.size());
+
+  for (auto& tri : bvh_ptr->GetMutablePrims()) {
+    for (auto& vertex_idx : tri.vertex_idxs) {
+      if (new_idxs[vertex_idx] == kUnassigned) {
+        new_idxs[vertex_idx] = static_cast<std::uint32_t>(new_verts.size());
+        new_verts.push_back(verts[vertex_idx]);
+      }
+      vertex_idx = new_idxs[vertex_idx];
+    }
+  }
+
+  // keep vertices no triangle uses, at the end
+  for (std::size_t i = 0; i < verts.size(); ++i) {
+    if (new_idxs[i] == kUnassigned)
+      new_verts.push_back(verts[i]);
+  }
+
+  verts = std::move(new_verts);
+}
 }
 
 std::unordered_map<std::string, Detail::TextureInfo> GPUTexture::LoadedTextures;
 
 // models smaller than unsigned int verts
-std::unique_ptr<Model> LoadObject(const std::string& name) {
+std::unique_ptr<Model> LoadObject(
+    const std::string& name,
+    const IntersectionUtils::BVHBuildOptions& bvh_options,
+    const bool use_cache,
+    const bool load_textures) {
+  const std::string folder_path = OBJ_FOLDER + name + "/";
+  const std::string obj_path = folder_path + name + ".obj";
+  const std::string cache_path = folder_path + name + MODEL_CACHE_EXTENSION;
+  if (use_cache) {
+    if (auto model = ReadModelCache(cache_path, obj_path, folder_path, bvh_options, load_textures)) {
+      // same guard as a fresh build, the cache could have been written before it existed
+      IntersectionUtils::CheckStackSize(IntersectionUtils::RequiredStackSize(model->model_bvh.GetBVH()), "Model BVH");
+      return model;
+    }
+  }
+
   std::vector<std::string> mtl_files;
-  auto geo = Detail::ParseOBJ(OBJ_FOLDER + name + "/" + name + ".obj", &mtl_files);
+  auto geo = Detail::ParseOBJ(obj_path, &mtl_files);
 
   std::unordered_map<std::string, Material> material_libs;
   for (const auto& file : mtl_files)
-    Detail::ParseMTL(OBJ_FOLDER + name + "/", file, &material_libs);
+    Detail::ParseMTL(folder_path, file, &material_libs, load_textures);
 
   if (!geo)
     throw std::runtime_error("error getting geo");
 
-  return Detail::ConvertCPUGeometryToModel(std::move(geo), std::move(material_libs));
+  auto model = Detail::ConvertCPUGeometryToModel(std::move(geo), std::move(material_libs), bvh_options);
+  if (use_cache) {
+    // still have a model, just a slow start next time too
+    try {
+      WriteModelCache(cache_path, *model, obj_path, folder_path, mtl_files);
+    } catch (const std::runtime_error& e) {
+      std::cerr << "Couldn't write model cache: " << e.what() << std::endl;
+    }
+  }
+
+  return model;
+}
+
+void ReorderModel(Model* const model_ptr, const IntersectionUtils::BVHNodeOrder order) {
+  auto& model = *model_ptr;
+  model.model_bvh.Reorder(order);
+  PermuteVerticesToTriangleOrder(&model.model_bvh, &model.vertex_data_buffer);
+  model.RebuildTriangleBlocks();
+}
+
+IntersectionUtils::BVHNodeRange RefitModel(Model* const model_ptr) {
+  auto& model = *model_ptr;
+  const auto& verts = model.vertex_data_buffer;
+  const IntersectionUtils::BVHNodeRange dirty = model.model_bvh.Refit([&verts](const GPU::Triangle& tri) -> std::pair<glm::vec3, glm::vec3> {
+    return TriangleBounds(verts, tri);
+  });
+  // the blocks hold the triangles' corners, so they moved with the vertices
+  model.RebuildTriangleBlocks();
+  return dirty;
 }
 
 namespace Detail {
@@ -179,7 +272,8 @@ std::unique_ptr<CpuGeometry> ParseOBJ(
 void ParseMTL(
     const std::string& folder_path,
     const std::string& file_name,
-    std::unordered_map<std::string, Material>* const material_libs_ptr) {
+    std::unordered_map<std::string, Material>* const material_libs_ptr,
+    const bool load_textures) {
   auto& material_libs = *material_libs_ptr;
   std::filesystem::path path = folder_path + file_name;
   std::ifstream file(path);
@@ -230,7 +324,9 @@ void ParseMTL(
 
       // Use 'file_name' rather than 'fileName'
       std::string tex_path = folder_path + "/" + texture_name;
-      current_material->texture = std::move(GPUTexture(tex_path, true));
+      if (load_textures)
+        current_material->texture = std::move(GPUTexture(tex_path, true));
+      current_material->texture_path = tex_path;
     }
     else if (prefix == "Kd") {
       glm::vec3 d;
@@ -279,7 +375,8 @@ void ParseMTL(
 
 std::unique_ptr<Model> ConvertCPUGeometryToModel(
     std::unique_ptr<CpuGeometry> cpu_geo,
-    std::unordered_map<std::string, Material> materials) {
+    std::unordered_map<std::string, Material> materials,
+    const IntersectionUtils::BVHBuildOptions& bvh_options) {
   std::vector<Material> model_materials; 
   model_materials.reserve(materials.size());
   
@@ -338,23 +435,34 @@ std::unique_ptr<Model> ConvertCPUGeometryToModel(
   };
 
   const auto bounds_fn = [&packed_verts](const GPU::Triangle& tri) -> std::pair<glm::vec3, glm::vec3> {
-    const glm::vec3& p0 = packed_verts[tri.vertex_idxs[0]].vertex;
-    const glm::vec3& p1 = packed_verts[tri.vertex_idxs[1]].vertex;
-    const glm::vec3& p2 = packed_verts[tri.vertex_idxs[2]].vertex;
-
-    std::pair<glm::vec3, glm::vec3> out = std::make_pair(p0, p0);
-    out.first = glm::min(out.first, p1);
-    out.first = glm::min(out.first, p2);
-    out.second = glm::max(out.second, p1);
-    out.second = glm::max(out.second, p2);
+    return TriangleBounds(packed_verts, tri);
+  };
 
-    return out;
+  using ModelBVH = IntersectionUtils::BVH<GPU::Triangle>;
+  // only used by SBVH builds
+  const auto split_fn = [&packed_verts](
+      const GPU::Triangle& tri,
+      const int axis,
+      const float position,
+      const ModelBVH::Bounds& ref_bounds) {
+    return IntersectionUtils::SplitTriangleBounds(
+        packed_verts[tri.vertex_idxs[0]].vertex,
+        packed_verts[tri.vertex_idxs[1]].vertex,
+        packed_verts[tri.vertex_idxs[2]].vertex,
+        axis,
+        position,
+        ref_bounds);
   };
 
-  IntersectionUtils::BVH<GPU::Triangle> bvh(
+  ModelBVH bvh(
       std::move(all_triangles), 
       center_fn, 
-      bounds_fn);
+      bounds_fn,
+      split_fn,
+      bvh_options);
+  // a pathological model would silently overflow the shader's traversal stack
+  IntersectionUtils::CheckStackSize(IntersectionUtils::RequiredStackSize(bvh.GetBVH()), "Model BVH");
+  PermuteVerticesToTriangleOrder(&bvh, &packed_verts);
 
   auto model = std::make_unique<Model>(
       std::move(bvh),
@@ -47,6 +47,40 @@ void Texture::Init(const std::vector<Color8>& textureData, uint width, uint heig
     }
 }
 
+void Texture::Update(const std::vector<Color8>& textureData, uint width, uint height)
+{
+    if (!m_image || width != m_width || height != m_height)
+    {
+        delete[] m_image;
+        m_image = nullptr;
+        Init(textureData, width, height);
+
+        // the GL texture keeps its handle but gets storage of the new size
+        if (m_textureHandle) {
+            glBindTexture(GL_TEXTURE_2D, m_textureHandle);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_width, m_height, 0,
+                GL_RGBA, GL_UNSIGNED_BYTE, m_image);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < textureData.size(); ++i)
+    {
+        Color8 c = textureData[i];
+        size_t start = i * m_numChannels;
+        m_image[start] = c.r;
+        m_image[start + 1] = c.g;
+        m_image[start + 2] = c.b;
+    }
+
+    if (m_textureHandle) {
+        glBindTexture(GL_TEXTURE_2D, m_textureHandle);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, m_image);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+}
+
 GLuint Texture::getTextureHandle(GLenum binding, GLuint bindIndex, bool isImage /* = false */)
 {
     if (m_textureHandle == 0) {
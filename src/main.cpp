@@ -9,6 +9,7 @@
 #include "raytracer/raytracer.h"
 #include "raytracer/world.h"
 #include "raytracer/light.h"
+#include "raytracer/mesh_instance.h"
 #include "raytracer/raytracer_types.h"
 #include "raytracer/utils.h"
 #include "graphics/texture.h"
@@ -209,8 +210,8 @@ void InitCompute(Graphics::Compute &compute)
 
 void SetupWorld(RayTracer::World &world)
 {
-  world.add(std::make_shared<RayTracer::Sphere>(RayTracer::Point3(0.0f, 0.0f, -1.0f), 0.5f));
-  world.add(std::make_shared<RayTracer::Sphere>(RayTracer::Point3(0.0f, -100.5f, -1.0f), 100.0f));
+  world.AddSphere(RayTracer::Point3(0.0f, 0.0f, -1.0f), 0.5f);
+  world.AddSphere(RayTracer::Point3(0.0f, -100.5f, -1.0f), 100.0f);
 }
 
 void SetupQuad()
@@ -464,6 +465,7 @@ int main()
   Graphics::Compute compute("./shaders/raytrace_compute.glsl");
   Graphics::Texture texture;
   Graphics::Texture32 accumBuffer;
+  std::unique_ptr<RayTracer::RayTracer> raytracer;
   std::vector<glm::vec3> noiseData(WIDTH * HEIGHT);
   std::vector<glm::vec3> noiseDataUniform(WIDTH * HEIGHT);
   if (RUN_COMPUTE_RT)
@@ -504,7 +506,8 @@ int main()
     RayTracer::CameraSettings settings;
     settings.aspect = static_cast<float>(WIDTH) / static_cast<float>(HEIGHT);
     settings.width = WIDTH;
-    settings.samplesPerPixel = 1;
+    // the viewer refines a pass a frame, image.ppm is written in one go so keep it quick
+    settings.samplesPerPixel = REND_TO_TEX ? 100 : 1;
     settings.maxDepth = 5;
 
     RayTracer::Camera camera(settings);
@@ -528,28 +531,43 @@ int main()
 
     RayTracer::World world;
     SetupWorld(world);
+    if (SHOW_MODEL)
+      world.add(std::make_shared<RayTracer::MeshInstance>(AssetUtils::LoadObject("Rubik")));
 
     std::vector<RayTracer::PointLight> lights;
     lights.reserve(MAX_LIGHTS);
     lights.emplace_back(glm::vec3(1.0, 2.0, 0.0), glm::vec3(1, 1, 1), 5.0f);
 
-    RayTracer::RayTracer raytracer(settings, "image.ppm", REND_TO_TEX);
-    raytracer.Init(world);
-    raytracer.Render();
+    // Render progressively, a sample per pixel each pass
+    RayTracer::RenderSettings renderSettings;
+    renderSettings.passSamples = 1;
+    raytracer = std::make_unique<RayTracer::RayTracer>(settings, "image.ppm", REND_TO_TEX, renderSettings);
+    raytracer->SetFrameCallback([](RayTracer::uint samplesDone, RayTracer::uint samplesPerPixel)
+                                {
+          std::clog << "\rSamples: " << samplesDone << '/' << samplesPerPixel << ' ' << std::flush;
+          if (samplesDone == samplesPerPixel)
+            std::clog << "\rDone.\t\t\n"; });
+    raytracer->Init(world);
 
     if (REND_TO_TEX)
     {
-      texture = raytracer.getTexture();
+      // First pass now so there's a texture to show, the render loop adds the rest a pass a frame
+      raytracer->ResetAccumulation();
+      raytracer->RenderPass();
+
       // Get the texture handle once and store it
       // Note: This calls the method that creates the texture
-      // We're casting away const because the method isn't const
-      rayTracerTextureHandle = texture.getTextureHandle(GL_TEXTURE0, 0);
+      rayTracerTextureHandle = raytracer->getTexture().getTextureHandle(GL_TEXTURE0, 0);
       if (rayTracerTextureHandle == 0)
       {
         std::cerr << "Error: rayTracerTextureHandle is 0" << std::endl;
         return -1;
       }
-      texture.debugReadTexture();
+      raytracer->getTexture().debugReadTexture();
+    }
+    else
+    {
+      raytracer->RenderProgressive();
     }
   }
   else
@@ -681,6 +699,7 @@ int main()
       compute.SetInt("Width", WIDTH);
       compute.SetInt("Height", HEIGHT);
       compute.SetUInt("bvh_count", 2); // models in scene
+      compute.SetUInt("tlas_instance_count", AssetUtils::GetTLASInstanceCount());
       compute.SetInt("lightCount", lights.size());
       compute.SetBool("showModel", SHOW_MODEL);
 
@@ -724,6 +743,12 @@ int main()
       }
     }
 
+    // Refine the software render, updates its texture until it has every sample
+    if (RUN_RT && REND_TO_TEX)
+    {
+      raytracer->RenderPass();
+    }
+
     // IMPORTANT: Reset all state completely
     glUseProgram(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
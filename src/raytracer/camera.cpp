@@ -1,3 +1,4 @@
+#include <cmath>
 #include <iostream>
 #include "raytracer/camera.h"
 #include "raytracer/light.h"
@@ -39,35 +40,71 @@ namespace RayTracer
         return position + (p[0] * defocusDiskU) + (p[1] * defocusDiskV);
     }
 
-    Color Camera::RayColor(const Common::Ray &r, uint depth, World &world, const PointLight &light) const
+    Color ShadeHit(const Common::Ray &r, const HitRecord &rec, const PointLight &light, bool lit)
     {
-        if (depth <= 0)
-            return Color(0, 0, 0);
+        Color ambient = 0.1f * light.color;
+        if (!lit)
+            return ambient;
 
-        HitRecord rec;
-        if (world.CheckHit(r, Common::Interval(0.001f, Common::infinity), rec))
-        {
-            glm::vec3 lightDir = -light.position;
-            float diff = glm::max(glm::dot(rec.normal, lightDir), 0.0f);
-            Color diffuse = diff * light.color;
-
-            glm::vec3 viewDir = glm::normalize(-r.direction);
-            glm::vec3 reflectDir = glm::reflect(-lightDir, rec.normal);
-            float spec = glm::pow(glm::max(glm::dot(viewDir, reflectDir), 0.0f), 32);
-            Color specular = spec * light.color;
+        glm::vec3 lightDir = -light.position;
+        float diff = glm::max(glm::dot(rec.normal, lightDir), 0.0f);
+        Color diffuse = diff * light.color;
 
-            Color ambient = 0.1f * light.color;
-            Color result = (ambient + diffuse + specular);
+        glm::vec3 viewDir = glm::normalize(-r.direction);
+        glm::vec3 reflectDir = glm::reflect(-lightDir, rec.normal);
+        float spec = glm::pow(glm::max(glm::dot(viewDir, reflectDir), 0.0f), 32);
+        Color specular = spec * light.color;
 
-            glm::vec3 direction = Common::randomOnHemisphere(rec.normal);
-            return result * RayColor(Common::Ray(rec.p, direction), depth - 1, world, light);
-        }
+        return (ambient + diffuse + specular);
+    }
 
+    Color SkyColor(const Common::Ray &r)
+    {
         glm::vec3 unitDirection = glm::normalize(r.direction);
         auto a = 0.5f * (unitDirection.y + 1.0f);
         return (1.0f - a) * Color(1.0f, 1.0f, 1.0f) + a * Color(0.5f, 0.7f, 1.0f);
     }
 
+    bool SurvivesRoulette(Color &throughput, float u)
+    {
+        // same odds as the GPU tracer, never below 10% so bright bounces off dim paths
+        // don't blow up
+        float luminance = glm::dot(throughput, Color(0.2126f, 0.7152f, 0.0722f));
+        float survival = glm::clamp(luminance, 0.1f, 1.0f);
+        if (u >= survival)
+            return false;
+
+        throughput /= survival;
+        return true;
+    }
+
+    Color Camera::RayColor(const Common::Ray &r, uint depth, World &world, const PointLight &light, bool shadowRays) const
+    {
+        // Path state, carried from bounce to bounce instead of down the stack
+        Common::Ray ray = r;
+        Color throughput(1.0f, 1.0f, 1.0f);
+
+        for (uint bounce = 0; bounce < depth; ++bounce)
+        {
+            HitRecord rec;
+            if (!world.CheckHit(ray, Common::Interval(0.001f, Common::infinity), rec))
+                return throughput * SkyColor(ray);
+
+            // out of bounces, nothing more comes back
+            if (bounce + 1 == depth)
+                break;
+
+            bool lit = !shadowRays || !world.Occluded(Common::Ray(rec.p, -light.position), Common::Interval(0.001f, Common::infinity));
+            throughput *= ShadeHit(ray, rec, light, lit);
+            if (bounce >= cameraSettings.minDepth && !SurvivesRoulette(throughput, Common::randomFloat()))
+                break;
+
+            ray = Common::Ray(rec.p, Common::randomOnHemisphere(rec.normal));
+        }
+
+        return Color(0, 0, 0);
+    }
+
     void Camera::MoveForward(float delta)
     {
         position += front * delta;
@@ -133,6 +170,36 @@ namespace RayTracer
         glm::vec3 fixedWorldUp = glm::vec3(0.0f, 1.0f, 0.0f);
         right = glm::normalize(glm::cross(front, fixedWorldUp));
         up = glm::normalize(glm::cross(right, front));
+
+        UpdateViewport();
+    }
+
+    void Camera::UpdateViewport()
+    {
+        // Size isn't known until Initialize
+        if (width == 0 || height == 0)
+            return;
+
+        // Viewport on the focus plane, spanning vFov top to bottom
+        float viewportHeight = 2.0f * std::tan(glm::radians(cameraSettings.vFov) / 2.0f) * cameraSettings.focusDist;
+        float viewportWidth = viewportHeight * float(width) / float(height);
+        w = -front;
+        u = right;
+        v = up;
+
+        // Across the image left to right, and down it top to bottom
+        glm::vec3 viewportU = viewportWidth * u;
+        glm::vec3 viewportV = -viewportHeight * v;
+        pixelDeltaU = viewportU / float(width);
+        pixelDeltaV = viewportV / float(height);
+
+        center = position;
+        Point3 viewportUpperLeft = center - cameraSettings.focusDist * w - viewportU / 2.0f - viewportV / 2.0f;
+        pixel00Loc = viewportUpperLeft + 0.5f * (pixelDeltaU + pixelDeltaV);
+
+        float defocusRadius = cameraSettings.focusDist * std::tan(glm::radians(cameraSettings.defocusAngle / 2.0f));
+        defocusDiskU = u * defocusRadius;
+        defocusDiskV = v * defocusRadius;
     }
 
     void Camera::MoveAndRotate(float deltaTime, const glm::vec3 &moveDelta, const glm::vec2 &rotDelta, float speed)
@@ -182,6 +249,8 @@ namespace RayTracer
             right = glm::normalize(glm::cross(front, fixedWorldUp));
             up = glm::normalize(glm::cross(right, front));
         }
+
+        UpdateViewport();
     }
 
     void Camera::Reset()
@@ -0,0 +1,84 @@
+#include "raytracer/mesh_instance.h"
+
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include "intersection_utils/tlas.h"
+#include "intersection_utils/traversal.h"
+#include "intersection_utils/triangle_blocks.h"
+
+namespace RayTracer {
+
+MeshInstance::MeshInstance(std::shared_ptr<const AssetUtils::Model> model, const glm::mat4& transform)
+	: model(std::move(model))
+{
+	if (!this->model)
+		throw std::invalid_argument("MeshInstance needs a model");
+
+	SetTransform(transform);
+}
+
+void MeshInstance::SetTransform(const glm::mat4& transform) {
+	modelToWorld = transform;
+	worldToModel = glm::inverse(transform);
+	normalToWorld = glm::transpose(glm::mat3(worldToModel));
+
+	const auto& nodes = model->model_bvh.GetBVH();
+	if (nodes.empty())
+	{
+		// never read, Hit and Occludes return before the box test for an empty model
+		boundedMin = boundedMax = worldMin = worldMax = glm::vec3(0.0f);
+		return;
+	}
+
+	boundedMin = nodes[0].min_bounds;
+	boundedMax = nodes[0].max_bounds;
+	std::tie(worldMin, worldMax) = IntersectionUtils::TransformBounds(boundedMin, boundedMax, transform);
+}
+
+bool MeshInstance::MissesWorldBounds(const Common::Ray& r, float tMax) const {
+	// after a RefitModel the box is out of date, the traversal tests the model's own root
+	const IntersectionUtils::BVHNode& root = model->model_bvh.GetBVH()[0];
+	if (root.min_bounds != boundedMin || root.max_bounds != boundedMax)
+		return false;
+	return IntersectionUtils::IntersectsBox(r.origin, 1.0f / r.direction, worldMin, worldMax) >= tMax;
+}
+
+Common::Ray MeshInstance::ToModelSpace(const Common::Ray& r) const {
+	return Common::Ray(glm::vec3(worldToModel * glm::vec4(r.origin, 1.0f)), glm::vec3(worldToModel * glm::vec4(r.direction, 0.0f)));
+}
+
+bool MeshInstance::Hit(const Common::Ray& r, const Common::Interval& interval, HitRecord& rec) {
+	if (model->model_bvh.GetBVH().empty())
+		return false;
+	if (MissesWorldBounds(r, interval.max))
+		return false;
+
+	Common::Ray local = ToModelSpace(r);
+	local.intersection_distance = interval.max;
+	const std::uint32_t hit = IntersectionUtils::ClosestHitBlocks(model->model_bvh, model->triangle_blocks, &local, interval.min);
+	if (hit == IntersectionUtils::kNoHit)
+		return false;
+
+	const AssetUtils::GPU::Triangle& tri = model->model_bvh.GetPrims()[hit];
+	const auto& verts = model->vertex_data_buffer;
+	const glm::vec3& v0 = verts[tri.vertex_idxs[0]].vertex;
+	const glm::vec3 modelNormal = glm::cross(verts[tri.vertex_idxs[1]].vertex - v0, verts[tri.vertex_idxs[2]].vertex - v0);
+
+	rec.t = local.intersection_distance;
+	rec.p = r.at(rec.t);
+	rec.setFaceNormal(r, glm::normalize(normalToWorld * modelNormal));
+	return true;
+}
+
+bool MeshInstance::Occludes(const Common::Ray& r, const Common::Interval& interval) {
+	if (model->model_bvh.GetBVH().empty())
+		return false;
+	if (MissesWorldBounds(r, interval.max))
+		return false;
+
+	return IntersectionUtils::OccludedBlocks(model->model_bvh, model->triangle_blocks, ToModelSpace(r), interval);
+}
+
+}
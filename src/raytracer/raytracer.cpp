@@ -1,6 +1,10 @@
-#include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <future>
+#include <mutex>
 
+#include "common/random.h"
 #include "raytracer/raytracer.h"
 #include "raytracer/world.h"
 
@@ -45,50 +49,164 @@ Graphics::Color8 writeColor(const Color& pixelColor) {
 void RayTracer::Init(World& w) {
 	camera.Initialize(false);
 	world = w;
+
+	const uint threadCount = Common::ResolveThreadCount(renderSettings.threadCount);
+	pool = threadCount > 1 ? std::make_unique<Common::ThreadPool>(threadCount - 1) : nullptr;
 }
 
-void RayTracer::Render() {
-	uint width = camera.getWidth();
-	uint height = camera.getHeight();
-	uint samplesPerPixel = camera.getSettings().samplesPerPixel;
-	uint maxDepth = camera.getSettings().maxDepth;
-	std::vector<Graphics::Color8> texData;
-	std::ofstream ostream;
+void RayTracer::RenderTile(uint x0, uint y0, uint x1, uint y1, uint firstSample, uint sampleCount) {
+	const uint width = camera.getWidth();
+	const uint samplesPerPixel = camera.getSettings().samplesPerPixel;
+	const uint maxDepth = camera.getSettings().maxDepth;
 
-	// TODO this is what will need to move to a compute shader so the work can be done in wavefronts instead of a loop
-	if (!writeTexture) {
-		ostream.open(outFileName);
-		ostream << "P3\n" << width << ' ' << height << "\n255\n";
-	}
-	for (uint j = 0; j < height; ++j)
+	for (uint j = y0; j < y1; ++j)
 	{
-		std::clog << "\rLines Remaining: " << (height - j) << ' ' << std::flush;
-		for (uint i = 0; i < width; ++i)
+		for (uint i = x0; i < x1; ++i)
 		{
-			Color pixelColor(0, 0, 0);
-			for (uint sample = 0; sample < samplesPerPixel; sample++)
+			const std::size_t pixel = std::size_t(j) * width + i;
+
+			Color pixelColor = accumulation[pixel];
+			for (uint sample = firstSample; sample < firstSample + sampleCount; sample++)
 			{
+				Common::ThreadRng().Seed(renderSettings.seed, SampleStream(pixel, sample, samplesPerPixel));
 				Common::Ray r = camera.GetRay(i, j);
-				pixelColor += camera.RayColor(r, maxDepth, world, light);
+				pixelColor += camera.RayColor(r, maxDepth, world, light, renderSettings.shadowRays);
 			}
-			
-			if (writeTexture)
-				texData.push_back(writeColor(camera.getPixelSamplesScale() * pixelColor));
-			else
-				writeColor(ostream, camera.getPixelSamplesScale() * pixelColor);
+
+			accumulation[pixel] = pixelColor;
 		}
 	}
+}
+
+bool RayTracer::RenderTiles(uint firstSample, uint sampleCount) {
+	const uint width = camera.getWidth();
+	const uint height = camera.getHeight();
+	const uint tileSize = std::max(renderSettings.tileSize, 1u);
+	const uint tilesX = (width + tileSize - 1) / tileSize;
+	const uint tileCount = tilesX * ((height + tileSize - 1) / tileSize);
+
+	// Threads take the next tile until there are none left, so ones that get cheap tiles
+	// (sky) end up doing more of them
+	std::atomic<uint> nextTile{0};
+	uint tilesDone = 0;
+	std::mutex progressMutex;
+	auto renderTiles = [&]() {
+		for (uint tile = nextTile++; tile < tileCount && !cancelRequested; tile = nextTile++)
+		{
+			const uint x0 = (tile % tilesX) * tileSize;
+			const uint y0 = (tile / tilesX) * tileSize;
+			RenderTile(x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height), firstSample, sampleCount);
+
+			std::lock_guard<std::mutex> lock(progressMutex);
+			++tilesDone;
+			if (progressCallback)
+				progressCallback(tilesDone, tileCount);
+		}
+	};
+
+	std::vector<std::future<void>> workers;
+	if (pool)
+	{
+		workers.reserve(pool->GetThreadCount());
+		for (uint i = 0; i < pool->GetThreadCount(); ++i)
+			workers.push_back(pool->Submit(renderTiles));
+	}
+	renderTiles();
+	for (auto& worker : workers)
+		pool->Wait(&worker);
+
+	return tilesDone == tileCount;
+}
+
+bool RayTracer::RenderSamples(uint firstSample, uint sampleCount) {
+	// TODO this is what will need to move to a compute shader so the work can be done in wavefronts instead of a loop
+	accumulation.resize(std::size_t(camera.getWidth()) * camera.getHeight(), Color(0, 0, 0));
+	if (renderSettings.integrator == Integrator::Wavefront)
+		return wavefront.Render(camera, world, light, renderSettings, firstSample, sampleCount, pool.get(), accumulation, cancelRequested, progressCallback);
+	return RenderTiles(firstSample, sampleCount);
+}
+
+void RayTracer::Publish() {
+	const float scale = 1.0f / samplesDone;
+	framebuffer.resize(accumulation.size());
+	for (std::size_t i = 0; i < accumulation.size(); ++i)
+		framebuffer[i] = scale * accumulation[i];
 
 	if (writeTexture)
 	{
-		texture.Init(texData, width, height);
+		texData.resize(framebuffer.size());
+		for (std::size_t i = 0; i < framebuffer.size(); ++i)
+			texData[i] = writeColor(framebuffer[i]);
+		texture.Update(texData, camera.getWidth(), camera.getHeight());
 	}
-	else
+
+	if (frameCallback)
+		frameCallback(samplesDone, camera.getSettings().samplesPerPixel);
+}
+
+void RayTracer::WriteOutputFile() const {
+	std::ofstream ostream(outFileName);
+	ostream << "P3\n" << camera.getWidth() << ' ' << camera.getHeight() << "\n255\n";
+	for (const Color& pixelColor : framebuffer)
+		writeColor(ostream, pixelColor);
+}
+
+void RayTracer::Render() {
+	ResetAccumulation();
+	const uint samplesPerPixel = camera.getSettings().samplesPerPixel;
+	const bool finished = RenderSamples(0, samplesPerPixel);
+	// a cancel from during the render was for this one, finished or not
+	cancelRequested = false;
+	if (!finished)
+		return;
+
+	samplesDone = samplesPerPixel;
+	Publish();
+	if (!writeTexture)
+		WriteOutputFile();
+}
+
+void RayTracer::ResetAccumulation() {
+	accumulation.assign(std::size_t(camera.getWidth()) * camera.getHeight(), Color(0, 0, 0));
+	samplesDone = 0;
+	lastPassTime = {};
+}
+
+bool RayTracer::RenderPass() {
+	using Clock = std::chrono::steady_clock;
+	const uint samplesPerPixel = camera.getSettings().samplesPerPixel;
+	if (samplesDone >= samplesPerPixel)
+		return false;
+	if (cancelRequested.exchange(false))
+		return false;
+
+	const Clock::time_point passStart = Clock::now();
+	if (samplesDone == 0)
+		progressiveStart = passStart;
+	else if (renderSettings.timeBudget > 0.0f
+		&& passStart - progressiveStart + lastPassTime > std::chrono::duration<float>(renderSettings.timeBudget))
+		return false;
+
+	const uint sampleCount = std::min(std::max(renderSettings.passSamples, 1u), samplesPerPixel - samplesDone);
+	if (!RenderSamples(samplesDone, sampleCount))
 	{
-		ostream.close();
+		cancelRequested = false;
+		return false;
 	}
 
-	std::clog << "\rDone.		\n";
+	samplesDone += sampleCount;
+	lastPassTime = Clock::now() - passStart;
+	Publish();
+	return true;
 }
 
-}
\ No newline at end of file
+void RayTracer::RenderProgressive() {
+	ResetAccumulation();
+	while (RenderPass())
+		;
+
+	if (!writeTexture && samplesDone > 0)
+		WriteOutputFile();
+}
+
+}
@@ -0,0 +1,291 @@
+#include "raytracer/sphere_set.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// For the AVX2 target macro and the CPU check, shared with the triangle kernels
+#include "intersection_utils/triangle_blocks.h"
+
+// Lets the AVX2 entry points inline the kernel templates and the AVX2 wrappers into
+// themselves, so the whole loop is compiled with AVX2 instead of calling out per op
+#if defined(INTERSECTION_UTILS_X86_64) && (defined(__GNUC__) || defined(__clang__))
+#define SPHERE_SET_FLATTEN __attribute__((flatten))
+#else
+#define SPHERE_SET_FLATTEN
+#endif
+
+namespace RayTracer {
+
+namespace {
+
+// The kernels below are written once against these and instantiated per instruction set,
+// the widest one the CPU has is picked at runtime. Masks are whatever the compares return
+struct SimdScalar {
+	using Float = float;
+	static constexpr int kWidth = 1;
+
+	static Float Set(float x) { return x; }
+	static Float Load(const float* p) { return *p; }
+	static void Store(float* p, Float x) { *p = x; }
+	static Float Add(Float a, Float b) { return a + b; }
+	static Float Sub(Float a, Float b) { return a - b; }
+	static Float Mul(Float a, Float b) { return a * b; }
+	static Float Div(Float a, Float b) { return a / b; }
+	static Float Sqrt(Float a) { return std::sqrt(a); }
+	static Float Max(Float a, Float b) { return a > b ? a : b; }
+	static Float Less(Float a, Float b) { return a < b ? 1.0f : 0.0f; }
+	static Float GreaterEqual(Float a, Float b) { return a >= b ? 1.0f : 0.0f; }
+	static Float And(Float a, Float b) { return a != 0.0f && b != 0.0f ? 1.0f : 0.0f; }
+	static Float Or(Float a, Float b) { return a != 0.0f || b != 0.0f ? 1.0f : 0.0f; }
+	static Float Select(Float mask, Float a, Float b) { return mask != 0.0f ? a : b; }
+	static bool Any(Float mask) { return mask != 0.0f; }
+};
+
+#if defined(INTERSECTION_UTILS_X86_64)
+// SSE2 is part of x86-64, so this one is always there
+struct SimdSSE {
+	using Float = __m128;
+	static constexpr int kWidth = 4;
+
+	static Float Set(float x) { return _mm_set1_ps(x); }
+	static Float Load(const float* p) { return _mm_loadu_ps(p); }
+	static void Store(float* p, Float x) { _mm_storeu_ps(p, x); }
+	static Float Add(Float a, Float b) { return _mm_add_ps(a, b); }
+	static Float Sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+	static Float Mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+	static Float Div(Float a, Float b) { return _mm_div_ps(a, b); }
+	static Float Sqrt(Float a) { return _mm_sqrt_ps(a); }
+	static Float Max(Float a, Float b) { return _mm_max_ps(a, b); }
+	static Float Less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+	static Float GreaterEqual(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+	static Float And(Float a, Float b) { return _mm_and_ps(a, b); }
+	static Float Or(Float a, Float b) { return _mm_or_ps(a, b); }
+	// blendv is SSE4.1, this is the SSE2 equivalent
+	static Float Select(Float mask, Float a, Float b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+	static bool Any(Float mask) { return _mm_movemask_ps(mask) != 0; }
+};
+
+// Only called from the AVX2 entry points, after the CPU check. Takes registers by
+// reference, see below
+struct SimdAVX2 {
+	using Float = __m256;
+	static constexpr int kWidth = 8;
+
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Set(float x) { return _mm256_set1_ps(x); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Load(const float* p) { return _mm256_loadu_ps(p); }
+	INTERSECTION_UTILS_TARGET_AVX2 static void Store(float* p, const Float& x) { _mm256_storeu_ps(p, x); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Add(const Float& a, const Float& b) { return _mm256_add_ps(a, b); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Sub(const Float& a, const Float& b) { return _mm256_sub_ps(a, b); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Mul(const Float& a, const Float& b) { return _mm256_mul_ps(a, b); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Div(const Float& a, const Float& b) { return _mm256_div_ps(a, b); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Sqrt(const Float& a) { return _mm256_sqrt_ps(a); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Max(const Float& a, const Float& b) { return _mm256_max_ps(a, b); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Less(const Float& a, const Float& b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float GreaterEqual(const Float& a, const Float& b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float And(const Float& a, const Float& b) { return _mm256_and_ps(a, b); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Or(const Float& a, const Float& b) { return _mm256_or_ps(a, b); }
+	INTERSECTION_UTILS_TARGET_AVX2 static Float Select(const Float& mask, const Float& a, const Float& b) { return _mm256_blendv_ps(b, a, mask); }
+	INTERSECTION_UTILS_TARGET_AVX2 static bool Any(const Float& mask) { return _mm256_movemask_ps(mask) != 0; }
+};
+
+static_assert(SphereSet::kBlockSize % SimdAVX2::kWidth == 0, "Blocks are whole registers");
+#endif
+
+// The set's arrays as the kernels see them, size is a whole number of blocks
+struct SphereArrays {
+	const float* centerX;
+	const float* centerY;
+	const float* centerZ;
+	const float* radius;
+	std::size_t size;
+};
+
+// Closest sphere inside interval, its root in t. Returns the sphere or -1
+using HitSpheresFn = std::ptrdiff_t (*)(const SphereArrays& spheres, const Common::Ray& r, const Common::Interval& interval, float& t);
+using OccludesSpheresFn = bool (*)(const SphereArrays& spheres, const Common::Ray& r, const Common::Interval& interval);
+
+// The templates pass __m256 around without AVX enabled, which GCC warns changes the ABI.
+// They're only ever inlined into the AVX2 entry points, so no call actually crosses it
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+// Per lane of spheres: the root nearer than the interval's max that's still above its
+// min, and a mask of the lanes that have one. Same math as Sphere::Hit
+template <typename Simd>
+struct Roots {
+	typename Simd::Float t;
+	typename Simd::Float hit;
+};
+
+template <typename Simd>
+inline Roots<Simd> IntersectLanes(
+	const SphereArrays& spheres, std::size_t i,
+	const typename Simd::Float (&origin)[3], const typename Simd::Float (&dir)[3], const typename Simd::Float& a,
+	const typename Simd::Float& tMin, const typename Simd::Float& tMax)
+{
+	using Float = typename Simd::Float;
+	const Float ocx = Simd::Sub(Simd::Load(spheres.centerX + i), origin[0]);
+	const Float ocy = Simd::Sub(Simd::Load(spheres.centerY + i), origin[1]);
+	const Float ocz = Simd::Sub(Simd::Load(spheres.centerZ + i), origin[2]);
+	const Float r = Simd::Load(spheres.radius + i);
+
+	const Float h = Simd::Add(Simd::Add(Simd::Mul(dir[0], ocx), Simd::Mul(dir[1], ocy)), Simd::Mul(dir[2], ocz));
+	const Float c = Simd::Sub(
+		Simd::Add(Simd::Add(Simd::Mul(ocx, ocx), Simd::Mul(ocy, ocy)), Simd::Mul(ocz, ocz)),
+		Simd::Mul(r, r));
+	const Float discriminant = Simd::Sub(Simd::Mul(h, h), Simd::Mul(a, c));
+	const Float real = Simd::GreaterEqual(discriminant, Simd::Set(0.0f));
+
+	const Float sqrtd = Simd::Sqrt(Simd::Max(discriminant, Simd::Set(0.0f)));
+	const Float nearRoot = Simd::Div(Simd::Sub(h, sqrtd), a);
+	const Float farRoot = Simd::Div(Simd::Add(h, sqrtd), a);
+	const Float nearInside = Simd::And(Simd::Less(tMin, nearRoot), Simd::Less(nearRoot, tMax));
+	const Float farInside = Simd::And(Simd::Less(tMin, farRoot), Simd::Less(farRoot, tMax));
+
+	return {Simd::Select(nearInside, nearRoot, farRoot), Simd::And(real, Simd::Or(nearInside, farInside))};
+}
+
+template <typename Simd>
+inline std::ptrdiff_t HitSpheres(const SphereArrays& spheres, const Common::Ray& r, const Common::Interval& interval, float& t) {
+	using Float = typename Simd::Float;
+	const Float origin[3] = {Simd::Set(r.origin.x), Simd::Set(r.origin.y), Simd::Set(r.origin.z)};
+	const Float dir[3] = {Simd::Set(r.direction.x), Simd::Set(r.direction.y), Simd::Set(r.direction.z)};
+	const Float a = Simd::Set(glm::length2(r.direction));
+	const Float tMin = Simd::Set(interval.min);
+
+	// closest root so far and which sphere it's on, per lane. Indices are kept as floats
+	// so they can be blended like the distances, exact for up to 2^24 spheres
+	Float bestT = Simd::Set(interval.max);
+	Float bestIndex = Simd::Set(-1.0f);
+	float laneOffsets[Simd::kWidth];
+	for (int lane = 0; lane < Simd::kWidth; ++lane)
+		laneOffsets[lane] = float(lane);
+	Float index = Simd::Load(laneOffsets);
+	const Float step = Simd::Set(float(Simd::kWidth));
+
+	for (std::size_t i = 0; i < spheres.size; i += Simd::kWidth)
+	{
+		const Roots<Simd> roots = IntersectLanes<Simd>(spheres, i, origin, dir, a, tMin, bestT);
+		bestT = Simd::Select(roots.hit, roots.t, bestT);
+		bestIndex = Simd::Select(roots.hit, index, bestIndex);
+		index = Simd::Add(index, step);
+	}
+
+	float laneT[Simd::kWidth];
+	float laneIndex[Simd::kWidth];
+	Simd::Store(laneT, bestT);
+	Simd::Store(laneIndex, bestIndex);
+	int best = -1;
+	for (int lane = 0; lane < Simd::kWidth; ++lane)
+	{
+		if (laneIndex[lane] >= 0.0f && (best < 0 || laneT[lane] < laneT[best]))
+			best = lane;
+	}
+	if (best < 0)
+		return -1;
+
+	t = laneT[best];
+	return std::ptrdiff_t(laneIndex[best]);
+}
+
+template <typename Simd>
+inline bool OccludesSpheres(const SphereArrays& spheres, const Common::Ray& r, const Common::Interval& interval) {
+	using Float = typename Simd::Float;
+	const Float origin[3] = {Simd::Set(r.origin.x), Simd::Set(r.origin.y), Simd::Set(r.origin.z)};
+	const Float dir[3] = {Simd::Set(r.direction.x), Simd::Set(r.direction.y), Simd::Set(r.direction.z)};
+	const Float a = Simd::Set(glm::length2(r.direction));
+	const Float tMin = Simd::Set(interval.min);
+	const Float tMax = Simd::Set(interval.max);
+
+	for (std::size_t i = 0; i < spheres.size; i += Simd::kWidth)
+	{
+		if (Simd::Any(IntersectLanes<Simd>(spheres, i, origin, dir, a, tMin, tMax).hit))
+			return true;
+	}
+
+	return false;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#if defined(INTERSECTION_UTILS_X86_64)
+INTERSECTION_UTILS_TARGET_AVX2 SPHERE_SET_FLATTEN
+std::ptrdiff_t HitSpheresAVX2(const SphereArrays& spheres, const Common::Ray& r, const Common::Interval& interval, float& t) {
+	return HitSpheres<SimdAVX2>(spheres, r, interval, t);
+}
+
+INTERSECTION_UTILS_TARGET_AVX2 SPHERE_SET_FLATTEN
+bool OccludesSpheresAVX2(const SphereArrays& spheres, const Common::Ray& r, const Common::Interval& interval) {
+	return OccludesSpheres<SimdAVX2>(spheres, r, interval);
+}
+#endif
+
+struct SphereKernels {
+	HitSpheresFn hit;
+	OccludesSpheresFn occludes;
+};
+
+// Kernels for this CPU, detected once. Same check as the triangle blocks use
+const SphereKernels& BestSphereKernels() {
+	static const SphereKernels kernels = []() -> SphereKernels {
+#if defined(INTERSECTION_UTILS_X86_64)
+		if (IntersectionUtils::DetectTriangleKernel() == IntersectionUtils::TriangleKernel::kAVX2)
+			return {HitSpheresAVX2, OccludesSpheresAVX2};
+		return {HitSpheres<SimdSSE>, OccludesSpheres<SimdSSE>};
+#else
+		return {HitSpheres<SimdScalar>, OccludesSpheres<SimdScalar>};
+#endif
+	}();
+	return kernels;
+}
+
+}
+
+void SphereSet::Add(const Point3& center, float r) {
+	if (count % kBlockSize == 0)
+	{
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+		for (std::vector<float>* component : {&centerX, &centerY, &centerZ})
+			component->resize(count + kBlockSize, 0.0f);
+		radius.resize(count + kBlockSize, nan);
+	}
+
+	centerX[count] = center.x;
+	centerY[count] = center.y;
+	centerZ[count] = center.z;
+	radius[count] = std::fmax(0.0f, r);
+	++count;
+}
+
+void SphereSet::Clear() {
+	centerX.clear();
+	centerY.clear();
+	centerZ.clear();
+	radius.clear();
+	count = 0;
+}
+
+bool SphereSet::Hit(const Common::Ray& r, const Common::Interval& interval, HitRecord& rec) const {
+	float t;
+	const std::ptrdiff_t sphere = BestSphereKernels().hit({centerX.data(), centerY.data(), centerZ.data(), radius.data(), radius.size()}, r, interval, t);
+	if (sphere < 0)
+		return false;
+
+	// only the winner gets a hit record
+	const Point3 center(centerX[sphere], centerY[sphere], centerZ[sphere]);
+	rec.t = t;
+	rec.p = r.at(rec.t);
+	rec.setFaceNormal(r, (rec.p - center) / radius[sphere]);
+	return true;
+}
+
+bool SphereSet::Occludes(const Common::Ray& r, const Common::Interval& interval) const {
+	return BestSphereKernels().occludes({centerX.data(), centerY.data(), centerZ.data(), radius.data(), radius.size()}, r, interval);
+}
+
+}
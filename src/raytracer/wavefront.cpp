@@ -0,0 +1,247 @@
+#include "raytracer/wavefront.h"
+
+#include <algorithm>
+
+namespace RayTracer {
+
+namespace {
+
+// Rays per ParallelFor chunk, enough that the chunks are worth a task each
+constexpr std::size_t kChunkSize = 1024;
+
+// Which of the 8 octants a direction points into
+inline int DirectionOctant(float x, float y, float z)
+{
+	return (x < 0.0f ? 1 : 0) | (y < 0.0f ? 2 : 0) | (z < 0.0f ? 4 : 0);
+}
+
+}
+
+void WavefrontIntegrator::RayQueue::Resize(std::size_t size) {
+	for (std::vector<float>* field : {&originX, &originY, &originZ, &dirX, &dirY, &dirZ, &throughputR, &throughputG, &throughputB})
+		field->resize(size);
+	path.resize(size);
+	rng.resize(size);
+}
+
+Common::Ray WavefrontIntegrator::RayQueue::GetRay(std::size_t i) const {
+	return Common::Ray(glm::vec3(originX[i], originY[i], originZ[i]), glm::vec3(dirX[i], dirY[i], dirZ[i]));
+}
+
+void WavefrontIntegrator::HitQueue::Resize(std::size_t size) {
+	for (std::vector<float>* field : {&pX, &pY, &pZ, &normalX, &normalY, &normalZ})
+		field->resize(size);
+	hit.resize(size);
+	occluded.resize(size);
+}
+
+HitRecord WavefrontIntegrator::HitQueue::GetHitRecord(std::size_t i) const {
+	HitRecord rec;
+	rec.p = Point3(pX[i], pY[i], pZ[i]);
+	rec.normal = glm::vec3(normalX[i], normalY[i], normalZ[i]);
+	return rec;
+}
+
+void WavefrontIntegrator::Generate(Camera& camera, const RenderSettings& settings, std::size_t firstPixel, std::size_t pixels, uint firstSample, uint sampleCount, Common::ThreadPool* pool) {
+	const uint width = camera.getWidth();
+	const uint samplesPerPixel = camera.getSettings().samplesPerPixel;
+	const std::size_t count = pixels * sampleCount;
+	rays.Resize(count);
+	pathRadiance.assign(count, Color(0, 0, 0));
+
+	Common::ParallelFor(pool, count, kChunkSize, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t k = begin; k < end; ++k)
+		{
+			const std::size_t pixel = firstPixel + k / sampleCount;
+			const uint sample = firstSample + uint(k % sampleCount);
+
+			// GetRay draws from the thread's generator, the path takes it over afterwards
+			Common::Pcg32& threadRng = Common::ThreadRng();
+			threadRng.Seed(settings.seed, SampleStream(pixel, sample, samplesPerPixel));
+			const Common::Ray r = camera.GetRay(uint(pixel % width), uint(pixel / width));
+			rays.rng[k] = threadRng;
+
+			rays.originX[k] = r.origin.x;
+			rays.originY[k] = r.origin.y;
+			rays.originZ[k] = r.origin.z;
+			rays.dirX[k] = r.direction.x;
+			rays.dirY[k] = r.direction.y;
+			rays.dirZ[k] = r.direction.z;
+			rays.throughputR[k] = rays.throughputG[k] = rays.throughputB[k] = 1.0f;
+			rays.path[k] = std::uint32_t(k);
+		}
+	});
+}
+
+void WavefrontIntegrator::Extend(World& world, Common::ThreadPool* pool) {
+	hits.Resize(rays.Size());
+
+	Common::ParallelFor(pool, rays.Size(), kChunkSize, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t k = begin; k < end; ++k)
+		{
+			HitRecord rec;
+			hits.hit[k] = world.CheckHit(rays.GetRay(k), Common::Interval(0.001f, Common::infinity), rec);
+			hits.occluded[k] = false;
+			if (!hits.hit[k])
+				continue;
+
+			hits.pX[k] = rec.p.x;
+			hits.pY[k] = rec.p.y;
+			hits.pZ[k] = rec.p.z;
+			hits.normalX[k] = rec.normal.x;
+			hits.normalY[k] = rec.normal.y;
+			hits.normalZ[k] = rec.normal.z;
+		}
+	});
+}
+
+void WavefrontIntegrator::Shadow(const World& world, const PointLight& light, Common::ThreadPool* pool) {
+	Common::ParallelFor(pool, rays.Size(), kChunkSize, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t k = begin; k < end; ++k)
+		{
+			if (!hits.hit[k])
+				continue;
+
+			const Common::Ray toLight(Point3(hits.pX[k], hits.pY[k], hits.pZ[k]), -light.position);
+			hits.occluded[k] = world.Occluded(toLight, Common::Interval(0.001f, Common::infinity));
+		}
+	});
+}
+
+void WavefrontIntegrator::Shade(const PointLight& light, bool shadowRays, uint bounce, uint minDepth, uint maxDepth, Common::ThreadPool* pool) {
+	const bool lastBounce = bounce + 1 == maxDepth;
+	alive.resize(rays.Size());
+
+	Common::ParallelFor(pool, rays.Size(), kChunkSize, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t k = begin; k < end; ++k)
+		{
+			const Common::Ray r = rays.GetRay(k);
+			const Color throughput(rays.throughputR[k], rays.throughputG[k], rays.throughputB[k]);
+			if (!hits.hit[k])
+			{
+				pathRadiance[rays.path[k]] = throughput * SkyColor(r);
+				alive[k] = false;
+				continue;
+			}
+
+			// out of bounces, Camera::RayColor returns black here
+			alive[k] = !lastBounce;
+			if (lastBounce)
+				continue;
+
+			const HitRecord rec = hits.GetHitRecord(k);
+			Color next = throughput * ShadeHit(r, rec, light, !shadowRays || !hits.occluded[k]);
+			Common::Pcg32& rng = rays.rng[k];
+			if (bounce >= minDepth && !SurvivesRoulette(next, rng.NextFloat()))
+			{
+				alive[k] = false;
+				continue;
+			}
+
+			const float u1 = rng.NextFloat();
+			const glm::vec3 direction = Common::SampleHemisphere(rec.normal, u1, rng.NextFloat());
+
+			rays.originX[k] = rec.p.x;
+			rays.originY[k] = rec.p.y;
+			rays.originZ[k] = rec.p.z;
+			rays.dirX[k] = direction.x;
+			rays.dirY[k] = direction.y;
+			rays.dirZ[k] = direction.z;
+			rays.throughputR[k] = next.r;
+			rays.throughputG[k] = next.g;
+			rays.throughputB[k] = next.b;
+		}
+	});
+}
+
+void WavefrontIntegrator::Compact() {
+	// counting sort of the surviving rays by direction octant
+	std::size_t octantStart[9] = {};
+	for (std::size_t k = 0; k < rays.Size(); ++k)
+	{
+		if (alive[k])
+			++octantStart[DirectionOctant(rays.dirX[k], rays.dirY[k], rays.dirZ[k]) + 1];
+	}
+	for (int octant = 0; octant < 8; ++octant)
+		octantStart[octant + 1] += octantStart[octant];
+
+	nextRays.Resize(octantStart[8]);
+	for (std::size_t k = 0; k < rays.Size(); ++k)
+	{
+		if (!alive[k])
+			continue;
+
+		const std::size_t to = octantStart[DirectionOctant(rays.dirX[k], rays.dirY[k], rays.dirZ[k])]++;
+		nextRays.originX[to] = rays.originX[k];
+		nextRays.originY[to] = rays.originY[k];
+		nextRays.originZ[to] = rays.originZ[k];
+		nextRays.dirX[to] = rays.dirX[k];
+		nextRays.dirY[to] = rays.dirY[k];
+		nextRays.dirZ[to] = rays.dirZ[k];
+		nextRays.throughputR[to] = rays.throughputR[k];
+		nextRays.throughputG[to] = rays.throughputG[k];
+		nextRays.throughputB[to] = rays.throughputB[k];
+		nextRays.path[to] = rays.path[k];
+		nextRays.rng[to] = rays.rng[k];
+	}
+
+	std::swap(rays, nextRays);
+}
+
+bool WavefrontIntegrator::Render(
+	Camera& camera,
+	World& world,
+	const PointLight& light,
+	const RenderSettings& settings,
+	uint firstSample,
+	uint sampleCount,
+	Common::ThreadPool* pool,
+	std::vector<Color>& accumulation,
+	const std::atomic<bool>& cancel,
+	const RenderProgressCallback& progress)
+{
+	if (sampleCount == 0)
+		return true;
+
+	const uint maxDepth = camera.getSettings().maxDepth;
+	const std::size_t pixelCount = std::size_t(camera.getWidth()) * camera.getHeight();
+
+	// whole pixels per wave, so a pixel's samples are summed together
+	const std::size_t wavePixels = std::max<std::size_t>(settings.wavefrontSize / sampleCount, 1);
+	const uint waveCount = uint((pixelCount + wavePixels - 1) / wavePixels);
+
+	for (uint wave = 0; wave < waveCount; ++wave)
+	{
+		if (cancel)
+			return false;
+
+		const std::size_t firstPixel = wave * wavePixels;
+		const std::size_t pixels = std::min(wavePixels, pixelCount - firstPixel);
+
+		Generate(camera, settings, firstPixel, pixels, firstSample, sampleCount, pool);
+		for (uint bounce = 0; bounce < maxDepth && rays.Size() > 0; ++bounce)
+		{
+			Extend(world, pool);
+			if (settings.shadowRays)
+				Shadow(world, light, pool);
+			Shade(light, settings.shadowRays, bounce, camera.getSettings().minDepth, maxDepth, pool);
+			Compact();
+		}
+
+		// added in sample order like RenderTile
+		Common::ParallelFor(pool, pixels, kChunkSize, [&](std::size_t begin, std::size_t end) {
+			for (std::size_t p = begin; p < end; ++p)
+			{
+				for (uint sample = 0; sample < sampleCount; ++sample)
+					accumulation[firstPixel + p] += pathRadiance[p * sampleCount + sample];
+			}
+		});
+
+		if (progress)
+			progress(wave + 1, waveCount);
+	}
+
+	return true;
+}
+
+}
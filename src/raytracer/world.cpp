@@ -3,9 +3,10 @@
 namespace RayTracer {
 
 bool World::CheckHit(const Common::Ray& ray, const Common::Interval& interval, HitRecord& hit) {
+	bool hitSomething = spheres.Hit(ray, interval, hit);
+	auto closest = hitSomething ? hit.t : interval.max;
+
 	HitRecord tempRec;
-	bool hitSomething = false;
-	auto closest = interval.max;
 
 	for (const auto& object : objects)
 	{
@@ -20,4 +21,17 @@ bool World::CheckHit(const Common::Ray& ray, const Common::Interval& interval, H
 	return hitSomething;
 }
 
+bool World::Occluded(const Common::Ray& ray, const Common::Interval& interval) const {
+	if (spheres.Occludes(ray, interval))
+		return true;
+
+	for (const auto& object : objects)
+	{
+		if (object->Occludes(ray, interval))
+			return true;
+	}
+
+	return false;
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,130 @@
+// Builds a model's BVH with each build method and prints what AnalyzeBVH reports, for
+// comparing builders and catching models whose trees are too deep for the shaders.
+//
+// usage: BVHAnalyzer path/to/model.obj [midpoint|sah|lbvh|sbvh]...
+// Builds with every method when none are given. Exits with 1 if any tree would overflow
+// the shader traversal stack.
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "asset_utils/model_loader.h"
+#include "common/types.h"
+#include "intersection_utils/bvh.h"
+#include "intersection_utils/bvh_analysis.h"
+#include "intersection_utils/traversal.h"
+
+namespace {
+using IntersectionUtils::BVH;
+using IntersectionUtils::BVHBuildMethod;
+
+std::vector<Common::Triangle> LoadTriangles(const std::string& path) {
+  std::vector<std::string> mtl_files;
+  const auto geo = AssetUtils::Detail::ParseOBJ(path, &mtl_files);
+  if (!geo)
+    throw std::runtime_error("Couldn't load " + path);
+
+  std::vector<Common::Triangle> triangles;
+  for (const auto& sub_geo : geo->geometries) {
+    for (const auto& face : sub_geo.faces) {
+      triangles.emplace_back(
+          geo->vertices[face.vertex_idxs[0]],
+          geo->vertices[face.vertex_idxs[1]],
+          geo->vertices[face.vertex_idxs[2]]);
+    }
+  }
+
+  return triangles;
+}
+
+const std::vector<std::pair<std::string, BVHBuildMethod>> kMethods = {
+    {"midpoint", BVHBuildMethod::kMidpoint},
+    {"sah", BVHBuildMethod::kBinnedSAH},
+    {"lbvh", BVHBuildMethod::kLBVH},
+    {"sbvh", BVHBuildMethod::kSBVH},
+};
+
+void PrintHistogram(const std::vector<std::size_t>& histogram) {
+  std::cout << "  leaf sizes:";
+  for (std::size_t size = 1; size < histogram.size(); ++size) {
+    if (histogram[size] > 0)
+      std::cout << " " << size << "x" << histogram[size];
+  }
+  std::cout << "\n";
+}
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " path/to/model.obj [midpoint|sah|lbvh|sbvh]...\n";
+    return 2;
+  }
+
+  std::vector<std::pair<std::string, BVHBuildMethod>> methods;
+  for (int i = 2; i < argc; ++i) {
+    const std::string name = argv[i];
+    bool found = false;
+    for (const auto& method : kMethods) {
+      if (method.first == name) {
+        methods.push_back(method);
+        found = true;
+      }
+    }
+    if (!found) {
+      std::cerr << "Unknown build method " << name << "\n";
+      return 2;
+    }
+  }
+  if (methods.empty())
+    methods = kMethods;
+
+  std::vector<Common::Triangle> triangles;
+  try {
+    triangles = LoadTriangles(argv[1]);
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << "\n";
+    return 2;
+  }
+  std::cout << argv[1] << ": " << triangles.size() << " triangles, shader stack holds "
+            << IntersectionUtils::kTraversalStackSize << " entries\n";
+
+  const auto split_fn = [](const Common::Triangle& tri, const int axis, const float position, const BVH<Common::Triangle>::Bounds& ref_bounds) {
+    return IntersectionUtils::SplitTriangleBounds(tri.v0, tri.v1, tri.v2, axis, position, ref_bounds);
+  };
+
+  bool too_deep = false;
+  std::cout << std::fixed << std::setprecision(3);
+  for (const auto& [name, method] : methods) {
+    IntersectionUtils::BVHBuildOptions options;
+    options.method = method;
+
+    const auto start = std::chrono::steady_clock::now();
+    const BVH<Common::Triangle> bvh(triangles, Common::Triangle::Centroid, Common::Triangle::Bounds, split_fn, options);
+    const std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - start;
+    const IntersectionUtils::BVHAnalysis analysis = IntersectionUtils::AnalyzeBVH(bvh);
+
+    std::cout << name << ": built in " << build_time.count() << " ms\n"
+              << "  nodes " << analysis.node_count << ", leaves " << analysis.leaf_count
+              << ", primative references " << analysis.prim_count << "\n"
+              << "  depth max " << analysis.max_depth << ", average leaf " << analysis.average_leaf_depth << "\n"
+              << "  SAH cost " << analysis.sah_cost << ", overlap ratio " << analysis.overlap_ratio << "\n"
+              << "  stack needed binary " << analysis.binary_stack_size << ", wide " << analysis.wide_stack_size << "\n";
+    PrintHistogram(analysis.leaf_size_histogram);
+
+    try {
+      IntersectionUtils::CheckStackSize(analysis.binary_stack_size, "Binary " + name + " BVH");
+      IntersectionUtils::CheckStackSize(analysis.wide_stack_size, "Wide " + name + " BVH");
+    } catch (const std::runtime_error& e) {
+      std::cout << "  " << e.what() << "\n";
+      too_deep = true;
+    }
+  }
+
+  return too_deep ? 1 : 0;
+}
@@ -55,7 +55,70 @@ target("SimpleRayTracer")
         end
     end)
 
+-- BENCHMARKS
+-- xmake build BVHTraversalBenchmark && xmake run BVHTraversalBenchmark [model.obj] [ray count]
+target("BVHTraversalBenchmark")
+    set_kind("binary")
+    set_languages("c++17")
+    set_default(false)
+
+    add_files("benchmarks/bvh_traversal_benchmark.cpp", "src/asset_utils/*.cpp", "src/glad.c")
+    add_includedirs("include")
+
+    add_packages("stb", "glfw", "glm")
+
+    if is_plat("windows") then
+        add_syslinks("opengl32", "gdi32", "user32", "kernel32")
+    elseif is_plat("linux") then
+        add_syslinks("GL", "X11", "pthread", "dl")
+    end
+
+    add_cxxflags("-O3")
+
+-- TOOLS
+-- xmake build BVHAnalyzer && xmake run BVHAnalyzer path/to/model.obj [midpoint|sah|lbvh|sbvh]...
+target("BVHAnalyzer")
+    set_kind("binary")
+    set_languages("c++17")
+    set_default(false)
+
+    add_files("tools/bvh_analyzer.cpp", "src/asset_utils/*.cpp", "src/glad.c")
+    add_includedirs("include")
+
+    add_packages("stb", "glfw", "glm")
+
+    if is_plat("windows") then
+        add_syslinks("opengl32", "gdi32", "user32", "kernel32")
+    elseif is_plat("linux") then
+        add_syslinks("GL", "X11", "pthread", "dl")
+    end
+
+    add_cxxflags("-O3")
+
 -- TESTS
+-- xmake build RayTracerTests && xmake run RayTracerTests
+target("RayTracerTests")
+    set_kind("binary")
+    set_languages("c++17")
+    set_default(false)
+
+    add_files("include/raytracer/tests/*.cpp", "src/raytracer/*.cpp", "src/graphics/texture.cpp", "src/asset_utils/*.cpp", "src/glad.c")
+    add_includedirs("include")
+
+    add_packages("stb", "glfw", "glm", "gtest", "gtest_main")
+
+    if is_plat("windows") then
+        add_syslinks("opengl32", "gdi32", "user32", "kernel32")
+    elseif is_plat("linux") then
+        add_syslinks("GL", "X11", "pthread", "dl")
+    end
+
+    if is_mode("debug") then
+        add_cxxflags("-Og", "-g", "-ggdb",  "-Wall", "-Wextra", {force = true})
+    elseif is_mode("release") then
+        add_cxxflags("-O3")
+    end
+
 -- target("IntersectionUtilsTests")
 --     set_kind("binary")
 --     set_languages("c++17")